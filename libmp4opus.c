@@ -0,0 +1,746 @@
+/*****************************************************************************
+ * libmp4opus.c
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <lsmash.h>
+
+#include <opus/opus_multistream.h>
+
+#include "mp4opus.h"
+#include "mp4opuscore.h"
+#include "mp4opustrack.h"
+
+#define MP4OPUS_MIN( a, b ) ((a) < (b) ? (a) : (b))
+
+/* Frames resampled at a time from the pushed samples, which keeps the input size in 32 bits. */
+#define RESAMPLE_FRAMES (1 << 20)
+
+#define ERROR_MSG( ctx, ... ) error_message( (ctx)->error, __VA_ARGS__ )
+
+struct mp4opus_encoder_tag
+{
+    mp4opus_encoder_param_t  param;
+    lsmash_root_t           *root;
+    lsmash_file_t           *fh;
+    lsmash_file_parameters_t file_param;
+    lsmash_audio_summary_t  *summary;
+    uint32_t                 track_ID;
+    mp4opus_track_encoder_t  codec;
+    mp4opus_output_media_t   out;
+    mp4opus_resampler_t     *resampler;         /* NULL at the sample rates supported by Opus */
+    uint32_t                 sample_bytes;      /* bytes of the pushed samples of all channels at a time */
+    uint8_t                 *buffer;            /* frame buffer for the samples not aligned to frames */
+    uint32_t                 buffer_size;
+    uint32_t                 buffer_pos;
+    uint64_t                 num_samples;       /* pushed samples per channel */
+    int                      finished;
+    int                      failed;            /* failed to open */
+    char                     error[MP4OPUS_ERROR_LENGTH];
+};
+
+typedef struct
+{
+    int64_t  start_time;    /* media time in 48kHz, -1 for an empty edit */
+    uint64_t duration;      /* in 48kHz */
+} decoder_edit_t;
+
+struct mp4opus_decoder_tag
+{
+    mp4opus_decoder_param_t  param;
+    lsmash_root_t           *root;
+    lsmash_file_t           *fh;
+    lsmash_file_parameters_t file_param;
+    uint32_t                 track_ID;
+    uint32_t                 channels;
+    uint32_t                 sample_bytes;
+    mp4opus_track_decoder_t  codec;
+    decoder_edit_t          *edits;
+    uint32_t                 num_edits;
+    uint32_t                 edit_number;       /* the next edit to be presented */
+    mp4opus_presentation_t   presentation;      /* of the current edit in 48kHz */
+    int                      presenting;        /* the current edit is not presented to the end yet */
+    int                      empty_edit;
+    uint32_t                 packet_number;     /* the next packet to be decoded */
+    uint8_t                 *pcm;               /* samples decoded from the last packet */
+    uint32_t                 pcm_pos;
+    uint32_t                 pcm_count;         /* samples left in pcm to be presented */
+    uint64_t                 duration;
+    int                      failed;            /* failed to open */
+    char                     error[MP4OPUS_ERROR_LENGTH];
+};
+
+static int error_message
+(
+    char       *error,
+    const char *message,
+    ...
+)
+{
+    va_list args;
+    va_start( args, message );
+    vsnprintf( error, MP4OPUS_ERROR_LENGTH, message, args );
+    va_end( args );
+    return -1;
+}
+
+static void setup_file_parameters
+(
+    lsmash_file_parameters_t *file_param,
+    const mp4opus_io_t       *io,
+    lsmash_file_mode          mode
+)
+{
+    /* Take the defaults of L-SMASH as lsmash_open_file() does for a file of the name. */
+    memset( file_param, 0, sizeof(lsmash_file_parameters_t) );
+    file_param->mode                = mode;
+    file_param->opaque              = io->opaque;
+    file_param->read                = io->read;
+    file_param->write               = io->write;
+    file_param->seek                = io->seek;
+    file_param->max_chunk_duration  = 0.5;
+    file_param->max_async_tolerance = 2.0;
+    file_param->max_chunk_size      = 4 * 1024 * 1024;
+    file_param->max_read_size       = 4 * 1024 * 1024;
+}
+
+/*** Encoder ***/
+
+void mp4opus_encoder_default_param
+(
+    mp4opus_encoder_param_t *param
+)
+{
+    memset( param, 0, sizeof(mp4opus_encoder_param_t) );
+    param->sample_rate    = 48000;
+    param->channels       = 2;
+    param->application    = OPUS_APPLICATION_AUDIO;
+    param->complexity     = 10;
+    param->bitrate        = OPUS_AUTO;
+    param->vbr            = 1;
+    param->max_bandwidth  = OPUS_BANDWIDTH_FULLBAND;
+    param->frame_size     = 20;
+    param->faststart      = 1;
+    param->mapping_family = -1;
+}
+
+static int prepare_output_track
+(
+    mp4opus_encoder_t *enc
+)
+{
+    mp4opus_encoder_param_t *opt = &enc->param;
+    if( mp4opus_create_output_track( enc->root, &enc->track_ID, enc->error ) < 0 )
+        return -1;
+    /* Set up Opus configurations. */
+    lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS,
+                                                                     LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !cs )
+        return ERROR_MSG( enc, "failed to create Opus specific info.\n" );
+    lsmash_opus_specific_parameters_t *param = (lsmash_opus_specific_parameters_t *)cs->data.structured;
+    param->Version            = 0;
+    param->OutputChannelCount = opt->channels;
+    param->InputSampleRate    = opt->sample_rate;
+    param->OutputGain         = 0;
+    mp4opus_encoder_option_t *codec_opt = &enc->codec.opt;
+    mp4opus_default_encoder_option( codec_opt );
+    codec_opt->application    = opt->application;
+    codec_opt->complexity     = opt->complexity;
+    codec_opt->bitrate        = opt->bitrate;
+    codec_opt->vbr            = opt->vbr;
+    codec_opt->max_bandwidth  = opt->max_bandwidth;
+    codec_opt->frame_size     = opt->frame_size;
+    codec_opt->mapping_family = opt->mapping_family;
+    /* The same layout as mp4opusenc assumes for raw PCM input. */
+    uint8_t channel_mapping[255];
+    if( mp4opus_setup_channel_mapping( param, opt->mapping_family, NULL, channel_mapping, enc->error ) < 0
+     || mp4opus_setup_encoder( &enc->codec, param, channel_mapping, enc->error ) < 0 )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return -1;
+    }
+    size_t input_sample_size = opt->float_input ? sizeof(float) : sizeof(opus_int16);
+    if( !mp4opus_is_native_rate( opt->sample_rate ) )
+    {
+        /* Resample into 48kHz. The samples delayed by the filter are skipped as well as the priming samples. */
+        enc->resampler = mp4opus_create_resampler( opt->sample_rate, 48000, opt->channels, input_sample_size,
+                                                   opt->float_input ? mp4opus_convert_float : mp4opus_convert_s16,
+                                                   enc->error );
+        if( !enc->resampler )
+        {
+            lsmash_destroy_codec_specific_data( cs );
+            return -1;
+        }
+        param->PreSkip += enc->resampler->delay;
+    }
+    enc->codec.float_input = opt->float_input || enc->resampler;
+    enc->sample_bytes      = opt->channels * input_sample_size;
+    enc->buffer_size       = enc->codec.frame_size * opt->channels * (enc->codec.float_input ? sizeof(float) : sizeof(opus_int16));
+    enc->buffer            = lsmash_malloc_zero( enc->buffer_size );
+    if( !enc->buffer )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( enc, "failed to allocate buffers.\n" );
+    }
+    int ret = mp4opus_prepare_output_media( &enc->out, param, opt->frame_size, enc->error );
+    if( ret == 0 )
+        ret = mp4opus_add_output_entry( enc->root, enc->track_ID, &enc->out, cs, opt->fragment, enc->error );
+    lsmash_destroy_codec_specific_data( cs );
+    return ret;
+}
+
+static int prepare_output
+(
+    mp4opus_encoder_t  *enc,
+    const mp4opus_io_t *io
+)
+{
+    mp4opus_encoder_param_t *opt = &enc->param;
+    if( opt->sample_rate == 0 )
+        return ERROR_MSG( enc, "sample rate %"PRIu32" is not supported.\n", opt->sample_rate );
+    if( opt->channels == 0 || opt->channels > 255 )
+        return ERROR_MSG( enc, "%"PRIu32" channels are not supported.\n", opt->channels );
+    if( opt->mapping_family != -1 && opt->mapping_family != 0 && opt->mapping_family != 1
+     && opt->mapping_family != 2  && opt->mapping_family != 255 )
+        return ERROR_MSG( enc, "the channel mapping family %d is not supported.\n", opt->mapping_family );
+    if( !mp4opus_is_valid_frame_size( opt->frame_size ) )
+        return ERROR_MSG( enc, "frame size %g ms is not supported.\n", opt->frame_size );
+    if( opt->complexity < 0 || opt->complexity > 10 || opt->vbr < 0 || opt->vbr > 2 )
+        return ERROR_MSG( enc, "invalid parameters.\n" );
+    if( opt->fragment < 0 )
+        return ERROR_MSG( enc, "fragment duration %d ms is not supported.\n", opt->fragment );
+    if( opt->fragment )
+        opt->faststart = 0;     /* The movie header of a fragmented movie is already at the beginning. */
+    if( !io->write || (!opt->fragment && !io->seek) || (opt->faststart && !io->read) )
+        return ERROR_MSG( enc, "I/O callbacks required for the output are missing.\n" );
+    /* Initialize L-SMASH muxer */
+    enc->root = lsmash_create_root();
+    if( !enc->root )
+        return ERROR_MSG( enc, "failed to create ROOT.\n" );
+    lsmash_file_parameters_t *file_param = &enc->file_param;
+    setup_file_parameters( file_param, io, LSMASH_FILE_MODE_WRITE
+                                         | LSMASH_FILE_MODE_BOX
+                                         | LSMASH_FILE_MODE_INITIALIZATION
+                                         | LSMASH_FILE_MODE_MEDIA
+                                         | (opt->fragment ? LSMASH_FILE_MODE_FRAGMENTED : 0) );
+    file_param->major_brand   = ISOM_BRAND_TYPE_OPUS;
+    file_param->brands        = (lsmash_brand_type [2]){ ISOM_BRAND_TYPE_OPUS, ISOM_BRAND_TYPE_ISO2 };
+    file_param->brand_count   = 2;
+    file_param->minor_version = 0;
+    enc->fh = lsmash_set_file( enc->root, file_param );
+    file_param->brands = NULL;  /* The brands are copied into the file. */
+    if( !enc->fh )
+        return ERROR_MSG( enc, "failed to add output file into ROOT.\n" );
+    /* Initialize movie */
+    lsmash_movie_parameters_t movie_param;
+    lsmash_initialize_movie_parameters( &movie_param );
+    movie_param.timescale = 48000;
+    if( lsmash_set_movie_parameters( enc->root, &movie_param ) < 0 )
+        return ERROR_MSG( enc, "failed to set movie parameters.\n" );
+    return prepare_output_track( enc );
+}
+
+int mp4opus_encoder_open
+(
+    mp4opus_encoder_t            **encp,
+    const mp4opus_encoder_param_t *param,
+    const mp4opus_io_t            *io
+)
+{
+    /* The encoder failed to open is handed over as well so that the caller gets the reason. */
+    mp4opus_encoder_t *enc = lsmash_malloc_zero( sizeof(mp4opus_encoder_t) );
+    *encp = enc;
+    if( !enc )
+        return -1;
+    enc->param = *param;
+    if( prepare_output( enc, io ) < 0 )
+    {
+        enc->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int encode_frame
+(
+    mp4opus_encoder_t *enc,
+    const uint8_t     *pcm
+)
+{
+    return mp4opus_encode_frame( enc->root, enc->track_ID, &enc->codec, &enc->out, pcm, enc->error ) < 0 ? -1 : 0;
+}
+
+static int feed_samples
+(
+    mp4opus_encoder_t *enc,
+    const uint8_t     *data,
+    uint64_t           size
+)
+{
+    while( size )
+    {
+        if( enc->resampler )
+        {
+            /* The resampler produces float samples into the frame buffer. */
+            const uint8_t *src      = data;
+            uint32_t       src_size = MP4OPUS_MIN( size, (uint64_t)RESAMPLE_FRAMES * enc->sample_bytes );
+            enc->buffer_pos += mp4opus_resample( enc->resampler, enc->buffer + enc->buffer_pos,
+                                                 enc->buffer_size - enc->buffer_pos, &src, &src_size );
+            size -= src - data;
+            data  = src;
+        }
+        else if( enc->buffer_pos == 0 && size >= enc->buffer_size
+         && ((uintptr_t)data & (enc->param.float_input ? sizeof(float) - 1 : sizeof(opus_int16) - 1)) == 0 )
+        {
+            /* The caller's buffer holds a whole frame, so encode it in place. */
+            if( encode_frame( enc, data ) < 0 )
+                return -1;
+            data += enc->buffer_size;
+            size -= enc->buffer_size;
+            continue;
+        }
+        else
+        {
+            uint32_t copy_size = MP4OPUS_MIN( enc->buffer_size - enc->buffer_pos, size );
+            memcpy( enc->buffer + enc->buffer_pos, data, copy_size );
+            enc->buffer_pos += copy_size;
+            data            += copy_size;
+            size            -= copy_size;
+        }
+        if( enc->buffer_pos == enc->buffer_size )
+        {
+            enc->buffer_pos = 0;
+            if( encode_frame( enc, enc->buffer ) < 0 )
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int mp4opus_encoder_push
+(
+    mp4opus_encoder_t *enc,
+    const void        *pcm,
+    uint32_t           num_samples
+)
+{
+    if( enc->failed )
+        return -1;  /* Keep the reason why the encoder failed to open. */
+    if( enc->finished )
+        return ERROR_MSG( enc, "the encoder is already finished.\n" );
+    if( feed_samples( enc, pcm, (uint64_t)num_samples * enc->sample_bytes ) < 0 )
+        return -1;
+    enc->num_samples += num_samples;
+    return 0;
+}
+
+static int moov_to_front_callback
+(
+    void    *param,
+    uint64_t written_movie_size,
+    uint64_t total_movie_size
+)
+{
+    return 0;
+}
+
+int mp4opus_encoder_finish
+(
+    mp4opus_encoder_t *enc
+)
+{
+    if( enc->failed )
+        return -1;  /* Keep the reason why the encoder failed to open. */
+    if( enc->finished )
+        return ERROR_MSG( enc, "the encoder is already finished.\n" );
+    enc->finished = 1;
+    /* Feed zeros once to take out the samples delayed by the resampler. */
+    uint8_t *tail;
+    uint32_t tail_size;
+    if( enc->resampler && mp4opus_get_resampler_tail( enc->resampler, &tail, &tail_size )
+     && feed_samples( enc, tail, tail_size ) < 0 )
+        return -1;
+    /* Pad with silence until the last pushed sample gets out of the encoder delay. */
+    mp4opus_output_media_t *out      = &enc->out;
+    uint64_t                duration = mp4opus_get_presentation_duration( enc->num_samples, enc->param.sample_rate );
+    while( enc->buffer_pos || mp4opus_get_padding_frames( out, out->timestamp / out->sample_duration, duration ) )
+    {
+        memset( enc->buffer + enc->buffer_pos, 0, enc->buffer_size - enc->buffer_pos );
+        enc->buffer_pos = 0;
+        if( encode_frame( enc, enc->buffer ) < 0 )
+            return -1;
+    }
+    if( mp4opus_flush_output_track( enc->root, enc->track_ID, out, enc->error ) < 0
+     || mp4opus_construct_timeline_map( enc->root, enc->track_ID, out, duration, enc->error ) < 0 )
+        return -1;
+    lsmash_adhoc_remux_t moov_to_front =
+    {
+        .func        = moov_to_front_callback,
+        .buffer_size = 4 * 1024 * 1024,
+        .param       = NULL
+    };
+    if( lsmash_finish_movie( enc->root, enc->param.faststart ? &moov_to_front : NULL ) < 0 )
+        return ERROR_MSG( enc, "failed to finalize output movie.\n" );
+    return 0;
+}
+
+void mp4opus_encoder_close
+(
+    mp4opus_encoder_t *enc
+)
+{
+    if( !enc )
+        return;
+    /* The file is owned by the caller, so it is never closed here. */
+    mp4opus_cleanup_output_media( &enc->out );
+    lsmash_destroy_root( enc->root );
+    if( enc->codec.msenc )
+        mp4opus_cleanup_encoder( &enc->codec );
+    mp4opus_destroy_resampler( enc->resampler );
+    lsmash_free( enc->buffer );
+    lsmash_free( enc );
+}
+
+const char *mp4opus_encoder_error
+(
+    mp4opus_encoder_t *enc
+)
+{
+    return enc ? enc->error : "failed to allocate encoder.\n";
+}
+
+/*** Decoder ***/
+
+void mp4opus_decoder_default_param
+(
+    mp4opus_decoder_param_t *param
+)
+{
+    memset( param, 0, sizeof(mp4opus_decoder_param_t) );
+}
+
+static int setup_decoder
+(
+    mp4opus_decoder_t                 *dec,
+    lsmash_opus_specific_parameters_t *param
+)
+{
+    /* The same order as mp4opusdec writes. */
+    uint8_t channel_mapping[255] = { 0 };
+    mp4opus_get_decoder_mapping( param, channel_mapping );
+    if( mp4opus_setup_decoder( &dec->codec, param, channel_mapping, dec->error ) < 0 )
+        return -1;
+    dec->channels     = param->OutputChannelCount;
+    dec->sample_bytes = dec->channels * (dec->param.float_output ? sizeof(float) : sizeof(opus_int16));
+    dec->pcm          = lsmash_malloc( MP4OPUS_MAX_PACKET_DURATION * dec->sample_bytes );
+    if( !dec->pcm )
+        return ERROR_MSG( dec, "failed to allocate sample buffer.\n" );
+    return 0;
+}
+
+static int open_input_track
+(
+    mp4opus_decoder_t *dec,
+    uint32_t           track_ID
+)
+{
+    /* Return 1 if the track is not an Opus track to decode. */
+    if( lsmash_count_summary( dec->root, track_ID ) != 1 )
+        return 1;
+    lsmash_summary_t *summary = lsmash_get_summary( dec->root, track_ID, 1 );
+    if( !summary )
+        return 1;
+    if( summary->summary_type != LSMASH_SUMMARY_TYPE_AUDIO
+     || !lsmash_check_codec_type_identical( summary->sample_type, ISOM_CODEC_TYPE_OPUS_AUDIO )
+     || ((lsmash_audio_summary_t *)summary)->frequency != 48000
+     || lsmash_get_media_timescale( dec->root, track_ID ) != 48000 )
+    {
+        lsmash_cleanup_summary( summary );
+        return 1;
+    }
+    lsmash_codec_specific_t *cs = mp4opus_get_opus_specific_info( summary );
+    lsmash_cleanup_summary( summary );
+    if( !cs )
+        return 1;
+    int ret = setup_decoder( dec, (lsmash_opus_specific_parameters_t *)cs->data.structured );
+    lsmash_destroy_codec_specific_data( cs );
+    if( ret < 0 )
+        return ret;
+    if( lsmash_construct_timeline( dec->root, track_ID ) < 0 )
+        return ERROR_MSG( dec, "failed to construct timeline.\n" );
+    dec->track_ID = track_ID;
+    return 0;
+}
+
+static int prepare_edits
+(
+    mp4opus_decoder_t *dec,
+    uint32_t           movie_timescale
+)
+{
+    /* Convert the edits into the media timescale, which is 48kHz as well as the output. */
+    uint32_t edit_count = lsmash_count_explicit_timeline_map( dec->root, dec->track_ID );
+    dec->edits = lsmash_malloc( (edit_count ? edit_count : 1) * sizeof(decoder_edit_t) );
+    if( !dec->edits )
+        return ERROR_MSG( dec, "failed to allocate edits.\n" );
+    uint64_t media_duration = lsmash_get_media_duration_from_media_timeline( dec->root, dec->track_ID );
+    if( edit_count == 0 )
+    {
+        /* Present the whole media. */
+        dec->edits[0]  = (decoder_edit_t){ 0, media_duration };
+        dec->num_edits = 1;
+        dec->duration  = media_duration;
+        return 0;
+    }
+    for( uint32_t i = 0; i < edit_count; i++ )
+    {
+        lsmash_edit_t edit;
+        if( lsmash_get_explicit_timeline_map( dec->root, dec->track_ID, i + 1, &edit ) < 0 )
+            return ERROR_MSG( dec, "failed to get explicit timeline map.\n" );
+        uint64_t duration = edit.duration == 0 && edit.start_time != -1
+                          ? media_duration
+                          : ((double)edit.duration / movie_timescale) * 48000;
+        dec->edits[i] = (decoder_edit_t){ edit.start_time, duration };
+        dec->duration += duration;
+    }
+    dec->num_edits = edit_count;
+    return 0;
+}
+
+static int open_input_file
+(
+    mp4opus_decoder_t  *dec,
+    const mp4opus_io_t *io
+)
+{
+    if( !io->read || !io->seek )
+        return ERROR_MSG( dec, "I/O callbacks required for the input are missing.\n" );
+    dec->root = lsmash_create_root();
+    if( !dec->root )
+        return ERROR_MSG( dec, "failed to create ROOT for input file.\n" );
+    setup_file_parameters( &dec->file_param, io, LSMASH_FILE_MODE_READ );
+    dec->fh = lsmash_set_file( dec->root, &dec->file_param );
+    if( !dec->fh )
+        return ERROR_MSG( dec, "failed to add input file into ROOT.\n" );
+    if( lsmash_read_file( dec->fh, &dec->file_param ) < 0 )
+        return ERROR_MSG( dec, "failed to read input file.\n" );
+    lsmash_movie_parameters_t movie_param;
+    if( lsmash_get_movie_parameters( dec->root, &movie_param ) < 0 )
+        return ERROR_MSG( dec, "failed to get movie parameters.\n" );
+    for( uint32_t i = 0; i < movie_param.number_of_tracks && !dec->track_ID; i++ )
+    {
+        uint32_t track_ID = lsmash_get_track_ID( dec->root, i + 1 );
+        if( track_ID == 0 )
+            return ERROR_MSG( dec, "failed to get track_ID.\n" );
+        if( dec->param.track_ID && track_ID != dec->param.track_ID )
+            continue;
+        if( open_input_track( dec, track_ID ) < 0 )
+            return -1;
+    }
+    if( !dec->track_ID )
+        return ERROR_MSG( dec, "failed to find Opus stream to decode.\n" );
+    lsmash_destroy_children( lsmash_file_as_box( dec->fh ) );
+    return prepare_edits( dec, movie_param.timescale );
+}
+
+int mp4opus_decoder_open
+(
+    mp4opus_decoder_t            **decp,
+    const mp4opus_decoder_param_t *param,
+    const mp4opus_io_t            *io
+)
+{
+    /* The decoder failed to open is handed over as well so that the caller gets the reason. */
+    mp4opus_decoder_t *dec = lsmash_malloc_zero( sizeof(mp4opus_decoder_t) );
+    *decp = dec;
+    if( !dec )
+        return -1;
+    dec->param = *param;
+    if( open_input_file( dec, io ) < 0 )
+    {
+        dec->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int mp4opus_decoder_get_info
+(
+    mp4opus_decoder_t     *dec,
+    mp4opus_stream_info_t *info
+)
+{
+    if( dec->failed )
+        return -1;  /* Keep the reason why the decoder failed to open. */
+    info->track_ID    = dec->track_ID;
+    info->sample_rate = 48000;
+    info->channels    = dec->channels;
+    info->duration    = dec->duration;
+    return 0;
+}
+
+static int start_edit
+(
+    mp4opus_decoder_t *dec
+)
+{
+    /* Return 1 if no more edits. */
+    if( dec->edit_number >= dec->num_edits )
+        return 1;
+    decoder_edit_t *edit = &dec->edits[ dec->edit_number++ ];
+    dec->presentation = (mp4opus_presentation_t)
+    {
+        .status     = MP4OPUS_RECOVERY_REQUIRED,
+        .timescale  = 48000,
+        .timestamp  = 0,
+        .duration   = edit->duration,
+        .start_time = edit->start_time,
+        .rate       = ISOM_EDIT_MODE_NORMAL
+    };
+    dec->presenting = 1;
+    dec->empty_edit = edit->start_time == -1;
+    dec->pcm_count  = 0;
+    if( dec->empty_edit )
+        return 0;
+    int ret = mp4opus_find_start_packet( dec->root, dec->track_ID, NULL, 0, 1, edit->start_time,
+                                         &dec->packet_number, dec->error );
+    if( ret < 0 )
+        return ret;
+    if( ret )
+        /* The edit is beyond the last sample, so nothing is decoded. */
+        dec->packet_number = lsmash_get_sample_count_in_media_timeline( dec->root, dec->track_ID ) + 1;
+    dec->presentation.status = MP4OPUS_RECOVERY_STARTED;
+    if( opus_multistream_decoder_ctl( dec->codec.msdec, OPUS_RESET_STATE ) != OPUS_OK )
+        return ERROR_MSG( dec, "failed to reset decoder.\n" );
+    return 0;
+}
+
+static int decode_next_packet
+(
+    mp4opus_decoder_t *dec
+)
+{
+    /* Return 1 if no more packets. */
+    if( !lsmash_check_sample_existence_in_media_timeline( dec->root, dec->track_ID, dec->packet_number ) )
+        return 1;
+    lsmash_sample_t *sample = lsmash_get_sample_from_media_timeline( dec->root, dec->track_ID, dec->packet_number );
+    if( !sample )
+        return ERROR_MSG( dec, "failed to get sample.\n" );
+    int num_samples = mp4opus_decode_packet( dec->codec.msdec, dec->param.float_output, sample->data, sample->length,
+                                             dec->pcm, MP4OPUS_MAX_PACKET_DURATION, 0 );
+    if( num_samples < 0 )
+    {
+        lsmash_delete_sample( sample );
+        return ERROR_MSG( dec, "failed to decode packet %"PRIu32".\n", dec->packet_number );
+    }
+    /* Drop the samples decoded for the pre-roll and the ones beyond the edit. */
+    uint32_t pre_skipped_samples;
+    num_samples = mp4opus_apply_edit( &dec->presentation, sample->cts, num_samples, &pre_skipped_samples );
+    lsmash_delete_sample( sample );
+    dec->pcm_pos   = pre_skipped_samples;
+    dec->pcm_count = num_samples > 0 ? num_samples : 0;
+    ++dec->packet_number;
+    return 0;
+}
+
+int mp4opus_decoder_pull
+(
+    mp4opus_decoder_t *dec,
+    void              *pcm,
+    uint32_t           max_samples
+)
+{
+    if( dec->failed )
+        return -1;  /* Keep the reason why the decoder failed to open. */
+    uint8_t *dst     = pcm;
+    uint32_t written = 0;
+    max_samples = MP4OPUS_MIN( max_samples, INT32_MAX );
+    while( written < max_samples )
+    {
+        if( !dec->presenting )
+        {
+            int ret = start_edit( dec );
+            if( ret < 0 )
+                return ret;
+            if( ret == 1 )
+                break;
+            continue;
+        }
+        mp4opus_presentation_t *presentation = &dec->presentation;
+        uint32_t                count;
+        if( dec->empty_edit )
+        {
+            /* An empty edit is presented as silence. */
+            count = MP4OPUS_MIN( max_samples - written, presentation->duration - presentation->timestamp );
+            memset( dst, 0, (size_t)count * dec->sample_bytes );
+            presentation->timestamp += count;
+            dec->presenting = presentation->timestamp < presentation->duration;
+        }
+        else
+        {
+            if( dec->pcm_count == 0 )
+            {
+                int ret = presentation->timestamp < presentation->duration ? decode_next_packet( dec ) : 1;
+                if( ret < 0 )
+                    return ret;
+                if( ret == 1 )
+                    dec->presenting = 0;    /* The edit ends, or exceeds the media. */
+                continue;
+            }
+            count = MP4OPUS_MIN( max_samples - written, dec->pcm_count );
+            memcpy( dst, dec->pcm + (size_t)dec->pcm_pos * dec->sample_bytes, (size_t)count * dec->sample_bytes );
+            dec->pcm_pos   += count;
+            dec->pcm_count -= count;
+        }
+        dst     += (size_t)count * dec->sample_bytes;
+        written += count;
+    }
+    return written;
+}
+
+void mp4opus_decoder_close
+(
+    mp4opus_decoder_t *dec
+)
+{
+    if( !dec )
+        return;
+    /* The file is owned by the caller, so it is never closed here. */
+    lsmash_destroy_root( dec->root );
+    if( dec->codec.msdec )
+        mp4opus_cleanup_decoder( &dec->codec );
+    lsmash_free( dec->edits );
+    lsmash_free( dec->pcm );
+    lsmash_free( dec );
+}
+
+const char *mp4opus_decoder_error
+(
+    mp4opus_decoder_t *dec
+)
+{
+    return dec ? dec->error : "failed to allocate decoder.\n";
+}
@@ -0,0 +1,131 @@
+/*****************************************************************************
+ * mp4opus.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUS_H
+#define MP4OPUS_H
+
+#include <stdint.h>
+
+/* libmp4opus: in-process encoding of PCM into Opus in ISO Base Media and decoding back.
+ * The caller pushes PCM into an encoder and pulls PCM from a decoder through its own buffers,
+ * and the container is read and written through the callbacks of the caller.
+ * Samples are interleaved in the SMPTE/USB channel order on both sides,
+ * or in the coded order with the channel mapping family 2 or 255.
+ * Every function returning int returns a negative value on failure,
+ * and then the reason is available by mp4opus_encoder_error() or mp4opus_decoder_error().
+ * This holds for the open functions too: the context failed to open is still returned
+ * so that the reason can be got from it, and must be closed by the caller. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    void    *opaque;
+    /* The same semantics as the I/O callbacks of L-SMASH.
+     * read and write return the number of bytes transferred, and seek returns the new position.
+     * The decoder requires read and seek. The encoder requires write, and seek unless fragmented,
+     * and read as well for faststart. */
+    int     (*read) ( void *opaque, uint8_t *buf, int size );
+    int     (*write)( void *opaque, uint8_t *buf, int size );
+    int64_t (*seek) ( void *opaque, int64_t offset, int whence );
+} mp4opus_io_t;
+
+/* Encoder */
+typedef struct mp4opus_encoder_tag mp4opus_encoder_t;
+
+typedef struct
+{
+    uint32_t sample_rate;   /* resampled into 48000 unless 8000, 12000, 16000, 24000 or 48000 */
+    uint32_t channels;      /* 1 to 255 */
+    int      float_input;   /* float samples instead of 16-bit native integers */
+    int      application;   /* OPUS_APPLICATION_* */
+    int      complexity;    /* 0 to 10 */
+    int      bitrate;       /* bits per second, or OPUS_AUTO */
+    int      vbr;           /* 0: CBR, 1: VBR, 2: constrained VBR */
+    int      max_bandwidth; /* OPUS_BANDWIDTH_* */
+    double   frame_size;    /* 2.5, 5, 10, 20, 40 or 60 (ms) */
+    int      fragment;      /* duration of a fragment (ms), 0 for a non-fragmented movie */
+    int      faststart;     /* move the movie header to the front of a non-fragmented movie */
+    int      mapping_family; /* 0, 1, 2 or 255, -1 for 0 up to 2 channels, 1 up to 8 and 255 above */
+} mp4opus_encoder_param_t;
+
+void mp4opus_encoder_default_param( mp4opus_encoder_param_t *param );
+
+/* Set *enc to a new encoder, which must be closed even on failure.
+ * *enc is set to NULL only if the encoder itself could not be allocated.
+ * io is copied and used until the encoder is closed. */
+int mp4opus_encoder_open( mp4opus_encoder_t **enc, const mp4opus_encoder_param_t *param, const mp4opus_io_t *io );
+
+/* Encode num_samples samples per channel in pcm. The buffer may be reused right after the return. */
+int mp4opus_encoder_push( mp4opus_encoder_t *enc, const void *pcm, uint32_t num_samples );
+
+/* Encode the rest of the pushed samples and finalize the movie. No samples can be pushed any more. */
+int mp4opus_encoder_finish( mp4opus_encoder_t *enc );
+
+/* Close the encoder. The unfinished movie is left broken. */
+void mp4opus_encoder_close( mp4opus_encoder_t *enc );
+
+/* enc may be NULL after mp4opus_encoder_open() failed to allocate it. */
+const char *mp4opus_encoder_error( mp4opus_encoder_t *enc );
+
+/* Decoder */
+typedef struct mp4opus_decoder_tag mp4opus_decoder_t;
+
+typedef struct
+{
+    uint32_t track_ID;      /* track to be decoded, 0 for the first Opus track */
+    int      float_output;  /* float samples instead of 16-bit native integers */
+} mp4opus_decoder_param_t;
+
+typedef struct
+{
+    uint32_t track_ID;
+    uint32_t sample_rate;   /* always 48000 */
+    uint32_t channels;
+    uint64_t duration;      /* number of samples per channel to be presented */
+} mp4opus_stream_info_t;
+
+void mp4opus_decoder_default_param( mp4opus_decoder_param_t *param );
+
+/* Set *dec to a new decoder, which must be closed even on failure.
+ * *dec is set to NULL only if the decoder itself could not be allocated.
+ * io is copied and used until the decoder is closed. */
+int mp4opus_decoder_open( mp4opus_decoder_t **dec, const mp4opus_decoder_param_t *param, const mp4opus_io_t *io );
+
+int mp4opus_decoder_get_info( mp4opus_decoder_t *dec, mp4opus_stream_info_t *info );
+
+/* Decode up to max_samples samples per channel into pcm in presentation order.
+ * Return the number of samples per channel written, which is less than max_samples only at the end. */
+int mp4opus_decoder_pull( mp4opus_decoder_t *dec, void *pcm, uint32_t max_samples );
+
+void mp4opus_decoder_close( mp4opus_decoder_t *dec );
+
+/* dec may be NULL after mp4opus_decoder_open() failed to allocate it. */
+const char *mp4opus_decoder_error( mp4opus_decoder_t *dec );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
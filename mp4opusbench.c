@@ -0,0 +1,668 @@
+/*****************************************************************************
+ * mp4opusbench.c
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+/* Throughput benchmark of the stages mp4opusenc and mp4opusdec consist of.
+ * The built tools are run on synthetic audio, and the time of each stage is taken from
+ * the statistics the tools write by --stats-json, so the shipped code paths are measured as they are.
+ * The results are written as JSON. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <lsmash.h>
+
+#include <opus/opus_multistream.h>
+
+#define MAX_LIST_COUNT 16
+
+typedef struct
+{
+    double   values[MAX_LIST_COUNT];
+    uint32_t count;
+} value_list_t;
+
+typedef struct
+{
+    int          help;
+    value_list_t frame_sizes;
+    value_list_t complexities;
+    value_list_t channels;
+    value_list_t sample_rates;
+    double       duration;
+    char        *output;
+    char        *encoder;
+    char        *decoder;
+    char        *lpcm_name;
+    char        *opus_name;
+    char        *decoded_name;
+    char        *stats_name;
+} option_t;
+
+typedef struct
+{
+    double seconds;
+    double cpu_seconds;
+} stage_time_t;
+
+typedef struct
+{
+    double       frame_size;
+    int          complexity;
+    uint32_t     channels;
+    uint32_t     sample_rate;
+    uint64_t     num_samples;       /* per channel at the sample rate */
+    uint64_t     num_packets;
+    uint64_t     encoded_bytes;
+    stage_time_t demux;
+    stage_time_t encode;
+    stage_time_t mux;
+    stage_time_t finish;
+    stage_time_t decode;
+} bench_result_t;
+
+#define MP4OPUSBENCH_MIN( a, b ) (((a) < (b)) ? (a) : (b))
+#define eprintf( ... ) fprintf( stderr, __VA_ARGS__ )
+#define ERROR_MSG( ... ) error_message( __VA_ARGS__ )
+#define REFRESH_CONSOLE eprintf( "                                                                               \r" )
+
+#define LPCM_CHUNK_SAMPLES 1024     /* the common chunking of QuickTime LPCM */
+#define COMMAND_LENGTH     4096
+
+static int error_message
+(
+    const char *message,
+    ...
+)
+{
+    REFRESH_CONSOLE;
+    eprintf( "Error: " );
+    va_list args;
+    va_start( args, message );
+    vfprintf( stderr, message, args );
+    va_end( args );
+    return -1;
+}
+
+static void display_help( void )
+{
+    eprintf
+    (
+        "\n"
+        "Usage: mp4opusbench [options]\n"
+        "Options:\n"
+        "    --help                    Display help\n"
+        "    --framesize <list>        Specify comma separated frame sizes in milliseconds\n"
+        "                                the default value is 2.5,20,60\n"
+        "    --complexity <list>       Specify comma separated encoding complexities\n"
+        "                                the default value is 0,10\n"
+        "    --channels <list>         Specify comma separated channel counts (1-8)\n"
+        "                                the default value is 2,6\n"
+        "    --rate <list>             Specify comma separated sample rates\n"
+        "                                the default value is 16000,48000\n"
+        "    --duration <float>        Specify duration of the test signal in seconds\n"
+        "                                the default value is 10\n"
+        "    --output <string>         Write the result in JSON into the file\n"
+        "                                the default is stdout\n"
+        "    --encoder <string>        Specify the path of mp4opusenc to be measured\n"
+        "                                the default is ./mp4opusenc\n"
+        "    --decoder <string>        Specify the path of mp4opusdec to be measured\n"
+        "                                the default is ./mp4opusdec\n"
+        "The temporary files mp4opusbench_lpcm.mov, mp4opusbench_opus.mp4,\n"
+        "mp4opusbench_decoded.mov and mp4opusbench_stats.json are written into\n"
+        "the current directory and removed at exit.\n"
+    );
+}
+
+static void default_options
+(
+    option_t *opt
+)
+{
+    opt->frame_sizes  = (value_list_t){ { 2.5, 20, 60 }, 3 };
+    opt->complexities = (value_list_t){ { 0, 10 }, 2 };
+    opt->channels     = (value_list_t){ { 2, 6 }, 2 };
+    opt->sample_rates = (value_list_t){ { 16000, 48000 }, 2 };
+    opt->duration     = 10;
+    opt->encoder      = "./mp4opusenc";
+    opt->decoder      = "./mp4opusdec";
+    opt->lpcm_name    = "mp4opusbench_lpcm.mov";
+    opt->opus_name    = "mp4opusbench_opus.mp4";
+    opt->decoded_name = "mp4opusbench_decoded.mov";
+    opt->stats_name   = "mp4opusbench_stats.json";
+}
+
+static int parse_value_list
+(
+    const char   *arg,
+    value_list_t *list
+)
+{
+    list->count = 0;
+    while( *arg )
+    {
+        if( list->count == MAX_LIST_COUNT )
+            return -1;
+        char *end;
+        list->values[ list->count++ ] = strtod( arg, &end );
+        if( end == arg || (*end != ',' && *end != '\0') )
+            return -1;
+        arg = *end ? end + 1 : end;
+    }
+    return list->count ? 0 : -1;
+}
+
+static int parse_options
+(
+    int       argc,
+    char    **argv,
+    option_t *opt
+)
+{
+    default_options( opt );
+    for( int i = 1; i < argc; i++ )
+    {
+#define CHECK_NEXT_ARG if( argc == ++i ) return ERROR_MSG( "%s requires argument.\n", argv[i - 1] );
+        if( !strcasecmp( argv[i], "-h" ) || !strcasecmp( argv[i], "--help" ) )
+        {
+            opt->help = 1;
+            return 0;
+        }
+        else if( !strcasecmp( argv[i], "--framesize" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( parse_value_list( argv[i], &opt->frame_sizes ) < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            for( uint32_t j = 0; j < opt->frame_sizes.count; j++ )
+            {
+                double frame_size = opt->frame_sizes.values[j];
+                if( frame_size != 2.5 && frame_size != 5
+                 && frame_size != 10  && frame_size != 20
+                 && frame_size != 40  && frame_size != 60 )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            }
+        }
+        else if( !strcasecmp( argv[i], "--complexity" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( parse_value_list( argv[i], &opt->complexities ) < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            for( uint32_t j = 0; j < opt->complexities.count; j++ )
+                if( opt->complexities.values[j] < 0 || opt->complexities.values[j] > 10 )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--channels" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( parse_value_list( argv[i], &opt->channels ) < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            for( uint32_t j = 0; j < opt->channels.count; j++ )
+                if( opt->channels.values[j] < 1 || opt->channels.values[j] > 8 )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--rate" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( parse_value_list( argv[i], &opt->sample_rates ) < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            for( uint32_t j = 0; j < opt->sample_rates.count; j++ )
+            {
+                double rate = opt->sample_rates.values[j];
+                if( rate != 8000 && rate != 12000 && rate != 16000 && rate != 24000 && rate != 48000 )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            }
+        }
+        else if( !strcasecmp( argv[i], "--duration" ) )
+        {
+            CHECK_NEXT_ARG;
+            opt->duration = atof( argv[i] );
+            if( opt->duration <= 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--output" ) )
+        {
+            CHECK_NEXT_ARG;
+            opt->output = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--encoder" ) )
+        {
+            CHECK_NEXT_ARG;
+            opt->encoder = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--decoder" ) )
+        {
+            CHECK_NEXT_ARG;
+            opt->decoder = argv[i];
+        }
+#undef CHECK_NEXT_ARG
+        else
+            return ERROR_MSG( "you specified invalid option: %s.\n", argv[i] );
+    }
+    return 0;
+}
+
+static opus_int16 *generate_signal
+(
+    uint32_t sample_rate,
+    uint32_t channels,
+    uint64_t num_samples
+)
+{
+    /* Deterministic mixture of a tone per channel and noise so that the encoder does real work. */
+    opus_int16 *pcm = lsmash_malloc( num_samples * channels * sizeof(opus_int16) );
+    if( !pcm )
+        return NULL;
+    uint32_t seed = 0x12345678;
+    for( uint64_t i = 0; i < num_samples; i++ )
+        for( uint32_t j = 0; j < channels; j++ )
+        {
+            seed = seed * 1664525 + 1013904223;
+            double tone  = sin( 2 * 3.14159265358979323846 * (220.0 * (j + 1)) * i / sample_rate );
+            double noise = (double)(int32_t)seed / 2147483648.0;
+            pcm[i * channels + j] = (opus_int16)(8000 * tone + 2000 * noise);
+        }
+    return pcm;
+}
+
+static int set_up_output_file
+(
+    lsmash_root_t           **root,
+    lsmash_file_parameters_t *file_param,
+    const char               *name,
+    lsmash_brand_type        *brands,
+    uint32_t                  brand_count,
+    uint32_t                  timescale,
+    uint32_t                 *track_ID,
+    int                       roll_grouping
+)
+{
+    *root = lsmash_create_root();
+    if( !*root )
+        return ERROR_MSG( "failed to create ROOT.\n" );
+    if( lsmash_open_file( name, 0, file_param ) < 0 )
+        return ERROR_MSG( "failed to open an output file.\n" );
+    file_param->major_brand   = brands[0];
+    file_param->brands        = brands;
+    file_param->brand_count   = brand_count;
+    file_param->minor_version = 0;
+    if( !lsmash_set_file( *root, file_param ) )
+        return ERROR_MSG( "failed to add output file into ROOT.\n" );
+    lsmash_movie_parameters_t movie_param;
+    lsmash_initialize_movie_parameters( &movie_param );
+    movie_param.timescale = timescale;
+    if( lsmash_set_movie_parameters( *root, &movie_param ) < 0 )
+        return ERROR_MSG( "failed to set movie parameters.\n" );
+    *track_ID = lsmash_create_track( *root, ISOM_MEDIA_HANDLER_TYPE_AUDIO_TRACK );
+    if( *track_ID == 0 )
+        return ERROR_MSG( "failed to create track.\n" );
+    lsmash_track_parameters_t track_param;
+    lsmash_initialize_track_parameters( &track_param );
+    track_param.mode = ISOM_TRACK_IN_MOVIE | ISOM_TRACK_IN_PREVIEW | ISOM_TRACK_ENABLED;
+    if( lsmash_set_track_parameters( *root, *track_ID, &track_param ) < 0 )
+        return ERROR_MSG( "failed to set track parameters.\n" );
+    lsmash_media_parameters_t media_param;
+    lsmash_initialize_media_parameters( &media_param );
+    media_param.timescale     = timescale;
+    media_param.roll_grouping = roll_grouping;
+    if( lsmash_set_media_parameters( *root, *track_ID, &media_param ) < 0 )
+        return ERROR_MSG( "failed to set media parameters.\n" );
+    return 0;
+}
+
+static void close_output_file
+(
+    lsmash_root_t           **root,
+    lsmash_file_parameters_t *file_param
+)
+{
+    lsmash_close_file( file_param );
+    lsmash_destroy_root( *root );
+    *root = NULL;
+}
+
+static int add_summary
+(
+    lsmash_root_t           *root,
+    uint32_t                 track_ID,
+    lsmash_audio_summary_t  *summary,
+    lsmash_codec_specific_t *cs,
+    uint32_t                *sample_entry
+)
+{
+    int ret = lsmash_add_codec_specific_data( (lsmash_summary_t *)summary, cs );
+    lsmash_destroy_codec_specific_data( cs );
+    if( ret < 0 )
+        return ERROR_MSG( "failed to add codec specific info.\n" );
+    *sample_entry = lsmash_add_sample_entry( root, track_ID, summary );
+    if( *sample_entry == 0 )
+        return ERROR_MSG( "failed to add sample description entry.\n" );
+    return 0;
+}
+
+static int write_lpcm_file
+(
+    option_t         *opt,
+    bench_result_t   *result,
+    const opus_int16 *pcm
+)
+{
+    /* Not timed. This is the input of the demuxing stage. */
+    lsmash_root_t           *root;
+    lsmash_file_parameters_t file_param = { 0 };
+    uint32_t                 track_ID;
+    if( set_up_output_file( &root, &file_param, opt->lpcm_name,
+                            (lsmash_brand_type [1]){ ISOM_BRAND_TYPE_QT }, 1,
+                            result->sample_rate, &track_ID, 0 ) < 0 )
+    {
+        close_output_file( &root, &file_param );
+        return -1;
+    }
+    lsmash_audio_summary_t  *summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
+    lsmash_codec_specific_t *cs      = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_QT_AUDIO_FORMAT_SPECIFIC_FLAGS,
+                                                                          LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !summary || !cs )
+    {
+        lsmash_cleanup_summary( (lsmash_summary_t *)summary );
+        lsmash_destroy_codec_specific_data( cs );
+        close_output_file( &root, &file_param );
+        return ERROR_MSG( "failed to allocate LPCM summary.\n" );
+    }
+    summary->sample_type = QT_CODEC_TYPE_LPCM_AUDIO;
+    summary->frequency   = result->sample_rate;
+    summary->channels    = result->channels;
+    summary->sample_size = 16;
+    ((lsmash_qt_audio_format_specific_flags_t *)cs->data.structured)->format_flags = QT_AUDIO_FORMAT_FLAG_SIGNED_INTEGER
+                                                                                   | QT_AUDIO_FORMAT_FLAG_PACKED;
+    uint32_t sample_entry;
+    int ret = add_summary( root, track_ID, summary, cs, &sample_entry );
+    lsmash_cleanup_summary( (lsmash_summary_t *)summary );
+    uint32_t frame_bytes = result->channels * sizeof(opus_int16);
+    for( uint64_t i = 0; ret == 0 && i < result->num_samples; i += LPCM_CHUNK_SAMPLES )
+    {
+        uint32_t         count  = MP4OPUSBENCH_MIN( LPCM_CHUNK_SAMPLES, result->num_samples - i );
+        lsmash_sample_t *sample = lsmash_create_sample( count * frame_bytes );
+        if( !sample )
+        {
+            ret = ERROR_MSG( "failed to allocate sample.\n" );
+            break;
+        }
+        memcpy( sample->data, pcm + i * result->channels, sample->length );
+        sample->dts           = i;
+        sample->cts           = i;
+        sample->index         = sample_entry;
+        sample->prop.ra_flags = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
+        if( lsmash_append_sample( root, track_ID, sample ) < 0 )
+        {
+            lsmash_delete_sample( sample );
+            ret = ERROR_MSG( "failed to append sample.\n" );
+        }
+    }
+    if( ret == 0 && lsmash_flush_pooled_samples( root, track_ID, LPCM_CHUNK_SAMPLES ) < 0 )
+        ret = ERROR_MSG( "failed to flush samples.\n" );
+    if( ret == 0 && lsmash_finish_movie( root, NULL ) < 0 )
+        ret = ERROR_MSG( "failed to finalize LPCM movie.\n" );
+    close_output_file( &root, &file_param );
+    return ret;
+}
+
+static int run_tool
+(
+    option_t   *opt,
+    const char *command
+)
+{
+    /* The statistics of the previous run must not be taken for this run. */
+    remove( opt->stats_name );
+    if( system( command ) != 0 )
+        return ERROR_MSG( "failed to run: %s\n", command );
+    return 0;
+}
+
+static char *read_stats_file
+(
+    option_t *opt
+)
+{
+    FILE *fp = fopen( opt->stats_name, "rb" );
+    if( !fp )
+    {
+        ERROR_MSG( "failed to open the statistics.\n" );
+        return NULL;
+    }
+    char  *stats = NULL;
+    size_t size  = 0;
+    if( fseek( fp, 0, SEEK_END ) == 0 )
+    {
+        long length = ftell( fp );
+        stats = length > 0 ? lsmash_malloc( length + 1 ) : NULL;
+        if( stats && fseek( fp, 0, SEEK_SET ) == 0 )
+            size = fread( stats, 1, length, fp );
+    }
+    fclose( fp );
+    if( !stats || size == 0 )
+    {
+        lsmash_free( stats );
+        ERROR_MSG( "failed to read the statistics.\n" );
+        return NULL;
+    }
+    stats[size] = '\0';
+    return stats;
+}
+
+static int get_stage_time
+(
+    const char   *stats,
+    const char   *name,
+    stage_time_t *time
+)
+{
+    /* The statistics are written by the tools in the fixed layout of
+     *   "<stage>": { "wall": <seconds>, "cpu": <seconds> } */
+    char key[64];
+    sprintf( key, "\"%s\":", name );
+    const char *value = strstr( stats, key );
+    if( !value || sscanf( value + strlen( key ), " { \"wall\": %lf, \"cpu\": %lf }",
+                          &time->seconds, &time->cpu_seconds ) != 2 )
+        return ERROR_MSG( "failed to get the time of %s from the statistics.\n", name );
+    return 0;
+}
+
+static int bench_encode
+(
+    option_t       *opt,
+    bench_result_t *result
+)
+{
+    char command[COMMAND_LENGTH];
+    snprintf( command, COMMAND_LENGTH, "\"%s\" --framesize %g --complexity %d --stats-json \"%s\" -i \"%s\" -o \"%s\"",
+              opt->encoder, result->frame_size, result->complexity, opt->stats_name, opt->lpcm_name, opt->opus_name );
+    if( run_tool( opt, command ) < 0 )
+        return -1;
+    char *stats = read_stats_file( opt );
+    if( !stats )
+        return -1;
+    int ret = 0;
+    const char *output = strstr( stats, "\"output\":" );
+    if( !output || sscanf( output, "\"output\": { \"packets\": %"SCNu64", \"bytes\": %"SCNu64" }",
+                           &result->num_packets, &result->encoded_bytes ) != 2 )
+        ret = ERROR_MSG( "failed to get the output from the statistics.\n" );
+    if( ret == 0 )
+        ret = get_stage_time( stats, "demux", &result->demux );
+    if( ret == 0 )
+        ret = get_stage_time( stats, "encode", &result->encode );
+    if( ret == 0 )
+        ret = get_stage_time( stats, "mux", &result->mux );
+    if( ret == 0 )
+        ret = get_stage_time( stats, "finalize", &result->finish );
+    lsmash_free( stats );
+    return ret;
+}
+
+static int bench_decode
+(
+    option_t       *opt,
+    bench_result_t *result
+)
+{
+    char command[COMMAND_LENGTH];
+    snprintf( command, COMMAND_LENGTH, "\"%s\" --stats-json \"%s\" -i \"%s\" -o \"%s\"",
+              opt->decoder, opt->stats_name, opt->opus_name, opt->decoded_name );
+    if( run_tool( opt, command ) < 0 )
+        return -1;
+    char *stats = read_stats_file( opt );
+    if( !stats )
+        return -1;
+    int ret = get_stage_time( stats, "decode", &result->decode );
+    lsmash_free( stats );
+    return ret;
+}
+
+static int run_bench
+(
+    option_t       *opt,
+    bench_result_t *result
+)
+{
+    result->num_samples = opt->duration * result->sample_rate;
+    opus_int16 *pcm = generate_signal( result->sample_rate, result->channels, result->num_samples );
+    if( !pcm )
+        return ERROR_MSG( "failed to allocate test signal.\n" );
+    int ret = write_lpcm_file( opt, result, pcm );
+    lsmash_free( pcm );
+    if( ret == 0 )
+        ret = bench_encode( opt, result );
+    if( ret == 0 )
+        ret = bench_decode( opt, result );
+    remove( opt->lpcm_name );
+    remove( opt->opus_name );
+    remove( opt->decoded_name );
+    remove( opt->stats_name );
+    return ret;
+}
+
+static void print_stage
+(
+    FILE           *fp,
+    const char     *name,
+    bench_result_t *result,
+    stage_time_t   *time,
+    int             last
+)
+{
+    /* ns_per_sample is per sample frame (all channels) at the input sample rate. */
+    double duration = (double)result->num_samples / result->sample_rate;
+    fprintf( fp, "        \"%s\": { \"seconds\": %.6f, \"cpu_seconds\": %.6f, \"x_realtime\": %.3f, \"ns_per_sample\": %.3f }%s\n",
+             name, time->seconds, time->cpu_seconds,
+             time->seconds > 0 ? duration / time->seconds : 0.0,
+             result->num_samples ? time->seconds * 1e9 / result->num_samples : 0.0,
+             last ? "" : "," );
+}
+
+static void print_result
+(
+    FILE           *fp,
+    bench_result_t *result,
+    int             first
+)
+{
+    /* The separator is written before every result but the first,
+     * so that the array stays valid whenever a later case fails. */
+    fprintf( fp, "%s      {\n", first ? "" : ",\n" );
+    fprintf( fp, "        \"framesize\": %g,\n", result->frame_size );
+    fprintf( fp, "        \"complexity\": %d,\n", result->complexity );
+    fprintf( fp, "        \"channels\": %"PRIu32",\n", result->channels );
+    fprintf( fp, "        \"sample_rate\": %"PRIu32",\n", result->sample_rate );
+    fprintf( fp, "        \"samples\": %"PRIu64",\n", result->num_samples );
+    fprintf( fp, "        \"packets\": %"PRIu64",\n", result->num_packets );
+    fprintf( fp, "        \"encoded_bytes\": %"PRIu64",\n", result->encoded_bytes );
+    print_stage( fp, "demux",  result, &result->demux,  0 );
+    print_stage( fp, "encode", result, &result->encode, 0 );
+    print_stage( fp, "mux",    result, &result->mux,    0 );
+    print_stage( fp, "finish", result, &result->finish, 0 );
+    print_stage( fp, "decode", result, &result->decode, 1 );
+    fprintf( fp, "      }" );
+}
+
+int main
+(
+    int   argc,
+    char *argv[]
+)
+{
+    option_t opt = { 0 };
+    if( parse_options( argc, argv, &opt ) < 0 )
+    {
+        display_help();
+        return -1;
+    }
+    if( opt.help )
+    {
+        display_help();
+        return 0;
+    }
+    FILE *fp = opt.output ? fopen( opt.output, "wb" ) : stdout;
+    if( !fp )
+        return ERROR_MSG( "failed to open output file.\n" );
+    uint32_t num_cases = opt.frame_sizes.count * opt.complexities.count * opt.channels.count * opt.sample_rates.count;
+    uint32_t case_number = 0;
+    uint32_t num_results = 0;
+    int ret = 0;
+    fprintf( fp, "{\n" );
+    fprintf( fp, "  \"opus_version\": \"%s\",\n", opus_get_version_string() );
+#ifdef LSMASH_VERSION_MAJOR
+    fprintf( fp, "  \"lsmash_version\": \"%d.%d.%d\",\n", LSMASH_VERSION_MAJOR, LSMASH_VERSION_MINOR, LSMASH_VERSION_MICRO );
+#endif
+    fprintf( fp, "  \"duration\": %g,\n", opt.duration );
+    fprintf( fp, "  \"results\":\n    [\n" );
+    for( uint32_t i = 0; ret == 0 && i < opt.sample_rates.count; i++ )
+        for( uint32_t j = 0; ret == 0 && j < opt.channels.count; j++ )
+            for( uint32_t k = 0; ret == 0 && k < opt.frame_sizes.count; k++ )
+                for( uint32_t l = 0; ret == 0 && l < opt.complexities.count; l++ )
+                {
+                    bench_result_t result =
+                    {
+                        .frame_size  = opt.frame_sizes.values[k],
+                        .complexity  = opt.complexities.values[l],
+                        .channels    = opt.channels.values[j],
+                        .sample_rate = opt.sample_rates.values[i]
+                    };
+                    REFRESH_CONSOLE;
+                    eprintf( "Benchmarking: [%"PRIu32"/%"PRIu32"]\r", ++case_number, num_cases );
+                    ret = run_bench( &opt, &result );
+                    if( ret == 0 )
+                        print_result( fp, &result, num_results++ == 0 );
+                }
+    /* The array and the object are closed even if a case failed, and then completed is false. */
+    fprintf( fp, "%s    ],\n", num_results ? "\n" : "" );
+    fprintf( fp, "  \"completed\": %s\n}\n", ret == 0 ? "true" : "false" );
+    if( fp != stdout )
+        fclose( fp );
+    REFRESH_CONSOLE;
+    if( ret < 0 )
+        return ERROR_MSG( "failed to benchmark.\n" );
+    eprintf( "Benchmark completed!\n" );
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*****************************************************************************
+ * mp4opuscore.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSCORE_H
+#define MP4OPUSCORE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <lsmash.h>
+
+/* Rules of Opus in ISO Base Media shared by mp4opusenc, mp4opusdec, mp4opusmux and libmp4opus,
+ * so that the tools and the library lay out, locate and decode the streams in the same way.
+ * Nothing here reports errors by itself. The callers do in their own manners. */
+
+#define MP4OPUS_PRE_ROLL_DURATION 80    /* ms, the decoder converges within */
+
+typedef struct
+{
+    uint32_t tag;           /* QuickTime channel layout tag */
+    uint32_t bitmap;        /* QuickTime channel bitmap */
+    uint8_t  encoder[8];    /* SMPTE/USB channel order -> Encoder channel order */
+    uint8_t  vorbis[8];     /* Encoder channel order -> Vorbis channel order */
+    uint8_t  decoder[8];    /* Vorbis channel order -> SMPTE/USB channel order */
+} mp4opus_channel_layout_t;
+
+static inline const mp4opus_channel_layout_t *mp4opus_get_channel_layout
+(
+    uint32_t channels
+)
+{
+    /* The layouts of the channel mapping family 0 and 1 by the number of channels. */
+    static const mp4opus_channel_layout_t layouts[8] =
+        {
+            /* C -> [C] -> C */
+            {
+                QT_CHANNEL_LAYOUT_MONO,
+                QT_CHANNEL_BIT_CENTER,
+                { 0 },
+                { 0 },
+                { 0 }
+            },
+            /* L+R -> [L+R] -> L+R */
+            {
+                QT_CHANNEL_LAYOUT_STEREO,
+                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT,
+                { 0, 1 },
+                { 0, 1 },
+                { 0, 1 }
+            },
+            /* L+R+C -> [L+R]+[C] -> L+C+R */
+            {
+                QT_CHANNEL_LAYOUT_MPEG_3_0_A,
+                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_CENTER,
+                { 0, 1, 2 },
+                { 0, 2, 1 },
+                { 0, 2, 1 }
+            },
+            /* L+R+BL+BR -> [L+R]+[BL+BR] -> L+R+BL+BR */
+            {
+                QT_CHANNEL_LAYOUT_QUADRAPHONIC,
+                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
+                { 0, 1, 2, 3 },
+                { 0, 1, 2, 3 },
+                { 0, 1, 2, 3 }
+            },
+            /* L+R+C+BL+BR -> [L+R]+[BL+BR]+[C] -> L+C+R+BL+BR */
+            {
+                QT_CHANNEL_LAYOUT_MPEG_5_0_A,
+                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_CENTER
+              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
+                { 0, 1, 3, 4, 2 },
+                { 0, 4, 1, 2, 3 },
+                { 0, 2, 1, 3, 4 }
+            },
+            /* L+R+C+LFE+BL+BR -> [L+R]+[BL+BR]+[C]+[LFE] -> L+C+R+BL+BR+LFE */
+            {
+                QT_CHANNEL_LAYOUT_MPEG_5_1_A,
+                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_CENTER
+              | QT_CHANNEL_BIT_LFE_SCREEN
+              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
+                { 0, 1, 4, 5, 2, 3 },
+                { 0, 4, 1, 2, 3, 5 },
+                { 0, 2, 1, 5, 3, 4 }
+            },
+            /* L+R+C+LFE+BC+SL+SR -> [L+R]+[SL+SR]+[C]+[BC]+[LFE] -> L+C+R+SL+SR+BC+LFE */
+            {
+                QT_CHANNEL_LAYOUT_UNKNOWN | 7,
+                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_CENTER
+              | QT_CHANNEL_BIT_LFE_SCREEN
+              | QT_CHANNEL_BIT_CENTER_SURROUND
+              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
+                { 0, 1, 5, 6, 2, 4, 3 },
+                { 0, 4, 1, 2, 3, 5, 6 },
+                { 0, 2, 1, 6, 5, 3, 4 }
+            },
+            /* L+R+C+LFE+BL+BR+SL+SR -> [L+R]+[SL+SR]+[BL+BR]+[C]+[LFE] -> L+C+R+SL+SR+BL+BR+LFE */
+            {
+                QT_CHANNEL_LAYOUT_UNKNOWN | 8,
+                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
+              | QT_CHANNEL_BIT_CENTER
+              | QT_CHANNEL_BIT_LFE_SCREEN
+              | QT_CHANNEL_BIT_LEFT_SURROUND        | QT_CHANNEL_BIT_RIGHT_SURROUND
+              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
+                { 0, 1, 6, 7, 4, 5, 2, 3 },
+                { 0, 6, 1, 2, 3, 4, 5, 7 },
+                { 0, 2, 1, 7, 5, 6, 3, 4 }
+            }
+        };
+    return channels >= 1 && channels <= 8 ? &layouts[channels - 1] : NULL;
+}
+
+static inline int mp4opus_is_native_rate
+(
+    uint32_t rate
+)
+{
+    return rate == 8000 || rate == 12000 || rate == 16000 || rate == 24000 || rate == 48000;
+}
+
+static inline int mp4opus_is_valid_frame_size
+(
+    double frame_size
+)
+{
+    /* Every frame size is a whole number of samples at any of the native rates. */
+    return frame_size == 2.5 || frame_size == 5
+        || frame_size == 10  || frame_size == 20
+        || frame_size == 40  || frame_size == 60;
+}
+
+static inline uint32_t mp4opus_get_preroll_distance
+(
+    double frame_size
+)
+{
+    /* Require at least 80ms for pre-roll. */
+    return (MP4OPUS_PRE_ROLL_DURATION - 1) / frame_size + 1;
+}
+
+static inline uint32_t mp4opus_get_max_packet_size
+(
+    double frame_size,
+    int    stream_count
+)
+{
+    /* A 40ms or 60ms packet consists of multiple frames of up to 1275 bytes per stream.
+     * 7 bytes are enough for the TOC and the frame lengths including the self-delimiting framing. */
+    uint32_t num_frames = frame_size > 20 ? (uint32_t)(frame_size / 20) : 1;
+    return (1275 * num_frames + 7) * stream_count;
+}
+
+static inline void mp4opus_set_stream_layout
+(
+    lsmash_opus_specific_parameters_t *param
+)
+{
+    /* The streams of the channel mapping family 0 and 1 for OutputChannelCount up to 8. */
+    param->CoupledCount = (int []){ 0, 1, 1, 2, 2, 2, 2, 3 }[ param->OutputChannelCount - 1 ];
+    param->StreamCount  = param->OutputChannelCount - param->CoupledCount;
+}
+
+static inline void mp4opus_set_encoder_mapping
+(
+    lsmash_opus_specific_parameters_t *param,
+    const mp4opus_channel_layout_t    *layout,
+    uint8_t                            channel_mapping[255]
+)
+{
+    /* The encoder takes the channels in the SMPTE/USB order of the layout,
+     * and ChannelMapping tells the decoder the Vorbis order of them. */
+    memcpy( param->ChannelMapping, layout->vorbis, sizeof(layout->vorbis) );
+    memcpy( channel_mapping, layout->encoder, sizeof(layout->encoder) );
+}
+
+static inline uint32_t mp4opus_get_decoder_mapping
+(
+    const lsmash_opus_specific_parameters_t *param,
+    uint8_t                                  channel_mapping[255]
+)
+{
+    /* Get the mapping of the decoder which outputs the channels in the SMPTE/USB order,
+     * and return the channel bitmap of them.
+     * The channels of the families 2 and 255 have no layout but the coded order,
+     * which is ACN order for ambisonics, and then return 0. */
+    const mp4opus_channel_layout_t *layout = mp4opus_get_channel_layout( param->OutputChannelCount );
+    if( param->ChannelMappingFamily > 1 || !layout )
+    {
+        memcpy( channel_mapping, param->ChannelMapping, param->OutputChannelCount );
+        return 0;
+    }
+    const uint8_t *opus_channel_mapping = param->ChannelMappingFamily
+                                        ? param->ChannelMapping
+                                        : (const uint8_t [8]){ 0, 1 };
+    for( uint8_t i = 0; i < param->OutputChannelCount; i++ )
+        channel_mapping[i] = opus_channel_mapping[ layout->decoder[i] ];
+    return layout->bitmap;
+}
+
+static inline lsmash_codec_specific_t *mp4opus_get_opus_specific_info
+(
+    lsmash_summary_t *summary
+)
+{
+    /* Return OpusSpecificBox in the structured format, which the caller destroys, or NULL if none. */
+    uint32_t cs_count = lsmash_count_codec_specific_data( summary );
+    for( uint32_t i = 0; i < cs_count; i++ )
+    {
+        lsmash_codec_specific_t *cs = lsmash_get_codec_specific_data( summary, i + 1 );
+        if( !cs || cs->type != LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS )
+            continue;
+        lsmash_codec_specific_t *conv = lsmash_convert_codec_specific_format( cs, LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+        if( conv )
+            return conv;
+    }
+    return NULL;
+}
+
+static inline int mp4opus_find_start_sample
+(
+    lsmash_root_t   *root,
+    uint32_t         track_ID,
+    uint32_t         first_sample,
+    int64_t          start_time,
+    uint32_t        *sample_number,
+    lsmash_sample_t *sample_info
+)
+{
+    /* Binary search from first_sample for the first sample composed at or after the start time.
+     * Audio samples are stored in composition order.
+     * Return 1 if the start time is beyond the last sample, and -1 on failure. */
+    uint32_t low  = first_sample;
+    uint32_t high = lsmash_get_sample_count_in_media_timeline( root, track_ID ) + 1;
+    while( low < high )
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if( lsmash_get_sample_info_from_media_timeline( root, track_ID, mid, sample_info ) < 0 )
+            return -1;
+        if( (int64_t)sample_info->cts < start_time )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if( !lsmash_check_sample_existence_in_media_timeline( root, track_ID, low ) )
+        return 1;
+    if( lsmash_get_sample_info_from_media_timeline( root, track_ID, low, sample_info ) < 0 )
+        return -1;
+    *sample_number = low;
+    return 0;
+}
+
+static inline uint32_t mp4opus_get_decode_start
+(
+    uint32_t start_sample,
+    uint32_t pre_roll_distance,
+    int      start_from_prev_sample
+)
+{
+    /* Go back from the first sample composed at or after the start time by the pre-roll distance,
+     * and by one more sample if the start time is within the previous one. */
+    uint32_t distance = pre_roll_distance + start_from_prev_sample;
+    return start_sample > distance ? start_sample - distance : 1;
+}
+
+static inline int mp4opus_clip_edit
+(
+    lsmash_edit_t *edit,
+    uint64_t       edit_start,
+    uint64_t       range_start,
+    uint64_t       range_end,
+    uint32_t       timescale
+)
+{
+    /* Clip the edit presented from edit_start into the range [range_start, range_end).
+     * The presentation times and the duration are in the movie timescale, and the start time in 48kHz.
+     * Return 0 if nothing of the edit is left. */
+    uint64_t begin = edit_start > range_start ? edit_start : range_start;
+    uint64_t end   = edit_start + edit->duration < range_end ? edit_start + edit->duration : range_end;
+    if( begin >= end )
+        return 0;
+    if( edit->start_time != -1 )
+        edit->start_time += ((double)(begin - edit_start) / timescale) * 48000;
+    edit->duration = end - begin;
+    return 1;
+}
+
+#endif
@@ -20,20 +20,103 @@
 
 /* This file is available under an ISC license. */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <strings.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #include <lsmash.h>
 
 #include <opus/opus_multistream.h>
 
+#include "mp4opuscore.h"
+#include "mp4opusidx.h"
+#include "mp4opustrack.h"
+#include "mp4opusring.h"
+#include "mp4opusloud.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAX_TRACKS 32   /* maximum number of tracks decoded in a pass */
+
 typedef struct
 {
-    int help;
+    int   help;
+    char *batch;
+    int   jobs;
+    int   stats;
+    char *stats_json;
+    int   threads;
+    double start;
+    double duration;
+    int    format;
+    uint32_t track_IDs[MAX_TRACKS];    /* tracks to be decoded, all Opus tracks if none */
+    uint32_t num_track_IDs;
+    char    *index;         /* sidecar packet index written by mp4opusenc */
+    int      pipeline;      /* depth of the rings between the pipelined stages, 0 for no pipeline */
+    int      resilient;     /* conceal lost and corrupt packets instead of failing */
+    int      loudness;      /* measure the loudness of the decoded PCM */
+    int      file_type;     /* OUTPUT_FILE_* */
+    uint32_t chunk_duration;    /* milliseconds of decoded PCM coalesced into a sample or a write */
 } option_t;
 
+#define OUTPUT_FORMAT_S16 0
+#define OUTPUT_FORMAT_S24 1
+#define OUTPUT_FORMAT_F32 2
+
+#define OUTPUT_FILE_MOVIE 0
+#define OUTPUT_FILE_RAW   1
+#define OUTPUT_FILE_WAV   2
+
+#define STAGE_DEMUX    0
+#define STAGE_CODEC    1
+#define STAGE_MUX      2
+#define STAGE_FINALIZE 3
+#define STAGE_COUNT    4
+
+typedef struct
+{
+    double wall;    /* seconds */
+    double cpu;     /* seconds consumed by the whole process */
+} stage_time_t;
+
+typedef struct
+{
+    struct timespec wall;
+    clock_t         cpu;
+} stage_clock_t;
+
+typedef struct
+{
+    stage_time_t stages[STAGE_COUNT];
+    uint64_t     input_packets;
+    uint64_t     input_bytes;
+    uint64_t     output_packets;
+    uint64_t     output_bytes;
+    uint32_t     min_packet_size;
+    uint32_t     max_packet_size;
+    uint64_t     allocations;       /* samples allocated for input and output */
+} stats_t;
+
 typedef struct
 {
     lsmash_sample_t *sample;
@@ -55,25 +138,16 @@ typedef struct
 
 typedef struct
 {
-#define STATUS_RECOVERY_REQUIRED 0
-#define STATUS_RECOVERY_STARTED  1
-    int      status;
-    uint32_t timescale;
-    uint64_t timestamp;
-    uint64_t duration;
-    int64_t  start_time;
-    int32_t  rate;
-} presentation_t;
-
-typedef struct
-{
-    uint32_t      track_ID;
-    input_media_t media;
+    uint32_t                  track_ID;
+    input_media_t             media;
+    const mp4opusidx_entry_t *index;        /* NULL unless the sidecar packet index describes this track */
+    uint32_t                  num_index_entries;
 } input_track_t;
 
 typedef struct
 {
-    input_track_t             track;
+    input_track_t             tracks[MAX_TRACKS];
+    uint32_t                  num_tracks;
     lsmash_movie_parameters_t param;
 } input_movie_t;
 
@@ -83,6 +157,9 @@ typedef struct
     lsmash_file_t           *fh;
     lsmash_file_parameters_t param;
     input_movie_t            movie;
+    uint8_t                 *index;     /* sidecar packet index loaded into memory */
+    uint64_t                 index_size;
+    int                      index_mapped;
 } input_file_t;
 
 typedef struct
@@ -94,10 +171,15 @@ typedef struct
 typedef struct
 {
     lsmash_audio_summary_t *summary;
-    uint8_t                *buffer;
+    lsmash_sample_t        *sample;         /* decoded PCM samples waiting for muxing */
     uint64_t                buffer_offset;
     uint64_t                timestamp;
     uint32_t                sample_entry;
+    lsmash_sample_t        *chunk;          /* decoded PCM coalesced into a sample or a write */
+    uint32_t                chunk_capacity;
+    FILE                   *raw;            /* raw PCM or WAV output instead of a movie */
+    uint32_t                channel_mask;   /* dwChannelMask of WAV */
+    mp4opus_loudness_t     *loudness;       /* NULL unless the loudness is measured */
 } output_media_t;
 
 typedef struct
@@ -108,7 +190,8 @@ typedef struct
 
 typedef struct
 {
-    output_track_t track;
+    output_track_t tracks[MAX_TRACKS];
+    uint32_t       num_tracks;
 } output_movie_t;
 
 typedef struct
@@ -117,6 +200,7 @@ typedef struct
     lsmash_file_t           *fh;
     lsmash_file_parameters_t param;
     output_movie_t           movie;
+    int                      type;      /* OUTPUT_FILE_* */
 } output_file_t;
 
 typedef struct
@@ -127,7 +211,34 @@ typedef struct
 
 typedef struct
 {
-    OpusMSDecoder *msdec;
+    pthread_t         thread;
+    OpusMSDecoder    *msdec;
+    input_packet_t   *packets;          /* the first packet to be decoded, preceded by warm-up packets */
+    uint32_t          warmup_packets;
+    uint32_t          num_packets;
+    uint32_t          channels;
+    int               format;
+    opus_int16       *pcm;              /* scratch buffer for the output of warm-up packets */
+    lsmash_sample_t **samples;          /* decoded PCM samples per packet */
+    int              *num_samples;
+    int               ret;
+} decode_chunk_t;
+
+typedef struct
+{
+    mp4opus_track_decoder_t codec;  /* the decoder of the first chunk in parallel decoding */
+    stats_t         *stats;     /* NULL unless statistics are requested */
+    int              format;    /* OUTPUT_FORMAT_* */
+    /* resilient decoding */
+    int              resilient;
+    uint64_t         concealed_packets;
+    uint64_t         recovered_packets; /* concealed packets recovered by in-band FEC */
+    /* parallel decoding */
+    int              threads;
+    decode_chunk_t  *chunks;
+    input_packet_t  *window;
+    lsmash_sample_t **samples;
+    int             *num_samples;
 } decoder_t;
 
 typedef struct
@@ -136,9 +247,63 @@ typedef struct
     input_t   input;
     output_t  output;
     decoder_t opus;
+    stats_t   stats;
 } mp4opusdec_t;
 
+typedef struct
+{
+    input_packet_t packet;
+    int            status;      /* 0: packet, 1: end of the edit, -1: error */
+} demux_item_t;
+
+typedef struct
+{
+    lsmash_sample_t *sample;
+    uint64_t         buffer_offset;
+    int              num_samples;
+    int              end;       /* no more samples in the edit */
+} mux_item_t;
+
+typedef struct
+{
+    lsmash_root_t  *in_root;
+    input_track_t  *in_track;
+    mp4opus_presentation_t *presentation;
+    uint64_t        end_cts;    /* no packets after the edit are needed */
+    lsmash_root_t  *out_root;
+    output_track_t *out_track;
+    stats_t        *stats;
+    mp4opus_ring_t  demux_ring; /* demux thread -> decoding thread */
+    mp4opus_ring_t  mux_ring;   /* decoding thread -> mux thread */
+    pthread_t       demux_thread;
+    pthread_t       mux_thread;
+    int             mux_ret;
+} pipeline_t;
+
+typedef struct
+{
+    char *input;
+    char *output;
+} batch_entry_t;
+
+typedef struct
+{
+    batch_entry_t  *entries;
+    uint32_t        num_entries;
+    uint32_t        next_entry;
+    uint32_t        num_failures;
+    pthread_mutex_t mutex;
+} batch_t;
+
+typedef struct
+{
+    pthread_t    thread;
+    batch_t     *batch;
+    mp4opusdec_t dec;
+} batch_worker_t;
+
 #define MP4OPUSDEC_MIN( a, b ) (((a) < (b)) ? (a) : (b))
+#define MP4OPUSDEC_MAX( a, b ) (((a) > (b)) ? (a) : (b))
 #define eprintf( ... ) fprintf( stderr, __VA_ARGS__ )
 #define ERROR_MSG( ... ) error_message( __VA_ARGS__ )
 #define WARNING_MSG( ... ) warning_message( __VA_ARGS__ )
@@ -146,23 +311,36 @@ typedef struct
 #define MP4OPUSDEC_USAGE_ERR() mp4opusdec_usage_error();
 #define REFRESH_CONSOLE eprintf( "                                                                               \r" )
 
-#define MAX_OPUS_PACKET_DURATION 5760
+#define CHUNK_PACKETS            256    /* number of packets in a chunk in parallel decoding */
+#define MAX_WARMUP_PACKETS       64     /* maximum number of packets decoded for warm-up in parallel decoding */
 
 static void cleanup_input_movie
 (
     input_t *input
 )
 {
-    input_media_t *in_media = &input->file.movie.track.media;
-    if( in_media->summaries )
+    for( uint32_t i = 0; i < input->file.movie.num_tracks; i++ )
     {
-        for( uint32_t i = 0; i < in_media->num_summaries; i++ )
+        input_media_t *in_media = &input->file.movie.tracks[i].media;
+        if( !in_media->summaries )
+            continue;
+        for( uint32_t j = 0; j < in_media->num_summaries; j++ )
         {
-            lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[i].summary );
-            lsmash_destroy_codec_specific_data( in_media->summaries[i].cs );
+            lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[j].summary );
+            lsmash_destroy_codec_specific_data( in_media->summaries[j].cs );
         }
         lsmash_free( in_media->summaries );
     }
+    if( input->file.index )
+    {
+#ifndef _WIN32
+        if( input->file.index_mapped )
+            munmap( input->file.index, input->file.index_size );
+        else
+#endif
+            lsmash_free( input->file.index );
+        input->file.index = NULL;
+    }
     lsmash_close_file( &input->file.param );
     lsmash_destroy_root( input->root );
     input->root = NULL;
@@ -173,13 +351,51 @@ static void cleanup_output_movie
     output_t *output
 )
 {
-    lsmash_cleanup_summary( (lsmash_summary_t *)output->file.movie.track.media.summary );
-    lsmash_free( output->file.movie.track.media.buffer );
+    for( uint32_t i = 0; i < output->file.movie.num_tracks; i++ )
+    {
+        output_media_t *out_media = &output->file.movie.tracks[i].media;
+        lsmash_cleanup_summary( (lsmash_summary_t *)out_media->summary );
+        lsmash_delete_sample( out_media->sample );
+        lsmash_delete_sample( out_media->chunk );
+        if( out_media->raw && out_media->raw != stdout )
+            fclose( out_media->raw );
+        if( out_media->loudness )
+        {
+            mp4opus_loudness_cleanup( out_media->loudness );
+            lsmash_free( out_media->loudness );
+        }
+    }
     lsmash_close_file( &output->file.param );
     lsmash_destroy_root( output->root );
     output->root = NULL;
 }
 
+static void cleanup_decoder
+(
+    decoder_t *opus
+)
+{
+    mp4opus_cleanup_decoder( &opus->codec );
+    if( opus->chunks )
+    {
+        /* The first chunk shares the decoder for the serial decoding. */
+        for( int i = 0; i < opus->threads; i++ )
+        {
+            if( i )
+                opus_multistream_decoder_destroy( opus->chunks[i].msdec );
+            lsmash_free( opus->chunks[i].pcm );
+        }
+        lsmash_free( opus->chunks );
+        opus->chunks = NULL;
+    }
+    lsmash_free( opus->window );
+    lsmash_free( opus->samples );
+    lsmash_free( opus->num_samples );
+    opus->window      = NULL;
+    opus->samples     = NULL;
+    opus->num_samples = NULL;
+}
+
 static void cleanup_mp4opusdec
 (
     mp4opusdec_t *dec
@@ -187,7 +403,7 @@ static void cleanup_mp4opusdec
 {
     cleanup_input_movie( &dec->input );
     cleanup_output_movie( &dec->output );
-    opus_multistream_decoder_destroy( dec->opus.msdec );
+    cleanup_decoder( &dec->opus );
 }
 
 static int mp4opusdec_error
@@ -237,12 +453,137 @@ static int warning_message
     return -1;
 }
 
+static void start_stage_clock
+(
+    stats_t       *stats,
+    stage_clock_t *clk
+)
+{
+    if( !stats )
+        return;
+    clock_gettime( CLOCK_MONOTONIC, &clk->wall );
+    clk->cpu = clock();
+}
+
+static void stop_stage_clock
+(
+    stats_t       *stats,
+    stage_clock_t *clk,
+    int            stage
+)
+{
+    if( !stats )
+        return;
+    struct timespec wall;
+    clock_gettime( CLOCK_MONOTONIC, &wall );
+    stats->stages[stage].wall += (wall.tv_sec - clk->wall.tv_sec) + (wall.tv_nsec - clk->wall.tv_nsec) * 1e-9;
+    stats->stages[stage].cpu  += (double)(clock() - clk->cpu) / CLOCKS_PER_SEC;
+}
+
+static void count_input_packet
+(
+    stats_t        *stats,
+    input_packet_t *packet
+)
+{
+    if( !stats || !packet->sample )
+        return;
+    if( stats->input_packets == 0 || packet->size < stats->min_packet_size )
+        stats->min_packet_size = packet->size;
+    if( packet->size > stats->max_packet_size )
+        stats->max_packet_size = packet->size;
+    ++stats->input_packets;
+    ++stats->allocations;
+    stats->input_bytes += packet->size;
+}
+
+static void count_output_packet
+(
+    stats_t *stats,
+    uint32_t size
+)
+{
+    if( !stats )
+        return;
+    ++stats->output_packets;
+    ++stats->allocations;
+    stats->output_bytes += size;
+}
+
 static void display_help( void )
 {
     eprintf
     (
         "\n"
-        "Usage: mp4opusdec -i input -o output\n"
+        "Usage: mp4opusdec [options] -i input -o output\n"
+        "       mp4opusdec [options] --batch manifest\n"
+        "'-' as input means stdin.\n"
+        "'-' as output means stdout, where raw interleaved little endian PCM is written\n"
+        "instead of a movie unless --wav is specified.\n"
+        "Options:\n"
+        "    --help                    Display help\n"
+        "    --batch <string>          Decode the list of files in the manifest\n"
+        "                                Each line consists of input and output file names\n"
+        "                                separated by a tab. Blank lines and lines beginning\n"
+        "                                with '#' are ignored. A result line is written to\n"
+        "                                stdout per file.\n"
+        "    --jobs <integer>          Specify the number of files decoded concurrently\n"
+        "                                in batch mode\n"
+        "                                the default value is 1\n"
+        "    --stats                   Display time spent in each stage and counters\n"
+        "                                at exit\n"
+        "    --stats-json <string>     Write the statistics into the file in JSON\n"
+        "    --threads <integer>       Specify the number of decoding threads\n"
+        "                                the default value is 1 (no parallel decoding)\n"
+        "                                Each chunk other than the first is decoded after\n"
+        "                                its pre-roll packets, so the output is not always\n"
+        "                                bit-identical to the single threaded one.\n"
+        "    --start <float>           Specify the presentation time in seconds to start\n"
+        "                                decoding at\n"
+        "                                the default value is 0\n"
+        "    --duration <float>        Specify the duration in seconds to decode\n"
+        "                                the default value is 0 (until the end)\n"
+        "    --format <string>         Specify the output sample format\n"
+        "                                s16 : 16-bit signed integer (default)\n"
+        "                                s24 : 24-bit signed integer\n"
+        "                                f32 : 32-bit floating point\n"
+        "    --raw                     Write raw interleaved little endian PCM instead of\n"
+        "                                a movie\n"
+        "    --wav                     Write a WAV file instead of a movie\n"
+        "                                The sizes in the header are left unknown if the\n"
+        "                                output is not seekable.\n"
+        "    --chunk-duration <integer>\n"
+        "                              Specify the duration in milliseconds of decoded PCM\n"
+        "                                coalesced into an LPCM sample or a write\n"
+        "                                the range is from 1 to 60000 inclusive\n"
+        "                                the default value is 1000\n"
+        "    --pipeline <integer>      Read ahead and write behind the decoding on their own\n"
+        "                                threads with the depth of the packet queues\n"
+        "                                the range is from 1 to 65536 inclusive\n"
+        "                                Ignored for parallel decoding.\n"
+        "    --index <string>          Seek with the sidecar packet index written by\n"
+        "                                mp4opusenc --index instead of the sample table\n"
+        "                                The index is ignored if it does not match the input.\n"
+        "    --resilient               Conceal lost and corrupt packets instead of failing\n"
+        "                                A packet is recovered by in-band FEC in the next\n"
+        "                                packet if any, or by packet loss concealment\n"
+        "                                otherwise, for its duration in the timeline.\n"
+        "                                The number of concealed packets is reported at\n"
+        "                                exit, or appended to the result line in batch mode\n"
+        "                                as the concealed and the FEC recovered counts.\n"
+        "                                The threads and the pipeline are ignored.\n"
+        "    --loudness                Measure the integrated loudness, the loudness range\n"
+        "                                and the true peak of the decoded PCM based on\n"
+        "                                ITU-R BS.1770 and EBU R128 while muxing\n"
+        "                                The result is reported per track at exit, or\n"
+        "                                appended to the result line of the first track\n"
+        "                                in batch mode.\n"
+        "    --tracks <list>           Specify the comma separated track_IDs to decode\n"
+        "                                the default is all Opus tracks\n"
+        "                                Each track is decoded into its own LPCM track.\n"
+        "                                The input is opened once, but the tracks are\n"
+        "                                decoded one after another, so each track is read\n"
+        "                                and muxed as a whole instead of interleaved.\n"
     );
 }
 
@@ -266,8 +607,11 @@ static int parse_options
         dec->opt.help = 1;
         return 0;
     }
-    else if( argc < 5 )
+    else if( argc < 3 )
         return -1;
+    dec->opt.jobs           = 1;
+    dec->opt.threads        = 1;
+    dec->opt.chunk_duration = 1000;
     uint32_t i = 1;
     while( argc > i && *argv[i] == '-' )
     {
@@ -282,11 +626,143 @@ static int parse_options
             CHECK_NEXT_ARG;
             dec->output.file.name = argv[i];
         }
+        else if( !strcasecmp( argv[i], "--batch" ) )
+        {
+            CHECK_NEXT_ARG;
+            dec->opt.batch = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--jobs" ) )
+        {
+            CHECK_NEXT_ARG;
+            int jobs = atoi( argv[i] );
+            if( jobs < 1 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.jobs = jobs;
+        }
+        else if( !strcasecmp( argv[i], "--threads" ) )
+        {
+            CHECK_NEXT_ARG;
+            int threads = atoi( argv[i] );
+            if( threads < 1 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.threads = threads;
+        }
+        else if( !strcasecmp( argv[i], "--start" ) )
+        {
+            CHECK_NEXT_ARG;
+            char  *end;
+            double start = strtod( argv[i], &end );
+            if( *end != '\0' || start < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.start = start;
+        }
+        else if( !strcasecmp( argv[i], "--duration" ) )
+        {
+            CHECK_NEXT_ARG;
+            char  *end;
+            double duration = strtod( argv[i], &end );
+            if( *end != '\0' || duration < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.duration = duration;
+        }
+        else if( !strcasecmp( argv[i], "--format" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( !strcasecmp( argv[i], "s16" ) )
+                dec->opt.format = OUTPUT_FORMAT_S16;
+            else if( !strcasecmp( argv[i], "s24" ) )
+                dec->opt.format = OUTPUT_FORMAT_S24;
+            else if( !strcasecmp( argv[i], "f32" ) )
+                dec->opt.format = OUTPUT_FORMAT_F32;
+            else
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--raw" ) )
+            dec->opt.file_type = OUTPUT_FILE_RAW;
+        else if( !strcasecmp( argv[i], "--wav" ) )
+            dec->opt.file_type = OUTPUT_FILE_WAV;
+        else if( !strcasecmp( argv[i], "--chunk-duration" ) )
+        {
+            CHECK_NEXT_ARG;
+            int chunk_duration = atoi( argv[i] );
+            if( chunk_duration < 1 || chunk_duration > 60000 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.chunk_duration = chunk_duration;
+        }
+        else if( !strcasecmp( argv[i], "--tracks" ) )
+        {
+            CHECK_NEXT_ARG;
+            char *list = argv[i];
+            dec->opt.num_track_IDs = 0;
+            do
+            {
+                char *end;
+                long track_ID = strtol( list, &end, 10 );
+                if( end == list || track_ID < 1 || track_ID > UINT32_MAX
+                 || (*end != '\0' && *end != ',') || dec->opt.num_track_IDs == MAX_TRACKS )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+                for( uint32_t j = 0; j < dec->opt.num_track_IDs; j++ )
+                    if( dec->opt.track_IDs[j] == track_ID )
+                        return ERROR_MSG( "duplicate track ID %ld in --tracks.\n", track_ID );
+                dec->opt.track_IDs[ dec->opt.num_track_IDs++ ] = track_ID;
+                list = *end ? end + 1 : end;
+            } while( *list );
+        }
+        else if( !strcasecmp( argv[i], "--pipeline" ) )
+        {
+            CHECK_NEXT_ARG;
+            int pipeline = atoi( argv[i] );
+            if( pipeline < 1 || pipeline > 65536 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            dec->opt.pipeline = pipeline;
+        }
+        else if( !strcasecmp( argv[i], "--index" ) )
+        {
+            CHECK_NEXT_ARG;
+            dec->opt.index = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--resilient" ) )
+            dec->opt.resilient = 1;
+        else if( !strcasecmp( argv[i], "--loudness" ) )
+            dec->opt.loudness = 1;
+        else if( !strcasecmp( argv[i], "--stats" ) )
+            dec->opt.stats = 1;
+        else if( !strcasecmp( argv[i], "--stats-json" ) )
+        {
+            CHECK_NEXT_ARG;
+            dec->opt.stats_json = argv[i];
+        }
 #undef CHECK_NEXT_ARG
         else
             return ERROR_MSG( "you specified invalid option: %s.\n", argv[i] );
         ++i;
     }
+    if( dec->opt.resilient && (dec->opt.threads > 1 || dec->opt.pipeline) )
+    {
+        /* The concealment peeks the next packet, which only the serial decoding has at hand. */
+        WARNING_MSG( "the threads and the pipeline are ignored in resilient mode.\n" );
+        dec->opt.threads  = 1;
+        dec->opt.pipeline = 0;
+    }
+    if( dec->opt.threads > 1 && dec->opt.pipeline )
+    {
+        WARNING_MSG( "--pipeline is ignored for parallel decoding.\n" );
+        dec->opt.pipeline = 0;
+    }
+    if( dec->opt.batch )
+    {
+        if( dec->input.file.name || dec->output.file.name )
+            return ERROR_MSG( "input and output file names are given by the manifest in batch mode.\n" );
+        if( dec->opt.stats || dec->opt.stats_json )
+            return ERROR_MSG( "statistics are not available in batch mode.\n" );
+        if( dec->opt.index )
+            return ERROR_MSG( "the packet index is not available in batch mode.\n" );
+        return 0;
+    }
+    if( !dec->input.file.name )
+        return ERROR_MSG( "input file name is not specified.\n" );
+    if( !dec->output.file.name )
+        return ERROR_MSG( "output file name is not specified.\n" );
     return 0;
 }
 
@@ -295,17 +771,125 @@ static int get_opus_specific_info
     input_summary_t *in_summary
 )
 {
-    uint32_t cs_count = lsmash_count_codec_specific_data( (lsmash_summary_t *)in_summary->summary );
-    for( uint32_t i = 0; i < cs_count; i++ )
+    in_summary->cs = mp4opus_get_opus_specific_info( (lsmash_summary_t *)in_summary->summary );
+    if( !in_summary->cs )
+        return ERROR_MSG( "failed to get Opus specific info.\n" );
+    return 0;
+}
+
+static int is_track_selected
+(
+    option_t *opt,
+    uint32_t  track_ID
+)
+{
+    if( opt->num_track_IDs == 0 )
+        return 1;
+    for( uint32_t i = 0; i < opt->num_track_IDs; i++ )
+        if( opt->track_IDs[i] == track_ID )
+            return 1;
+    return 0;
+}
+
+static void discard_input_track
+(
+    input_track_t *in_track
+)
+{
+    input_media_t *in_media = &in_track->media;
+    for( uint32_t i = 0; i < in_media->num_summaries; i++ )
+    {
+        lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[i].summary );
+        lsmash_destroy_codec_specific_data( in_media->summaries[i].cs );
+    }
+    lsmash_free( in_media->summaries );
+    memset( in_track, 0, sizeof(input_track_t) );
+}
+
+static int read_packet_index
+(
+    input_file_t *in_file,
+    const char   *name
+)
+{
+#ifndef _WIN32
+    int fd = open( name, O_RDONLY );
+    struct stat st;
+    if( fd >= 0 && fstat( fd, &st ) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX )
+    {
+        void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( map != MAP_FAILED )
+        {
+            in_file->index        = map;
+            in_file->index_size   = st.st_size;
+            in_file->index_mapped = 1;
+        }
+    }
+    if( fd >= 0 )
+        close( fd );    /* The mapping is kept after closing. */
+    if( in_file->index )
+        return 0;
+#endif
+    /* Fall back to reading the whole index. */
+    FILE *fp = fopen( name, "rb" );
+    if( !fp )
+        return -1;
+    uint64_t capacity = 0;
+    size_t   size;
+    do
+    {
+        capacity += 1 << 20;
+        uint8_t *index = lsmash_realloc( in_file->index, capacity );
+        if( !index )
+        {
+            fclose( fp );
+            return -1;
+        }
+        in_file->index       = index;
+        size                 = fread( in_file->index + in_file->index_size, 1, capacity - in_file->index_size, fp );
+        in_file->index_size += size;
+    } while( in_file->index_size == capacity );
+    int ret = ferror( fp ) ? -1 : 0;
+    fclose( fp );
+    return ret;
+}
+
+static void load_packet_index
+(
+    input_t    *input,
+    const char *name
+)
+{
+    /* The index is an optional shortcut, so the timeline is just used when it does not match the input. */
+    input_file_t *in_file = &input->file;
+    if( read_packet_index( in_file, name ) < 0 || in_file->index_size < sizeof(mp4opusidx_header_t) )
+    {
+        WARNING_MSG( "failed to read the packet index. Seek with the sample table.\n" );
+        return;
+    }
+    const mp4opusidx_header_t *header = (const mp4opusidx_header_t *)in_file->index;
+    if( header->magic != MP4OPUSIDX_MAGIC || header->version != MP4OPUSIDX_VERSION
+     || header->timescale != 48000
+     || header->num_entries > (in_file->index_size - sizeof(mp4opusidx_header_t)) / sizeof(mp4opusidx_entry_t) )
+    {
+        WARNING_MSG( "the packet index is broken or not supported. Seek with the sample table.\n" );
+        return;
+    }
+    for( uint32_t i = 0; i < in_file->movie.num_tracks; i++ )
     {
-        lsmash_codec_specific_t *cs = lsmash_get_codec_specific_data( (lsmash_summary_t *)in_summary->summary, i + 1 );
-        if( !cs || cs->type != LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS )
+        input_track_t *in_track = &in_file->movie.tracks[i];
+        if( in_track->track_ID != header->track_ID )
             continue;
-        in_summary->cs = lsmash_convert_codec_specific_format( cs, LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
-        if( in_summary->cs )
-            return 0;
+        if( header->num_entries != lsmash_get_sample_count_in_media_timeline( input->root, in_track->track_ID ) )
+        {
+            WARNING_MSG( "the packet index does not match the input. Seek with the sample table.\n" );
+            return;
+        }
+        in_track->index             = (const mp4opusidx_entry_t *)(header + 1);
+        in_track->num_index_entries = header->num_entries;
+        return;
     }
-    return ERROR_MSG( "failed to get Opus specific info.\n" );
+    WARNING_MSG( "the packet index describes none of the decoded tracks.\n" );
 }
 
 static int open_input_file
@@ -327,13 +911,21 @@ static int open_input_file
         return ERROR_MSG( "failed to read input file\n" );
     if( lsmash_get_movie_parameters( input->root, &in_file->movie.param ) < 0 )
         return ERROR_MSG( "failed to get movie parameters.\n" );
-    input_track_t *in_track = &in_file->movie.track;
-    int opus_stream_found = 0;
-    for( uint32_t i = 0; i < in_file->movie.param.number_of_tracks; i++ )
+    input_movie_t *in_movie = &in_file->movie;
+    for( uint32_t i = 0; i < in_movie->param.number_of_tracks; i++ )
     {
-        in_track->track_ID = lsmash_get_track_ID( input->root, i + 1 );
-        if( in_track->track_ID == 0 )
+        uint32_t track_ID = lsmash_get_track_ID( input->root, i + 1 );
+        if( track_ID == 0 )
             return ERROR_MSG( "failed to get track_ID.\n" );
+        if( !is_track_selected( &dec->opt, track_ID ) )
+            continue;
+        if( in_movie->num_tracks == MAX_TRACKS )
+        {
+            WARNING_MSG( "tracks after the %dth Opus track are not decoded.\n", MAX_TRACKS );
+            break;
+        }
+        input_track_t *in_track = &in_movie->tracks[ in_movie->num_tracks ];
+        in_track->track_ID = track_ID;
         /* Check CODEC type.
          * This program has no support of CODECs other than Opus. */
         uint32_t num_summaries = lsmash_count_summary( input->root, in_track->track_ID );
@@ -363,7 +955,7 @@ static int open_input_file
             if( summary->summary_type != LSMASH_SUMMARY_TYPE_AUDIO
              || !lsmash_check_codec_type_identical( summary->sample_type, ISOM_CODEC_TYPE_OPUS_AUDIO )
              || ((lsmash_audio_summary_t *)summary)->frequency != 48000
-             || ((lsmash_audio_summary_t *)summary)->channels > 8 )
+             || ((lsmash_audio_summary_t *)summary)->channels > 255 )
             {
                 lsmash_cleanup_summary( summary );
                 continue;
@@ -376,22 +968,32 @@ static int open_input_file
                 continue;
             }
         }
+        if( !in_media->summaries[0].summary )
+        {
+            discard_input_track( in_track );
+            continue;
+        }
         if( lsmash_get_media_timescale( input->root, in_track->track_ID ) != 48000 )
         {
             WARNING_MSG( "media timescale != 48000 is not supported.\n" );
+            discard_input_track( in_track );
             continue;
         }
         if( lsmash_construct_timeline( input->root, in_track->track_ID ) < 0 )
         {
             WARNING_MSG( "failed to construct timeline.\n" );
+            discard_input_track( in_track );
             continue;
         }
-        opus_stream_found = 1;
-        break;
+        ++in_movie->num_tracks;
     }
-    if( !opus_stream_found )
+    if( in_movie->num_tracks == 0 )
         return ERROR_MSG( "failed to find Opus stream to decode.\n" );
+    if( dec->opt.num_track_IDs && in_movie->num_tracks < dec->opt.num_track_IDs )
+        return ERROR_MSG( "some of the selected tracks are not Opus streams to decode.\n" );
     lsmash_destroy_children( lsmash_file_as_box( in_file->fh ) );
+    if( dec->opt.index )
+        load_packet_index( input, dec->opt.index );
     return 0;
 }
 
@@ -399,87 +1001,18 @@ static void remap_channel_layout
 (
     lsmash_opus_specific_parameters_t *param,
     lsmash_qt_audio_channel_layout_t  *layout,
-    uint8_t                            channel_mapping[8]
+    uint8_t                            channel_mapping[255]
 )
 {
-    /* Vorbis channel order -> SMPTE/USB channel order */
-    static const struct
-    {
-        uint32_t bitmap;
-        uint8_t  vorbis[8];
-    } channel_remap_table[8] =
-        {
-            /* C -> C */
-            {
-                QT_CHANNEL_BIT_CENTER,
-                { 0 }
-            },
-            /* L+R -> L+R */
-            {
-                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT,
-                { 0, 1 }
-            },
-            /* L+C+R -> L+R+C */
-            {
-                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER,
-                { 0, 2, 1 }
-            },
-            /* L+R+BL+BR -> L+R+BL+BR */
-            {
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 1, 2, 3 }
-            },
-            /* L+C+R+BL+BR -> L+R+C+BL+BR */
-            {
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 2, 1, 3, 4 }
-            },
-            /* L+C+R+BL+BR+LFE -> L+R+C+LFE+BL+BR */
-            {
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 2, 1, 5, 3, 4 }
-            },
-            /* L+C+R+SL+SR+BC+LFE -> L+R+C+LFE+BC+SL+SR */
-            {
-                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_CENTER_SURROUND
-              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
-                { 0, 2, 1, 6, 5, 3, 4 }
-            },
-            /* L+C+R+SL+SR+BL+BR+LFE -> L+R+C+LFE+BL+BR+SL+SR */
-            {
-                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_LEFT_SURROUND        | QT_CHANNEL_BIT_RIGHT_SURROUND
-              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
-                { 0, 2, 1, 7, 5, 6, 3, 4 }
-            }
-        };
-    /* Coded channel order -> Vorbis channel order */
-    uint8_t index = param->OutputChannelCount - 1;
-    if( index < 8 )
+    /* Coded channel order -> Vorbis channel order -> SMPTE/USB channel order */
+    uint32_t bitmap = mp4opus_get_decoder_mapping( param, channel_mapping );
+    if( bitmap )
     {
         layout->channelLayoutTag = QT_CHANNEL_LAYOUT_USE_CHANNEL_BITMAP;
-        layout->channelBitmap    = channel_remap_table[index].bitmap;
-        uint8_t *opus_channel_mapping = param->ChannelMappingFamily
-                                      ? param->ChannelMapping
-                                      : (uint8_t [8]){ 0, 1 };
-        for( uint8_t i = 0; i < param->OutputChannelCount; i++ )
-            channel_mapping[i] = opus_channel_mapping[ channel_remap_table[index].vorbis[i] ];
+        layout->channelBitmap    = bitmap;
     }
     else
-        layout->channelLayoutTag = QT_CHANNEL_LAYOUT_UNKNOWN | param->OutputChannelCount;
-    return;
+        layout->channelLayoutTag = QT_CHANNEL_LAYOUT_DISCRETE_IN_ORDER | param->OutputChannelCount;
 }
 
 static int setup_decoder
@@ -489,30 +1022,120 @@ static int setup_decoder
     lsmash_qt_audio_channel_layout_t  *layout
 )
 {
-    uint8_t channel_mapping[8] = { 0 };
+    uint8_t channel_mapping[255] = { 0 };
     remap_channel_layout( param, layout, channel_mapping );
-    int err;
-    OpusMSDecoder *msdec = opus_multistream_decoder_create( 48000,
-                                                            param->OutputChannelCount,
-                                                            param->StreamCount,
-                                                            param->CoupledCount,
-                                                            channel_mapping,
-                                                            &err );
-    if( err != OPUS_OK )
-        return ERROR_MSG( "failed to create decoder.\n" );
-    opus->msdec = msdec;
-    err = opus_multistream_decoder_ctl( msdec, OPUS_SET_GAIN( param->OutputGain ) );
-    if( err != OPUS_OK )
-        return ERROR_MSG( "failed to set output gain.\n" );
+    /* Reuse the decoder created with the same configuration.
+     * The decoders for parallel decoding are reset per chunk. */
+    if( opus->codec.msdec && !mp4opus_is_same_decoder_config( &opus->codec.config, param, channel_mapping ) )
+        cleanup_decoder( opus );
+    char error[MP4OPUS_ERROR_LENGTH];
+    int created = mp4opus_setup_decoder( &opus->codec, param, channel_mapping, error );
+    if( created < 0 )
+        return ERROR_MSG( "%s", error );
+    if( created && opus->threads > 1 )
+    {
+        /* Set up a decoder per chunk for parallel decoding. */
+        opus->chunks = lsmash_malloc_zero( opus->threads * sizeof(decode_chunk_t) );
+        if( !opus->chunks )
+            return ERROR_MSG( "failed to allocate chunks for parallel decoding.\n" );
+        for( int i = 0; i < opus->threads; i++ )
+        {
+            decode_chunk_t *chunk = &opus->chunks[i];
+            chunk->msdec    = i ? mp4opus_create_decoder( param, channel_mapping, error ) : opus->codec.msdec;
+            chunk->channels = param->OutputChannelCount;
+            chunk->format   = opus->format;
+            chunk->pcm      = lsmash_malloc( MP4OPUS_MAX_PACKET_DURATION * param->OutputChannelCount * sizeof(opus_int16) );
+            if( !chunk->msdec || !chunk->pcm )
+                return ERROR_MSG( "failed to set up parallel decoding.\n" );
+        }
+    }
+    /* The gain of the first decoder is set by the setup. */
+    for( int i = 1; opus->chunks && i < opus->threads; i++ )
+        if( opus_multistream_decoder_ctl( opus->chunks[i].msdec, OPUS_SET_GAIN( param->OutputGain ) ) != OPUS_OK )
+            return ERROR_MSG( "failed to set output gain.\n" );
     return 0;
 }
 
-static int prepare_output
+static uint32_t get_pcm_frame_size
 (
-    mp4opusdec_t *dec
+    output_media_t *out_media
+)
+{
+    return out_media->summary->channels * (out_media->summary->sample_size / 8);
+}
+
+static int write_wav_header
+(
+    output_media_t *out_media,
+    uint64_t        data_size
+)
+{
+    /* WAVE_FORMAT_EXTENSIBLE is required for more than 2 channels or samples other than 16-bit integer.
+     * The sizes are saturated when unknown or beyond the limit of RIFF. */
+    lsmash_audio_summary_t *summary     = out_media->summary;
+    int                     extensible  = summary->channels > 2 || summary->sample_size != 16;
+    uint32_t                header_size = extensible ? 68 : 44;
+    uint32_t                frame_size  = get_pcm_frame_size( out_media );
+    uint8_t  header[68];
+    uint8_t *p = header;
+#define PUT_FOURCC( s ) memcpy( p, s, 4 ), p += 4
+#define PUT_LE16( x ) *p++ = (x) & 0xFF, *p++ = ((x) >> 8) & 0xFF
+#define PUT_LE32( x ) PUT_LE16( (x) & 0xFFFF ), PUT_LE16( (uint32_t)(x) >> 16 )
+    PUT_FOURCC( "RIFF" );
+    PUT_LE32( (uint32_t)MP4OPUSDEC_MIN( data_size + (data_size & 1) + header_size - 8, UINT32_MAX ) );
+    PUT_FOURCC( "WAVE" );
+    PUT_FOURCC( "fmt " );
+    PUT_LE32( extensible ? 40 : 16 );
+    PUT_LE16( extensible ? 0xFFFE : 1 );    /* WAVE_FORMAT_EXTENSIBLE or WAVE_FORMAT_PCM */
+    PUT_LE16( summary->channels );
+    PUT_LE32( summary->frequency );
+    PUT_LE32( summary->frequency * frame_size );
+    PUT_LE16( frame_size );
+    PUT_LE16( summary->sample_size );
+    if( extensible )
+    {
+        /* The bits of the channel bitmap of QuickTime match the ones of dwChannelMask. */
+        PUT_LE16( 22 );
+        PUT_LE16( summary->sample_size );
+        PUT_LE32( out_media->channel_mask );
+        /* KSDATAFORMAT_SUBTYPE_PCM or KSDATAFORMAT_SUBTYPE_IEEE_FLOAT */
+        PUT_LE16( summary->sample_size == 32 ? 3 : 1 );
+        memcpy( p, "\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 14 );
+        p += 14;
+    }
+    PUT_FOURCC( "data" );
+    PUT_LE32( (uint32_t)MP4OPUSDEC_MIN( data_size, UINT32_MAX ) );
+#undef PUT_FOURCC
+#undef PUT_LE16
+#undef PUT_LE32
+    if( fwrite( header, 1, header_size, out_media->raw ) != header_size )
+        return ERROR_MSG( "failed to write WAV header.\n" );
+    return 0;
+}
+
+static int finish_wav
+(
+    output_media_t *out_media
+)
+{
+    uint64_t data_size = out_media->timestamp * get_pcm_frame_size( out_media );
+    if( (data_size & 1) && fputc( 0, out_media->raw ) == EOF )
+        return ERROR_MSG( "failed to write PCM samples.\n" );
+    if( data_size > UINT32_MAX )
+        WARNING_MSG( "the sizes in the WAV header overflow.\n" );
+    /* Leave the sizes unknown if the output is not seekable. */
+    if( fseek( out_media->raw, 0, SEEK_SET ) == 0 && write_wav_header( out_media, data_size ) < 0 )
+        return -1;
+    if( fflush( out_media->raw ) )
+        return ERROR_MSG( "failed to write WAV header.\n" );
+    return 0;
+}
+
+static int prepare_output_movie
+(
+    output_t *output
 )
 {
-    output_t      *output   = &dec->output;
     output_file_t *out_file = &output->file;
     /* Initialize L-SMASH muxer */
     output->root = lsmash_create_root();
@@ -534,8 +1157,16 @@ static int prepare_output
     movie_param.timescale = 48000;
     if( lsmash_set_movie_parameters( output->root, &movie_param ) < 0 )
         return ERROR_MSG( "failed to set movie parameters.\n" );
+    return 0;
+}
+
+static int create_output_track
+(
+    output_t       *output,
+    output_track_t *out_track
+)
+{
     /* Set up track parameters. */
-    output_track_t *out_track = &output->file.movie.track;
     out_track->track_ID = lsmash_create_track( output->root, ISOM_MEDIA_HANDLER_TYPE_AUDIO_TRACK );
     if( out_track->track_ID == 0 )
         return ERROR_MSG( "failed to create track.\n" );
@@ -550,8 +1181,38 @@ static int prepare_output
     media_param.timescale = 48000;
     if( lsmash_set_media_parameters( output->root, out_track->track_ID, &media_param ) < 0 )
         return ERROR_MSG( "failed to set media parameters.\n" );
+    return 0;
+}
+
+static int prepare_output_track
+(
+    mp4opusdec_t *dec,
+    uint32_t      track_number
+)
+{
+    output_t       *output    = &dec->output;
+    output_track_t *out_track = &output->file.movie.tracks[track_number];
+    if( output->file.type == OUTPUT_FILE_MOVIE )
+    {
+        if( create_output_track( output, out_track ) < 0 )
+            return -1;
+    }
+    else if( !strcmp( output->file.name, "-" ) )
+    {
+        /* PCM is written into stdout sequentially. */
+#ifdef _WIN32
+        _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+        out_track->media.raw = stdout;
+    }
+    else
+    {
+        out_track->media.raw = fopen( output->file.name, "wb" );
+        if( !out_track->media.raw )
+            return ERROR_MSG( "failed to open an output file.\n" );
+    }
     /* Set up Opus configurations. */
-    input_summary_t *in_summary = &dec->input.file.movie.track.media.summaries[0];
+    input_summary_t *in_summary = &dec->input.file.movie.tracks[track_number].media.summaries[0];
     lsmash_opus_specific_parameters_t *opus_param = (lsmash_opus_specific_parameters_t *)in_summary->cs->data.structured;
     lsmash_audio_summary_t *out_summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
     if( !out_summary )
@@ -560,19 +1221,18 @@ static int prepare_output
     out_summary->sample_type = QT_CODEC_TYPE_LPCM_AUDIO;
     out_summary->frequency   = 48000;
     out_summary->channels    = opus_param->OutputChannelCount;
-    out_summary->sample_size = 16;
-    output_media_t *out_media = &dec->output.file.movie.track.media;
-    uint32_t buffer_size = MAX_OPUS_PACKET_DURATION * opus_param->OutputChannelCount * 2;
-    uint8_t *buffer      = lsmash_malloc_zero( buffer_size );
-    if( !buffer )
-        return ERROR_MSG( "failed to allocate sample buffer.\n" );
-    out_media->buffer = buffer;
+    out_summary->sample_size = dec->opt.format == OUTPUT_FORMAT_S24 ? 24
+                             : dec->opt.format == OUTPUT_FORMAT_F32 ? 32
+                             :                                        16;
     lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_QT_AUDIO_FORMAT_SPECIFIC_FLAGS,
                                                                      LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
     if( !cs )
         return ERROR_MSG( "failed to create LPCM specific info.\n" );
     lsmash_qt_audio_format_specific_flags_t *lpcm_param = (lsmash_qt_audio_format_specific_flags_t *)cs->data.structured;
-    lpcm_param->format_flags = QT_AUDIO_FORMAT_FLAG_SIGNED_INTEGER | QT_AUDIO_FORMAT_FLAG_PACKED;
+    if( dec->opt.format == OUTPUT_FORMAT_F32 )
+        lpcm_param->format_flags = QT_AUDIO_FORMAT_FLAG_FLOAT | QT_AUDIO_FORMAT_FLAG_PACKED;
+    else
+        lpcm_param->format_flags = QT_AUDIO_FORMAT_FLAG_SIGNED_INTEGER | QT_AUDIO_FORMAT_FLAG_PACKED;
     if( lsmash_add_codec_specific_data( (lsmash_summary_t *)out_summary, cs ) < 0 )
     {
         lsmash_destroy_codec_specific_data( cs );
@@ -585,6 +1245,9 @@ static int prepare_output
         return ERROR_MSG( "failed to create channel layout info.\n" );
     lsmash_qt_audio_channel_layout_t *layout = (lsmash_qt_audio_channel_layout_t *)cs->data.structured;
     decoder_t *opus = &dec->opus;
+    opus->threads   = dec->opt.threads;
+    opus->format    = dec->opt.format;
+    opus->resilient = dec->opt.resilient;
     if( setup_decoder( opus, opus_param, layout ) < 0 )
     {
         lsmash_destroy_codec_specific_data( cs );
@@ -595,13 +1258,57 @@ static int prepare_output
         lsmash_destroy_codec_specific_data( cs );
         return ERROR_MSG( "failed to add channel layout info.\n" );
     }
+    out_track->media.channel_mask = layout->channelLayoutTag == QT_CHANNEL_LAYOUT_USE_CHANNEL_BITMAP ? layout->channelBitmap : 0;
     lsmash_destroy_codec_specific_data( cs );
+    /* Decoded PCM is coalesced into large samples or writes instead of one per packet. */
+    uint32_t chunk_frames = MP4OPUSDEC_MAX( (uint64_t)out_summary->frequency * dec->opt.chunk_duration / 1000, 1 );
+    out_track->media.chunk_capacity = chunk_frames * get_pcm_frame_size( &out_track->media );
+    if( dec->opt.loudness )
+    {
+        out_track->media.loudness = lsmash_malloc( sizeof(mp4opus_loudness_t) );
+        if( !out_track->media.loudness
+         || mp4opus_loudness_init( out_track->media.loudness, out_summary->frequency, out_summary->channels ) < 0 )
+        {
+            lsmash_freep( &out_track->media.loudness );
+            return ERROR_MSG( "failed to set up loudness meter.\n" );
+        }
+    }
+    if( output->file.type == OUTPUT_FILE_WAV )
+        return write_wav_header( &out_track->media, UINT32_MAX );    /* unknown until finished */
+    if( out_track->media.raw )
+        return 0;
     out_track->media.sample_entry = lsmash_add_sample_entry( output->root, out_track->track_ID, out_summary );
     if( !out_track->media.sample_entry )
         return ERROR_MSG( "failed to add sample description entry.\n" );
     return 0;
 }
 
+static int prepare_output
+(
+    mp4opusdec_t *dec
+)
+{
+    output_t *output     = &dec->output;
+    uint32_t  num_tracks = dec->input.file.movie.num_tracks;
+    output->file.type = dec->opt.file_type;
+    if( output->file.type == OUTPUT_FILE_MOVIE && !strcmp( output->file.name, "-" ) )
+        output->file.type = OUTPUT_FILE_RAW;
+    if( output->file.type != OUTPUT_FILE_MOVIE )
+    {
+        if( num_tracks > 1 )
+            return ERROR_MSG( "PCM output supports a single track only, select one by --tracks.\n" );
+    }
+    else if( prepare_output_movie( output ) < 0 )
+        return -1;
+    for( uint32_t i = 0; i < num_tracks; i++ )
+    {
+        ++output->file.movie.num_tracks;    /* to be cleaned up even on failure */
+        if( prepare_output_track( dec, i ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
 static void free_input_packet
 (
     input_packet_t *packet
@@ -611,42 +1318,65 @@ static void free_input_packet
     packet->sample = NULL;
 }
 
+static lsmash_sample_t *create_lost_packet
+(
+    lsmash_root_t *in_root,
+    uint32_t       in_track_ID,
+    uint32_t       packet_number
+)
+{
+    /* The data of the packet is unavailable, but the timeline still tells when it is presented. */
+    lsmash_sample_t sample_info = { 0 };
+    if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, packet_number, &sample_info ) < 0 )
+        return NULL;
+    lsmash_sample_t *sample = lsmash_create_sample( 0 );
+    if( !sample )
+        return NULL;
+    sample->dts  = sample_info.dts;
+    sample->cts  = sample_info.cts;
+    sample->prop = sample_info.prop;
+    return sample;
+}
+
 static int get_input_packet
 (
     lsmash_root_t  *in_root,
-    uint32_t        in_track_ID,
+    input_track_t  *in_track,
     uint32_t       *packet_number,
     input_packet_t *packet,
-    presentation_t *presentation
+    mp4opus_presentation_t *presentation,
+    int             resilient
 )
 {
+    uint32_t in_track_ID = in_track->track_ID;
     do
     {
         if( !lsmash_check_sample_existence_in_media_timeline( in_root, in_track_ID, *packet_number ) )
             return 1;   /* No more samples. So, reached EOF. */
-        if( presentation->status == STATUS_RECOVERY_REQUIRED )
+        if( presentation->status == MP4OPUS_RECOVERY_REQUIRED )
         {
-            lsmash_sample_t sample_info = { 0 };
-            if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, *packet_number, &sample_info ) < 0 )
-                return ERROR_MSG( "failed to get sample info.\n" );
-            if( sample_info.cts < presentation->start_time )
-            {
-                *packet_number += 1;
-                continue;
-            }
-            else
-            {
-                presentation->status = STATUS_RECOVERY_STARTED;
-                uint32_t start_from_prev_sample = sample_info.cts > presentation->start_time ? 1 : 0;
-                uint32_t pre_roll_distance      = sample_info.prop.pre_roll.distance;
-                if( *packet_number <= pre_roll_distance + start_from_prev_sample )
-                    *packet_number = 1;
-                else
-                    *packet_number -= pre_roll_distance + start_from_prev_sample;
-                continue;
-            }
+            char error[MP4OPUS_ERROR_LENGTH];
+            int ret = mp4opus_find_start_packet( in_root, in_track_ID, in_track->index, in_track->num_index_entries,
+                                                 *packet_number, presentation->start_time, packet_number, error );
+            if( ret < 0 )
+                return ERROR_MSG( "%s", error );
+            if( ret )
+                return ret;     /* The start time is beyond the last sample. */
+            presentation->status = MP4OPUS_RECOVERY_STARTED;
+            continue;
         }
         lsmash_sample_t *sample = lsmash_get_sample_from_media_timeline( in_root, in_track_ID, *packet_number );
+        if( !sample && resilient )
+        {
+            /* Leave the packet to the concealment. */
+            sample = create_lost_packet( in_root, in_track_ID, *packet_number );
+            if( !sample )
+                return ERROR_MSG( "failed to get sample info.\n" );
+            packet->sample = sample;
+            packet->data   = NULL;
+            packet->size   = 0;
+            continue;
+        }
         if( !sample )
             return ERROR_MSG( "failed to get sample.\n" );
         packet->sample = sample;
@@ -656,6 +1386,89 @@ static int get_input_packet
     return 0;
 }
 
+static void convert_float_to_s24
+(
+    uint8_t *buf,
+    uint32_t count
+)
+{
+    /* Convert in place. The 24-bit output never overtakes the float input
+     * since each sample shrinks from 4 bytes to 3 bytes. */
+    const float *src = (const float *)buf;
+    uint8_t     *dst = buf;
+    uint32_t     i   = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps( 8388608.0f );
+    const __m128 min   = _mm_set1_ps( -8388608.0f );
+    const __m128 max   = _mm_set1_ps( 8388607.0f );
+    for( ; i + 4 <= count; i += 4 )
+    {
+        __m128 x = _mm_mul_ps( _mm_loadu_ps( src + i ), scale );
+        x = _mm_min_ps( _mm_max_ps( x, min ), max );
+        int32_t v[4];
+        _mm_storeu_si128( (__m128i *)v, _mm_cvtps_epi32( x ) );
+        for( int j = 0; j < 4; j++ )
+        {
+            dst[0] = v[j];
+            dst[1] = v[j] >> 8;
+            dst[2] = v[j] >> 16;
+            dst += 3;
+        }
+    }
+#endif
+    for( ; i < count; i++ )
+    {
+        float x = src[i] * 8388608.0f;
+        x = x < -8388608.0f ? -8388608.0f : x > 8388607.0f ? 8388607.0f : x;
+        int32_t v = (int32_t)(x < 0 ? x - 0.5f : x + 0.5f);
+        dst[0] = v;
+        dst[1] = v >> 8;
+        dst[2] = v >> 16;
+        dst += 3;
+    }
+}
+
+static int decode_pcm
+(
+    OpusMSDecoder   *msdec,
+    int              format,
+    const uint8_t   *data,
+    uint32_t         size,
+    lsmash_sample_t *out_sample,
+    int              frame_size,
+    int              decode_fec
+)
+{
+    return mp4opus_decode_packet( msdec, format != OUTPUT_FORMAT_S16, data, size, out_sample->data, frame_size, decode_fec );
+}
+
+static int decode_packet
+(
+    OpusMSDecoder    *msdec,
+    uint32_t          channels,
+    int               format,
+    input_packet_t   *packet,
+    lsmash_sample_t **sample
+)
+{
+    /* Decode into a sample sized for this packet so that it can be handed to the muxer as it is. */
+    int max_samples = mp4opus_get_packet_samples( packet->data, packet->size );
+    uint32_t sample_size = format == OUTPUT_FORMAT_S16 ? sizeof(opus_int16) : sizeof(float);
+    lsmash_sample_t *out_sample = lsmash_create_sample( max_samples * channels * sample_size );
+    if( !out_sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    int num_samples = decode_pcm( msdec, format, packet->data, packet->size, out_sample, max_samples, 0 );
+    if( num_samples < 0 )
+    {
+        lsmash_delete_sample( out_sample );
+        return ERROR_MSG( "failed to decode.\n" );
+    }
+    if( format == OUTPUT_FORMAT_S24 )
+        convert_float_to_s24( out_sample->data, num_samples * channels );
+    *sample = out_sample;
+    return num_samples;
+}
+
 static int feed_packet_to_decoder
 (
     decoder_t      *opus,
@@ -663,14 +1476,73 @@ static int feed_packet_to_decoder
     input_packet_t *packet
 )
 {
-    int num_samples = opus_multistream_decode( opus->msdec,
-                                               packet->data,
-                                               packet->size,
-                                               (opus_int16 *)out_media->buffer,
-                                               MAX_OPUS_PACKET_DURATION,
-                                               0 );
+    return decode_packet( opus->codec.msdec, out_media->summary->channels, opus->format, packet, &out_media->sample );
+}
+
+static int get_packet_duration
+(
+    lsmash_root_t *in_root,
+    uint32_t       in_track_ID,
+    uint32_t       packet_number,
+    uint64_t       cts
+)
+{
+    /* Take the duration of the packet from the timeline.
+     * Concealment is done in multiples of 2.5ms as Opus frames are. */
+    lsmash_sample_t next_info = { 0 };
+    uint32_t        duration  = 0;
+    if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, packet_number + 1, &next_info ) == 0 )
+        duration = next_info.cts - cts;
+    else if( lsmash_get_last_sample_delta_from_media_timeline( in_root, in_track_ID, &duration ) < 0 )
+        duration = 960;
+    duration = (duration + 119) / 120 * 120;
+    return MP4OPUSDEC_MIN( MP4OPUSDEC_MAX( duration, 120 ), MP4OPUS_MAX_PACKET_DURATION );
+}
+
+static int decode_resilient
+(
+    decoder_t      *opus,
+    lsmash_root_t  *in_root,
+    uint32_t        in_track_ID,
+    uint32_t        packet_number,
+    output_media_t *out_media,
+    input_packet_t *packet
+)
+{
+    /* Decode the packet, or conceal it if it is lost or corrupt.
+     * The concealment lasts for the duration of the packet in the timeline, so the presentation keeps its length. */
+    uint32_t channels    = out_media->summary->channels;
+    uint32_t sample_size = opus->format == OUTPUT_FORMAT_S16 ? sizeof(opus_int16) : sizeof(float);
+    lsmash_sample_t *out_sample = lsmash_create_sample( MP4OPUS_MAX_PACKET_DURATION * channels * sample_size );
+    if( !out_sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    int num_samples = packet->data
+                    ? decode_pcm( opus->codec.msdec, opus->format, packet->data, packet->size, out_sample, MP4OPUS_MAX_PACKET_DURATION, 0 )
+                    : OPUS_INVALID_PACKET;
     if( num_samples < 0 )
-        return ERROR_MSG( "failed to decode.\n" );
+    {
+        int duration = get_packet_duration( in_root, in_track_ID, packet_number, packet->sample->cts );
+        /* Only SILK and hybrid packets can carry the redundancy of the previous packet. */
+        lsmash_sample_t *next = lsmash_get_sample_from_media_timeline( in_root, in_track_ID, packet_number + 1 );
+        if( next && next->length && (next->data[0] >> 3) < 16 )
+        {
+            num_samples = decode_pcm( opus->codec.msdec, opus->format, next->data, next->length, out_sample, duration, 1 );
+            if( num_samples > 0 )
+                ++opus->recovered_packets;
+        }
+        lsmash_delete_sample( next );
+        if( num_samples < 0 )
+            num_samples = decode_pcm( opus->codec.msdec, opus->format, NULL, 0, out_sample, duration, 0 );
+        if( num_samples < 0 )
+        {
+            lsmash_delete_sample( out_sample );
+            return ERROR_MSG( "failed to conceal packet %"PRIu32".\n", packet_number );
+        }
+        ++opus->concealed_packets;
+    }
+    if( opus->format == OUTPUT_FORMAT_S24 )
+        convert_float_to_s24( out_sample->data, num_samples * channels );
+    out_media->sample = out_sample;
     return num_samples;
 }
 
@@ -678,148 +1550,637 @@ static int apply_edit
 (
     output_media_t *out_media,
     input_packet_t *packet,
-    presentation_t *presentation,
+    mp4opus_presentation_t *presentation,
     int             num_samples
 )
 {
     if( num_samples <= 0 )
         return num_samples;
-    int pre_skipped_samples;
-    if( packet->sample->cts < presentation->start_time )
+    uint32_t pre_skipped_samples;
+    num_samples = mp4opus_apply_edit( presentation, packet->sample->cts, num_samples, &pre_skipped_samples );
+    out_media->buffer_offset = (uint64_t)pre_skipped_samples * get_pcm_frame_size( out_media );
+    return num_samples;
+}
+
+static int emit_pcm_chunk
+(
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media
+)
+{
+    lsmash_sample_t *chunk = out_media->chunk;
+    if( !chunk || chunk->length == 0 )
+        return 0;
+    uint32_t num_samples = chunk->length / get_pcm_frame_size( out_media );
+    if( out_media->raw )
     {
-        if( packet->sample->cts + num_samples <= presentation->start_time )
-            pre_skipped_samples = num_samples;  /* no output samples */
-        else
-            pre_skipped_samples = presentation->start_time - packet->sample->cts;
-        num_samples -= pre_skipped_samples;
+        /* The chunk is reused for the next write. */
+        if( fwrite( chunk->data, 1, chunk->length, out_media->raw ) != chunk->length )
+            return ERROR_MSG( "failed to write PCM samples.\n" );
+        chunk->length = 0;
     }
     else
-        pre_skipped_samples = 0;
-    out_media->buffer_offset = (uint64_t)pre_skipped_samples * out_media->summary->channels * 2;
-    presentation->timestamp += ((double)num_samples / 48000) * presentation->timescale;
-    if( presentation->timestamp > presentation->duration )
-        num_samples -= ((double)(presentation->timestamp - presentation->duration) / presentation->timescale) * 48000;
-    return num_samples;
+    {
+        chunk->dts           = out_media->timestamp;
+        chunk->cts           = out_media->timestamp;
+        chunk->index         = out_media->sample_entry;
+        chunk->prop.ra_flags = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
+        out_media->chunk = NULL;
+        if( lsmash_append_sample( out_root, out_track_ID, chunk ) < 0 )
+        {
+            lsmash_delete_sample( chunk );
+            return ERROR_MSG( "failed to append sample.\n" );
+        }
+    }
+    out_media->timestamp += num_samples;
+    return 0;
 }
 
-static int mux_pcm_samples
+static int coalesce_pcm_samples
 (
     lsmash_root_t  *out_root,
     uint32_t        out_track_ID,
     output_media_t *out_media,
-    int             num_samples
+    const uint8_t  *pcm,    /* NULL for silence */
+    uint64_t        size
+)
+{
+    while( size )
+    {
+        if( !out_media->chunk )
+        {
+            out_media->chunk = lsmash_create_sample( out_media->chunk_capacity );
+            if( !out_media->chunk )
+                return ERROR_MSG( "failed to allocate sample.\n" );
+            out_media->chunk->length = 0;
+        }
+        lsmash_sample_t *chunk = out_media->chunk;
+        uint32_t count = MP4OPUSDEC_MIN( out_media->chunk_capacity - chunk->length, size );
+        if( pcm )
+        {
+            memcpy( chunk->data + chunk->length, pcm, count );
+            pcm += count;
+        }
+        else
+            memset( chunk->data + chunk->length, 0, count );
+        chunk->length += count;
+        size          -= count;
+        if( chunk->length == out_media->chunk_capacity
+         && emit_pcm_chunk( out_root, out_track_ID, out_media ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static int append_pcm_samples
+(
+    lsmash_root_t   *out_root,
+    uint32_t         out_track_ID,
+    output_media_t  *out_media,
+    lsmash_sample_t *out_sample,
+    uint64_t         buffer_offset,
+    int              num_samples
 )
 {
+    /* Only the chunk and the timestamp of out_media are updated here, so this can run apart from the decoding. */
     if( num_samples <= 0 )
-        return num_samples;
-    lsmash_sample_t *out_sample = lsmash_create_sample( num_samples * out_media->summary->channels * 2 );
-    if( !out_sample )
-        return ERROR_MSG( "failed to allocate sample.\n" );
-    memcpy( out_sample->data, out_media->buffer + out_media->buffer_offset, out_sample->length );
-    out_sample->dts           = out_media->timestamp;
-    out_sample->cts           = out_media->timestamp;
-    out_sample->index         = out_media->sample_entry;
-    out_sample->prop.ra_flags = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
-    if( lsmash_append_sample( out_root, out_track_ID, out_sample ) < 0 )
     {
         lsmash_delete_sample( out_sample );
-        return ERROR_MSG( "failed to append sample.\n" );
+        return num_samples;
     }
-    out_media->timestamp += num_samples;
-    return 0;
+    uint32_t length = num_samples * get_pcm_frame_size( out_media );
+    uint8_t *pcm    = out_sample->data + buffer_offset;
+    if( out_media->loudness )
+    {
+        /* Measure the samples to be presented in the same pass as muxing. */
+        if( out_media->summary->sample_size == 32 )
+            mp4opus_loudness_add_float( out_media->loudness, (float *)pcm, num_samples );
+        else if( out_media->summary->sample_size == 24 )
+            mp4opus_loudness_add_s24( out_media->loudness, pcm, num_samples );
+        else
+            mp4opus_loudness_add_s16( out_media->loudness, (int16_t *)pcm, num_samples );
+    }
+    int ret = coalesce_pcm_samples( out_root, out_track_ID, out_media, pcm, length );
+    lsmash_delete_sample( out_sample );
+    return ret < 0 ? ret : (int)length;
+}
+
+static int mux_pcm_samples
+(
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media,
+    int             num_samples
+)
+{
+    lsmash_sample_t *out_sample = out_media->sample;
+    out_media->sample = NULL;
+    return append_pcm_samples( out_root, out_track_ID, out_media, out_sample, out_media->buffer_offset, num_samples );
 }
 
 static int flush_decoder
 (
-    lsmash_root_t *out_root,
-    uint32_t       out_track_ID
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media
 )
 {
+    if( emit_pcm_chunk( out_root, out_track_ID, out_media ) < 0 )
+        return -1;
+    if( out_media->raw )
+    {
+        if( fflush( out_media->raw ) )
+            return ERROR_MSG( "failed to write PCM samples.\n" );
+        return 0;
+    }
     if( lsmash_flush_pooled_samples( out_root, out_track_ID, 1 ) < 0 )
         return ERROR_MSG( "failed to flush samples.\n" );
     return 0;
 }
 
-static int do_decode
+static int decode_edit_serial
 (
-    mp4opusdec_t *dec
+    mp4opusdec_t   *dec,
+    input_track_t  *in_track,
+    output_track_t *out_track,
+    mp4opus_presentation_t *presentation
 )
 {
     input_t  *input  = &dec->input;
     output_t *output = &dec->output;
+    stats_t  *stats  = dec->opus.stats;
+    stage_clock_t clk;
+    int ret = 0;
+    /* ret == 1 means EOF. */
+    for( uint32_t packet_number = 1; ret != 1 && presentation->timestamp < presentation->duration; packet_number++ )
+    {
+        input_packet_t packet = { NULL };
+        start_stage_clock( stats, &clk );
+        ret = get_input_packet( input->root,
+                                in_track,
+                                &packet_number,
+                                &packet,
+                                presentation,
+                                dec->opus.resilient );
+        stop_stage_clock( stats, &clk, STAGE_DEMUX );
+        if( ret < 0 )
+            return ret;
+        if( ret != 1 )
+        {
+            count_input_packet( stats, &packet );
+            start_stage_clock( stats, &clk );
+            int num_samples = dec->opus.resilient
+                            ? decode_resilient( &dec->opus,
+                                                input->root,
+                                                in_track->track_ID,
+                                                packet_number,
+                                                &out_track->media,
+                                                &packet )
+                            : feed_packet_to_decoder( &dec->opus,
+                                                      &out_track->media,
+                                                      &packet );
+            stop_stage_clock( stats, &clk, STAGE_CODEC );
+            start_stage_clock( stats, &clk );
+            num_samples = apply_edit( &out_track->media,
+                                      &packet,
+                                      presentation,
+                                      num_samples );
+            ret = mux_pcm_samples( output->root,
+                                   out_track->track_ID,
+                                   &out_track->media,
+                                   num_samples );
+            stop_stage_clock( stats, &clk, STAGE_MUX );
+            if( ret > 0 )
+            {
+                count_output_packet( stats, ret );
+                ret = 0;
+            }
+        }
+        free_input_packet( &packet );
+        if( ret < 0 )
+            return ret;
+    }
+    return 0;
+}
+
+static void *demux_worker
+(
+    void *arg
+)
+{
+    pipeline_t     *pipeline     = (pipeline_t *)arg;
+    mp4opus_presentation_t *presentation = pipeline->presentation;
+    /* The recovery status of the presentation is only touched on this thread. */
+    for( uint32_t packet_number = 1; ; packet_number++ )
+    {
+        demux_item_t  item = { { NULL } };
+        stage_clock_t clk;
+        start_stage_clock( pipeline->stats, &clk );
+        item.status = get_input_packet( pipeline->in_root, pipeline->in_track, &packet_number, &item.packet, presentation, 0 );
+        stop_stage_clock( pipeline->stats, &clk, STAGE_DEMUX );
+        if( item.status == 0 && item.packet.sample->cts >= pipeline->end_cts )
+        {
+            free_input_packet( &item.packet );
+            item.status = 1;
+        }
+        if( mp4opus_ring_push( &pipeline->demux_ring, &item ) < 0 )
+        {
+            free_input_packet( &item.packet );
+            break;
+        }
+        if( item.status )
+            break;
+    }
+    return NULL;
+}
+
+static void *mux_worker
+(
+    void *arg
+)
+{
+    pipeline_t     *pipeline  = (pipeline_t *)arg;
+    output_track_t *out_track = pipeline->out_track;
+    mux_item_t      item;
+    pipeline->mux_ret = -1;
+    while( mp4opus_ring_pop( &pipeline->mux_ring, &item ) == 0 )
+    {
+        if( item.end )
+        {
+            pipeline->mux_ret = 0;
+            break;
+        }
+        stage_clock_t clk;
+        start_stage_clock( pipeline->stats, &clk );
+        int ret = append_pcm_samples( pipeline->out_root,
+                                      out_track->track_ID,
+                                      &out_track->media,
+                                      item.sample,
+                                      item.buffer_offset,
+                                      item.num_samples );
+        stop_stage_clock( pipeline->stats, &clk, STAGE_MUX );
+        if( ret < 0 )
+            break;
+    }
+    /* Let the decoding thread know of the failure if it is waiting for room. */
+    mp4opus_ring_abort( &pipeline->mux_ring );
+    return NULL;
+}
+
+static int decode_edit_pipelined
+(
+    mp4opusdec_t   *dec,
+    input_track_t  *in_track,
+    output_track_t *out_track,
+    mp4opus_presentation_t *presentation
+)
+{
+    /* The demux thread reads ahead and the mux thread writes behind the decoding on this thread,
+     * so that the I/O latency overlaps with the decoding. */
+    stats_t *stats = dec->opus.stats;
+    pipeline_t pipeline =
+    {
+        .in_root      = dec->input.root,
+        .in_track     = in_track,
+        .presentation = presentation,
+        .end_cts      = presentation->start_time
+                      + ((double)presentation->duration / presentation->timescale) * 48000,
+        .out_root     = dec->output.root,
+        .out_track    = out_track,
+        .stats        = stats
+    };
+    if( mp4opus_ring_init( &pipeline.demux_ring, sizeof(demux_item_t), dec->opt.pipeline ) < 0
+     || mp4opus_ring_init( &pipeline.mux_ring,   sizeof(mux_item_t),   dec->opt.pipeline ) < 0 )
+    {
+        mp4opus_ring_cleanup( &pipeline.demux_ring );
+        mp4opus_ring_cleanup( &pipeline.mux_ring );
+        return ERROR_MSG( "failed to allocate rings for the pipeline.\n" );
+    }
+    int ret = 0;
+    int demux_started = !pthread_create( &pipeline.demux_thread, NULL, demux_worker, &pipeline );
+    int mux_started   = !pthread_create( &pipeline.mux_thread,   NULL, mux_worker,   &pipeline );
+    if( !demux_started || !mux_started )
+        ret = ERROR_MSG( "failed to create threads for the pipeline.\n" );
+    output_media_t *out_media = &out_track->media;
+    while( ret == 0 && presentation->timestamp < presentation->duration )
+    {
+        demux_item_t item;
+        if( mp4opus_ring_pop( &pipeline.demux_ring, &item ) < 0 || item.status < 0 )
+        {
+            ret = -1;
+            break;
+        }
+        if( item.status == 1 )
+            break;
+        /* The counters are updated only on this thread. */
+        count_input_packet( stats, &item.packet );
+        stage_clock_t clk;
+        start_stage_clock( stats, &clk );
+        int num_samples = feed_packet_to_decoder( &dec->opus, out_media, &item.packet );
+        stop_stage_clock( stats, &clk, STAGE_CODEC );
+        num_samples = apply_edit( out_media, &item.packet, presentation, num_samples );
+        free_input_packet( &item.packet );
+        mux_item_t mux_item =
+        {
+            .sample        = out_media->sample,
+            .buffer_offset = out_media->buffer_offset,
+            .num_samples   = num_samples
+        };
+        out_media->sample = NULL;
+        if( num_samples < 0 )
+            ret = -1;
+        else if( num_samples > 0 )
+            count_output_packet( stats, num_samples * get_pcm_frame_size( out_media ) );
+        if( mp4opus_ring_push( &pipeline.mux_ring, &mux_item ) < 0 )
+        {
+            lsmash_delete_sample( mux_item.sample );
+            ret = -1;
+        }
+    }
+    if( ret == 0 && mp4opus_ring_push( &pipeline.mux_ring, &(mux_item_t){ .end = 1 } ) < 0 )
+        ret = -1;
+    if( ret < 0 )
+        mp4opus_ring_abort( &pipeline.mux_ring );
+    /* The demux thread may still be reading ahead beyond the edit. */
+    mp4opus_ring_abort( &pipeline.demux_ring );
+    if( demux_started )
+        pthread_join( pipeline.demux_thread, NULL );
+    if( mux_started )
+        pthread_join( pipeline.mux_thread, NULL );
+    if( ret == 0 && pipeline.mux_ret < 0 )
+        ret = -1;
+    demux_item_t demux_item;
+    while( mp4opus_ring_try_pop( &pipeline.demux_ring, &demux_item ) == 0 )
+        free_input_packet( &demux_item.packet );
+    mux_item_t mux_item;
+    while( mp4opus_ring_try_pop( &pipeline.mux_ring, &mux_item ) == 0 )
+        lsmash_delete_sample( mux_item.sample );
+    mp4opus_ring_cleanup( &pipeline.demux_ring );
+    mp4opus_ring_cleanup( &pipeline.mux_ring );
+    return ret;
+}
+
+static void *decode_chunk
+(
+    void *arg
+)
+{
+    decode_chunk_t *chunk = (decode_chunk_t *)arg;
+    chunk->ret = -1;
+    if( opus_multistream_decoder_ctl( chunk->msdec, OPUS_RESET_STATE ) != OPUS_OK )
+        return NULL;
+    /* Warm up the decoder with the pre-roll packets and discard their output. */
+    for( input_packet_t *packet = chunk->packets - chunk->warmup_packets; packet != chunk->packets; packet++ )
+        if( mp4opus_decode_packet( chunk->msdec, 0, packet->data, packet->size, chunk->pcm, MP4OPUS_MAX_PACKET_DURATION, 0 ) < 0 )
+            return NULL;
+    for( uint32_t i = 0; i < chunk->num_packets; i++ )
+    {
+        chunk->num_samples[i] = decode_packet( chunk->msdec, chunk->channels, chunk->format, &chunk->packets[i], &chunk->samples[i] );
+        if( chunk->num_samples[i] < 0 )
+            return NULL;
+    }
+    chunk->ret = 0;
+    return NULL;
+}
+
+static int decode_edit_parallel
+(
+    mp4opusdec_t   *dec,
+    input_track_t  *in_track,
+    output_track_t *out_track,
+    mp4opus_presentation_t *presentation
+)
+{
+    input_t        *input     = &dec->input;
+    output_t       *output    = &dec->output;
+    decoder_t      *opus      = &dec->opus;
+    output_media_t *out_media = &out_track->media;
+    stats_t        *stats     = opus->stats;
+    /* The window consists of the packets taken over from the previous window for warm-up
+     * followed by the packets split into chunks which are decoded in parallel.
+     * The main thread reads packets and muxes the decoded samples in order. */
+    uint32_t num_chunks     = opus->threads;
+    uint32_t window_packets = CHUNK_PACKETS * num_chunks;
+    if( !opus->window )
+    {
+        opus->window      = lsmash_malloc_zero( (MAX_WARMUP_PACKETS + window_packets) * sizeof(input_packet_t) );
+        opus->samples     = lsmash_malloc_zero( window_packets * sizeof(lsmash_sample_t *) );
+        opus->num_samples = lsmash_malloc_zero( window_packets * sizeof(int) );
+        if( !opus->window || !opus->samples || !opus->num_samples )
+            return ERROR_MSG( "failed to allocate buffers for parallel decoding.\n" );
+    }
+    input_packet_t *window = opus->window + MAX_WARMUP_PACKETS;
+    /* No packets after the edit are needed. */
+    uint64_t end_cts = presentation->start_time
+                     + ((double)presentation->duration / presentation->timescale) * 48000;
+    uint32_t history_packets = 0;
+    uint32_t packet_number   = 1;
+    int      eof = 0;
+    int      ret = 0;
+    stage_clock_t clk;
+    while( !eof && ret == 0 && presentation->timestamp < presentation->duration )
+    {
+        /* Read packets into the window. */
+        start_stage_clock( stats, &clk );
+        uint32_t num_packets = 0;
+        while( num_packets < window_packets )
+        {
+            input_packet_t *packet = &window[num_packets];
+            *packet = (input_packet_t){ NULL };
+            ret = get_input_packet( input->root,
+                                    in_track,
+                                    &packet_number,
+                                    packet,
+                                    presentation,
+                                    0 );
+            if( ret < 0 )
+                break;
+            if( ret == 1 || packet->sample->cts >= end_cts )
+            {
+                free_input_packet( packet );
+                eof = 1;
+                ret = 0;
+                break;
+            }
+            count_input_packet( stats, packet );
+            ++num_packets;
+            ++packet_number;
+        }
+        stop_stage_clock( stats, &clk, STAGE_DEMUX );
+        /* Decode the chunks in parallel. */
+        start_stage_clock( stats, &clk );
+        uint32_t num_active_chunks = 0;
+        for( uint32_t i = 0; ret == 0 && i < num_chunks; i++ )
+        {
+            uint32_t start_packet = i * CHUNK_PACKETS;
+            if( start_packet >= num_packets )
+                break;
+            decode_chunk_t *chunk = &opus->chunks[i];
+            chunk->packets        = &window[start_packet];
+            chunk->warmup_packets = MP4OPUSDEC_MIN( chunk->packets->sample->prop.pre_roll.distance,
+                                                    MP4OPUSDEC_MIN( history_packets + start_packet, MAX_WARMUP_PACKETS ) );
+            chunk->num_packets    = MP4OPUSDEC_MIN( CHUNK_PACKETS, num_packets - start_packet );
+            chunk->samples        = &opus->samples[start_packet];
+            chunk->num_samples    = &opus->num_samples[start_packet];
+            if( pthread_create( &chunk->thread, NULL, decode_chunk, chunk ) )
+            {
+                ret = ERROR_MSG( "failed to create a decoding thread.\n" );
+                break;
+            }
+            ++num_active_chunks;
+        }
+        for( uint32_t i = 0; i < num_active_chunks; i++ )
+        {
+            pthread_join( opus->chunks[i].thread, NULL );
+            if( opus->chunks[i].ret < 0 )
+                ret = ERROR_MSG( "failed to decode chunk.\n" );
+        }
+        stop_stage_clock( stats, &clk, STAGE_CODEC );
+        /* Feed the decoded samples to muxer in order. */
+        start_stage_clock( stats, &clk );
+        for( uint32_t i = 0; i < num_packets; i++ )
+        {
+            out_media->sample = opus->samples[i];
+            opus->samples[i]  = NULL;
+            int num_samples   = opus->num_samples[i];
+            if( ret < 0 || !out_media->sample || presentation->timestamp >= presentation->duration )
+                num_samples = 0;    /* Just release the decoded samples. */
+            else
+                num_samples = apply_edit( out_media, &window[i], presentation, num_samples );
+            int mux_ret = mux_pcm_samples( output->root,
+                                           out_track->track_ID,
+                                           out_media,
+                                           num_samples );
+            if( mux_ret < 0 )
+                ret = mux_ret;
+            else if( mux_ret > 0 )
+                count_output_packet( stats, mux_ret );
+        }
+        stop_stage_clock( stats, &clk, STAGE_MUX );
+        /* Take over the last packets for warm-up of the next window. */
+        uint32_t total_packets = history_packets + num_packets;
+        uint32_t kept_packets  = MP4OPUSDEC_MIN( MAX_WARMUP_PACKETS, total_packets );
+        input_packet_t *first  = window - history_packets;
+        for( uint32_t i = 0; i < total_packets - kept_packets; i++ )
+            free_input_packet( &first[i] );
+        memmove( window - kept_packets, first + total_packets - kept_packets, kept_packets * sizeof(input_packet_t) );
+        history_packets = kept_packets;
+    }
+    input_packet_t *history = window - history_packets;
+    for( uint32_t i = 0; i < history_packets; i++ )
+        free_input_packet( &history[i] );
+    return ret;
+}
+
+static int decode_track
+(
+    mp4opusdec_t *dec,
+    uint32_t      track_number
+)
+{
+    input_t        *input     = &dec->input;
+    output_t       *output    = &dec->output;
+    input_track_t  *in_track  = &input->file.movie.tracks[track_number];
+    output_track_t *out_track = &output->file.movie.tracks[track_number];
+    stats_t        *stats     = dec->opus.stats;
+    stage_clock_t clk;
+    if( output->file.movie.num_tracks > 1 )
+    {
+        /* The tracks are decoded in turn with the shared decoder. */
+        lsmash_opus_specific_parameters_t *opus_param = (lsmash_opus_specific_parameters_t *)in_track->media.summaries[0].cs->data.structured;
+        lsmash_qt_audio_channel_layout_t   layout;
+        if( setup_decoder( &dec->opus, opus_param, &layout ) < 0 )
+            return ERROR_MSG( "failed to set up decoder.\n" );
+    }
+    uint32_t timescale  = input->file.movie.param.timescale;
+    uint64_t range_start = dec->opt.start * timescale;
+    uint64_t range_end   = dec->opt.duration > 0 ? range_start + (uint64_t)(dec->opt.duration * timescale) : UINT64_MAX;
+    uint64_t edit_offset = 0;   /* presentation time of the current edit in the movie timescale */
     uint32_t edit_count = lsmash_count_explicit_timeline_map( input->root,
-                                                              input->file.movie.track.track_ID );
+                                                              in_track->track_ID );
     for( uint32_t edit_number = 1; edit_number <= edit_count; edit_number++ )
     {
         lsmash_edit_t edit;
         int ret = lsmash_get_explicit_timeline_map( input->root,
-                                                    input->file.movie.track.track_ID,
+                                                    in_track->track_ID,
                                                     edit_number,
                                                     &edit );
         if( ret < 0 )
             return ERROR_MSG( "failed to get explicit timeline map.\n" );
+        if( edit.duration == 0 && edit.start_time != -1 )
+        {
+            uint64_t duration = lsmash_get_media_duration_from_media_timeline( input->root,
+                                                                               in_track->track_ID );
+            edit.duration = ((double)duration / 48000) * timescale;
+        }
+        /* Clip the edit into the requested range. */
+        uint64_t edit_start = edit_offset;
+        edit_offset += edit.duration;
+        if( !mp4opus_clip_edit( &edit, edit_start, range_start, range_end, timescale ) )
+            continue;
+        int raw = out_track->media.raw != NULL;
         if( edit.start_time == -1 )
         {
+            if( raw )
+            {
+                /* An empty edit is presented as silence. */
+                uint64_t num_samples = ((double)edit.duration / input->file.movie.param.timescale) * 48000;
+                if( coalesce_pcm_samples( NULL, 0, &out_track->media, NULL,
+                                          num_samples * get_pcm_frame_size( &out_track->media ) ) < 0 )
+                    return -1;
+                continue;
+            }
             ret = lsmash_create_explicit_timeline_map( output->root,
-                                                       output->file.movie.track.track_ID,
+                                                       out_track->track_ID,
                                                        edit );
             if( ret < 0 )
                 return ERROR_MSG( "failed to create empty edit.\n" );
             continue;
         }
-        presentation_t presentation =
+        mp4opus_presentation_t presentation =
         {
-            .status     = STATUS_RECOVERY_REQUIRED,
-            .timescale  = input->file.movie.param.timescale,
+            .status     = MP4OPUS_RECOVERY_REQUIRED,
+            .timescale  = timescale,
             .timestamp  = 0,
             .duration   = edit.duration,
             .start_time = edit.start_time,
             .rate       = edit.rate
         };
         edit.start_time = 0;    /* no extra samples within LPCM track */
-        if( presentation.duration == 0 )
-        {
-            uint64_t duration = lsmash_get_media_duration_from_media_timeline( input->root,
-                                                                               input->file.movie.track.track_ID );
-            presentation.duration = edit.duration = ((double)duration / 48000) * presentation.timescale;
-        }
-        ret = lsmash_create_explicit_timeline_map( output->root,
-                                                   output->file.movie.track.track_ID,
-                                                   edit );
+        ret = raw ? 0 : lsmash_create_explicit_timeline_map( output->root,
+                                                             out_track->track_ID,
+                                                             edit );
         if( ret < 0 )
             return ERROR_MSG( "failed to create explicit timeline map.\n" );
-        /* ret == 1 means EOF. */
-        for( uint32_t packet_number = 1; ret != 1 && presentation.timestamp < presentation.duration; packet_number++ )
-        {
-            input_packet_t packet = { NULL };
-            ret = get_input_packet( input->root,
-                                    input->file.movie.track.track_ID,
-                                    &packet_number,
-                                    &packet,
-                                    &presentation );
-            if( ret < 0 )
-                return ret;
-            if( ret != 1 )
-            {
-                int num_samples = feed_packet_to_decoder( &dec->opus,
-                                                          &output->file.movie.track.media,
-                                                          &packet );
-                num_samples = apply_edit( &output->file.movie.track.media,
-                                          &packet,
-                                          &presentation,
-                                          num_samples );
-                ret = mux_pcm_samples( output->root,
-                                       output->file.movie.track.track_ID,
-                                       &output->file.movie.track.media,
-                                       num_samples );
-            }
-            free_input_packet( &packet );
-            if( ret < 0 )
-                return ret;
-        }
+        if( dec->opus.chunks )
+            ret = decode_edit_parallel( dec, in_track, out_track, &presentation );
+        else if( dec->opt.pipeline )
+            ret = decode_edit_pipelined( dec, in_track, out_track, &presentation );
+        else
+            ret = decode_edit_serial( dec, in_track, out_track, &presentation );
+        if( ret < 0 )
+            return ret;
     }
-    return flush_decoder( output->root,
-                          output->file.movie.track.track_ID );
+    start_stage_clock( stats, &clk );
+    int ret = flush_decoder( output->root,
+                             out_track->track_ID,
+                             &out_track->media );
+    stop_stage_clock( stats, &clk, STAGE_MUX );
+    return ret;
+}
+
+static int do_decode
+(
+    mp4opusdec_t *dec
+)
+{
+    /* Unlike mp4opusenc, the tracks are decoded serially: each track is read and muxed to its end
+     * before the next one starts, so the output tracks are not interleaved by chunks. */
+    for( uint32_t i = 0; i < dec->output.file.movie.num_tracks; i++ )
+        if( decode_track( dec, i ) < 0 )
+            return -1;
+    return 0;
 }
 
 static int finish_movie
@@ -828,11 +2189,261 @@ static int finish_movie
 )
 {
     output_t *output = &dec->output;
+    if( output->file.type == OUTPUT_FILE_WAV )
+        return finish_wav( &output->file.movie.tracks[0].media );
+    if( output->file.type == OUTPUT_FILE_RAW )
+        return 0;
+    stage_clock_t clk;
+    start_stage_clock( dec->opus.stats, &clk );
     if( lsmash_finish_movie( output->root, NULL ) < 0 )
         return ERROR_MSG( "failed to finalize output movie.\n" );
+    stop_stage_clock( dec->opus.stats, &clk, STAGE_FINALIZE );
+    return 0;
+}
+
+static int decode_file
+(
+    mp4opusdec_t *dec
+)
+{
+    dec->opus.concealed_packets = 0;
+    dec->opus.recovered_packets = 0;
+    if( open_input_file( dec ) < 0 )
+        return -1;
+    if( prepare_output( dec ) < 0 )
+        return ERROR_MSG( "failed to set up preparation for output.\n" );
+    if( do_decode( dec ) < 0 )
+        return ERROR_MSG( "failed to decode.\n" );
+    if( finish_movie( dec ) < 0 )
+        return ERROR_MSG( "failed to finish output movie.\n" );
+    return 0;
+}
+
+static void cleanup_batch
+(
+    batch_t *batch
+)
+{
+    for( uint32_t i = 0; i < batch->num_entries; i++ )
+        lsmash_free( batch->entries[i].input );    /* The output file name shares the allocation. */
+    lsmash_free( batch->entries );
+}
+
+static int read_batch_manifest
+(
+    batch_t    *batch,
+    const char *name
+)
+{
+    FILE *manifest = fopen( name, "rb" );
+    if( !manifest )
+        return ERROR_MSG( "failed to open manifest: %s.\n", name );
+    char     line[4096];
+    uint32_t line_number    = 0;
+    uint32_t entry_capacity = 0;
+    while( fgets( line, sizeof(line), manifest ) )
+    {
+        ++line_number;
+        size_t length = strlen( line );
+        if( length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof( manifest ) )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "line %"PRIu32" in manifest is too long.\n", line_number );
+        }
+        while( length && (line[length - 1] == '\n' || line[length - 1] == '\r') )
+            line[--length] = '\0';
+        if( length == 0 || line[0] == '#' )
+            continue;
+        char *separator = strchr( line, '\t' );
+        if( !separator || separator == line || separator[1] == '\0' )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "line %"PRIu32" in manifest is not a pair of input and output.\n", line_number );
+        }
+        if( batch->num_entries == entry_capacity )
+        {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            batch_entry_t *entries = lsmash_realloc( batch->entries, entry_capacity * sizeof(batch_entry_t) );
+            if( !entries )
+            {
+                fclose( manifest );
+                return ERROR_MSG( "failed to allocate manifest entries.\n" );
+            }
+            batch->entries = entries;
+        }
+        char *names = lsmash_malloc( length + 1 );
+        if( !names )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "failed to allocate manifest entry.\n" );
+        }
+        *separator = '\0';
+        memcpy( names, line, length + 1 );
+        batch_entry_t *entry = &batch->entries[ batch->num_entries++ ];
+        entry->input  = names;
+        entry->output = names + (separator - line) + 1;
+    }
+    fclose( manifest );
+    if( batch->num_entries == 0 )
+        return ERROR_MSG( "no files to decode in manifest.\n" );
     return 0;
 }
 
+static void *batch_worker
+(
+    void *arg
+)
+{
+    batch_worker_t *worker = (batch_worker_t *)arg;
+    batch_t        *batch  = worker->batch;
+    mp4opusdec_t   *dec    = &worker->dec;
+    while( 1 )
+    {
+        pthread_mutex_lock( &batch->mutex );
+        uint32_t entry_number = batch->next_entry++;
+        pthread_mutex_unlock( &batch->mutex );
+        if( entry_number >= batch->num_entries )
+            break;
+        batch_entry_t *entry = &batch->entries[entry_number];
+        dec->input.file.name  = entry->input;
+        dec->output.file.name = entry->output;
+        int ret = decode_file( dec );
+        mp4opus_loudness_t *loudness = dec->output.file.movie.num_tracks ? dec->output.file.movie.tracks[0].media.loudness : NULL;
+        double integrated = loudness ? mp4opus_loudness_integrated( loudness ) : 0;
+        double range      = loudness ? mp4opus_loudness_range( loudness )      : 0;
+        double true_peak  = loudness ? mp4opus_loudness_true_peak( loudness )  : 0;
+        /* Keep the decoder for the next file unless it might be broken. */
+        cleanup_input_movie( &dec->input );
+        cleanup_output_movie( &dec->output );
+        memset( &dec->input,  0, sizeof(input_t) );
+        memset( &dec->output, 0, sizeof(output_t) );
+        if( ret < 0 )
+            cleanup_decoder( &dec->opus );
+        pthread_mutex_lock( &batch->mutex );
+        printf( "%s\t%s\t%s", ret < 0 ? "FAILED" : "OK", entry->input, entry->output );
+        if( dec->opt.resilient )
+            printf( "\t%"PRIu64"\t%"PRIu64, dec->opus.concealed_packets, dec->opus.recovered_packets );
+        if( dec->opt.loudness )
+            printf( "\t%.1lf\t%.1lf\t%.1lf", integrated, range, true_peak );
+        printf( "\n" );
+        fflush( stdout );
+        if( ret < 0 )
+            ++batch->num_failures;
+        pthread_mutex_unlock( &batch->mutex );
+    }
+    cleanup_decoder( &dec->opus );
+    return NULL;
+}
+
+static int do_batch
+(
+    mp4opusdec_t *dec
+)
+{
+    batch_t batch = { NULL };
+    if( read_batch_manifest( &batch, dec->opt.batch ) < 0 )
+    {
+        cleanup_batch( &batch );
+        return -1;
+    }
+    uint32_t num_workers = MP4OPUSDEC_MIN( (uint32_t)dec->opt.jobs, batch.num_entries );
+    batch_worker_t *workers = lsmash_malloc_zero( num_workers * sizeof(batch_worker_t) );
+    if( !workers || pthread_mutex_init( &batch.mutex, NULL ) )
+    {
+        lsmash_free( workers );
+        cleanup_batch( &batch );
+        return ERROR_MSG( "failed to set up batch workers.\n" );
+    }
+    uint32_t num_active_workers = 0;
+    for( uint32_t i = 0; i < num_workers; i++ )
+    {
+        batch_worker_t *worker = &workers[i];
+        worker->batch   = &batch;
+        worker->dec.opt = dec->opt;
+        if( pthread_create( &worker->thread, NULL, batch_worker, worker ) )
+        {
+            WARNING_MSG( "failed to create a batch worker.\n" );
+            break;
+        }
+        ++num_active_workers;
+    }
+    for( uint32_t i = 0; i < num_active_workers; i++ )
+        pthread_join( workers[i].thread, NULL );
+    int ret = 0;
+    if( num_active_workers == 0 )
+        ret = ERROR_MSG( "no batch worker is available.\n" );
+    else if( batch.num_failures )
+        ret = ERROR_MSG( "%"PRIu32" of %"PRIu32" files failed to be decoded.\n", batch.num_failures, batch.num_entries );
+    else
+        eprintf( "Batch decoding completed!\n" );
+    pthread_mutex_destroy( &batch.mutex );
+    lsmash_free( workers );
+    cleanup_batch( &batch );
+    return ret;
+}
+
+static void report_loudness
+(
+    mp4opusdec_t *dec
+)
+{
+    output_movie_t *out_movie = &dec->output.file.movie;
+    for( uint32_t i = 0; i < out_movie->num_tracks; i++ )
+    {
+        mp4opus_loudness_t *loudness = out_movie->tracks[i].media.loudness;
+        if( !loudness )
+            continue;
+        eprintf( "Track %"PRIu32": integrated loudness %.1lf LUFS, loudness range %.1lf LU, true peak %.1lf dBTP\n",
+                 dec->input.file.movie.tracks[i].track_ID,
+                 mp4opus_loudness_integrated( loudness ),
+                 mp4opus_loudness_range( loudness ),
+                 mp4opus_loudness_true_peak( loudness ) );
+    }
+}
+
+static void report_stats
+(
+    mp4opusdec_t *dec
+)
+{
+    static const char *stage_names[STAGE_COUNT] = { "demux", "decode", "mux", "finalize" };
+    stats_t *stats = dec->opus.stats;
+    if( !stats )
+        return;
+    double average_packet_size = stats->input_packets ? (double)stats->input_bytes / stats->input_packets : 0;
+    if( dec->opt.stats )
+    {
+        eprintf( "Statistics:\n" );
+        for( int i = 0; i < STAGE_COUNT; i++ )
+            eprintf( "    %-8s : wall %.6lf sec, cpu %.6lf sec\n", stage_names[i], stats->stages[i].wall, stats->stages[i].cpu );
+        eprintf( "    input    : %"PRIu64" packets, %"PRIu64" bytes\n", stats->input_packets, stats->input_bytes );
+        eprintf( "    output   : %"PRIu64" packets, %"PRIu64" bytes\n", stats->output_packets, stats->output_bytes );
+        eprintf( "    packet   : min %"PRIu32" bytes, avg %.2lf bytes, max %"PRIu32" bytes\n",
+                 stats->min_packet_size, average_packet_size, stats->max_packet_size );
+        eprintf( "    alloc    : %"PRIu64" samples\n", stats->allocations );
+    }
+    if( dec->opt.stats_json )
+    {
+        FILE *fp = fopen( dec->opt.stats_json, "wb" );
+        if( !fp )
+        {
+            WARNING_MSG( "failed to open %s to write statistics.\n", dec->opt.stats_json );
+            return;
+        }
+        fprintf( fp, "{\n  \"stages\": {\n" );
+        for( int i = 0; i < STAGE_COUNT; i++ )
+            fprintf( fp, "    \"%s\": { \"wall\": %.6lf, \"cpu\": %.6lf }%s\n",
+                     stage_names[i], stats->stages[i].wall, stats->stages[i].cpu, i == STAGE_COUNT - 1 ? "" : "," );
+        fprintf( fp, "  },\n" );
+        fprintf( fp, "  \"input\": { \"packets\": %"PRIu64", \"bytes\": %"PRIu64" },\n", stats->input_packets, stats->input_bytes );
+        fprintf( fp, "  \"output\": { \"packets\": %"PRIu64", \"bytes\": %"PRIu64" },\n", stats->output_packets, stats->output_bytes );
+        fprintf( fp, "  \"packet_size\": { \"min\": %"PRIu32", \"avg\": %.2lf, \"max\": %"PRIu32" },\n",
+                 stats->min_packet_size, average_packet_size, stats->max_packet_size );
+        fprintf( fp, "  \"allocations\": %"PRIu64"\n}\n", stats->allocations );
+        fclose( fp );
+    }
+}
+
 int main
 (
     int   argc,
@@ -847,6 +2458,10 @@ int main
         display_help();
         return 0;
     }
+    if( dec.opt.batch )
+        return do_batch( &dec );
+    if( dec.opt.stats || dec.opt.stats_json )
+        dec.opus.stats = &dec.stats;
     if( open_input_file( &dec ) < 0 )
         return MP4OPUSDEC_USAGE_ERR();
     if( prepare_output( &dec ) < 0 )
@@ -857,6 +2472,11 @@ int main
         return MP4OPUSDEC_ERR( "failed to finish output movie.\n" );
     REFRESH_CONSOLE;
     eprintf( "Decoding completed!\n" );
+    if( dec.opt.resilient )
+        eprintf( "Concealed %"PRIu64" packets, %"PRIu64" of which were recovered by in-band FEC.\n",
+                 dec.opus.concealed_packets, dec.opus.recovered_packets );
+    report_loudness( &dec );
+    report_stats( &dec );
     cleanup_mp4opusdec( &dec );
     return 0;
 }
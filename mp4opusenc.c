@@ -20,20 +20,100 @@
 
 /* This file is available under an ISC license. */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <strings.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #include <lsmash.h>
 
 #include <opus/opus_multistream.h>
 
+#include "mp4opuscore.h"
+#include "mp4opusidx.h"
+#include "mp4opustrack.h"
+#include "mp4opusseg.h"
+#include "mp4opusring.h"
+#include "mp4opusloud.h"
+
+#define MAX_TRACKS 32   /* maximum number of tracks encoded in a pass */
+
 typedef struct
 {
-    int help;
+    int   help;
+    char *batch;
+    int   jobs;
+    int   stats;
+    char *stats_json;
+    int   fragment;     /* duration of a fragment (ms), 0 for a non-fragmented movie */
+    int   rate;         /* sample rate of raw PCM input, 0 for a movie */
+    int   channels;     /* number of channels of raw PCM input */
+    int   no_faststart;
+    int   remux_buffer; /* buffer size for moov to front (MiB), 0 for the estimation */
+    int   mmap;
+    uint32_t track_IDs[MAX_TRACKS];    /* tracks to be encoded, all LPCM tracks if none */
+    uint32_t num_track_IDs;
+    int   live;         /* interval of fragments (ms) in live mode, 0 otherwise */
+    char *index;        /* sidecar packet index to be written */
+    int   pipeline;     /* depth of the rings between the pipelined stages, 0 for no pipeline */
+    int   loudness;     /* measure the loudness of the input */
+    double normalize;   /* target loudness (LUFS) written into OutputGain, 0 for no normalization */
+    int    segment;         /* write a packet segment instead of a movie */
+    double segment_start;   /* seconds of the input */
+    double segment_end;     /* seconds of the input, 0 for the end of the input */
+    char **segments;        /* packet segments stitched into a movie, NULL unless stitching */
+    uint32_t num_segments;
 } option_t;
 
+#define STAGE_DEMUX    0
+#define STAGE_CODEC    1
+#define STAGE_MUX      2
+#define STAGE_FINALIZE 3
+#define STAGE_COUNT    4
+
+typedef struct
+{
+    double wall;    /* seconds */
+    double cpu;     /* seconds consumed by the whole process */
+} stage_time_t;
+
+typedef struct
+{
+    struct timespec wall;
+    clock_t         cpu;
+} stage_clock_t;
+
+typedef struct
+{
+    stage_time_t stages[STAGE_COUNT];
+    uint64_t     input_packets;
+    uint64_t     input_bytes;
+    uint64_t     output_packets;
+    uint64_t     output_bytes;
+    uint32_t     min_packet_size;
+    uint32_t     max_packet_size;
+    uint64_t     allocations;       /* samples allocated for input and output */
+    uint64_t     finalized_bytes;   /* size of the movie rewritten by moov to front */
+} stats_t;
+
 typedef struct
 {
     lsmash_sample_t *sample;
@@ -54,6 +134,21 @@ typedef struct
     uint32_t         buffer_pos;
     uint32_t         num_summaries;
     uint64_t         num_samples;
+    uint64_t         copied_bytes;      /* bytes copied into the buffer before encoding */
+    uint64_t         inplace_bytes;     /* bytes encoded directly from input packets */
+    /* PCM sample format */
+    uint32_t         sample_bytes;      /* bytes per sample of a channel */
+    mp4opus_convert_t convert;          /* NULL if samples are encoded as 16-bit native integers */
+    mp4opus_resampler_t *resampler;     /* NULL if the sample rate is supported by Opus */
+    /* raw PCM input */
+    FILE            *raw;
+    uint8_t         *raw_buffer;
+    uint32_t         raw_buffer_size;
+    /* memory mapped input */
+    uint32_t         map_sample_number; /* the next sample read from the mapping */
+    /* loudness */
+    mp4opus_loudness_t *loudness;       /* NULL unless the loudness is measured */
+    int              measure_staged;    /* measure the staged samples, otherwise measured ahead of encoding */
 } input_media_t;
 
 typedef struct
@@ -64,7 +159,8 @@ typedef struct
 
 typedef struct
 {
-    input_track_t track;
+    input_track_t tracks[MAX_TRACKS];
+    uint32_t      num_tracks;
 } input_movie_t;
 
 typedef struct
@@ -73,6 +169,8 @@ typedef struct
     lsmash_file_t           *fh;
     lsmash_file_parameters_t param;
     input_movie_t            movie;
+    uint8_t                 *map;       /* memory mapped input shared by the tracks */
+    uint64_t                 map_size;
 } input_file_t;
 
 typedef struct
@@ -83,12 +181,29 @@ typedef struct
 
 typedef struct
 {
-    lsmash_audio_summary_t *summary;
-    uint32_t                sample_entry;
-    uint32_t                priming_samples;
-    uint32_t                preroll_distance;
-    uint32_t                sample_duration;
-    uint64_t                timestamp;
+    double   *arrivals;     /* wall clock when the input of each queued frame was read */
+    uint32_t  num_queued;   /* frames queued in the current fragment */
+    uint32_t  max_queued;   /* hard cap on the queued frames */
+    double    last_read;    /* wall clock when the last input was read */
+    uint64_t *histogram;    /* number of frames per LIVE_LATENCY_RESOLUTION of latency */
+    uint64_t  num_frames;
+    double    max_latency;  /* seconds */
+} live_t;
+
+typedef struct
+{
+    mp4opus_output_media_t  mux;
+    live_t                 *live;               /* NULL unless in live mode */
+    mp4opusidx_entry_t     *index;              /* entries of the sidecar packet index, NULL unless requested */
+    uint64_t                num_index_entries;
+    uint64_t                index_capacity;
+    mp4opus_ring_t         *mux_ring;           /* encoded packets handed over to the mux thread, NULL unless pipelined */
+    int16_t                 output_gain;        /* OutputGain in Q7.8 dB */
+    uint64_t                num_frames;         /* frames passed to the encoder */
+    FILE                   *segment;            /* packet segment written instead of a movie, NULL unless segmented */
+    mp4opusseg_header_t     segment_header;
+    uint64_t                segment_start;      /* first frame of the segment */
+    uint64_t                segment_end;        /* frame following the segment */
 } output_media_t;
 
 typedef struct
@@ -99,7 +214,8 @@ typedef struct
 
 typedef struct
 {
-    output_track_t track;
+    output_track_t tracks[MAX_TRACKS];
+    uint32_t       num_tracks;
 } output_movie_t;
 
 typedef struct
@@ -118,20 +234,62 @@ typedef struct
 
 typedef struct
 {
-    int    application;
-    int    complexity;
-    int    bitrate;
-    int    vbr;
-    int    max_bandwidth;
-    double frame_size;
+    int    threads;
+    int    two_pass;
+    uint64_t target_size;   /* bytes of the output file for two-pass encoding, 0 for the average bitrate */
+    double realtime_budget; /* target speed of the encoder as a multiple of realtime, 0 for a fixed complexity */
 } encoder_option_t;
 
 typedef struct
 {
-    OpusMSEncoder   *msenc;
+    pthread_t         thread;
+    OpusMSEncoder    *msenc;
+    const uint8_t    *pcm;              /* the first frame to be encoded, preceded by pre-roll frames */
+    int               float_input;
+    int               keep_state;       /* continue from the previous chunk instead of the pre-roll frames */
+    int               frame_size;
+    uint32_t          channels;
+    uint32_t          preroll_frames;
+    uint32_t          num_frames;
+    uint8_t          *packet;           /* scratch buffer for a packet */
+    uint32_t          max_packet_size;
+    uint8_t          *data;             /* encoded packets in decoding order */
+    uint32_t          data_size;
+    uint32_t          data_capacity;
+    uint32_t         *packet_sizes;
+    int               ret;
+} encode_chunk_t;
+
+typedef struct
+{
+    uint64_t frame_number;  /* first frame encoded at the complexity */
+    int      complexity;
+} complexity_change_t;
+
+typedef struct
+{
+    double               frame_duration;    /* seconds */
+    uint32_t             segment_frames;    /* frames per adjustment */
+    uint32_t             frames;            /* frames encoded in the current segment */
+    double               elapsed;           /* seconds spent in the encoder in the current segment */
+    uint32_t             fast_segments;     /* consecutive segments fast enough to step up */
+    int                  complexity;
+    uint64_t             num_frames;
+    complexity_change_t *changes;           /* history of the complexity */
+    uint32_t             num_changes;
+    uint32_t             changes_capacity;
+} budget_t;
+
+typedef struct
+{
+    mp4opus_track_encoder_t codec;  /* the encoder of the first chunk in parallel encoding */
     encoder_option_t opt;
-    int              stream_count;
-    int              frame_size;
+    stats_t         *stats;     /* NULL unless statistics are requested */
+    budget_t        *budget;    /* NULL unless the complexity is adapted to the realtime budget */
+    /* parallel encoding */
+    encode_chunk_t  *chunks;
+    uint8_t         *window;
+    uint64_t         window_size;
 } encoder_t;
 
 typedef struct
@@ -139,30 +297,110 @@ typedef struct
     option_t  opt;
     input_t   input;
     output_t  output;
-    encoder_t opus;
+    encoder_t opus[MAX_TRACKS]; /* per output track, options are given to the first one */
+    stats_t   stats;
 } mp4opusenc_t;
 
+typedef struct
+{
+    input_packet_t packet;
+    int            status;      /* 0: packet, 1: end of stream, -1: error */
+} demux_item_t;
+
+typedef struct
+{
+    lsmash_sample_t *sample;    /* NULL at the end of stream */
+} mux_item_t;
+
+typedef struct
+{
+    input_t        *input;
+    input_track_t  *in_track;
+    lsmash_root_t  *out_root;
+    output_track_t *out_track;
+    stats_t        *stats;
+    mp4opus_ring_t  demux_ring; /* demux thread -> codec thread */
+    mp4opus_ring_t  mux_ring;   /* codec thread -> mux thread */
+    pthread_t       demux_thread;
+    pthread_t       mux_thread;
+    int             mux_ret;
+} pipeline_t;
+
+typedef struct
+{
+    char *input;
+    char *output;
+} batch_entry_t;
+
+typedef struct
+{
+    batch_entry_t  *entries;
+    uint32_t        num_entries;
+    uint32_t        next_entry;
+    uint32_t        num_failures;
+    pthread_mutex_t mutex;
+} batch_t;
+
+typedef struct
+{
+    pthread_t    thread;
+    batch_t     *batch;
+    mp4opusenc_t enc;
+} batch_worker_t;
+
 #define MP4OPUSENC_MIN( a, b ) (((a) < (b)) ? (a) : (b))
+#define MP4OPUSENC_MAX( a, b ) (((a) > (b)) ? (a) : (b))
 #define eprintf( ... ) fprintf( stderr, __VA_ARGS__ )
 #define ERROR_MSG( ... ) error_message( __VA_ARGS__ )
 #define WARNING_MSG( ... ) warning_message( __VA_ARGS__ )
 #define MP4OPUSENC_ERR( ... ) mp4opusenc_error( &enc, __VA_ARGS__ )
 #define MP4OPUSENC_USAGE_ERR() mp4opusenc_usage_error();
+#define BUDGET_SEGMENT_DURATION 1000    /* duration of the audio per adjustment of the complexity (ms) */
+#define BUDGET_HYSTERESIS       1.25    /* margin over the target speed to step up the complexity */
+#define BUDGET_UP_SEGMENTS      3       /* consecutive segments over the margin to step up the complexity */
+
 #define REFRESH_CONSOLE eprintf( "                                                                               \r" )
 
+#define CHUNK_DURATION 5000     /* duration of a chunk in parallel encoding (ms) */
+#define MAP_READ_SIZE  (1 << 20) /* maximum size of contiguous samples read from the mapping at a time */
+
+#define LIVE_MAX_INTERVAL        1000   /* maximum interval of fragments in live mode (ms) */
+#define LIVE_LATENCY_RESOLUTION  0.0001 /* seconds per bin of the latency histogram */
+#define LIVE_LATENCY_BINS        100000
+
+#define TWO_PASS_CACHE_FRAMES    1024   /* frames by which the input cache grows in two-pass encoding */
+#define TWO_PASS_FILE_OVERHEAD   4096   /* estimated bytes of the boxes other than the sample table */
+#define TWO_PASS_SAMPLE_OVERHEAD 8      /* estimated bytes of the sample table per sample */
+
 static void cleanup_input_movie
 (
     input_t *input
 )
 {
-    input_media_t *in_media = &input->file.movie.track.media;
-    if( in_media->summaries )
+    for( uint32_t i = 0; i < input->file.movie.num_tracks; i++ )
     {
-        for( uint32_t i = 0; i < in_media->num_summaries; i++ )
-            lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[i].summary );
-        lsmash_free( in_media->summaries );
+        input_media_t *in_media = &input->file.movie.tracks[i].media;
+        if( in_media->summaries )
+        {
+            for( uint32_t j = 0; j < in_media->num_summaries; j++ )
+                lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[j].summary );
+            lsmash_free( in_media->summaries );
+        }
+        lsmash_free( in_media->buffer );
+        mp4opus_destroy_resampler( in_media->resampler );
+        if( in_media->raw && in_media->raw != stdin )
+            fclose( in_media->raw );
+        lsmash_free( in_media->raw_buffer );
+        if( in_media->loudness )
+        {
+            mp4opus_loudness_cleanup( in_media->loudness );
+            lsmash_free( in_media->loudness );
+        }
     }
-    lsmash_free( in_media->buffer );
+#ifndef _WIN32
+    if( input->file.map )
+        munmap( input->file.map, input->file.map_size );
+#endif
     lsmash_close_file( &input->file.param );
     lsmash_destroy_root( input->root );
     input->root = NULL;
@@ -173,12 +411,57 @@ static void cleanup_output_movie
     output_t *output
 )
 {
-    lsmash_cleanup_summary( (lsmash_summary_t *)output->file.movie.track.media.summary );
+    for( uint32_t i = 0; i < output->file.movie.num_tracks; i++ )
+    {
+        mp4opus_cleanup_output_media( &output->file.movie.tracks[i].media.mux );
+        lsmash_free( output->file.movie.tracks[i].media.index );
+        if( output->file.movie.tracks[i].media.segment )
+            fclose( output->file.movie.tracks[i].media.segment );
+        live_t *live = output->file.movie.tracks[i].media.live;
+        if( live )
+        {
+            lsmash_free( live->arrivals );
+            lsmash_free( live->histogram );
+            lsmash_free( live );
+        }
+    }
     lsmash_close_file( &output->file.param );
     lsmash_destroy_root( output->root );
     output->root = NULL;
 }
 
+static void cleanup_encoder
+(
+    encoder_t *opus
+)
+{
+    mp4opus_cleanup_encoder( &opus->codec );
+    if( opus->chunks )
+    {
+        /* The first chunk shares the encoder for the serial encoding. */
+        for( int i = 0; i < opus->opt.threads; i++ )
+        {
+            encode_chunk_t *chunk = &opus->chunks[i];
+            if( i )
+                opus_multistream_encoder_destroy( chunk->msenc );
+            lsmash_free( chunk->packet );
+            lsmash_free( chunk->data );
+            lsmash_free( chunk->packet_sizes );
+        }
+        lsmash_free( opus->chunks );
+        opus->chunks = NULL;
+    }
+    lsmash_free( opus->window );
+    opus->window      = NULL;
+    opus->window_size = 0;
+    if( opus->budget )
+    {
+        lsmash_free( opus->budget->changes );
+        lsmash_free( opus->budget );
+        opus->budget = NULL;
+    }
+}
+
 static void cleanup_mp4opusenc
 (
     mp4opusenc_t *enc
@@ -186,7 +469,8 @@ static void cleanup_mp4opusenc
 {
     cleanup_input_movie( &enc->input );
     cleanup_output_movie( &enc->output );
-    opus_multistream_encoder_destroy( enc->opus.msenc );
+    for( int i = 0; i < MAX_TRACKS; i++ )
+        cleanup_encoder( &enc->opus[i] );
 }
 
 static int mp4opusenc_error
@@ -236,14 +520,121 @@ static int warning_message
     return -1;
 }
 
+static void start_stage_clock
+(
+    stats_t       *stats,
+    stage_clock_t *clk
+)
+{
+    if( !stats )
+        return;
+    clock_gettime( CLOCK_MONOTONIC, &clk->wall );
+    clk->cpu = clock();
+}
+
+static void stop_stage_clock
+(
+    stats_t       *stats,
+    stage_clock_t *clk,
+    int            stage
+)
+{
+    if( !stats )
+        return;
+    struct timespec wall;
+    clock_gettime( CLOCK_MONOTONIC, &wall );
+    stats->stages[stage].wall += (wall.tv_sec - clk->wall.tv_sec) + (wall.tv_nsec - clk->wall.tv_nsec) * 1e-9;
+    stats->stages[stage].cpu  += (double)(clock() - clk->cpu) / CLOCKS_PER_SEC;
+}
+
+static void count_input_packet
+(
+    stats_t        *stats,
+    input_packet_t *packet
+)
+{
+    if( !stats || !packet->data )
+        return;
+    ++stats->input_packets;
+    if( packet->sample )
+        ++stats->allocations;
+    stats->input_bytes += packet->size;
+}
+
+static void count_output_packet
+(
+    stats_t *stats,
+    uint32_t size
+)
+{
+    if( !stats )
+        return;
+    if( stats->output_packets == 0 || size < stats->min_packet_size )
+        stats->min_packet_size = size;
+    if( size > stats->max_packet_size )
+        stats->max_packet_size = size;
+    ++stats->output_packets;
+    ++stats->allocations;
+    stats->output_bytes += size;
+}
+
 static void display_help( void )
 {
     eprintf
     (
         "\n"
         "Usage: mp4opusenc [options] -i input -o output\n"
+        "       mp4opusenc [options] --batch manifest\n"
+        "       mp4opusenc [options] -o output --stitch segment...\n"
+        "'-' as input or output means stdin or stdout respectively.\n"
+        "A movie written into stdout is always fragmented.\n"
         "Options:\n"
         "    --help                    Display help\n"
+        "    --mmap                    Read LPCM samples from the memory mapped input file\n"
+        "                                instead of copying them through the file I/O\n"
+        "                                Fall back to the file I/O if mapping fails.\n"
+        "    --rate <integer>          Read the input as raw interleaved 16-bit little\n"
+        "                                endian PCM of the sample rate\n"
+        "                                the range is from 1000 to 768000 inclusive\n"
+        "                                Sample rates other than 8000, 12000, 16000, 24000\n"
+        "                                and 48000 are resampled into 48000, which requires\n"
+        "                                a common divisor of 48 or more with 48000,\n"
+        "                                e.g. 11025, 22050, 44100, 88200 and 96000.\n"
+        "    --channels <integer>      Specify the number of channels of raw PCM input\n"
+        "                                the range is from 1 to 255 inclusive\n"
+        "    --batch <string>          Encode the list of files in the manifest\n"
+        "                                Each line consists of input and output file names\n"
+        "                                separated by a tab. Blank lines and lines beginning\n"
+        "                                with '#' are ignored. A result line is written to\n"
+        "                                stdout per file.\n"
+        "    --jobs <integer>          Specify the number of files encoded concurrently\n"
+        "                                in batch mode\n"
+        "                                the default value is 1\n"
+        "    --stats                   Display time spent in each stage and counters\n"
+        "                                at exit\n"
+        "    --stats-json <string>     Write the statistics into the file in JSON\n"
+        "    --index <string>          Write a sidecar index of the file offset, size,\n"
+        "                                timestamp and pre-roll distance of every packet\n"
+        "                                for seeking without parsing the movie header\n"
+        "                                The index can be given to mp4opusdec --index.\n"
+        "    --live <integer>          Encode raw PCM input from a pipe or a socket with low\n"
+        "                                latency, writing a fragment at the interval in ms\n"
+        "                                Input is read a frame at a time, the restricted\n"
+        "                                low-delay mode is used, and the frame size has to\n"
+        "                                be 20ms or less. No more than the interval of\n"
+        "                                samples is queued before written. Percentiles of\n"
+        "                                the latency per frame are displayed at exit.\n"
+        "    --fragment <integer>      Write a fragmented movie with the fragment duration\n"
+        "                                in milliseconds\n"
+        "                                Fragments are written while encoding and the\n"
+        "                                movie header is placed at the beginning without\n"
+        "                                any remux at the end.\n"
+        "    --no-faststart            Leave the movie header at the end of the file\n"
+        "                                and skip the remux for progressive download\n"
+        "    --remux-buffer <integer>  Specify the buffer size in MiB for the remux which\n"
+        "                                moves the movie header to the beginning\n"
+        "                                the default is estimated from the number of\n"
+        "                                samples and at least 4\n"
         "    --application <integer>   Specify intended application\n"
         "                                0: Improved speech intelligibility\n"
         "                                1: Faithfulness (default)\n"
@@ -251,12 +642,51 @@ static void display_help( void )
         "    --complexity <integer>    Specify encoding complexity\n"
         "                                the range is from 0 to 10 inclusive\n"
         "                                the default value is 10 (slowest)\n"
+        "    --realtime-budget <float> Adapt the complexity per second of audio so that\n"
+        "                                the encoder runs at the multiple of realtime\n"
+        "                                The complexity is lowered below the target speed\n"
+        "                                and raised up to --complexity after a few seconds\n"
+        "                                well above it. The complexity chosen over time is\n"
+        "                                displayed at exit. Ignored for parallel encoding.\n"
         "    --bitrate <integer>       Specify bitrate (bits/second)\n"
         "                                6000-256000 per channel are meaningful\n"
         "    --vbr <integer>           Specify VBR mode\n"
         "                                0: Hard CBR\n"
         "                                1: Unconstrained VBR (default)\n"
         "                                2: Constrained VBR\n"
+        "    --two-pass                Encode in two passes to hit the average of --bitrate\n"
+        "                                The first pass analyzes the input at the lowest\n"
+        "                                complexity and the second pass assigns a bitrate\n"
+        "                                to each frame. VBR is constrained in the second\n"
+        "                                pass. The input is cached in memory.\n"
+        "    --target-size <integer>   Encode in two passes to hit the output file size\n"
+        "                                in KiB instead of the average bitrate\n"
+        "    --fec                     Add in-band FEC for the previous packet into each packet\n"
+        "                                FEC is carried by the SILK and hybrid modes only,\n"
+        "                                so it is never added in restricted low-delay mode.\n"
+        "    --expected-loss <integer> Specify the expected packet loss rate in percent\n"
+        "                                the range is from 0 to 100 inclusive\n"
+        "                                the default value is 0\n"
+        "                                The more loss is expected, the more bits are spent\n"
+        "                                on FEC and the less on prediction.\n"
+        "    --dtx                     Enable discontinuous transmission\n"
+        "                                Silence is coded into tiny packets of the same\n"
+        "                                duration, which are concealed by the decoder.\n"
+        "    --signal <string>         Specify the type of the signal\n"
+        "                                auto  : detected by the encoder (default)\n"
+        "                                voice : speech\n"
+        "                                music : music\n"
+        "    --mapping-family <string> Specify the channel mapping family\n"
+        "                                auto : 0 up to 2 channels, 1 up to 8 channels\n"
+        "                                       and 255 for more (default)\n"
+        "                                0    : mono or stereo\n"
+        "                                1    : Vorbis channel order up to 8 channels\n"
+        "                                2    : ambisonics in ACN order with SN3D\n"
+        "                                       normalization, optionally followed by\n"
+        "                                       a non-diegetic stereo pair\n"
+        "                                255  : discrete channels without any layout\n"
+        "                                The family 3 is not supported since the demixing\n"
+        "                                matrix has no place in OpusSpecificBox.\n"
         "    --cutoff <integer>        Specify the maximum bandpass\n"
         "                                0:  4 kHz passband\n"
         "                                1:  6 kHz passband\n"
@@ -266,6 +696,48 @@ static void display_help( void )
         "    --framesize <float>       Specify frame size in milliseconds\n"
         "                                2.5, 5, 10, 20, 40 and 60 are available\n"
         "                                the default value is 20\n"
+        "    --threads <integer>       Specify the number of encoding threads\n"
+        "                                the default value is 1 (no parallel encoding)\n"
+        "                                Each chunk other than the first is primed with\n"
+        "                                its pre-roll audio, so the output is not always\n"
+        "                                bit-identical to the single threaded one.\n"
+        "                                Ignored for multiple tracks.\n"
+        "    --pipeline <integer>      Read ahead and write behind the encoding on their own\n"
+        "                                threads with the depth of the packet queues\n"
+        "                                the range is from 1 to 65536 inclusive\n"
+        "                                Ignored for parallel and live encoding.\n"
+        "    --tracks <list>           Specify the comma separated track_IDs to encode\n"
+        "                                the default is all LPCM tracks\n"
+        "                                Every track is encoded on its own thread and\n"
+        "                                muxed into the output in a single pass.\n"
+        "    --loudness                Measure the integrated loudness, the loudness range\n"
+        "                                and the true peak of the input based on\n"
+        "                                ITU-R BS.1770 and EBU R128 while encoding\n"
+        "                                The result is reported per track at exit, or\n"
+        "                                appended to the result line of the first track\n"
+        "                                in batch mode.\n"
+        "    --normalize <float>       Write the gain from the integrated loudness of the\n"
+        "                                input to the target loudness in LUFS into the\n"
+        "                                OutputGain of the decoder configuration\n"
+        "                                the range is from -70 to 0 exclusive\n"
+        "                                The input is read through once ahead of encoding,\n"
+        "                                so it has to be seekable. The samples themselves\n"
+        "                                are encoded as they are. Implies --loudness.\n"
+        "    --segment <start>:<end>   Encode the range of the input in seconds into a packet\n"
+        "                                segment instead of a movie\n"
+        "                                The end may be omitted for the end of the input,\n"
+        "                                and an end at or after the end of the input makes\n"
+        "                                the last segment as well.\n"
+        "                                Each boundary is rounded down to a frame, and the\n"
+        "                                encoder is primed with the pre-roll audio before\n"
+        "                                the start as the parallel encoding does. The input\n"
+        "                                is still read from the beginning. The same segment\n"
+        "                                is written byte for byte with the same options.\n"
+        "                                The threads and the pipeline are ignored.\n"
+        "    --stitch                  Concatenate the packet segments following the\n"
+        "                                options into a movie in the order of the stream\n"
+        "                                No input is encoded. The segments have to cover\n"
+        "                                the stream from the beginning to the end.\n"
     );
 }
 
@@ -280,12 +752,9 @@ static void default_options
     mp4opusenc_t *enc
 )
 {
-    enc->opus.opt.application   = OPUS_APPLICATION_AUDIO;
-    enc->opus.opt.complexity    = 10;
-    enc->opus.opt.bitrate       = OPUS_AUTO;
-    enc->opus.opt.vbr           = 1;
-    enc->opus.opt.max_bandwidth = OPUS_BANDWIDTH_FULLBAND;
-    enc->opus.opt.frame_size    = 20;
+    enc->opt.jobs               = 1;
+    enc->opus[0].opt.threads    = 1;
+    mp4opus_default_encoder_option( &enc->opus[0].codec.opt );
 }
 
 static int parse_options
@@ -302,7 +771,7 @@ static int parse_options
         enc->opt.help = 1;
         return 0;
     }
-    else if( argc < 5 )
+    else if( argc < 3 )
         return -1;
     default_options( enc );
     uint32_t i = 1;
@@ -319,13 +788,127 @@ static int parse_options
             CHECK_NEXT_ARG;
             enc->output.file.name = argv[i];
         }
+        else if( !strcasecmp( argv[i], "--batch" ) )
+        {
+            CHECK_NEXT_ARG;
+            enc->opt.batch = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--jobs" ) )
+        {
+            CHECK_NEXT_ARG;
+            int jobs = atoi( argv[i] );
+            if( jobs < 1 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.jobs = jobs;
+        }
+        else if( !strcasecmp( argv[i], "--stats" ) )
+            enc->opt.stats = 1;
+        else if( !strcasecmp( argv[i], "--stats-json" ) )
+        {
+            CHECK_NEXT_ARG;
+            enc->opt.stats_json = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--pipeline" ) )
+        {
+            CHECK_NEXT_ARG;
+            int pipeline = atoi( argv[i] );
+            if( pipeline < 1 || pipeline > 65536 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.pipeline = pipeline;
+        }
+        else if( !strcasecmp( argv[i], "--index" ) )
+        {
+            CHECK_NEXT_ARG;
+            enc->opt.index = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--loudness" ) )
+            enc->opt.loudness = 1;
+        else if( !strcasecmp( argv[i], "--normalize" ) )
+        {
+            CHECK_NEXT_ARG;
+            char  *end;
+            double normalize = strtod( argv[i], &end );
+            if( end == argv[i] || *end != '\0' || normalize <= MP4OPUSLOUD_MIN_LOUDNESS || normalize >= 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.normalize = normalize;
+            enc->opt.loudness  = 1;
+        }
+        else if( !strcasecmp( argv[i], "--segment" ) )
+        {
+            CHECK_NEXT_ARG;
+            char  *end;
+            double start = strtod( argv[i], &end );
+            if( end == argv[i] || *end != ':' || start < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            char  *stop_string = end + 1;
+            double stop        = *stop_string ? strtod( stop_string, &end ) : 0;
+            if( *stop_string && (*end != '\0' || stop <= start) )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.segment       = 1;
+            enc->opt.segment_start = start;
+            enc->opt.segment_end   = stop;
+        }
+        else if( !strcasecmp( argv[i], "--stitch" ) )
+        {
+            /* The segments are the rest of the arguments. */
+            enc->opt.segments     = argv + i + 1;
+            enc->opt.num_segments = argc - i - 1;
+            break;
+        }
+        else if( !strcasecmp( argv[i], "--mmap" ) )
+            enc->opt.mmap = 1;
+        else if( !strcasecmp( argv[i], "--no-faststart" ) )
+            enc->opt.no_faststart = 1;
+        else if( !strcasecmp( argv[i], "--remux-buffer" ) )
+        {
+            CHECK_NEXT_ARG;
+            int remux_buffer = atoi( argv[i] );
+            if( remux_buffer < 1 || remux_buffer > 4096 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.remux_buffer = remux_buffer;
+        }
+        else if( !strcasecmp( argv[i], "--rate" ) )
+        {
+            CHECK_NEXT_ARG;
+            int rate = atoi( argv[i] );
+            if( rate < 1000 || rate > 768000 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            if( mp4opus_get_resampler_phases( rate, 48000 ) > MP4OPUS_RESAMPLER_MAX_PHASES )
+                return ERROR_MSG( "%d Hz cannot be resampled into 48000 Hz, since the sample rate has to share"
+                                  " a common divisor of 48 or more with 48000.\n", rate );
+            enc->opt.rate = rate;
+        }
+        else if( !strcasecmp( argv[i], "--channels" ) )
+        {
+            CHECK_NEXT_ARG;
+            int channels = atoi( argv[i] );
+            if( channels < 1 || channels > 255 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.channels = channels;
+        }
+        else if( !strcasecmp( argv[i], "--fragment" ) )
+        {
+            CHECK_NEXT_ARG;
+            int fragment = atoi( argv[i] );
+            if( fragment < 1 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.fragment = fragment;
+        }
+        else if( !strcasecmp( argv[i], "--live" ) )
+        {
+            CHECK_NEXT_ARG;
+            int live = atoi( argv[i] );
+            if( live < 1 || live > LIVE_MAX_INTERVAL )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opt.live = live;
+        }
         else if( !strcasecmp( argv[i], "--application" ) )
         {
             CHECK_NEXT_ARG;
             int index = atoi( argv[i] );
             if( index < 0 || index > 2 )
                 return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
-            enc->opus.opt.application =
+            enc->opus[0].codec.opt.application =
                 (int [])
                 {
                     OPUS_APPLICATION_VOIP,
@@ -339,12 +922,12 @@ static int parse_options
             int complexity = atoi( argv[i] );
             if( complexity < 0 || complexity > 10 )
                 return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
-            enc->opus.opt.complexity = complexity;
+            enc->opus[0].codec.opt.complexity = complexity;
         }
         else if( !strcasecmp( argv[i], "--bitrate" ) )
         {
             CHECK_NEXT_ARG;
-            enc->opus.opt.bitrate = atoi( argv[i] );
+            enc->opus[0].codec.opt.bitrate = atoi( argv[i] );
         }
         else if( !strcasecmp( argv[i], "--vbr" ) )
         {
@@ -352,7 +935,66 @@ static int parse_options
             int vbr = atoi( argv[i] );
             if( vbr < 0 || vbr > 2 )
                 return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
-            enc->opus.opt.vbr = vbr;
+            enc->opus[0].codec.opt.vbr = vbr;
+        }
+        else if( !strcasecmp( argv[i], "--two-pass" ) )
+            enc->opus[0].opt.two_pass = 1;
+        else if( !strcasecmp( argv[i], "--target-size" ) )
+        {
+            CHECK_NEXT_ARG;
+            int target_size = atoi( argv[i] );
+            if( target_size < 1 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opus[0].opt.two_pass    = 1;
+            enc->opus[0].opt.target_size = (uint64_t)target_size * 1024;
+        }
+        else if( !strcasecmp( argv[i], "--realtime-budget" ) )
+        {
+            CHECK_NEXT_ARG;
+            char  *end;
+            double realtime_budget = strtod( argv[i], &end );
+            if( *end != '\0' || realtime_budget <= 0 || realtime_budget > 1000 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opus[0].opt.realtime_budget = realtime_budget;
+        }
+        else if( !strcasecmp( argv[i], "--fec" ) )
+            enc->opus[0].codec.opt.fec = 1;
+        else if( !strcasecmp( argv[i], "--expected-loss" ) )
+        {
+            CHECK_NEXT_ARG;
+            char *end;
+            long  expected_loss = strtol( argv[i], &end, 10 );
+            if( *end != '\0' || expected_loss < 0 || expected_loss > 100 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opus[0].codec.opt.expected_loss = expected_loss;
+        }
+        else if( !strcasecmp( argv[i], "--dtx" ) )
+            enc->opus[0].codec.opt.dtx = 1;
+        else if( !strcasecmp( argv[i], "--signal" ) )
+        {
+            CHECK_NEXT_ARG;
+            if( !strcasecmp( argv[i], "voice" ) )
+                enc->opus[0].codec.opt.signal = OPUS_SIGNAL_VOICE;
+            else if( !strcasecmp( argv[i], "music" ) )
+                enc->opus[0].codec.opt.signal = OPUS_SIGNAL_MUSIC;
+            else if( !strcasecmp( argv[i], "auto" ) )
+                enc->opus[0].codec.opt.signal = OPUS_AUTO;
+            else
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--mapping-family" ) )
+        {
+            CHECK_NEXT_ARG;
+            char *end;
+            long family = strtol( argv[i], &end, 10 );
+            if( !strcasecmp( argv[i], "auto" ) )
+                enc->opus[0].codec.opt.mapping_family = -1;
+            else if( *end == '\0' && family == 3 )
+                return ERROR_MSG( "the channel mapping family 3 is not supported since OpusSpecificBox cannot store the demixing matrix.\n" );
+            else if( *end == '\0' && (family == 0 || family == 1 || family == 2 || family == 255) )
+                enc->opus[0].codec.opt.mapping_family = family;
+            else
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
         }
         else if( !strcasecmp( argv[i], "--cutoff" ) )
         {
@@ -360,7 +1002,7 @@ static int parse_options
             int index = atoi( argv[i] );
             if( index < 0 || index > 5 )
                 return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
-            enc->opus.opt.max_bandwidth =
+            enc->opus[0].codec.opt.max_bandwidth =
                 (int [])
                 {
                     OPUS_BANDWIDTH_NARROWBAND,
@@ -374,29 +1016,267 @@ static int parse_options
         {
             CHECK_NEXT_ARG;
             double frame_size = atof( argv[i] );
-            if( frame_size != 2.5 && frame_size != 5
-             && frame_size != 10  && frame_size != 20
-             && frame_size != 40  && frame_size != 60 )
+            if( !mp4opus_is_valid_frame_size( frame_size ) )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+            enc->opus[0].codec.opt.frame_size = frame_size;
+        }
+        else if( !strcasecmp( argv[i], "--threads" ) )
+        {
+            CHECK_NEXT_ARG;
+            int threads = atoi( argv[i] );
+            if( threads < 1 )
                 return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
-            enc->opus.opt.frame_size = frame_size;
+            enc->opus[0].opt.threads = threads;
+        }
+        else if( !strcasecmp( argv[i], "--tracks" ) )
+        {
+            CHECK_NEXT_ARG;
+            char *list = argv[i];
+            enc->opt.num_track_IDs = 0;
+            do
+            {
+                char *end;
+                long track_ID = strtol( list, &end, 10 );
+                if( end == list || track_ID < 1 || track_ID > UINT32_MAX
+                 || (*end != '\0' && *end != ',') || enc->opt.num_track_IDs == MAX_TRACKS )
+                    return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+                for( uint32_t j = 0; j < enc->opt.num_track_IDs; j++ )
+                    if( enc->opt.track_IDs[j] == track_ID )
+                        return ERROR_MSG( "duplicate track ID %ld in --tracks.\n", track_ID );
+                enc->opt.track_IDs[ enc->opt.num_track_IDs++ ] = track_ID;
+                list = *end ? end + 1 : end;
+            } while( *list );
         }
 #undef CHECK_NEXT_ARG
         else
             return ERROR_MSG( "you specified invalid option: %s.\n", argv[i] );
         ++i;
     }
+    if( !enc->opt.rate != !enc->opt.channels )
+        return ERROR_MSG( "both of --rate and --channels are required for raw PCM input.\n" );
+    if( enc->opt.rate && enc->opt.num_track_IDs )
+        return ERROR_MSG( "raw PCM input has no tracks to be selected.\n" );
+    if( enc->opus[0].opt.two_pass && !enc->opus[0].opt.target_size && enc->opus[0].codec.opt.bitrate == OPUS_AUTO )
+        return ERROR_MSG( "two-pass encoding requires --bitrate or --target-size.\n" );
+    if( enc->opus[0].opt.realtime_budget && enc->opus[0].opt.threads > 1 )
+        WARNING_MSG( "the realtime budget is ignored for parallel encoding.\n" );
+    if( enc->opus[0].codec.opt.fec && enc->opus[0].codec.opt.expected_loss == 0 )
+        WARNING_MSG( "in-band FEC takes no effect without --expected-loss.\n" );
+    if( enc->opt.segment || enc->opt.segments )
+    {
+        if( enc->opt.segment && enc->opt.segments )
+            return ERROR_MSG( "--segment and --stitch are exclusive.\n" );
+        if( enc->opt.batch || enc->opt.live || enc->opt.fragment || enc->opt.index )
+            return ERROR_MSG( "--segment and --stitch are not available with --batch, --live, --fragment and --index.\n" );
+        if( !enc->output.file.name || !strcmp( enc->output.file.name, "-" ) )
+            return ERROR_MSG( "--segment and --stitch require a seekable output file.\n" );
+    }
+    if( enc->opt.segments )
+    {
+        if( enc->opt.num_segments == 0 )
+            return ERROR_MSG( "no segments to be stitched are specified.\n" );
+        return 0;
+    }
+    if( enc->opt.segment )
+    {
+        /* Only the options determine the encoded packets, so nothing depends on the timing or the threads. */
+        if( enc->opus[0].opt.two_pass || enc->opus[0].opt.realtime_budget )
+            return ERROR_MSG( "two-pass encoding and the realtime budget are not available for a segment.\n" );
+        if( enc->opus[0].opt.threads > 1 || enc->opt.pipeline )
+            WARNING_MSG( "the threads and the pipeline are ignored for a segment.\n" );
+        enc->opus[0].opt.threads = 1;
+        enc->opt.pipeline        = 0;
+    }
+    if( enc->opt.batch )
+    {
+        if( enc->input.file.name || enc->output.file.name )
+            return ERROR_MSG( "input and output file names are given by the manifest in batch mode.\n" );
+        if( enc->opt.stats || enc->opt.stats_json )
+            return ERROR_MSG( "statistics are not available in batch mode.\n" );
+        if( enc->opt.index )
+            return ERROR_MSG( "the packet index is not available in batch mode.\n" );
+        return 0;
+    }
     if( !enc->input.file.name )
         return ERROR_MSG( "input file name is not specified.\n" );
     if( !enc->output.file.name )
         return ERROR_MSG( "output file name is not specified.\n" );
+    if( enc->opt.live )
+    {
+        if( !enc->opt.rate )
+            return ERROR_MSG( "live mode requires raw PCM input.\n" );
+        if( enc->opus[0].codec.opt.frame_size > 20 )
+            return ERROR_MSG( "live mode requires the frame size of 20ms or less.\n" );
+        if( enc->opus[0].opt.two_pass )
+            return ERROR_MSG( "two-pass encoding is not available in live mode.\n" );
+        if( enc->opt.normalize )
+            return ERROR_MSG( "the normalization is not available in live mode.\n" );
+        if( enc->opt.live < enc->opus[0].codec.opt.frame_size )
+            return ERROR_MSG( "the interval of fragments is shorter than the frame size.\n" );
+        enc->opus[0].codec.opt.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+        enc->opt.fragment            = enc->opt.live;
+    }
+    if( !strcmp( enc->output.file.name, "-" ) && enc->opt.index )
+        return ERROR_MSG( "the packet index is not available for stdout.\n" );
+    if( !strcmp( enc->output.file.name, "-" ) && !enc->opt.fragment )
+        enc->opt.fragment = 1000;   /* stdout is not seekable. */
+    return 0;
+}
+
+static int setup_input_format
+(
+    lsmash_audio_summary_t *summary,
+    input_media_t          *in_media
+)
+{
+    /* Without format specific flags, LPCM is assumed to be little endian signed integer. */
+    lsmash_qt_audio_format_specific_flag format_flags = QT_AUDIO_FORMAT_FLAG_SIGNED_INTEGER;
+    uint32_t cs_count = lsmash_count_codec_specific_data( (lsmash_summary_t *)summary );
+    for( uint32_t i = 0; i < cs_count; i++ )
+    {
+        lsmash_codec_specific_t *cs = lsmash_get_codec_specific_data( (lsmash_summary_t *)summary, i + 1 );
+        if( !cs || cs->type != LSMASH_CODEC_SPECIFIC_DATA_TYPE_QT_AUDIO_FORMAT_SPECIFIC_FLAGS )
+            continue;
+        lsmash_codec_specific_t *conv = lsmash_convert_codec_specific_format( cs, LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+        if( !conv )
+            return -1;
+        format_flags = ((lsmash_qt_audio_format_specific_flags_t *)conv->data.structured)->format_flags;
+        lsmash_destroy_codec_specific_data( conv );
+        break;
+    }
+    if( format_flags & QT_AUDIO_FORMAT_FLAG_NON_INTERLEAVED )
+        return -1;
+    uint32_t sample_bytes = summary->sample_size / 8;
+    if( summary->sample_size % 8 || summary->bytes_per_frame != summary->channels * sample_bytes )
+        return -1;  /* not packed */
+    if( !(format_flags & (QT_AUDIO_FORMAT_FLAG_FLOAT | QT_AUDIO_FORMAT_FLAG_SIGNED_INTEGER))
+     || mp4opus_get_pcm_converter( !!(format_flags & QT_AUDIO_FORMAT_FLAG_FLOAT),
+                                   !!(format_flags & QT_AUDIO_FORMAT_FLAG_BIG_ENDIAN),
+                                   summary->sample_size,
+                                   &in_media->convert ) < 0 )
+        return -1;
+    in_media->sample_bytes = sample_bytes;
+    return 0;
+}
+
+static int open_raw_input_file
+(
+    mp4opusenc_t *enc
+)
+{
+    input_t       *input    = &enc->input;
+    input_media_t *in_media = &input->file.movie.tracks[0].media;
+    input->file.movie.num_tracks = 1;
+    if( !strcmp( input->file.name, "-" ) )
+    {
+#ifdef _WIN32
+        _setmode( _fileno( stdin ), _O_BINARY );
+#endif
+        in_media->raw = stdin;
+    }
+    else
+        in_media->raw = fopen( input->file.name, "rb" );
+    if( !in_media->raw )
+        return ERROR_MSG( "failed to open input file.\n" );
+    /* Describe the raw PCM as LPCM in a movie. */
+    in_media->num_summaries = 1;
+    in_media->summaries = lsmash_malloc_zero( sizeof(input_summary_t) );
+    if( !in_media->summaries )
+        return ERROR_MSG( "failed to alloc input summaries.\n" );
+    lsmash_audio_summary_t *summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
+    if( !summary )
+        return ERROR_MSG( "failed to allocate summary for input.\n" );
+    in_media->summaries[0].summary = summary;
+    summary->sample_type     = QT_CODEC_TYPE_LPCM_AUDIO;
+    summary->frequency       = enc->opt.rate;
+    summary->channels        = enc->opt.channels;
+    summary->sample_size     = 16;
+    summary->bytes_per_frame = enc->opt.channels * 2;
+    in_media->sample_bytes   = 2;
+    double   frame_size  = enc->opus[0].codec.opt.frame_size;
+    uint32_t frame_bytes = MP4OPUSENC_MAX( (uint32_t)(enc->opt.rate * frame_size / 1000), 1 ) * summary->bytes_per_frame;
+    if( enc->opt.live )
+    {
+        /* Read a frame at a time with no buffering on the stream not to hold samples. */
+        setvbuf( in_media->raw, NULL, _IONBF, 0 );
+        in_media->raw_buffer_size = frame_bytes;
+    }
+    else
+        /* Read whole frames of about 100ms at a time so that every read starts at a frame boundary
+         * and its frames are encoded in place without staging. */
+        in_media->raw_buffer_size = MP4OPUSENC_MAX( (uint32_t)(100 / frame_size), 1 ) * frame_bytes;
+    in_media->raw_buffer      = lsmash_malloc( in_media->raw_buffer_size );
+    if( !in_media->raw_buffer )
+        return ERROR_MSG( "failed to allocate buffer for raw PCM input.\n" );
+    return 0;
+}
+
+static void map_input_file
+(
+    mp4opusenc_t *enc
+)
+{
+    /* Samples are read at the offsets in the timeline constructed by L-SMASH.
+     * Just keep reading through L-SMASH when the mapping is not available. */
+    input_file_t *in_file = &enc->input.file;
+#ifndef _WIN32
+    if( strcmp( in_file->name, "-" ) )
+    {
+        int fd = open( in_file->name, O_RDONLY );
+        struct stat st;
+        if( fd >= 0 && fstat( fd, &st ) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX )
+        {
+            void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( map != MAP_FAILED )
+            {
+                posix_madvise( map, st.st_size, POSIX_MADV_SEQUENTIAL );
+                in_file->map      = map;
+                in_file->map_size = st.st_size;
+                for( uint32_t i = 0; i < in_file->movie.num_tracks; i++ )
+                    in_file->movie.tracks[i].media.map_sample_number = 1;
+            }
+        }
+        if( fd >= 0 )
+            close( fd );    /* The mapping is kept after closing. */
+    }
+#endif
+    if( !in_file->map )
+        WARNING_MSG( "failed to map input file. Fall back to the file I/O.\n" );
+}
+
+static int is_track_selected
+(
+    option_t *opt,
+    uint32_t  track_ID
+)
+{
+    if( opt->num_track_IDs == 0 )
+        return 1;
+    for( uint32_t i = 0; i < opt->num_track_IDs; i++ )
+        if( opt->track_IDs[i] == track_ID )
+            return 1;
     return 0;
 }
 
+static void discard_input_track
+(
+    input_track_t *in_track
+)
+{
+    input_media_t *in_media = &in_track->media;
+    for( uint32_t i = 0; i < in_media->num_summaries; i++ )
+        lsmash_cleanup_summary( (lsmash_summary_t *)in_media->summaries[i].summary );
+    lsmash_free( in_media->summaries );
+    memset( in_track, 0, sizeof(input_track_t) );
+}
+
 static int open_input_file
 (
     mp4opusenc_t *enc
 )
 {
+    if( enc->opt.rate )
+        return open_raw_input_file( enc );
     input_t *input = &enc->input;
     input->root = lsmash_create_root();
     if( !input->root )
@@ -412,13 +1292,21 @@ static int open_input_file
     lsmash_movie_parameters_t movie_param;
     if( lsmash_get_movie_parameters( input->root, &movie_param ) < 0 )
         return ERROR_MSG( "failed to get movie parameters.\n" );
-    input_track_t *in_track = &in_file->movie.track;
-    int lpcm_stream_found = 0;
+    input_movie_t *in_movie = &in_file->movie;
     for( uint32_t i = 0; i < movie_param.number_of_tracks; i++ )
     {
-        in_track->track_ID = lsmash_get_track_ID( input->root, i + 1 );
-        if( in_track->track_ID == 0 )
+        uint32_t track_ID = lsmash_get_track_ID( input->root, i + 1 );
+        if( track_ID == 0 )
             return ERROR_MSG( "failed to get track_ID.\n" );
+        if( !is_track_selected( &enc->opt, track_ID ) )
+            continue;
+        if( in_movie->num_tracks == MAX_TRACKS )
+        {
+            WARNING_MSG( "tracks after the %dth LPCM track are not encoded.\n", MAX_TRACKS );
+            break;
+        }
+        input_track_t *in_track = &in_movie->tracks[ in_movie->num_tracks ];
+        in_track->track_ID = track_ID;
         /* Check CODEC type.
          * This program has no support of CODECs other than LPCM. */
         uint32_t num_summaries = lsmash_count_summary( input->root, in_track->track_ID );
@@ -447,212 +1335,510 @@ static int open_input_file
             }
             if( summary->summary_type != LSMASH_SUMMARY_TYPE_AUDIO
              || !lsmash_check_codec_type_identical( summary->sample_type, QT_CODEC_TYPE_LPCM_AUDIO )
-             || (((lsmash_audio_summary_t *)summary)->frequency != 8000
-              && ((lsmash_audio_summary_t *)summary)->frequency != 12000
-              && ((lsmash_audio_summary_t *)summary)->frequency != 16000
-              && ((lsmash_audio_summary_t *)summary)->frequency != 24000
-              && ((lsmash_audio_summary_t *)summary)->frequency != 48000)
-             || ((lsmash_audio_summary_t *)summary)->channels > 8
-             || ((lsmash_audio_summary_t *)summary)->sample_size != 16 )
+             || ((lsmash_audio_summary_t *)summary)->frequency < 1000
+             || ((lsmash_audio_summary_t *)summary)->frequency > 768000
+             || ((lsmash_audio_summary_t *)summary)->channels > 255
+             || setup_input_format( (lsmash_audio_summary_t *)summary, in_media ) < 0 )
             {
                 lsmash_cleanup_summary( summary );
                 continue;
             }
             in_media->summaries[j].summary = (lsmash_audio_summary_t *)summary;
         }
+        if( !in_media->summaries[0].summary )
+        {
+            discard_input_track( in_track );
+            continue;
+        }
         if( lsmash_construct_timeline( input->root, in_track->track_ID ) < 0 )
         {
             WARNING_MSG( "failed to construct timeline.\n" );
+            discard_input_track( in_track );
             continue;
         }
-        lpcm_stream_found = 1;
-        break;
+        ++in_movie->num_tracks;
     }
-    if( !lpcm_stream_found )
+    if( in_movie->num_tracks == 0 )
         return ERROR_MSG( "failed to find LPCM stream to encode.\n" );
+    if( enc->opt.num_track_IDs && in_movie->num_tracks < enc->opt.num_track_IDs )
+        return ERROR_MSG( "some of the selected tracks are not LPCM streams to encode.\n" );
     lsmash_destroy_children( lsmash_file_as_box( in_file->fh ) );
+    if( enc->opt.mmap )
+        map_input_file( enc );
     return 0;
 }
 
-static void remap_channel_layout
+static uint32_t resample_input_samples
 (
-    lsmash_summary_t                  *summary,
-    lsmash_opus_specific_parameters_t *param,
-    uint8_t                            channel_mapping[8]
+    input_media_t  *in_media,
+    uint8_t        *dst,
+    uint32_t        dst_size,
+    input_packet_t *packet
 )
 {
-    /* SMPTE/USB channel order -> Encoder channel order -> Vorbis channel order */
-    static const struct
-    {
-        uint32_t tag;
-        uint32_t bitmap;
-        uint8_t  encoder[8];
-        uint8_t  vorbis[8];
-    } channel_remap_table[8] =
-        {
-            /* C -> [C] -> C */
-            {
-                QT_CHANNEL_LAYOUT_MONO,
-                QT_CHANNEL_BIT_CENTER,
-                { 0 },
-                { 0 }
-            },
-            /* L+R -> [L+R] -> L+R */
-            {
-                QT_CHANNEL_LAYOUT_STEREO,
-                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT,
-                { 0, 1 },
-                { 0, 1 }
-            },
-            /* L+R+C -> [L+R]+[C] -> L+C+R */
-            {
-                QT_CHANNEL_LAYOUT_MPEG_3_0_A,
-                QT_CHANNEL_BIT_LEFT | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER,
-                { 0, 1, 2 },
-                { 0, 2, 1 }
-            },
-            /* L+R+BL+BR -> [L+R]+[BL+BR] -> L+R+BL+BR */
-            {
-                QT_CHANNEL_LAYOUT_QUADRAPHONIC,
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 1, 2, 3 },
-                { 0, 1, 2, 3 }
-            },
-            /* L+R+C+BL+BR -> [L+R]+[BL+BR]+[C] -> L+C+R+BL+BR */
-            {
-                QT_CHANNEL_LAYOUT_MPEG_5_0_A,
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 1, 3, 4, 2 },
-                { 0, 4, 1, 2, 3 }
-            },
-            /* L+R+C+LFE+BL+BR -> [L+R]+[BL+BR]+[C]+[LFE] -> L+C+R+BL+BR+LFE */
-            {
-                QT_CHANNEL_LAYOUT_MPEG_5_1_A,
-                QT_CHANNEL_BIT_LEFT          | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_LEFT_SURROUND | QT_CHANNEL_BIT_RIGHT_SURROUND,
-                { 0, 1, 4, 5, 2, 3 },
-                { 0, 4, 1, 2, 3, 5 }
-            },
-            /* L+R+C+LFE+BC+SL+SR -> [L+R]+[SL+SR]+[C]+[BC]+[LFE] -> L+C+R+SL+SR+BC+LFE */
-            {
-                QT_CHANNEL_LAYOUT_UNKNOWN | 7,
-                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_CENTER_SURROUND
-              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
-                { 0, 1, 5, 6, 2, 4, 3 },
-                { 0, 4, 1, 2, 3, 5, 6 }
-            },
-            /* L+R+C+LFE+BL+BR+SL+SR -> [L+R]+[SL+SR]+[BL+BR]+[C]+[LFE] -> L+C+R+SL+SR+BL+BR+LFE */
-            {
-                QT_CHANNEL_LAYOUT_UNKNOWN | 8,
-                QT_CHANNEL_BIT_LEFT                 | QT_CHANNEL_BIT_RIGHT
-              | QT_CHANNEL_BIT_CENTER
-              | QT_CHANNEL_BIT_LFE_SCREEN
-              | QT_CHANNEL_BIT_LEFT_SURROUND        | QT_CHANNEL_BIT_RIGHT_SURROUND
-              | QT_CHANNEL_BIT_LEFT_SURROUND_DIRECT | QT_CHANNEL_BIT_RIGHT_SURROUND_DIRECT,
-                { 0, 1, 6, 7, 4, 5, 2, 3 },
-                { 0, 6, 1, 2, 3, 4, 5, 7 }
-            }
-        };
-    int channel_layout_found = 0;
-    uint32_t cs_count = lsmash_count_codec_specific_data( summary );
-    for( uint32_t i = 0; i < cs_count; i++ )
+    /* Produce as many output samples as fit into dst, pulling input frames
+     * from the packet on demand. Return the number of bytes written into dst. */
+    const uint8_t *data = packet->data;
+    uint32_t resampled_size = mp4opus_resample( in_media->resampler, dst, dst_size, &data, &packet->size );
+    in_media->copied_bytes += data - packet->data;
+    packet->data            = (uint8_t *)data;
+    return resampled_size;
+}
+
+static int get_resampler_tail
+(
+    input_media_t  *in_media,
+    input_packet_t *packet
+)
+{
+    /* Feed zeros once at the end of stream to take out the samples delayed by the filter. */
+    if( !in_media->resampler
+     || !mp4opus_get_resampler_tail( in_media->resampler, &packet->data, &packet->size ) )
+        return 0;
+    packet->sample = NULL;
+    return 1;
+}
+
+static int setup_encoder
+(
+    encoder_t                         *opus,
+    lsmash_opus_specific_parameters_t *param,
+    uint8_t                            channel_mapping[255]
+)
+{
+    if( opus->codec.opt.frame_size < 10 && opus->codec.opt.application != OPUS_APPLICATION_RESTRICTED_LOWDELAY )
     {
-        lsmash_codec_specific_t *cs = lsmash_get_codec_specific_data( summary, i + 1 );
-        if( !cs || cs->type != LSMASH_CODEC_SPECIFIC_DATA_TYPE_QT_AUDIO_CHANNEL_LAYOUT )
-            continue;
-        lsmash_codec_specific_t *conv = lsmash_convert_codec_specific_format( cs, LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
-        if( !conv )
-            continue;
-        lsmash_qt_audio_channel_layout_t *layout = (lsmash_qt_audio_channel_layout_t *)conv->data.structured;
-        int index = 8;
-        if( layout->channelLayoutTag == QT_CHANNEL_LAYOUT_USE_CHANNEL_BITMAP )
-        {
-            for( index = 0; index < 8; index++ )
-                if( layout->channelBitmap == channel_remap_table[index].bitmap )
-                {
-                    channel_layout_found = 1;
-                    break;
-                }
-        }
-        else if( (layout->channelLayoutTag & QT_CHANNEL_LAYOUT_UNKNOWN) != QT_CHANNEL_LAYOUT_UNKNOWN )
+        WARNING_MSG( "framesize < 10ms can only use the MDCT modes.\n"
+                     "Switch to restricted low-delay mode.\n" );
+        opus->codec.opt.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+    }
+    /* Reuse the encoders created with the same configuration.
+     * The encoders for parallel encoding are reset per chunk. */
+    if( opus->codec.msenc && !mp4opus_is_same_encoder_config( &opus->codec.config, param, channel_mapping ) )
+        cleanup_encoder( opus );
+    char error[MP4OPUS_ERROR_LENGTH];
+    int created = mp4opus_setup_encoder( &opus->codec, param, channel_mapping, error );
+    if( created < 0 )
+        return ERROR_MSG( "%s", error );
+    if( created && opus->opt.threads > 1 )
+    {
+        /* Set up an encoder per chunk for parallel encoding. */
+        opus->chunks = lsmash_malloc_zero( opus->opt.threads * sizeof(encode_chunk_t) );
+        if( !opus->chunks )
+            return ERROR_MSG( "failed to allocate chunks for parallel encoding.\n" );
+        opus->chunks[0].msenc = opus->codec.msenc;
+        for( int i = 1; i < opus->opt.threads; i++ )
         {
-            for( index = 0; index < 8; index++ )
-                if( layout->channelLayoutTag == channel_remap_table[index].tag )
-                {
-                    channel_layout_found = 1;
-                    break;
-                }
+            opus->chunks[i].msenc = mp4opus_create_encoder( &opus->codec.opt, param, channel_mapping, error );
+            if( !opus->chunks[i].msenc )
+                return ERROR_MSG( "%s", error );
         }
-        if( channel_layout_found )
+    }
+    return 0;
+}
+
+static int record_complexity
+(
+    budget_t *budget
+)
+{
+    if( budget->num_changes == budget->changes_capacity )
+    {
+        uint32_t capacity = budget->changes_capacity ? budget->changes_capacity * 2 : 64;
+        complexity_change_t *changes = lsmash_realloc( budget->changes, capacity * sizeof(complexity_change_t) );
+        if( !changes )
+            return ERROR_MSG( "failed to allocate the history of the complexity.\n" );
+        budget->changes          = changes;
+        budget->changes_capacity = capacity;
+    }
+    budget->changes[ budget->num_changes++ ] = (complexity_change_t){ budget->num_frames, budget->complexity };
+    return 0;
+}
+
+static int setup_budget
+(
+    encoder_t *opus
+)
+{
+    /* The encoder is reused across files, so the controller starts over per file. */
+    if( !opus->budget )
+    {
+        opus->budget = lsmash_malloc_zero( sizeof(budget_t) );
+        if( !opus->budget )
+            return -1;
+    }
+    budget_t *budget = opus->budget;
+    budget->frame_duration = opus->codec.opt.frame_size / 1000;
+    budget->segment_frames = MP4OPUSENC_MAX( BUDGET_SEGMENT_DURATION / opus->codec.opt.frame_size, 1 );
+    budget->frames         = 0;
+    budget->elapsed        = 0;
+    budget->fast_segments  = 0;
+    budget->complexity     = opus->codec.opt.complexity;
+    budget->num_frames     = 0;
+    budget->num_changes    = 0;
+    if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_COMPLEXITY( budget->complexity ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to set complexity.\n" );
+    return record_complexity( budget );
+}
+
+static void free_input_packet
+(
+    input_packet_t *packet
+)
+{
+    lsmash_delete_sample( packet->sample );
+    packet->sample = NULL;
+}
+
+static int get_raw_input_packet
+(
+    input_media_t  *in_media,
+    input_packet_t *packet
+)
+{
+    uint32_t bytes_per_frame = in_media->summaries[0].summary->bytes_per_frame;
+    size_t   size            = fread( in_media->raw_buffer, 1, in_media->raw_buffer_size, in_media->raw );
+    if( ferror( in_media->raw ) )
+        return ERROR_MSG( "failed to read raw PCM input.\n" );
+    /* Drop the incomplete frame at the end of the stream. */
+    size -= size % bytes_per_frame;
+    if( size == 0 )
+        return 1;   /* reached EOF */
+    packet->sample = NULL;
+    packet->data   = in_media->raw_buffer;
+    packet->size   = size;
+    in_media->num_samples += size / bytes_per_frame;
+    return 0;
+}
+
+static int get_mapped_input_packet
+(
+    input_t        *input,
+    input_track_t  *in_track,
+    input_packet_t *packet
+)
+{
+    lsmash_root_t *in_root     = input->root;
+    uint32_t       in_track_ID = in_track->track_ID;
+    input_media_t *in_media    = &in_track->media;
+    /* Contiguous samples in the file are handed over as a packet without any copy. */
+    uint64_t pos  = 0;
+    uint32_t size = 0;
+    while( size < MAP_READ_SIZE )
+    {
+        lsmash_sample_t sample_info = { 0 };
+        if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, in_media->map_sample_number, &sample_info ) < 0 )
         {
-            memcpy( param->ChannelMapping, channel_remap_table[index].vorbis, sizeof(channel_remap_table[index].vorbis) );
-            memcpy( channel_mapping, channel_remap_table[index].encoder, sizeof(channel_remap_table[index].encoder) );
+            if( lsmash_check_sample_existence_in_media_timeline( in_root, in_track_ID, in_media->map_sample_number ) )
+                return ERROR_MSG( "failed to get sample info.\n" );
+            break;  /* No more samples. */
         }
-        lsmash_destroy_codec_specific_data( conv );
-        break;
+        if( sample_info.pos + sample_info.length > input->file.map_size )
+            return ERROR_MSG( "sample is out of input file.\n" );
+        if( size == 0 )
+            pos = sample_info.pos;
+        else if( sample_info.pos != pos + size )
+            break;
+        size += sample_info.length;
+        ++in_media->map_sample_number;
+    }
+    if( size == 0 )
+        return 1;   /* reached EOF */
+    packet->sample = NULL;
+    packet->data   = input->file.map + pos;
+    packet->size   = size;
+    in_media->num_samples += size / in_media->summaries[0].summary->bytes_per_frame;
+    return 0;
+}
+
+static int get_input_packet
+(
+    input_t        *input,
+    input_track_t  *in_track,
+    uint32_t        packet_number,
+    input_packet_t *packet
+)
+{
+    lsmash_root_t *in_root     = input->root;
+    uint32_t       in_track_ID = in_track->track_ID;
+    input_media_t *in_media    = &in_track->media;
+    /* Raw and mapped input are read sequentially regardless of packet_number. */
+    if( in_media->raw )
+        return get_raw_input_packet( in_media, packet );
+    if( input->file.map )
+        return get_mapped_input_packet( input, in_track, packet );
+    lsmash_sample_t *sample = lsmash_get_sample_from_media_timeline( in_root, in_track_ID, packet_number );
+    if( !sample )
+    {
+        if( lsmash_check_sample_existence_in_media_timeline( in_root, in_track_ID, packet_number ) )
+            return ERROR_MSG( "failed to get sample.\n" );
+        lsmash_sample_t sample_info = { 0 };
+        if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, packet_number, &sample_info ) < 0 )
+            /* No more samples. So, reached EOF. */
+            return 1;
+        else
+            return ERROR_MSG( "failed to get sample.\n" );
     }
-    if( !channel_layout_found && param->OutputChannelCount < 3 )
+    else
     {
-        int index = param->OutputChannelCount - 1;
-        memcpy( param->ChannelMapping, channel_remap_table[index].vorbis, sizeof(channel_remap_table[index].vorbis) );
-        memcpy( channel_mapping, channel_remap_table[index].encoder, sizeof(channel_remap_table[index].encoder) );
+        packet->data = sample->data;
+        packet->size = sample->length;
+        in_media->num_samples += packet->size / in_media->summaries[0].summary->bytes_per_frame;
     }
+    packet->sample = sample;
+    return 0;
 }
 
-static int setup_encoder
+static int analyze_input_loudness
 (
-    encoder_t                         *opus,
-    lsmash_opus_specific_parameters_t *param,
-    uint8_t                            channel_mapping[8]
+    input_t            *input,
+    input_track_t      *in_track,
+    mp4opus_loudness_t *loudness
 )
 {
-    if( opus->opt.frame_size < 10 && opus->opt.application != OPUS_APPLICATION_RESTRICTED_LOWDELAY )
+    /* Measure the whole input ahead of encoding since OutputGain is written before any sample,
+     * and then rewind the input. The samples are measured at the input sample rate. */
+    input_media_t *in_media = &in_track->media;
+    uint32_t       channels = in_media->summaries[0].summary->channels;
+    long           raw_pos  = 0;
+    if( in_media->raw && (raw_pos = ftell( in_media->raw )) < 0 )
+        return ERROR_MSG( "the normalization requires a seekable input.\n" );
+    union
     {
-        WARNING_MSG( "framesize < 10ms can only use the MDCT modes.\n"
-                     "Switch to restricted low-delay mode.\n" );
-        opus->opt.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
-    }
-    int err;
-    OpusMSEncoder *msenc = opus_multistream_encoder_create( param->InputSampleRate,
-                                                            param->OutputChannelCount,
-                                                            param->StreamCount,
-                                                            param->CoupledCount,
-                                                            channel_mapping,
-                                                            opus->opt.application,
-                                                            &err );
-    if( err != OPUS_OK )
-        return ERROR_MSG( "failed to create encoder.\n" );
-    opus->msenc = msenc;
-#define SET_OPT( opt, ... )                           \
-    err = opus_multistream_encoder_ctl( msenc, opt ); \
-    if( err != OPUS_OK )                              \
-        return ERROR_MSG( __VA_ARGS__ )
-    SET_OPT( OPUS_SET_COMPLEXITY( opus->opt.complexity ), "failed to set complexity.\n" );
-    SET_OPT( OPUS_SET_BITRATE( opus->opt.bitrate ), "failed to set bitrate.\n" );
-    SET_OPT( OPUS_SET_VBR( opus->opt.vbr > 0 ? 1 : 0 ), "failed to set VBR.\n" );
-    SET_OPT( OPUS_SET_VBR_CONSTRAINT( opus->opt.vbr == 2 ? 1 : 0 ), "failed to set constraint VBR.\n" );
-    SET_OPT( OPUS_SET_MAX_BANDWIDTH( opus->opt.max_bandwidth ), "failed to set maximum bandwidth.\n" );
-#undef SET_OPT
-    opus->frame_size = param->InputSampleRate * opus->opt.frame_size / 1000;
-    /* Get the number of priming samples. */
-    int priming_samples;
-    err = opus_multistream_encoder_ctl( msenc, OPUS_GET_LOOKAHEAD( &priming_samples ) );
-    if( err != OPUS_OK )
-        return ERROR_MSG( "failed to get number of priming samples.\n" );
-    param->PreSkip = priming_samples * (48000 / param->InputSampleRate);
+        float      f32[4096];
+        opus_int16 s16[8192];
+    } scratch;
+    int ret = 0;
+    for( uint32_t packet_number = 1; ret == 0; packet_number++ )
+    {
+        input_packet_t packet = { NULL };
+        ret = get_input_packet( input, in_track, packet_number, &packet );
+        if( ret )
+            break;
+        uint32_t frame_bytes  = in_media->sample_bytes * channels;
+        uint32_t chunk_frames = (in_media->convert ? 4096 : 8192) / channels;
+        for( uint32_t num_frames = packet.size / frame_bytes; num_frames; )
+        {
+            uint32_t count = MP4OPUSENC_MIN( num_frames, chunk_frames );
+            if( in_media->convert )
+            {
+                in_media->convert( scratch.f32, packet.data, count * channels );
+                mp4opus_loudness_add_float( loudness, scratch.f32, count );
+            }
+            else
+            {
+                /* Mapped samples may lie at odd offsets. */
+                memcpy( scratch.s16, packet.data, count * frame_bytes );
+                mp4opus_loudness_add_s16( loudness, scratch.s16, count );
+            }
+            packet.data += count * frame_bytes;
+            num_frames  -= count;
+        }
+        free_input_packet( &packet );
+    }
+    if( ret < 0 )
+        return ret;
+    in_media->num_samples       = 0;
+    in_media->map_sample_number = 1;
+    if( in_media->raw && fseek( in_media->raw, raw_pos, SEEK_SET ) < 0 )
+        return ERROR_MSG( "failed to rewind the input.\n" );
     return 0;
 }
 
-static int prepare_output
+static int create_output_track
+(
+    output_t       *output,
+    output_track_t *out_track
+)
+{
+    char error[MP4OPUS_ERROR_LENGTH];
+    if( mp4opus_create_output_track( output->root, &out_track->track_ID, error ) < 0 )
+        return ERROR_MSG( "%s", error );
+    return 0;
+}
+
+static int prepare_segment
+(
+    mp4opusenc_t                      *enc,
+    output_media_t                    *out_media,
+    lsmash_opus_specific_parameters_t *param
+)
+{
+    /* The boundaries are rounded down to frames, so the segments sharing a boundary meet exactly there. */
+    double frame_size = enc->opus[0].codec.opt.frame_size;
+    out_media->segment_start = enc->opt.segment_start * 1000 / frame_size + 1e-6;
+    out_media->segment_end   = enc->opt.segment_end > 0 ? enc->opt.segment_end * 1000 / frame_size + 1e-6 : UINT64_MAX;
+    if( out_media->segment_end <= out_media->segment_start )
+        return ERROR_MSG( "the segment is shorter than a frame.\n" );
+    out_media->segment = fopen( enc->output.file.name, "wb" );
+    if( !out_media->segment )
+        return ERROR_MSG( "failed to open an output file.\n" );
+    /* The header is rewritten with the number of packets and the duration at the end. */
+    mp4opusseg_header_t *header = &out_media->segment_header;
+    memset( header, 0, sizeof(mp4opusseg_header_t) );
+    header->magic                  = MP4OPUSSEG_MAGIC;
+    header->version                = MP4OPUSSEG_VERSION;
+    header->sample_duration        = out_media->mux.sample_duration;
+    header->start_packet           = out_media->segment_start;
+    header->pre_roll_distance      = out_media->mux.preroll_distance;
+    header->input_sample_rate      = param->InputSampleRate;
+    header->pre_skip               = param->PreSkip;
+    header->output_gain            = param->OutputGain;
+    header->output_channel_count   = param->OutputChannelCount;
+    header->channel_mapping_family = param->ChannelMappingFamily;
+    header->stream_count           = param->StreamCount;
+    header->coupled_count          = param->CoupledCount;
+    if( param->ChannelMappingFamily )
+        memcpy( header->channel_mapping, param->ChannelMapping, param->OutputChannelCount );
+    if( mp4opus_seg_write_header( out_media->segment, header ) < 0 )
+        return ERROR_MSG( "failed to write the segment header.\n" );
+    return 0;
+}
+
+static int prepare_output_track
+(
+    mp4opusenc_t *enc,
+    uint32_t      track_number
+)
+{
+    output_t       *output    = &enc->output;
+    output_track_t *out_track = &output->file.movie.tracks[track_number];
+    if( !enc->opt.segment && create_output_track( output, out_track ) < 0 )
+        return -1;
+    /* Set up Opus configurations. */
+    input_media_t          *in_media   = &enc->input.file.movie.tracks[track_number].media;
+    lsmash_audio_summary_t *in_summary = in_media->summaries[0].summary;
+    char                    error[MP4OPUS_ERROR_LENGTH];
+    lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS,
+                                                                     LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !cs )
+        return ERROR_MSG( "failed to create Opus specific info.\n" );
+    lsmash_opus_specific_parameters_t *param = (lsmash_opus_specific_parameters_t *)cs->data.structured;
+    param->Version              = 0;
+    param->OutputChannelCount   = in_summary->channels;
+    param->InputSampleRate      = in_summary->frequency;
+    param->OutputGain           = 0;
+    encoder_t *opus = &enc->opus[track_number];
+    if( track_number )
+    {
+        /* Every track is encoded with the same options. */
+        opus->opt   = enc->opus[0].opt;
+        opus->stats = enc->opus[0].stats;
+    }
+    uint8_t channel_mapping[255];
+    if( mp4opus_setup_channel_mapping( param, opus->codec.opt.mapping_family, (lsmash_summary_t *)in_summary,
+                                       channel_mapping, error ) < 0 )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( "%s", error );
+    }
+    if( setup_encoder( opus, param, channel_mapping ) < 0 )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( "failed to set up encoder.\n" );
+    }
+    if( opus->opt.realtime_budget && opus->opt.threads == 1 && setup_budget( opus ) < 0 )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( "failed to set up the realtime budget.\n" );
+    }
+    if( !mp4opus_is_native_rate( in_summary->frequency ) )
+    {
+        /* Resample into 48kHz. The samples delayed by the filter are skipped as well as the priming samples. */
+        if( !in_media->convert )
+            in_media->convert = mp4opus_convert_s16le;
+        in_media->resampler = mp4opus_create_resampler( in_summary->frequency, 48000, param->OutputChannelCount,
+                                                        in_media->sample_bytes, in_media->convert, error );
+        if( !in_media->resampler )
+        {
+            lsmash_destroy_codec_specific_data( cs );
+            return ERROR_MSG( "%s", error );
+        }
+        param->PreSkip += in_media->resampler->delay;
+    }
+    opus->codec.float_input = in_media->convert != NULL;
+    if( enc->opt.loudness )
+    {
+        mp4opus_loudness_t *loudness = lsmash_malloc( sizeof(mp4opus_loudness_t) );
+        in_media->loudness       = loudness;
+        in_media->measure_staged = !enc->opt.normalize;
+        if( !loudness || mp4opus_loudness_init( loudness,
+                                                in_media->measure_staged && in_media->resampler ? 48000 : in_summary->frequency,
+                                                param->OutputChannelCount ) < 0 )
+        {
+            lsmash_freep( &in_media->loudness );
+            lsmash_destroy_codec_specific_data( cs );
+            return ERROR_MSG( "failed to set up loudness meter.\n" );
+        }
+    }
+    if( enc->opt.normalize )
+    {
+        if( analyze_input_loudness( &enc->input, &enc->input.file.movie.tracks[track_number], in_media->loudness ) < 0 )
+        {
+            lsmash_destroy_codec_specific_data( cs );
+            return ERROR_MSG( "failed to analyze the loudness of the input.\n" );
+        }
+        double integrated = mp4opus_loudness_integrated( in_media->loudness );
+        if( integrated == -HUGE_VAL )
+            WARNING_MSG( "the input is too quiet to be normalized.\n" );
+        else
+        {
+            /* Q7.8 in dB */
+            double gain = MP4OPUSENC_MIN( MP4OPUSENC_MAX( (enc->opt.normalize - integrated) * 256, INT16_MIN ), INT16_MAX );
+            param->OutputGain = lrint( gain );
+            if( mp4opus_loudness_true_peak( in_media->loudness ) + param->OutputGain / 256.0 > 0 )
+                WARNING_MSG( "the true peak exceeds 0 dBTP after the normalization.\n" );
+        }
+        out_track->media.output_gain = param->OutputGain;
+    }
+    uint32_t buffer_size = opus->codec.frame_size * param->OutputChannelCount * (opus->codec.float_input ? sizeof(float) : sizeof(opus_int16));
+    uint8_t *buffer      = lsmash_malloc_zero( buffer_size );
+    if( !buffer )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( "failed to allocate sample buffer.\n" );
+    }
+    in_media->buffer      = buffer;
+    in_media->buffer_size = buffer_size;
+    if( mp4opus_prepare_output_media( &out_track->media.mux, param, opus->codec.opt.frame_size, error ) < 0 )
+    {
+        lsmash_destroy_codec_specific_data( cs );
+        return ERROR_MSG( "%s", error );
+    }
+    if( enc->opt.segment )
+    {
+        int ret = prepare_segment( enc, &out_track->media, param );
+        lsmash_destroy_codec_specific_data( cs );
+        return ret;
+    }
+    int ret = mp4opus_add_output_entry( output->root, out_track->track_ID, &out_track->media.mux, cs, enc->opt.fragment, error );
+    lsmash_destroy_codec_specific_data( cs );
+    if( ret < 0 )
+        return ERROR_MSG( "%s", error );
+    if( enc->opt.index )
+    {
+        out_track->media.index_capacity = 4096;
+        out_track->media.index          = lsmash_malloc( out_track->media.index_capacity * sizeof(mp4opusidx_entry_t) );
+        if( !out_track->media.index )
+            return ERROR_MSG( "failed to allocate the packet index.\n" );
+    }
+    if( enc->opt.live )
+    {
+        live_t *live = lsmash_malloc_zero( sizeof(live_t) );
+        out_track->media.live = live;
+        if( !live )
+            return ERROR_MSG( "failed to allocate live mode context.\n" );
+        live->max_queued = (out_track->media.mux.fragment_duration + out_track->media.mux.sample_duration - 1)
+                         / out_track->media.mux.sample_duration;
+        live->arrivals   = lsmash_malloc( live->max_queued * sizeof(double) );
+        live->histogram  = lsmash_malloc_zero( LIVE_LATENCY_BINS * sizeof(uint64_t) );
+        if( !live->arrivals || !live->histogram )
+            return ERROR_MSG( "failed to allocate live mode context.\n" );
+    }
+    return 0;
+}
+
+static int prepare_output_movie
 (
     mp4opusenc_t *enc
 )
@@ -666,6 +1852,8 @@ static int prepare_output
     lsmash_file_parameters_t *file_param = &out_file->param;
     if( lsmash_open_file( out_file->name, 0, file_param ) < 0 )
         return ERROR_MSG( "failed to open an output file.\n" );
+    if( enc->opt.fragment )
+        file_param->mode |= LSMASH_FILE_MODE_FRAGMENTED;
     file_param->major_brand   = ISOM_BRAND_TYPE_OPUS;
     file_param->brands        = (lsmash_brand_type [2]){ ISOM_BRAND_TYPE_OPUS, ISOM_BRAND_TYPE_ISO2 };
     file_param->brand_count   = 2;
@@ -679,258 +1867,1408 @@ static int prepare_output
     movie_param.timescale = 48000;
     if( lsmash_set_movie_parameters( output->root, &movie_param ) < 0 )
         return ERROR_MSG( "failed to set movie parameters.\n" );
-    /* Set up track parameters. */
-    output_track_t *out_track = &output->file.movie.track;
-    out_track->track_ID = lsmash_create_track( output->root, ISOM_MEDIA_HANDLER_TYPE_AUDIO_TRACK );
-    if( out_track->track_ID == 0 )
-        return ERROR_MSG( "failed to create track.\n" );
-    lsmash_track_parameters_t track_param;
-    lsmash_initialize_track_parameters( &track_param );
-    track_param.mode = ISOM_TRACK_IN_MOVIE | ISOM_TRACK_IN_PREVIEW | ISOM_TRACK_ENABLED;
-    if( lsmash_set_track_parameters( output->root, out_track->track_ID, &track_param ) < 0 )
-        return ERROR_MSG( "failed to set track parameters.\n" );
-    /* Set up media parameters. */
-    lsmash_media_parameters_t media_param;
-    lsmash_initialize_media_parameters( &media_param );
-    media_param.timescale     = 48000;
-    media_param.roll_grouping = 1;
-    if( lsmash_set_media_parameters( output->root, out_track->track_ID, &media_param ) < 0 )
-        return ERROR_MSG( "failed to set media parameters.\n" );
-    /* Set up Opus configurations. */
-    lsmash_audio_summary_t *in_summary = enc->input.file.movie.track.media.summaries->summary;
-    lsmash_audio_summary_t *out_summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
-    if( !out_summary )
-        return ERROR_MSG( "failed to allocate summary for output.\n" );
-    out_track->media.summary = out_summary;
-    out_summary->sample_type = ISOM_CODEC_TYPE_OPUS_AUDIO;
-    out_summary->frequency   = 48000;
-    out_summary->channels    = in_summary->channels;
-    out_summary->sample_size = 16;
-    lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS,
-                                                                     LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
-    if( !cs )
-        return ERROR_MSG( "failed to create Opus specific info.\n" );
-    lsmash_opus_specific_parameters_t *param = (lsmash_opus_specific_parameters_t *)cs->data.structured;
-    param->Version              = 0;
-    param->OutputChannelCount   = out_summary->channels;
-    param->InputSampleRate      = in_summary->frequency;
-    param->OutputGain           = 0;
-    param->ChannelMappingFamily = out_summary->channels > 2 ? 1 : 0;
-    param->CoupledCount         = (int []){ 0, 1, 1, 2, 2, 2, 2, 3 }[ out_summary->channels - 1 ];
-    param->StreamCount          = out_summary->channels - param->CoupledCount;
-    encoder_t *opus = &enc->opus;
-    opus->stream_count = param->StreamCount;
-    uint8_t channel_mapping[8];
-    remap_channel_layout( (lsmash_summary_t *)in_summary, param, channel_mapping );
-    if( setup_encoder( opus, param, channel_mapping ) < 0 )
+    return 0;
+}
+
+static int prepare_output
+(
+    mp4opusenc_t *enc
+)
+{
+    output_t *output = &enc->output;
+    if( enc->opt.fragment && enc->input.file.movie.num_tracks > 1 )
+        return ERROR_MSG( "fragmented movie supports a single track only.\n" );
+    if( enc->opt.index && enc->input.file.movie.num_tracks > 1 )
+        return ERROR_MSG( "the packet index supports a single track only.\n" );
+    if( enc->opt.segment )
     {
-        lsmash_destroy_codec_specific_data( cs );
-        return ERROR_MSG( "failed to set up encoder.\n" );
+        if( enc->input.file.movie.num_tracks > 1 )
+            return ERROR_MSG( "a segment supports a single track only, select one by --tracks.\n" );
     }
-    input_media_t *in_media = &enc->input.file.movie.track.media;
-    uint32_t buffer_size = opus->frame_size * param->OutputChannelCount * 2;
-    uint8_t *buffer      = lsmash_malloc_zero( buffer_size );
-    if( !buffer )
+    else if( prepare_output_movie( enc ) < 0 )
+        return -1;
+    for( uint32_t i = 0; i < enc->input.file.movie.num_tracks; i++ )
     {
-        lsmash_destroy_codec_specific_data( cs );
-        return ERROR_MSG( "failed to allocate sample buffer.\n" );
+        ++output->file.movie.num_tracks;    /* to be cleaned up even on failure */
+        if( prepare_output_track( enc, i ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static double get_wall_clock( void )
+{
+    struct timespec wall;
+    clock_gettime( CLOCK_MONOTONIC, &wall );
+    return wall.tv_sec + wall.tv_nsec * 1e-9;
+}
+
+static void settle_live_latency
+(
+    live_t *live
+)
+{
+    /* The queued frames have been handed over to the output.
+     * Push them out of the stream buffer and record how long each frame took since read. */
+    fflush( NULL );
+    double now = get_wall_clock();
+    for( uint32_t i = 0; i < live->num_queued; i++ )
+    {
+        double   latency = now - live->arrivals[i];
+        uint64_t bin     = MP4OPUSENC_MAX( latency, 0 ) / LIVE_LATENCY_RESOLUTION;
+        ++live->histogram[ MP4OPUSENC_MIN( bin, LIVE_LATENCY_BINS - 1 ) ];
+        live->max_latency = MP4OPUSENC_MAX( live->max_latency, latency );
+    }
+    live->num_frames += live->num_queued;
+    live->num_queued  = 0;
+}
+
+static int add_index_entry
+(
+    output_media_t  *out_media,
+    lsmash_sample_t *out_sample
+)
+{
+    /* The packet is appended at the current timestamp.
+     * The file offset is unknown until the movie is finished, and is filled in write_packet_index(). */
+    if( out_media->num_index_entries == out_media->index_capacity )
+    {
+        uint64_t capacity = out_media->index_capacity * 2;
+        mp4opusidx_entry_t *index = lsmash_realloc( out_media->index, capacity * sizeof(mp4opusidx_entry_t) );
+        if( !index )
+            return ERROR_MSG( "failed to allocate the packet index.\n" );
+        out_media->index          = index;
+        out_media->index_capacity = capacity;
+    }
+    out_media->index[ out_media->num_index_entries++ ] = (mp4opusidx_entry_t)
+        {
+            .offset            = 0,
+            .timestamp         = out_media->mux.timestamp,
+            .size              = out_sample->length,
+            .pre_roll_distance = out_media->mux.preroll_distance
+        };
+    return 0;
+}
+
+static int mux_opus_packet
+(
+    lsmash_root_t   *out_root,
+    uint32_t         out_track_ID,
+    output_media_t  *out_media,
+    lsmash_sample_t *out_sample
+)
+{
+    /* In live mode, a fragment is also started when the queued frames hit the cap. */
+    live_t *live = out_media->live;
+    if( out_media->index && add_index_entry( out_media, out_sample ) < 0 )
+    {
+        lsmash_delete_sample( out_sample );
+        return -1;
+    }
+    char error[MP4OPUS_ERROR_LENGTH];
+    int ret = mp4opus_mux_opus_packet( out_root, out_track_ID, &out_media->mux, out_sample,
+                                       live && live->num_queued == live->max_queued, error );
+    if( ret < 0 )
+        return ERROR_MSG( "%s", error );
+    if( live )
+    {
+        if( ret )
+            settle_live_latency( live );
+        live->arrivals[ live->num_queued++ ] = live->last_read;
+    }
+    return 0;
+}
+
+static void measure_staged_samples
+(
+    input_media_t *in_media,
+    const uint8_t *data,
+    uint32_t       size
+)
+{
+    /* Staged samples are float if converted or resampled, 16-bit native integers otherwise. */
+    if( !in_media->measure_staged )
+        return;
+    uint32_t channels = in_media->summaries[0].summary->channels;
+    if( in_media->convert )
+        mp4opus_loudness_add_float( in_media->loudness, (const float *)data, size / (channels * sizeof(float)) );
+    else
+        mp4opus_loudness_add_s16( in_media->loudness, (const int16_t *)data, size / (channels * sizeof(int16_t)) );
+}
+
+static uint32_t stage_input_samples
+(
+    input_media_t  *in_media,
+    uint8_t        *dst,
+    uint32_t        dst_size,
+    input_packet_t *packet
+)
+{
+    /* Copy as many samples from the input packet as fit into dst.
+     * Samples in the other formats than 16-bit native integers are converted into float on the copy.
+     * Return the number of bytes written into dst. */
+    if( in_media->resampler )
+    {
+        uint32_t staged_size = resample_input_samples( in_media, dst, dst_size, packet );
+        measure_staged_samples( in_media, dst, staged_size );
+        return staged_size;
+    }
+    uint32_t consumed_size;
+    uint32_t staged_size;
+    if( in_media->convert )
+    {
+        uint32_t count = MP4OPUSENC_MIN( dst_size / sizeof(float), packet->size / in_media->sample_bytes );
+        in_media->convert( (float *)dst, packet->data, count );
+        consumed_size = count ? count * in_media->sample_bytes : packet->size;  /* Drop a broken sample. */
+        staged_size   = count * sizeof(float);
+    }
+    else
+    {
+        consumed_size = staged_size = MP4OPUSENC_MIN( dst_size, packet->size );
+        memcpy( dst, packet->data, consumed_size );
+    }
+    in_media->copied_bytes += consumed_size;
+    packet->data           += consumed_size;
+    packet->size           -= consumed_size;
+    measure_staged_samples( in_media, dst, staged_size );
+    return staged_size;
+}
+
+static int update_complexity
+(
+    encoder_t *opus,
+    double     elapsed
+)
+{
+    /* Hysteresis controller of the complexity for the time spent in the encoder per segment.
+     * A segment slower than the target steps the complexity down at once, while a step up needs
+     * consecutive segments faster than the target by the margin so that the complexity does not flap. */
+    budget_t *budget = opus->budget;
+    budget->elapsed += elapsed;
+    ++budget->num_frames;
+    if( ++budget->frames < budget->segment_frames )
+        return 0;
+    double speed = budget->frames * budget->frame_duration / MP4OPUSENC_MAX( budget->elapsed, 1e-9 );
+    budget->frames  = 0;
+    budget->elapsed = 0;
+    int complexity = budget->complexity;
+    if( speed < opus->opt.realtime_budget )
+    {
+        budget->fast_segments = 0;
+        complexity = MP4OPUSENC_MAX( complexity - 1, 0 );
+    }
+    else if( speed > opus->opt.realtime_budget * BUDGET_HYSTERESIS && complexity < opus->codec.opt.complexity )
+    {
+        if( ++budget->fast_segments == BUDGET_UP_SEGMENTS )
+        {
+            budget->fast_segments = 0;
+            ++complexity;
+        }
+    }
+    else
+        budget->fast_segments = 0;
+    if( complexity == budget->complexity )
+        return 0;
+    if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_COMPLEXITY( complexity ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to set complexity.\n" );
+    budget->complexity = complexity;
+    return record_complexity( budget );
+}
+
+static int write_segment_packet
+(
+    stats_t        *stats,
+    output_media_t *out_media,
+    uint32_t        size
+)
+{
+    if( mp4opus_seg_write_size( out_media->segment, size ) < 0
+     || fwrite( out_media->mux.packet_buffer, 1, size, out_media->segment ) != size )
+        return ERROR_MSG( "failed to write packet into the segment.\n" );
+    ++out_media->segment_header.num_packets;
+    count_output_packet( stats, size );
+    return size;
+}
+
+static uint64_t get_input_duration
+(
+    input_media_t *in_media
+)
+{
+    return mp4opus_get_presentation_duration( in_media->num_samples, in_media->summaries[0].summary->frequency );
+}
+
+static int flush_output_track
+(
+    stats_t        *stats,
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media
+)
+{
+    stage_clock_t clk;
+    start_stage_clock( stats, &clk );
+    char error[MP4OPUS_ERROR_LENGTH];
+    if( mp4opus_flush_output_track( out_root, out_track_ID, &out_media->mux, error ) < 0 )
+        return ERROR_MSG( "%s", error );
+    stop_stage_clock( stats, &clk, STAGE_MUX );
+    return 0;
+}
+
+static int encode_frame
+(
+    encoder_t        *opus,
+    lsmash_root_t    *out_root,
+    uint32_t          out_track_ID,
+    output_media_t   *out_media,
+    const uint8_t    *pcm
+)
+{
+    uint64_t frame_number = out_media->num_frames++;
+    if( out_media->segment
+     && (frame_number >= out_media->segment_end || frame_number + out_media->mux.preroll_distance < out_media->segment_start) )
+        /* Frames out of the segment and its pre-roll are staged but not encoded,
+         * so the samples of the segment are the same as the ones of the whole stream. */
+        return 0;
+    stage_clock_t clk;
+    start_stage_clock( opus->stats, &clk );
+    double codec_start = opus->budget ? get_wall_clock() : 0;
+    int ret = mp4opus_encode_pcm( opus->codec.msenc,
+                                  pcm,
+                                  opus->codec.float_input,
+                                  opus->codec.frame_size,
+                                  out_media->mux.packet_buffer,
+                                  out_media->mux.packet_buffer_size );
+    stop_stage_clock( opus->stats, &clk, STAGE_CODEC );
+    if( ret < 0 )
+        return ERROR_MSG( "failed to encode.\n" );
+    if( opus->budget && update_complexity( opus, get_wall_clock() - codec_start ) < 0 )
+        return -1;
+    if( out_media->segment )
+        /* The packets of the pre-roll only prime the encoder. */
+        return frame_number < out_media->segment_start ? ret : write_segment_packet( opus->stats, out_media, ret );
+    /* Feed encoded packet to muxer. */
+    lsmash_sample_t *out_sample = lsmash_create_sample( ret );
+    if( !out_sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    memcpy( out_sample->data, out_media->mux.packet_buffer, ret );
+    if( out_media->mux_ring )
+    {
+        /* The mux thread appends the packet and advances the timestamp. */
+        if( mp4opus_ring_push( out_media->mux_ring, &(mux_item_t){ out_sample } ) < 0 )
+        {
+            lsmash_delete_sample( out_sample );
+            return ERROR_MSG( "failed to hand over packet to the mux thread.\n" );
+        }
+        count_output_packet( opus->stats, ret );
+        return ret;
+    }
+    start_stage_clock( opus->stats, &clk );
+    if( mux_opus_packet( out_root, out_track_ID, out_media, out_sample ) < 0 )
+        return -1;
+    stop_stage_clock( opus->stats, &clk, STAGE_MUX );
+    count_output_packet( opus->stats, ret );
+    return ret;
+}
+
+static int feed_packet_to_encoder
+(
+    encoder_t      *opus,
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media,
+    input_media_t  *in_media,
+    input_packet_t *packet
+)
+{
+    do
+    {
+        if( packet->data && !in_media->convert && in_media->buffer_pos == 0 && packet->size >= in_media->buffer_size
+         && ((uintptr_t)packet->data & 1) == 0 )
+        {
+            /* The input packet holds a whole frame, so encode it in place.
+             * The frame is aligned to the channel interleaved samples since the buffer is empty.
+             * Samples mapped from odd offsets of the file have to be copied to be accessed as int16.
+             * A frame straddling two packets is always staged, so the share of the frames encoded in place
+             * depends on the packet size: raw and mapped input hand over many frames per packet,
+             * while a sample of 1024 frames from L-SMASH rarely holds a whole 20ms frame after the staged one. */
+            measure_staged_samples( in_media, packet->data, in_media->buffer_size );
+            if( encode_frame( opus, out_root, out_track_ID, out_media, packet->data ) < 0 )
+                return -1;
+            in_media->inplace_bytes += in_media->buffer_size;
+            packet->data            += in_media->buffer_size;
+            packet->size            -= in_media->buffer_size;
+            continue;
+        }
+        /* Copy data from input packet to invalid region. */
+        uint8_t *invalid      = in_media->buffer      + in_media->buffer_pos;
+        uint32_t invalid_size = in_media->buffer_size - in_media->buffer_pos;
+        if( packet->data )
+            in_media->buffer_pos += stage_input_samples( in_media, invalid, invalid_size, packet );
+        else
+        {
+            memset( invalid, 0, invalid_size );
+            in_media->buffer_pos = in_media->buffer_size;
+        }
+        if( in_media->buffer_pos >= in_media->buffer_size )
+        {
+            in_media->buffer_pos = 0;
+            if( encode_frame( opus, out_root, out_track_ID, out_media, in_media->buffer ) < 0 )
+                return -1;
+        }
+    } while( packet->size );
+    return 0;
+}
+
+static int encode_padding
+(
+    encoder_t      *opus,
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media,
+    input_media_t  *in_media
+)
+{
+    /* Pad the staged samples and then frames of zeros until the last sample gets out of the encoder delay. */
+    uint64_t duration = get_input_duration( in_media );
+    while( in_media->buffer_pos || mp4opus_get_padding_frames( &out_media->mux, out_media->num_frames, duration ) )
+    {
+        input_packet_t packet = { NULL };
+        if( feed_packet_to_encoder( opus, out_root, out_track_ID, out_media, in_media, &packet ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static int flush_encoder
+(
+    encoder_t      *opus,
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media,
+    input_media_t  *in_media
+)
+{
+    if( encode_padding( opus, out_root, out_track_ID, out_media, in_media ) < 0 )
+        return -1;
+    return out_media->segment ? 0 : flush_output_track( opus->stats, out_root, out_track_ID, out_media );
+}
+
+static int do_encode_serial
+(
+    mp4opusenc_t *enc
+)
+{
+    input_t        *input     = &enc->input;
+    output_t       *output    = &enc->output;
+    input_track_t  *in_track  = &input->file.movie.tracks[0];
+    output_track_t *out_track = &output->file.movie.tracks[0];
+    encoder_t      *opus      = &enc->opus[0];
+    int             eof       = 0;
+    stats_t        *stats     = opus->stats;
+    for( uint32_t packet_number = 1; !eof; packet_number++ )
+    {
+        input_packet_t packet = { NULL };
+        stage_clock_t  clk;
+        start_stage_clock( stats, &clk );
+        int ret = get_input_packet( input, in_track, packet_number, &packet );
+        stop_stage_clock( stats, &clk, STAGE_DEMUX );
+        if( ret < 0 )
+            return ret;
+        if( out_track->media.live )
+            out_track->media.live->last_read = get_wall_clock();
+        eof = ret;
+        if( eof && get_resampler_tail( &in_track->media, &packet ) )
+            eof = 0;
+        count_input_packet( stats, &packet );
+        ret = feed_packet_to_encoder( opus,
+                                      output->root,
+                                      out_track->track_ID,
+                                      &out_track->media,
+                                      &in_track->media,
+                                      &packet );
+        free_input_packet( &packet );
+        if( ret < 0 )
+            return ret;
+        if( out_track->media.segment && out_track->media.num_frames >= out_track->media.segment_end )
+        {
+            /* No more input is needed, but the segment is still the last one
+             * if the input ends right at its end. */
+            input_packet_t next = { NULL };
+            ret = get_input_packet( input, in_track, packet_number + 1, &next );
+            free_input_packet( &next );
+            if( ret < 0 )
+                return ret;
+            uint64_t duration = get_input_duration( &in_track->media );
+            if( ret == 1 && duration <= out_track->media.segment_end * out_track->media.mux.sample_duration )
+            {
+                /* The padding flushed out of the encoder belongs to the last segment. */
+                eof = 1;
+                out_track->media.segment_end = UINT64_MAX;
+            }
+            break;
+        }
+    }
+    if( out_track->media.segment && eof )
+        out_track->media.segment_header.flags |= MP4OPUSSEG_FLAG_LAST;
+    return flush_encoder( opus,
+                          output->root,
+                          out_track->track_ID,
+                          &out_track->media,
+                          &in_track->media );
+}
+
+static int detach_raw_packet
+(
+    input_packet_t *packet
+)
+{
+    /* Raw PCM is read into the buffer reused for the next read, so copy it for the read-ahead. */
+    lsmash_sample_t *sample = lsmash_create_sample( packet->size );
+    if( !sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    memcpy( sample->data, packet->data, packet->size );
+    packet->sample = sample;
+    packet->data   = sample->data;
+    return 0;
+}
+
+static void *demux_worker
+(
+    void *arg
+)
+{
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    for( uint32_t packet_number = 1; ; packet_number++ )
+    {
+        demux_item_t  item = { { NULL } };
+        stage_clock_t clk;
+        start_stage_clock( pipeline->stats, &clk );
+        item.status = get_input_packet( pipeline->input, pipeline->in_track, packet_number, &item.packet );
+        if( item.status == 0 && !item.packet.sample && pipeline->in_track->media.raw )
+            item.status = detach_raw_packet( &item.packet );
+        stop_stage_clock( pipeline->stats, &clk, STAGE_DEMUX );
+        if( mp4opus_ring_push( &pipeline->demux_ring, &item ) < 0 )
+        {
+            free_input_packet( &item.packet );
+            break;
+        }
+        if( item.status )
+            break;
+    }
+    return NULL;
+}
+
+static void *mux_worker
+(
+    void *arg
+)
+{
+    pipeline_t     *pipeline  = (pipeline_t *)arg;
+    output_track_t *out_track = pipeline->out_track;
+    mux_item_t      item;
+    pipeline->mux_ret = -1;
+    while( mp4opus_ring_pop( &pipeline->mux_ring, &item ) == 0 )
+    {
+        if( !item.sample )
+        {
+            pipeline->mux_ret = 0;
+            break;
+        }
+        stage_clock_t clk;
+        start_stage_clock( pipeline->stats, &clk );
+        int ret = mux_opus_packet( pipeline->out_root, out_track->track_ID, &out_track->media, item.sample );
+        stop_stage_clock( pipeline->stats, &clk, STAGE_MUX );
+        if( ret < 0 )
+            break;
+    }
+    /* Let the codec thread know of the failure if it is waiting for room. */
+    mp4opus_ring_abort( &pipeline->mux_ring );
+    return NULL;
+}
+
+static int do_encode_pipelined
+(
+    mp4opusenc_t *enc
+)
+{
+    /* The demux thread reads ahead and the mux thread writes behind the encoding on this thread,
+     * so that the I/O latency overlaps with the encoding. */
+    input_t        *input     = &enc->input;
+    output_t       *output    = &enc->output;
+    input_track_t  *in_track  = &input->file.movie.tracks[0];
+    output_track_t *out_track = &output->file.movie.tracks[0];
+    encoder_t      *opus      = &enc->opus[0];
+    pipeline_t pipeline =
+    {
+        .input     = input,
+        .in_track  = in_track,
+        .out_root  = output->root,
+        .out_track = out_track,
+        .stats     = opus->stats
+    };
+    if( mp4opus_ring_init( &pipeline.demux_ring, sizeof(demux_item_t), enc->opt.pipeline ) < 0
+     || mp4opus_ring_init( &pipeline.mux_ring,   sizeof(mux_item_t),   enc->opt.pipeline ) < 0 )
+    {
+        mp4opus_ring_cleanup( &pipeline.demux_ring );
+        mp4opus_ring_cleanup( &pipeline.mux_ring );
+        return ERROR_MSG( "failed to allocate rings for the pipeline.\n" );
+    }
+    int ret = 0;
+    int demux_started = !pthread_create( &pipeline.demux_thread, NULL, demux_worker, &pipeline );
+    int mux_started   = !pthread_create( &pipeline.mux_thread,   NULL, mux_worker,   &pipeline );
+    if( !demux_started || !mux_started )
+        ret = ERROR_MSG( "failed to create threads for the pipeline.\n" );
+    else
+        out_track->media.mux_ring = &pipeline.mux_ring;
+    for( int eof = 0; ret == 0 && !eof; )
+    {
+        demux_item_t item;
+        if( mp4opus_ring_pop( &pipeline.demux_ring, &item ) < 0 || item.status < 0 )
+        {
+            ret = -1;
+            break;
+        }
+        eof = item.status;
+        if( eof && get_resampler_tail( &in_track->media, &item.packet ) )
+            eof = 0;
+        /* The counters are shared with the encoding, so they are updated on this thread. */
+        count_input_packet( opus->stats, &item.packet );
+        ret = feed_packet_to_encoder( opus,
+                                      output->root,
+                                      out_track->track_ID,
+                                      &out_track->media,
+                                      &in_track->media,
+                                      &item.packet );
+        free_input_packet( &item.packet );
+    }
+    if( ret == 0 )
+        /* Encode the rest of the buffered samples. */
+        ret = encode_padding( opus, output->root, out_track->track_ID, &out_track->media, &in_track->media );
+    out_track->media.mux_ring = NULL;
+    if( ret == 0 && mux_started && mp4opus_ring_push( &pipeline.mux_ring, &(mux_item_t){ NULL } ) < 0 )
+        ret = -1;
+    if( ret < 0 )
+        mp4opus_ring_abort( &pipeline.mux_ring );
+    mp4opus_ring_abort( &pipeline.demux_ring );
+    if( demux_started )
+        pthread_join( pipeline.demux_thread, NULL );
+    if( mux_started )
+        pthread_join( pipeline.mux_thread, NULL );
+    if( ret == 0 && pipeline.mux_ret < 0 )
+        ret = -1;
+    /* Release the items left by the failure. */
+    demux_item_t demux_item;
+    while( mp4opus_ring_try_pop( &pipeline.demux_ring, &demux_item ) == 0 )
+        free_input_packet( &demux_item.packet );
+    mux_item_t mux_item;
+    while( mp4opus_ring_try_pop( &pipeline.mux_ring, &mux_item ) == 0 )
+        lsmash_delete_sample( mux_item.sample );
+    mp4opus_ring_cleanup( &pipeline.demux_ring );
+    mp4opus_ring_cleanup( &pipeline.mux_ring );
+    if( ret < 0 )
+        return ret;
+    return flush_output_track( opus->stats, output->root, out_track->track_ID, &out_track->media );
+}
+
+static void *encode_chunk
+(
+    void *arg
+)
+{
+    encode_chunk_t *chunk = (encode_chunk_t *)arg;
+    chunk->ret       = -1;
+    chunk->data_size = 0;
+    if( !chunk->keep_state && opus_multistream_encoder_ctl( chunk->msenc, OPUS_RESET_STATE ) != OPUS_OK )
+        return NULL;
+    uint32_t       frame_bytes = chunk->frame_size * chunk->channels * (chunk->float_input ? sizeof(float) : sizeof(opus_int16));
+    const uint8_t *pcm         = chunk->pcm - chunk->preroll_frames * frame_bytes;
+    /* Prime the encoder with the pre-roll frames and discard their packets. */
+    for( uint32_t i = 0; i < chunk->preroll_frames; i++, pcm += frame_bytes )
+        if( mp4opus_encode_pcm( chunk->msenc, pcm, chunk->float_input, chunk->frame_size, chunk->packet, chunk->max_packet_size ) < 0 )
+            return NULL;
+    for( uint32_t i = 0; i < chunk->num_frames; i++, pcm += frame_bytes )
+    {
+        int ret = mp4opus_encode_pcm( chunk->msenc, pcm, chunk->float_input, chunk->frame_size, chunk->packet, chunk->max_packet_size );
+        if( ret < 0 )
+            return NULL;
+        if( chunk->data_size + ret > chunk->data_capacity )
+        {
+            uint32_t capacity = MP4OPUSENC_MAX( chunk->data_capacity * 2, chunk->data_size + ret );
+            uint8_t *data     = lsmash_realloc( chunk->data, capacity );
+            if( !data )
+                return NULL;
+            chunk->data          = data;
+            chunk->data_capacity = capacity;
+        }
+        memcpy( chunk->data + chunk->data_size, chunk->packet, ret );
+        chunk->data_size      += ret;
+        chunk->packet_sizes[i] = ret;
+    }
+    chunk->ret = 0;
+    return NULL;
+}
+
+static int mux_encoded_chunk
+(
+    lsmash_root_t  *out_root,
+    uint32_t        out_track_ID,
+    output_media_t *out_media,
+    encode_chunk_t *chunk,
+    stats_t        *stats
+)
+{
+    uint8_t *data = chunk->data;
+    for( uint32_t i = 0; i < chunk->num_frames; i++ )
+    {
+        lsmash_sample_t *out_sample = lsmash_create_sample( chunk->packet_sizes[i] );
+        if( !out_sample )
+            return ERROR_MSG( "failed to allocate sample.\n" );
+        memcpy( out_sample->data, data, chunk->packet_sizes[i] );
+        data += chunk->packet_sizes[i];
+        if( mux_opus_packet( out_root, out_track_ID, out_media, out_sample ) < 0 )
+            return -1;
+        count_output_packet( stats, chunk->packet_sizes[i] );
+    }
+    return 0;
+}
+
+static uint8_t *reserve_window
+(
+    encoder_t *opus,
+    uint64_t   size
+)
+{
+    /* The window is kept for the next file, but the frame size in bytes may change with the input format. */
+    if( opus->window_size < size )
+    {
+        lsmash_free( opus->window );
+        opus->window      = lsmash_malloc( size );
+        opus->window_size = opus->window ? size : 0;
+    }
+    return opus->window;
+}
+
+static int do_encode_parallel
+(
+    mp4opusenc_t *enc
+)
+{
+    input_t        *input     = &enc->input;
+    output_t       *output    = &enc->output;
+    encoder_t      *opus      = &enc->opus[0];
+    input_track_t  *in_track  = &input->file.movie.tracks[0];
+    output_track_t *out_track = &output->file.movie.tracks[0];
+    input_media_t  *in_media  = &in_track->media;
+    output_media_t *out_media = &out_track->media;
+    /* The window consists of the pre-roll frames taken over from the previous window
+     * followed by the frames split into chunks which are encoded in parallel.
+     * The frames of zeros padded at the end of the stream are reserved after them, which are
+     * at most as many as the frames covering the priming samples.
+     * The buffers are kept while the encoders are reused with the same configuration. */
+    uint32_t num_chunks     = opus->opt.threads;
+    uint32_t chunk_frames   = MP4OPUSENC_MAX( CHUNK_DURATION / opus->codec.opt.frame_size, out_media->mux.preroll_distance );
+    uint32_t padding_frames = mp4opus_get_padding_frames( &out_media->mux, 0, 0 );
+    uint32_t frame_bytes    = in_media->buffer_size;
+    uint32_t history_bytes  = out_media->mux.preroll_distance * frame_bytes;
+    uint64_t window_bytes   = (uint64_t)chunk_frames * num_chunks * frame_bytes;
+    if( !reserve_window( opus, history_bytes + window_bytes + (uint64_t)padding_frames * frame_bytes ) )
+        return ERROR_MSG( "failed to allocate PCM buffer for parallel encoding.\n" );
+    /* Reserve the buffer for encoded packets of a chunk from the bitrate with a margin for VBR. */
+    opus_int32 bitrate;
+    if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_GET_BITRATE( &bitrate ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to get bitrate.\n" );
+    uint64_t data_capacity = ((uint64_t)bitrate / 8 * chunk_frames * opus->codec.opt.frame_size / 1000) * 5 / 4;
+    for( uint32_t i = 0; i < num_chunks; i++ )
+    {
+        encode_chunk_t *chunk = &opus->chunks[i];
+        chunk->frame_size      = opus->codec.frame_size;
+        chunk->float_input     = opus->codec.float_input;
+        chunk->channels        = out_media->mux.summary->channels;
+        chunk->max_packet_size = mp4opus_get_max_packet_size( opus->codec.opt.frame_size, opus->codec.stream_count );
+        if( !chunk->packet )
+            chunk->packet = lsmash_malloc( chunk->max_packet_size );
+        /* The last chunk may take over the frames of zeros. */
+        lsmash_free( chunk->packet_sizes );
+        chunk->packet_sizes = lsmash_malloc( (chunk_frames + padding_frames) * sizeof(uint32_t) );
+        if( !chunk->data )
+        {
+            chunk->data          = lsmash_malloc( data_capacity );
+            chunk->data_capacity = chunk->data ? data_capacity : 0;
+        }
+        if( !chunk->packet || !chunk->packet_sizes )
+            return ERROR_MSG( "failed to allocate buffers for parallel encoding.\n" );
+    }
+    uint8_t       *window         = opus->window + history_bytes;
+    uint32_t       history_frames = 0;
+    uint32_t       packet_number  = 1;
+    input_packet_t packet         = { NULL };
+    int            eof            = 0;
+    stats_t       *stats          = opus->stats;
+    stage_clock_t  clk;
+    while( !eof )
+    {
+        /* Fill the window with PCM samples. */
+        start_stage_clock( stats, &clk );
+        uint64_t window_pos = 0;
+        while( window_pos < window_bytes )
+        {
+            if( packet.size == 0 )
+            {
+                free_input_packet( &packet );
+                int ret = get_input_packet( input, in_track, packet_number++, &packet );
+                if( ret < 0 )
+                    return ret;
+                eof = ret;
+                if( eof && get_resampler_tail( in_media, &packet ) )
+                    eof = 0;
+                if( eof )
+                    break;
+                count_input_packet( stats, &packet );
+                continue;
+            }
+            window_pos += stage_input_samples( in_media, window + window_pos,
+                                               MP4OPUSENC_MIN( window_bytes - window_pos, UINT32_MAX ), &packet );
+        }
+        if( eof )
+        {
+            /* Pad the last frame and then frames of zeros as flush_encoder() does. */
+            uint64_t muxed_frames = out_media->mux.timestamp / out_media->mux.sample_duration;
+            uint64_t padding_size = (frame_bytes - window_pos % frame_bytes) % frame_bytes;
+            padding_size += (uint64_t)frame_bytes * mp4opus_get_padding_frames( &out_media->mux,
+                                                                                muxed_frames + (window_pos + padding_size) / frame_bytes,
+                                                                                get_input_duration( in_media ) );
+            memset( window + window_pos, 0, padding_size );
+            window_pos += padding_size;
+        }
+        uint32_t num_frames = window_pos / frame_bytes;
+        stop_stage_clock( stats, &clk, STAGE_DEMUX );
+        /* Encode the chunks in parallel. */
+        start_stage_clock( stats, &clk );
+        uint32_t num_active_chunks = 0;
+        for( uint32_t i = 0; i < num_chunks; i++ )
+        {
+            uint32_t start_frame = i * chunk_frames;
+            if( start_frame >= num_frames )
+                break;
+            encode_chunk_t *chunk = &opus->chunks[i];
+            chunk->pcm            = window + (uint64_t)start_frame * frame_bytes;
+            chunk->preroll_frames = MP4OPUSENC_MIN( out_media->mux.preroll_distance, history_frames + start_frame );
+            chunk->num_frames     = i == num_chunks - 1
+                                  ? num_frames - start_frame
+                                  : MP4OPUSENC_MIN( chunk_frames, num_frames - start_frame );
+            if( pthread_create( &chunk->thread, NULL, encode_chunk, chunk ) )
+            {
+                for( uint32_t j = 0; j < num_active_chunks; j++ )
+                    pthread_join( opus->chunks[j].thread, NULL );
+                free_input_packet( &packet );
+                return ERROR_MSG( "failed to create an encoding thread.\n" );
+            }
+            ++num_active_chunks;
+        }
+        for( uint32_t i = 0; i < num_active_chunks; i++ )
+            pthread_join( opus->chunks[i].thread, NULL );
+        stop_stage_clock( stats, &clk, STAGE_CODEC );
+        /* Feed the encoded packets to muxer in order. */
+        start_stage_clock( stats, &clk );
+        for( uint32_t i = 0; i < num_active_chunks; i++ )
+        {
+            if( opus->chunks[i].ret < 0
+             || mux_encoded_chunk( output->root,
+                                   out_track->track_ID,
+                                   out_media,
+                                   &opus->chunks[i],
+                                   stats ) < 0 )
+            {
+                free_input_packet( &packet );
+                return ERROR_MSG( "failed to encode chunk.\n" );
+            }
+        }
+        stop_stage_clock( stats, &clk, STAGE_MUX );
+        /* Take over the last frames as the pre-roll of the next window. */
+        history_frames = MP4OPUSENC_MIN( out_media->mux.preroll_distance, history_frames + num_frames );
+        memmove( window - (uint64_t)history_frames * frame_bytes,
+                 window + (uint64_t)num_frames * frame_bytes - (uint64_t)history_frames * frame_bytes,
+                 (uint64_t)history_frames * frame_bytes );
+    }
+    free_input_packet( &packet );
+    return flush_output_track( stats, output->root, out_track->track_ID, out_media );
+}
+
+static int fill_track_slice
+(
+    input_t        *input,
+    input_track_t  *in_track,
+    uint32_t       *packet_number,
+    input_packet_t *packet,
+    uint8_t        *slice,
+    uint64_t        slice_bytes,
+    uint64_t       *slice_pos,
+    stats_t        *stats
+)
+{
+    /* Return 1 if the track reached the end of stream. */
+    *slice_pos = 0;
+    while( *slice_pos < slice_bytes )
+    {
+        if( packet->size == 0 )
+        {
+            free_input_packet( packet );
+            int ret = get_input_packet( input, in_track, (*packet_number)++, packet );
+            if( ret < 0 )
+                return ret;
+            if( ret && !get_resampler_tail( &in_track->media, packet ) )
+                return 1;
+            count_input_packet( stats, packet );
+            continue;
+        }
+        *slice_pos += stage_input_samples( &in_track->media, slice + *slice_pos,
+                                           MP4OPUSENC_MIN( slice_bytes - *slice_pos, UINT32_MAX ), packet );
+    }
+    return 0;
+}
+
+static int do_encode_multitrack
+(
+    mp4opusenc_t *enc
+)
+{
+    /* Every track has its own encoder running on its own thread. The tracks are read
+     * a slice at a time in turn, and the encoded slices are muxed in the same order
+     * so that the chunks of the tracks are interleaved in the output. */
+    input_t        *input      = &enc->input;
+    output_t       *output     = &enc->output;
+    uint32_t        num_tracks = input->file.movie.num_tracks;
+    stats_t        *stats      = enc->opus[0].stats;
+    encode_chunk_t  chunks[MAX_TRACKS];
+    input_packet_t  packets[MAX_TRACKS];
+    uint32_t        packet_numbers[MAX_TRACKS];
+    int             finished[MAX_TRACKS];
+    uint32_t        slice_frames = CHUNK_DURATION / enc->opus[0].codec.opt.frame_size;
+    int             ret          = 0;
+    memset( chunks,  0, sizeof(chunks) );
+    memset( packets, 0, sizeof(packets) );
+    for( uint32_t i = 0; i < num_tracks; i++ )
+    {
+        encoder_t      *opus   = &enc->opus[i];
+        encode_chunk_t *chunk  = &chunks[i];
+        uint32_t frame_bytes   = input->file.movie.tracks[i].media.buffer_size;
+        uint32_t padding_frames = mp4opus_get_padding_frames( &output->file.movie.tracks[i].media.mux, 0, 0 );
+        packet_numbers[i]      = 1;
+        finished[i]            = 0;
+        chunk->msenc           = opus->codec.msenc;
+        chunk->keep_state      = 1;
+        chunk->float_input     = opus->codec.float_input;
+        chunk->frame_size      = opus->codec.frame_size;
+        chunk->channels        = output->file.movie.tracks[i].media.mux.summary->channels;
+        chunk->max_packet_size = mp4opus_get_max_packet_size( opus->codec.opt.frame_size, opus->codec.stream_count );
+        chunk->packet          = lsmash_malloc( chunk->max_packet_size );
+        chunk->packet_sizes    = lsmash_malloc( (slice_frames + padding_frames) * sizeof(uint32_t) );
+        /* The frames of zeros padded at the end of the stream are reserved after the slice. */
+        if( !chunk->packet || !chunk->packet_sizes
+         || !reserve_window( opus, (uint64_t)(slice_frames + padding_frames) * frame_bytes ) )
+        {
+            ret = ERROR_MSG( "failed to allocate buffers for multi-track encoding.\n" );
+            goto done;
+        }
+    }
+    uint32_t num_active_tracks = num_tracks;
+    while( num_active_tracks )
+    {
+        /* Fill a slice of every track. */
+        stage_clock_t clk;
+        start_stage_clock( stats, &clk );
+        int active[MAX_TRACKS];
+        for( uint32_t i = 0; i < num_tracks; i++ )
+        {
+            active[i] = !finished[i];
+            if( !active[i] )
+                continue;
+            encoder_t *opus        = &enc->opus[i];
+            uint32_t   frame_bytes = input->file.movie.tracks[i].media.buffer_size;
+            uint64_t   slice_pos;
+            ret = fill_track_slice( input, &input->file.movie.tracks[i], &packet_numbers[i], &packets[i],
+                                    opus->window, (uint64_t)slice_frames * frame_bytes, &slice_pos, stats );
+            if( ret < 0 )
+                goto done;
+            if( ret )
+            {
+                /* Pad the last frame and then frames of zeros as flush_encoder() does. */
+                output_media_t *out_media    = &output->file.movie.tracks[i].media;
+                uint64_t        muxed_frames = out_media->mux.timestamp / out_media->mux.sample_duration;
+                uint64_t        padding_size = (frame_bytes - slice_pos % frame_bytes) % frame_bytes;
+                padding_size += (uint64_t)frame_bytes * mp4opus_get_padding_frames( &out_media->mux,
+                                                                                    muxed_frames + (slice_pos + padding_size) / frame_bytes,
+                                                                                    get_input_duration( &input->file.movie.tracks[i].media ) );
+                memset( opus->window + slice_pos, 0, padding_size );
+                slice_pos  += padding_size;
+                finished[i] = 1;
+                --num_active_tracks;
+            }
+            chunks[i].pcm        = opus->window;
+            chunks[i].num_frames = slice_pos / frame_bytes;
+        }
+        ret = 0;
+        stop_stage_clock( stats, &clk, STAGE_DEMUX );
+        /* Encode the slices in parallel. */
+        start_stage_clock( stats, &clk );
+        for( uint32_t i = 0; i < num_tracks; i++ )
+        {
+            if( !active[i] )
+                continue;
+            if( pthread_create( &chunks[i].thread, NULL, encode_chunk, &chunks[i] ) )
+            {
+                for( uint32_t j = 0; j < i; j++ )
+                    if( active[j] )
+                        pthread_join( chunks[j].thread, NULL );
+                ret = ERROR_MSG( "failed to create an encoding thread.\n" );
+                goto done;
+            }
+        }
+        for( uint32_t i = 0; i < num_tracks; i++ )
+            if( active[i] )
+                pthread_join( chunks[i].thread, NULL );
+        stop_stage_clock( stats, &clk, STAGE_CODEC );
+        /* Feed the encoded slices to muxer in the track order. */
+        start_stage_clock( stats, &clk );
+        for( uint32_t i = 0; i < num_tracks; i++ )
+        {
+            if( !active[i] )
+                continue;
+            output_track_t *out_track = &output->file.movie.tracks[i];
+            if( chunks[i].ret < 0
+             || mux_encoded_chunk( output->root, out_track->track_ID, &out_track->media, &chunks[i], stats ) < 0 )
+            {
+                ret = ERROR_MSG( "failed to encode track %"PRIu32".\n", input->file.movie.tracks[i].track_ID );
+                goto done;
+            }
+        }
+        stop_stage_clock( stats, &clk, STAGE_MUX );
+    }
+    for( uint32_t i = 0; i < num_tracks; i++ )
+    {
+        output_track_t *out_track = &output->file.movie.tracks[i];
+        ret = flush_output_track( stats, output->root, out_track->track_ID, &out_track->media );
+        if( ret < 0 )
+            break;
+    }
+done:
+    for( uint32_t i = 0; i < num_tracks; i++ )
+    {
+        free_input_packet( &packets[i] );
+        lsmash_free( chunks[i].packet );
+        lsmash_free( chunks[i].data );
+        lsmash_free( chunks[i].packet_sizes );
+    }
+    return ret;
+}
+
+static int cache_input_frames
+(
+    mp4opusenc_t *enc,
+    uint8_t     **cache,
+    uint32_t     *num_frames
+)
+{
+    /* Stage the whole input into the cache frame by frame as the serial encoding would.
+     * The last frame is padded with zeros, and is followed by frames of zeros
+     * until the last sample gets out of the encoder delay. */
+    input_t       *input       = &enc->input;
+    input_track_t *in_track    = &input->file.movie.tracks[0];
+    stats_t       *stats       = enc->opus[0].stats;
+    uint64_t       frame_bytes = in_track->media.buffer_size;
+    uint64_t       grow_bytes  = frame_bytes * TWO_PASS_CACHE_FRAMES;
+    uint64_t       capacity    = 0;
+    uint64_t       cached      = 0;
+    uint32_t       packet_number = 1;
+    input_packet_t packet        = { NULL };
+    int            ret           = 0;
+    stage_clock_t  clk;
+    start_stage_clock( stats, &clk );
+    while( ret == 0 )
+    {
+        if( capacity - cached < grow_bytes )
+        {
+            uint8_t *buffer = lsmash_realloc( *cache, capacity + grow_bytes );
+            if( !buffer )
+            {
+                ret = ERROR_MSG( "failed to allocate the input cache for two-pass encoding.\n" );
+                break;
+            }
+            *cache    = buffer;
+            capacity += grow_bytes;
+        }
+        uint64_t filled;
+        ret = fill_track_slice( input, in_track, &packet_number, &packet,
+                                *cache + cached, grow_bytes, &filled, stats );
+        cached += filled;
+    }
+    free_input_packet( &packet );
+    stop_stage_clock( stats, &clk, STAGE_DEMUX );
+    if( ret < 0 )
+        return ret;
+    uint64_t staged_frames = (cached + frame_bytes - 1) / frame_bytes;
+    uint64_t total_frames  = staged_frames + mp4opus_get_padding_frames( &enc->output.file.movie.tracks[0].media.mux,
+                                                                         staged_frames,
+                                                                         get_input_duration( &in_track->media ) );
+    if( total_frames > UINT32_MAX )
+        return ERROR_MSG( "input is too long for two-pass encoding.\n" );
+    if( total_frames * frame_bytes > capacity )
+    {
+        uint8_t *buffer = lsmash_realloc( *cache, total_frames * frame_bytes );
+        if( !buffer )
+            return ERROR_MSG( "failed to allocate the input cache for two-pass encoding.\n" );
+        *cache = buffer;
+    }
+    memset( *cache + cached, 0, total_frames * frame_bytes - cached );
+    *num_frames = total_frames;
+    return 0;
+}
+
+static int analyze_cached_frames
+(
+    encoder_t      *opus,
+    output_media_t *out_media,
+    const uint8_t  *cache,
+    uint64_t        frame_bytes,
+    uint32_t        num_frames,
+    opus_int32      bitrate,
+    uint32_t       *frame_sizes
+)
+{
+    /* The first pass runs at the lowest complexity and records the size of each VBR packet,
+     * which tells how hard the frame is to be coded at the average bitrate. */
+    stage_clock_t clk;
+    start_stage_clock( opus->stats, &clk );
+    if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_COMPLEXITY( 0 ) ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_BITRATE( bitrate ) ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_VBR( 1 ) ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_VBR_CONSTRAINT( 0 ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to set up the first pass.\n" );
+    for( uint32_t i = 0; i < num_frames; i++ )
+    {
+        int ret = mp4opus_encode_pcm( opus->codec.msenc,
+                                      cache + i * frame_bytes,
+                                      opus->codec.float_input,
+                                      opus->codec.frame_size,
+                                      out_media->mux.packet_buffer,
+                                      out_media->mux.packet_buffer_size );
+        if( ret < 0 )
+            return ERROR_MSG( "failed to encode in the first pass.\n" );
+        frame_sizes[i] = MP4OPUSENC_MAX( ret, 1 );
+    }
+    /* Restore the configuration for the second pass. */
+    if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_RESET_STATE ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_COMPLEXITY( opus->codec.opt.complexity ) ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_VBR( opus->codec.opt.vbr > 0 ? 1 : 0 ) ) != OPUS_OK
+     || opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_VBR_CONSTRAINT( opus->codec.opt.vbr > 0 ? 1 : 0 ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to set up the second pass.\n" );
+    stop_stage_clock( opus->stats, &clk, STAGE_CODEC );
+    return 0;
+}
+
+static int do_encode_two_pass
+(
+    mp4opusenc_t *enc
+)
+{
+    output_t       *output      = &enc->output;
+    output_track_t *out_track   = &output->file.movie.tracks[0];
+    encoder_t      *opus        = &enc->opus[0];
+    uint64_t        frame_bytes = enc->input.file.movie.tracks[0].media.buffer_size;
+    uint8_t        *cache       = NULL;
+    uint32_t       *frame_sizes = NULL;
+    uint32_t        num_frames  = 0;
+    int             ret         = cache_input_frames( enc, &cache, &num_frames );
+    if( ret < 0 )
+        goto done;
+    /* Decide the budget for the Opus packets. */
+    double   frames_per_second = (double)opus->codec.config.sample_rate / opus->codec.frame_size;
+    double   target_bytes;
+    if( opus->opt.target_size )
+    {
+        /* Leave the room for the container, mostly the sample table. */
+        uint64_t overhead = TWO_PASS_FILE_OVERHEAD + (uint64_t)TWO_PASS_SAMPLE_OVERHEAD * num_frames;
+        if( opus->opt.target_size <= overhead )
+        {
+            ret = ERROR_MSG( "target size is too small for the input.\n" );
+            goto done;
+        }
+        target_bytes = opus->opt.target_size - overhead;
+    }
+    else
+        target_bytes = (double)opus->codec.opt.bitrate / 8 * num_frames / frames_per_second;
+    uint32_t   channels        = out_track->media.mux.summary->channels;
+    opus_int32 min_bitrate     = 500    * channels;
+    opus_int32 max_bitrate     = 256000 * channels;
+    opus_int32 average_bitrate = MP4OPUSENC_MIN( MP4OPUSENC_MAX( target_bytes * 8 * frames_per_second / num_frames,
+                                                                 min_bitrate ), max_bitrate );
+    /* First pass */
+    frame_sizes = lsmash_malloc( num_frames * sizeof(uint32_t) );
+    if( !frame_sizes )
+    {
+        ret = ERROR_MSG( "failed to allocate the statistics for two-pass encoding.\n" );
+        goto done;
+    }
+    ret = analyze_cached_frames( opus, &out_track->media, cache, frame_bytes, num_frames, average_bitrate, frame_sizes );
+    if( ret < 0 )
+        goto done;
+    double planned_bytes = 0;
+    for( uint32_t i = 0; i < num_frames; i++ )
+        planned_bytes += frame_sizes[i];
+    /* Second pass
+     * Each frame is given its share of the budget in proportion to its size in the first pass.
+     * The shares of the remaining frames are scaled by the budget actually remaining
+     * so that the errors of the former frames are compensated by the latter ones. */
+    double nominal_scale = target_bytes / planned_bytes;
+    double used_bytes    = 0;
+    for( uint32_t i = 0; i < num_frames; i++ )
+    {
+        double scale = (target_bytes - used_bytes) / planned_bytes;
+        scale = MP4OPUSENC_MIN( MP4OPUSENC_MAX( scale, nominal_scale / 2 ), nominal_scale * 2 );
+        opus_int32 bitrate = frame_sizes[i] * scale * 8 * frames_per_second;
+        bitrate = MP4OPUSENC_MIN( MP4OPUSENC_MAX( bitrate, min_bitrate ), max_bitrate );
+        if( opus_multistream_encoder_ctl( opus->codec.msenc, OPUS_SET_BITRATE( bitrate ) ) != OPUS_OK )
+        {
+            ret = ERROR_MSG( "failed to set bitrate.\n" );
+            goto done;
+        }
+        ret = encode_frame( opus, output->root, out_track->track_ID, &out_track->media, cache + i * frame_bytes );
+        if( ret < 0 )
+            goto done;
+        used_bytes    += ret;
+        planned_bytes -= frame_sizes[i];
+    }
+    ret = flush_output_track( opus->stats, output->root, out_track->track_ID, &out_track->media );
+done:
+    lsmash_free( frame_sizes );
+    lsmash_free( cache );
+    return ret;
+}
+
+static int do_encode
+(
+    mp4opusenc_t *enc
+)
+{
+    if( enc->input.file.movie.num_tracks > 1 )
+    {
+        if( enc->opus[0].opt.threads > 1 )
+            WARNING_MSG( "--threads is ignored for multiple tracks, each of which is encoded on its own thread.\n" );
+        if( enc->opus[0].opt.two_pass )
+            return ERROR_MSG( "two-pass encoding supports a single track only.\n" );
+        if( enc->opt.pipeline )
+            WARNING_MSG( "--pipeline is ignored for multiple tracks.\n" );
+        return do_encode_multitrack( enc );
+    }
+    if( enc->opt.live )
+    {
+        if( enc->opus[0].opt.threads > 1 || enc->opt.pipeline )
+            WARNING_MSG( "--threads and --pipeline are ignored in live mode.\n" );
+        return do_encode_serial( enc );
+    }
+    if( enc->opus[0].opt.two_pass )
+    {
+        if( enc->opus[0].opt.threads > 1 )
+            WARNING_MSG( "--threads is ignored for two-pass encoding.\n" );
+        if( enc->opt.pipeline )
+            WARNING_MSG( "--pipeline is ignored for two-pass encoding.\n" );
+        return do_encode_two_pass( enc );
     }
-    in_media->buffer      = buffer;
-    in_media->buffer_size = buffer_size;
-    out_track->media.priming_samples  = param->PreSkip;
-    out_track->media.preroll_distance = (80 - 1) / opus->opt.frame_size + 1;    /* require at least 80ms for pre-roll */
-    out_track->media.sample_duration  = 48000 * opus->opt.frame_size / 1000;
-    if( lsmash_add_codec_specific_data( (lsmash_summary_t *)out_summary, cs ) < 0 )
+    if( enc->opus[0].opt.threads > 1 )
     {
-        lsmash_destroy_codec_specific_data( cs );
-        return ERROR_MSG( "failed to add Opus specific info.\n" );
+        if( enc->opt.pipeline )
+            WARNING_MSG( "--pipeline is ignored for parallel encoding.\n" );
+        return do_encode_parallel( enc );
     }
-    lsmash_destroy_codec_specific_data( cs );
-    out_track->media.sample_entry = lsmash_add_sample_entry( output->root, out_track->track_ID, out_summary );
-    if( !out_track->media.sample_entry )
-        return ERROR_MSG( "failed to add sample description entry.\n" );
-    return 0;
+    if( enc->opt.pipeline )
+        return do_encode_pipelined( enc );
+    return do_encode_serial( enc );
 }
 
-static void free_input_packet
+static int construct_timeline_maps
 (
-    input_packet_t *packet
+    mp4opusenc_t *enc
 )
 {
-    lsmash_delete_sample( packet->sample );
+    output_t *output = &enc->output;
+    char      error[MP4OPUS_ERROR_LENGTH];
+    for( uint32_t i = 0; i < output->file.movie.num_tracks; i++ )
+    {
+        output_track_t *out_track = &output->file.movie.tracks[i];
+        uint64_t        duration  = get_input_duration( &enc->input.file.movie.tracks[i].media );
+        if( mp4opus_construct_timeline_map( output->root, out_track->track_ID, &out_track->media.mux, duration, error ) < 0 )
+            return ERROR_MSG( "%s", error );
+    }
+    return 0;
 }
 
-static int get_input_packet
+static int finish_segment
 (
-    lsmash_root_t  *in_root,
-    uint32_t        in_track_ID,
-    input_media_t  *in_media,
-    uint32_t        packet_number,
-    input_packet_t *packet
+    mp4opusenc_t *enc
 )
 {
-    lsmash_sample_t *sample = lsmash_get_sample_from_media_timeline( in_root, in_track_ID, packet_number );
-    if( !sample )
+    output_media_t      *out_media = &enc->output.file.movie.tracks[0].media;
+    input_media_t       *in_media  = &enc->input.file.movie.tracks[0].media;
+    mp4opusseg_header_t *header    = &out_media->segment_header;
+    if( header->num_packets == 0 )
+        return ERROR_MSG( "the segment starts after the end of the input.\n" );
+    if( header->flags & MP4OPUSSEG_FLAG_LAST )
     {
-        if( lsmash_check_sample_existence_in_media_timeline( in_root, in_track_ID, packet_number ) )
-            return ERROR_MSG( "failed to get sample.\n" );
-        lsmash_sample_t sample_info = { 0 };
-        if( lsmash_get_sample_info_from_media_timeline( in_root, in_track_ID, packet_number, &sample_info ) < 0 )
-            /* No more samples. So, reached EOF. */
-            return 1;
-        else
-            return ERROR_MSG( "failed to get sample.\n" );
+        /* Trim the end of the stream as construct_timeline_maps() does.
+         * The padding alone is left to the segment ending at the end of the input. */
+        uint64_t duration = get_input_duration( in_media );
+        uint64_t start    = header->start_packet * header->sample_duration;
+        if( duration <= start )
+            return ERROR_MSG( "the segment starts after the end of the input.\n" );
+        header->duration = duration - start;
     }
     else
-    {
-        packet->data = sample->data;
-        packet->size = sample->length;
-        in_media->num_samples += packet->size / in_media->summaries[0].summary->bytes_per_frame;
-    }
-    packet->sample = sample;
+        header->duration = header->num_packets * header->sample_duration;
+    if( fseek( out_media->segment, 0, SEEK_SET )
+     || mp4opus_seg_write_header( out_media->segment, header ) < 0
+     || fflush( out_media->segment ) )
+        return ERROR_MSG( "failed to write the segment header.\n" );
     return 0;
 }
 
-static int feed_packet_to_encoder
+static int is_same_segment_config
 (
-    encoder_t      *opus,
-    lsmash_root_t  *out_root,
-    uint32_t        out_track_ID,
-    output_media_t *out_media,
-    input_media_t  *in_media,
-    input_packet_t *packet
+    mp4opusseg_header_t *a,
+    mp4opusseg_header_t *b
 )
 {
-    do
-    {
-        /* Copy data from input packet to invalid region. */
-        uint8_t *invalid      = in_media->buffer      + in_media->buffer_pos;
-        uint32_t invalid_size = in_media->buffer_size - in_media->buffer_pos;
-        uint32_t padding_size = 0;
-        if( packet->data )
-        {
-            uint32_t consumed_size = MP4OPUSENC_MIN( invalid_size, packet->size );
-            memcpy( invalid, packet->data, consumed_size );
-            in_media->buffer_pos += consumed_size;
-            packet->data         += consumed_size;
-            packet->size         -= consumed_size;
-        }
-        else
-        {
-            memset( invalid, 0, invalid_size );
-            padding_size = invalid_size;
-            in_media->buffer_pos = in_media->buffer_size;
-        }
-        if( in_media->buffer_pos >= in_media->buffer_size )
-        {
-            in_media->buffer_pos = 0;
-            lsmash_sample_t *out_sample = lsmash_create_sample( (1275 * 3 + 7) * opus->stream_count );
-            if( !out_sample )
-                return ERROR_MSG( "failed to allocate sample.\n" );
-            int ret = opus_multistream_encode( opus->msenc,
-                                               (const opus_int16 *)in_media->buffer,
-                                               opus->frame_size,
-                                               out_sample->data,
-                                               out_sample->length );
-            if( ret < 0 )
-            {
-                lsmash_delete_sample( out_sample );
-                return ERROR_MSG( "failed to encode.\n" );
-            }
-            else if( ret == 0 )
-            {
-                lsmash_delete_sample( out_sample );
-                continue;
-            }
-            /* Feed encoded packet to muxer. */
-            out_sample->length                 = ret;
-            out_sample->dts                    = out_media->timestamp;
-            out_sample->cts                    = out_media->timestamp;
-            out_sample->index                  = out_media->sample_entry;
-            out_sample->prop.ra_flags          = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
-            out_sample->prop.pre_roll.distance = out_media->preroll_distance;
-            if( lsmash_append_sample( out_root, out_track_ID, out_sample ) < 0 )
-            {
-                lsmash_delete_sample( out_sample );
-                return ERROR_MSG( "failed to append sample.\n" );
-            }
-            if( padding_size != in_media->buffer_size )
-                out_media->timestamp += out_media->sample_duration;
-        }
-    } while( packet->size );
-    return 0;
+    return a->sample_duration        == b->sample_duration
+        && a->pre_roll_distance      == b->pre_roll_distance
+        && a->input_sample_rate      == b->input_sample_rate
+        && a->pre_skip               == b->pre_skip
+        && a->output_gain            == b->output_gain
+        && a->output_channel_count   == b->output_channel_count
+        && a->channel_mapping_family == b->channel_mapping_family
+        && a->stream_count           == b->stream_count
+        && a->coupled_count          == b->coupled_count
+        && !memcmp( a->channel_mapping, b->channel_mapping, a->output_channel_count );
 }
 
-static int flush_encoder
+static int prepare_stitch_output
 (
-    encoder_t      *opus,
-    lsmash_root_t  *out_root,
-    uint32_t        out_track_ID,
-    output_media_t *out_media,
-    input_media_t  *in_media
+    mp4opusenc_t        *enc,
+    mp4opusseg_header_t *header
 )
 {
-    input_packet_t packet = { NULL };
-    int ret = feed_packet_to_encoder( opus, out_root, out_track_ID, out_media, in_media, &packet );
+    output_t       *output    = &enc->output;
+    output_track_t *out_track = &output->file.movie.tracks[0];
+    output_media_t *out_media = &out_track->media;
+    output->file.movie.num_tracks = 1;
+    if( prepare_output_movie( enc ) < 0
+     || create_output_track( output, out_track ) < 0 )
+        return -1;
+    lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS,
+                                                                     LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !cs )
+        return ERROR_MSG( "failed to create Opus specific info.\n" );
+    lsmash_opus_specific_parameters_t *param = (lsmash_opus_specific_parameters_t *)cs->data.structured;
+    param->Version              = 0;
+    param->OutputChannelCount   = header->output_channel_count;
+    param->PreSkip              = header->pre_skip;
+    param->InputSampleRate      = header->input_sample_rate;
+    param->OutputGain           = header->output_gain;
+    param->ChannelMappingFamily = header->channel_mapping_family;
+    param->StreamCount          = header->stream_count;
+    param->CoupledCount         = header->coupled_count;
+    memcpy( param->ChannelMapping, header->channel_mapping, header->output_channel_count );
+    /* The pre-roll is taken over from the segments, which may be encoded by another build. */
+    char error[MP4OPUS_ERROR_LENGTH];
+    int  ret = mp4opus_prepare_output_media( &out_media->mux, param, header->sample_duration / 48.0, error );
+    if( ret == 0 )
+    {
+        out_media->mux.preroll_distance = header->pre_roll_distance;
+        ret = mp4opus_add_output_entry( output->root, out_track->track_ID, &out_media->mux, cs, 0, error );
+    }
+    lsmash_destroy_codec_specific_data( cs );
     if( ret < 0 )
-        return ret;
-    if( lsmash_flush_pooled_samples( out_root, out_track_ID, out_media->sample_duration ) < 0 )
-        return ERROR_MSG( "failed to flush samples.\n" );
+        return ERROR_MSG( "%s", error );
     return 0;
 }
 
-static int do_encode
+static int stitch_segment
 (
-    mp4opusenc_t *enc
+    mp4opusenc_t        *enc,
+    FILE                *segment,
+    mp4opusseg_header_t *header,
+    const char          *name
 )
 {
-    input_t  *input     = &enc->input;
-    output_t *output    = &enc->output;
-    int       eof       = 0;
-    for( uint32_t packet_number = 1; !eof; packet_number++ )
+    output_t       *output    = &enc->output;
+    output_track_t *out_track = &output->file.movie.tracks[0];
+    for( uint64_t i = 0; i < header->num_packets; i++ )
     {
-        input_packet_t packet = { NULL };
-        int ret = get_input_packet( input->root,
-                                    input->file.movie.track.track_ID,
-                                    &input->file.movie.track.media,
-                                    packet_number,
-                                    &packet );
-        if( ret < 0 )
-            return ret;
-        eof = ret;
-        ret = feed_packet_to_encoder( &enc->opus,
-                                      output->root,
-                                      output->file.movie.track.track_ID,
-                                      &output->file.movie.track.media,
-                                      &input->file.movie.track.media,
-                                      &packet );
-        free_input_packet( &packet );
-        if( ret < 0 )
-            return ret;
+        uint32_t size;
+        if( mp4opus_seg_read_size( segment, &size ) < 0 || size == 0 )
+            return ERROR_MSG( "%s is truncated or broken.\n", name );
+        lsmash_sample_t *sample = lsmash_create_sample( size );
+        if( !sample )
+            return ERROR_MSG( "failed to allocate sample.\n" );
+        if( fread( sample->data, 1, size, segment ) != size )
+        {
+            lsmash_delete_sample( sample );
+            return ERROR_MSG( "%s is truncated or broken.\n", name );
+        }
+        if( mux_opus_packet( output->root, out_track->track_ID, &out_track->media, sample ) < 0 )
+            return -1;
+        count_output_packet( enc->opus[0].stats, size );
     }
-    return flush_encoder( &enc->opus,
-                          output->root,
-                          output->file.movie.track.track_ID,
-                          &output->file.movie.track.media,
-                          &input->file.movie.track.media );
+    return 0;
 }
 
-static int construct_timeline_maps
+static int do_stitch
 (
     mp4opusenc_t *enc
 )
 {
-    output_t       *output    = &enc->output;
-    output_track_t *out_track = &output->file.movie.track;
-    input_media_t  *in_media  = &enc->input.file.movie.track.media;
-    lsmash_edit_t edit =
+    /* The segments are concatenated into a track, which is trimmed by an edit as construct_timeline_maps() does. */
+    output_t            *output      = &enc->output;
+    output_track_t      *out_track   = &output->file.movie.tracks[0];
+    mp4opusseg_header_t  first       = { 0 };
+    uint64_t             next_packet = 0;
+    uint64_t             duration    = 0;
+    int                  last        = 0;
+    for( uint32_t i = 0; i < enc->opt.num_segments; i++ )
     {
-        .duration   = ((double)in_media->num_samples * 48000) / in_media->summaries[0].summary->frequency,
-        .start_time = out_track->media.priming_samples,
-        .rate       = ISOM_EDIT_MODE_NORMAL
-    };
-    if( lsmash_create_explicit_timeline_map( output->root, out_track->track_ID, edit ) < 0 )
-        return ERROR_MSG( "failed to create explicit timeline map.\n" );
+        const char *name    = enc->opt.segments[i];
+        FILE       *segment = fopen( name, "rb" );
+        if( !segment )
+            return ERROR_MSG( "failed to open %s.\n", name );
+        mp4opusseg_header_t header;
+        int ret = 0;
+        if( mp4opus_seg_read_header( segment, &header ) < 0 || header.magic != MP4OPUSSEG_MAGIC )
+            ret = ERROR_MSG( "%s is not a packet segment.\n", name );
+        else if( header.version != MP4OPUSSEG_VERSION )
+            ret = ERROR_MSG( "the version of %s is not supported.\n", name );
+        else if( i && !is_same_segment_config( &first, &header ) )
+            ret = ERROR_MSG( "%s is encoded with another configuration.\n", name );
+        else if( last || header.start_packet != next_packet )
+            ret = ERROR_MSG( "%s does not follow the previous segment.\n", name );
+        else if( i == 0 )
+        {
+            first = header;
+            ret   = prepare_stitch_output( enc, &header );
+        }
+        if( ret == 0 )
+            ret = stitch_segment( enc, segment, &header, name );
+        fclose( segment );
+        if( ret < 0 )
+            return ret;
+        next_packet  = header.start_packet + header.num_packets;
+        duration    += header.duration;
+        last         = header.flags & MP4OPUSSEG_FLAG_LAST;
+    }
+    if( !last )
+        return ERROR_MSG( "the segments do not reach the end of the stream.\n" );
+    char error[MP4OPUS_ERROR_LENGTH];
+    if( mp4opus_flush_output_track( output->root, out_track->track_ID, &out_track->media.mux, error ) < 0
+     || mp4opus_construct_timeline_map( output->root, out_track->track_ID, &out_track->media.mux, duration, error ) < 0 )
+        return ERROR_MSG( "%s", error );
     return 0;
 }
 
@@ -956,6 +3294,73 @@ static void write_tool_indicator( lsmash_root_t *root )
         ERROR_MSG( "failed to write the tool specific tag.\n" );
 }
 
+static int write_packet_index
+(
+    mp4opusenc_t *enc
+)
+{
+    /* The packets may be moved by the remux, so their offsets are taken from the finished file.
+     * The timeline of the file is walked only here so that the consumers of the index never have to. */
+    output_track_t *out_track = &enc->output.file.movie.tracks[0];
+    output_media_t *out_media = &out_track->media;
+    fflush( NULL );
+    lsmash_root_t *root = lsmash_create_root();
+    if( !root )
+        return ERROR_MSG( "failed to create ROOT for the packet index.\n" );
+    int ret = -1;
+    lsmash_file_parameters_t file_param = { 0 };
+    if( lsmash_open_file( enc->output.file.name, 1, &file_param ) < 0 )
+    {
+        ERROR_MSG( "failed to reopen output file for the packet index.\n" );
+        goto fail;
+    }
+    lsmash_file_t *fh = lsmash_set_file( root, &file_param );
+    if( !fh
+     || lsmash_read_file( fh, &file_param ) < 0
+     || lsmash_construct_timeline( root, out_track->track_ID ) < 0 )
+    {
+        ERROR_MSG( "failed to read output file for the packet index.\n" );
+        goto fail;
+    }
+    for( uint64_t i = 0; i < out_media->num_index_entries; i++ )
+    {
+        lsmash_sample_t sample_info = { 0 };
+        if( i >= UINT32_MAX
+         || lsmash_get_sample_info_from_media_timeline( root, out_track->track_ID, i + 1, &sample_info ) < 0
+         || sample_info.length != out_media->index[i].size )
+        {
+            ERROR_MSG( "failed to get the offset of packet %"PRIu64".\n", i + 1 );
+            goto fail;
+        }
+        out_media->index[i].offset = sample_info.pos;
+    }
+    FILE *fp = fopen( enc->opt.index, "wb" );
+    if( !fp )
+    {
+        ERROR_MSG( "failed to open %s to write the packet index.\n", enc->opt.index );
+        goto fail;
+    }
+    mp4opusidx_header_t header =
+    {
+        .magic       = MP4OPUSIDX_MAGIC,
+        .version     = MP4OPUSIDX_VERSION,
+        .track_ID    = out_track->track_ID,
+        .timescale   = 48000,
+        .num_entries = out_media->num_index_entries
+    };
+    if( fwrite( &header, sizeof(header), 1, fp ) != 1
+     || fwrite( out_media->index, sizeof(mp4opusidx_entry_t), out_media->num_index_entries, fp ) != out_media->num_index_entries )
+        ERROR_MSG( "failed to write the packet index.\n" );
+    else
+        ret = 0;
+    if( fclose( fp ) && ret == 0 )
+        ret = ERROR_MSG( "failed to write the packet index.\n" );
+fail:
+    lsmash_close_file( &file_param );
+    lsmash_destroy_root( root );
+    return ret;
+}
+
 static int moov_to_front_callback
 (
     void    *param,
@@ -963,30 +3368,383 @@ static int moov_to_front_callback
     uint64_t total_movie_size
 )
 {
+    mp4opusenc_t *enc = (mp4opusenc_t *)param;
+    if( enc->opus[0].stats )
+        enc->opus[0].stats->finalized_bytes = total_movie_size;
+    if( enc->opt.batch )
+        return 0;   /* Progress of concurrent jobs would be garbled. */
     REFRESH_CONSOLE;
     eprintf( "Finalizing: [%5.2lf%%]\r", ((double)written_movie_size / total_movie_size) * 100.0 );
     return 0;
 }
 
+static uint32_t get_remux_buffer_size
+(
+    mp4opusenc_t *enc
+)
+{
+    if( enc->opt.remux_buffer )
+        /* 4096MiB does not fit in the buffer size of L-SMASH, so it is clamped. */
+        return MP4OPUSENC_MIN( (uint64_t)enc->opt.remux_buffer * 1024 * 1024, UINT32_MAX );
+    /* Every Opus sample has the same duration, so the movie header grows mainly with
+     * the sample size table (4 bytes per sample) and the chunk offset table (8 bytes per chunk
+     * of about 0.5 seconds). The remux is done in a single pass per buffer, so make it hold
+     * twice of the movie header at least. */
+    uint64_t moov_size = 64 * 1024;
+    for( uint32_t i = 0; i < enc->output.file.movie.num_tracks; i++ )
+    {
+        output_media_t *out_media   = &enc->output.file.movie.tracks[i].media;
+        uint64_t        num_samples = out_media->mux.timestamp / out_media->mux.sample_duration;
+        uint64_t        num_chunks  = out_media->mux.timestamp / 24000 + 1;
+        moov_size += num_samples * 4 + num_chunks * 8;
+    }
+    return MP4OPUSENC_MIN( MP4OPUSENC_MAX( 2 * moov_size, 4 * 1024 * 1024 ), (uint64_t)1 << 30 );
+}
+
 static int finish_movie
 (
     mp4opusenc_t *enc
 )
 {
     output_t *output = &enc->output;
-    REFRESH_CONSOLE;
-    static lsmash_adhoc_remux_t moov_to_front =
+    if( !enc->opt.batch )
+        REFRESH_CONSOLE;
+    lsmash_adhoc_remux_t moov_to_front =
     {
         .func        = moov_to_front_callback,
-        .buffer_size = 4 * 1024 * 1024, /* 4MiB */
-        .param       = NULL
+        .buffer_size = get_remux_buffer_size( enc ),
+        .param       = enc
     };
-    if( lsmash_finish_movie( output->root, &moov_to_front ) < 0 )
+    stage_clock_t clk;
+    start_stage_clock( enc->opus[0].stats, &clk );
+    /* The movie header of a fragmented movie is already at the beginning. */
+    int remux = !enc->opt.fragment && !enc->opt.no_faststart;
+    if( lsmash_finish_movie( output->root, remux ? &moov_to_front : NULL ) < 0 )
         return ERROR_MSG( "failed to finalize output movie.\n" );
+    if( output->file.movie.tracks[0].media.live )
+        settle_live_latency( output->file.movie.tracks[0].media.live );
     write_tool_indicator( output->root );
+    if( enc->opt.index && write_packet_index( enc ) < 0 )
+        return -1;
+    stop_stage_clock( enc->opus[0].stats, &clk, STAGE_FINALIZE );
+    return 0;
+}
+
+static int encode_file
+(
+    mp4opusenc_t *enc
+)
+{
+    if( open_input_file( enc ) < 0 )
+        return -1;
+    if( prepare_output( enc ) < 0 )
+        return ERROR_MSG( "failed to set up preparation for output.\n" );
+    if( do_encode( enc ) < 0 )
+        return ERROR_MSG( "failed to encode.\n" );
+    if( construct_timeline_maps( enc ) < 0 )
+        return ERROR_MSG( "failed to construct timeline maps.\n" );
+    if( finish_movie( enc ) < 0 )
+        return ERROR_MSG( "failed to finish output movie.\n" );
+    return 0;
+}
+
+static void cleanup_batch
+(
+    batch_t *batch
+)
+{
+    for( uint32_t i = 0; i < batch->num_entries; i++ )
+        lsmash_free( batch->entries[i].input );    /* The output file name shares the allocation. */
+    lsmash_free( batch->entries );
+}
+
+static int read_batch_manifest
+(
+    batch_t    *batch,
+    const char *name
+)
+{
+    FILE *manifest = fopen( name, "rb" );
+    if( !manifest )
+        return ERROR_MSG( "failed to open manifest: %s.\n", name );
+    char     line[4096];
+    uint32_t line_number    = 0;
+    uint32_t entry_capacity = 0;
+    while( fgets( line, sizeof(line), manifest ) )
+    {
+        ++line_number;
+        size_t length = strlen( line );
+        if( length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof( manifest ) )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "line %"PRIu32" in manifest is too long.\n", line_number );
+        }
+        while( length && (line[length - 1] == '\n' || line[length - 1] == '\r') )
+            line[--length] = '\0';
+        if( length == 0 || line[0] == '#' )
+            continue;
+        char *separator = strchr( line, '\t' );
+        if( !separator || separator == line || separator[1] == '\0' )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "line %"PRIu32" in manifest is not a pair of input and output.\n", line_number );
+        }
+        if( batch->num_entries == entry_capacity )
+        {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            batch_entry_t *entries = lsmash_realloc( batch->entries, entry_capacity * sizeof(batch_entry_t) );
+            if( !entries )
+            {
+                fclose( manifest );
+                return ERROR_MSG( "failed to allocate manifest entries.\n" );
+            }
+            batch->entries = entries;
+        }
+        char *names = lsmash_malloc( length + 1 );
+        if( !names )
+        {
+            fclose( manifest );
+            return ERROR_MSG( "failed to allocate manifest entry.\n" );
+        }
+        *separator = '\0';
+        memcpy( names, line, length + 1 );
+        batch_entry_t *entry = &batch->entries[ batch->num_entries++ ];
+        entry->input  = names;
+        entry->output = names + (separator - line) + 1;
+    }
+    fclose( manifest );
+    if( batch->num_entries == 0 )
+        return ERROR_MSG( "no files to encode in manifest.\n" );
     return 0;
 }
 
+static void *batch_worker
+(
+    void *arg
+)
+{
+    batch_worker_t *worker = (batch_worker_t *)arg;
+    batch_t        *batch  = worker->batch;
+    mp4opusenc_t   *enc    = &worker->enc;
+    while( 1 )
+    {
+        pthread_mutex_lock( &batch->mutex );
+        uint32_t entry_number = batch->next_entry++;
+        pthread_mutex_unlock( &batch->mutex );
+        if( entry_number >= batch->num_entries )
+            break;
+        batch_entry_t *entry = &batch->entries[entry_number];
+        enc->input.file.name  = entry->input;
+        enc->output.file.name = entry->output;
+        int ret = encode_file( enc );
+        mp4opus_loudness_t *loudness = enc->input.file.movie.num_tracks ? enc->input.file.movie.tracks[0].media.loudness : NULL;
+        double integrated = loudness ? mp4opus_loudness_integrated( loudness ) : 0;
+        double range      = loudness ? mp4opus_loudness_range( loudness )      : 0;
+        double true_peak  = loudness ? mp4opus_loudness_true_peak( loudness )  : 0;
+        /* Keep the encoders for the next file unless they might be broken. */
+        cleanup_input_movie( &enc->input );
+        cleanup_output_movie( &enc->output );
+        memset( &enc->input,  0, sizeof(input_t) );
+        memset( &enc->output, 0, sizeof(output_t) );
+        if( ret < 0 )
+            for( int i = 0; i < MAX_TRACKS; i++ )
+                cleanup_encoder( &enc->opus[i] );
+        pthread_mutex_lock( &batch->mutex );
+        printf( "%s\t%s\t%s", ret < 0 ? "FAILED" : "OK", entry->input, entry->output );
+        if( enc->opt.loudness )
+            printf( "\t%.1lf\t%.1lf\t%.1lf", integrated, range, true_peak );
+        printf( "\n" );
+        fflush( stdout );
+        if( ret < 0 )
+            ++batch->num_failures;
+        pthread_mutex_unlock( &batch->mutex );
+    }
+    for( int i = 0; i < MAX_TRACKS; i++ )
+        cleanup_encoder( &enc->opus[i] );
+    return NULL;
+}
+
+static int do_batch
+(
+    mp4opusenc_t *enc
+)
+{
+    batch_t batch = { NULL };
+    if( read_batch_manifest( &batch, enc->opt.batch ) < 0 )
+    {
+        cleanup_batch( &batch );
+        return -1;
+    }
+    uint32_t num_workers = MP4OPUSENC_MIN( (uint32_t)enc->opt.jobs, batch.num_entries );
+    batch_worker_t *workers = lsmash_malloc_zero( num_workers * sizeof(batch_worker_t) );
+    if( !workers || pthread_mutex_init( &batch.mutex, NULL ) )
+    {
+        lsmash_free( workers );
+        cleanup_batch( &batch );
+        return ERROR_MSG( "failed to set up batch workers.\n" );
+    }
+    uint32_t num_active_workers = 0;
+    for( uint32_t i = 0; i < num_workers; i++ )
+    {
+        batch_worker_t *worker = &workers[i];
+        worker->batch        = &batch;
+        worker->enc.opt      = enc->opt;
+        worker->enc.opus[0].opt = enc->opus[0].opt;
+        if( pthread_create( &worker->thread, NULL, batch_worker, worker ) )
+        {
+            WARNING_MSG( "failed to create a batch worker.\n" );
+            break;
+        }
+        ++num_active_workers;
+    }
+    for( uint32_t i = 0; i < num_active_workers; i++ )
+        pthread_join( workers[i].thread, NULL );
+    int ret = 0;
+    if( num_active_workers == 0 )
+        ret = ERROR_MSG( "no batch worker is available.\n" );
+    else if( batch.num_failures )
+        ret = ERROR_MSG( "%"PRIu32" of %"PRIu32" files failed to be encoded.\n", batch.num_failures, batch.num_entries );
+    else
+        eprintf( "Batch encoding completed!\n" );
+    pthread_mutex_destroy( &batch.mutex );
+    lsmash_free( workers );
+    cleanup_batch( &batch );
+    return ret;
+}
+
+static void report_stats
+(
+    mp4opusenc_t *enc
+)
+{
+    static const char *stage_names[STAGE_COUNT] = { "demux", "encode", "mux", "finalize" };
+    stats_t *stats = enc->opus[0].stats;
+    if( !stats )
+        return;
+    uint64_t inplace_bytes = 0;
+    uint64_t copied_bytes  = 0;
+    for( uint32_t i = 0; i < enc->input.file.movie.num_tracks; i++ )
+    {
+        inplace_bytes += enc->input.file.movie.tracks[i].media.inplace_bytes;
+        copied_bytes  += enc->input.file.movie.tracks[i].media.copied_bytes;
+    }
+    double average_packet_size = stats->output_packets ? (double)stats->output_bytes / stats->output_packets : 0;
+    double inplace_share       = inplace_bytes ? 100.0 * inplace_bytes / (inplace_bytes + copied_bytes) : 0;
+    if( enc->opt.stats )
+    {
+        eprintf( "Statistics:\n" );
+        for( int i = 0; i < STAGE_COUNT; i++ )
+            eprintf( "    %-8s : wall %.6lf sec, cpu %.6lf sec\n", stage_names[i], stats->stages[i].wall, stats->stages[i].cpu );
+        eprintf( "    input    : %"PRIu64" packets, %"PRIu64" bytes"
+                 " (%"PRIu64" bytes encoded in place, %"PRIu64" bytes copied, %.1lf%% in place)\n",
+                 stats->input_packets, stats->input_bytes, inplace_bytes, copied_bytes, inplace_share );
+        eprintf( "    output   : %"PRIu64" packets, %"PRIu64" bytes\n", stats->output_packets, stats->output_bytes );
+        eprintf( "    packet   : min %"PRIu32" bytes, avg %.2lf bytes, max %"PRIu32" bytes\n",
+                 stats->min_packet_size, average_packet_size, stats->max_packet_size );
+        eprintf( "    alloc    : %"PRIu64" samples\n", stats->allocations );
+        eprintf( "    finalize : %"PRIu64" bytes moved\n", stats->finalized_bytes );
+    }
+    if( enc->opt.stats_json )
+    {
+        FILE *fp = fopen( enc->opt.stats_json, "wb" );
+        if( !fp )
+        {
+            WARNING_MSG( "failed to open %s to write statistics.\n", enc->opt.stats_json );
+            return;
+        }
+        fprintf( fp, "{\n  \"stages\": {\n" );
+        for( int i = 0; i < STAGE_COUNT; i++ )
+            fprintf( fp, "    \"%s\": { \"wall\": %.6lf, \"cpu\": %.6lf }%s\n",
+                     stage_names[i], stats->stages[i].wall, stats->stages[i].cpu, i == STAGE_COUNT - 1 ? "" : "," );
+        fprintf( fp, "  },\n" );
+        fprintf( fp, "  \"input\": { \"packets\": %"PRIu64", \"bytes\": %"PRIu64", \"inplace_bytes\": %"PRIu64", \"copied_bytes\": %"PRIu64" },\n",
+                 stats->input_packets, stats->input_bytes, inplace_bytes, copied_bytes );
+        fprintf( fp, "  \"output\": { \"packets\": %"PRIu64", \"bytes\": %"PRIu64" },\n", stats->output_packets, stats->output_bytes );
+        fprintf( fp, "  \"packet_size\": { \"min\": %"PRIu32", \"avg\": %.2lf, \"max\": %"PRIu32" },\n",
+                 stats->min_packet_size, average_packet_size, stats->max_packet_size );
+        fprintf( fp, "  \"allocations\": %"PRIu64",\n", stats->allocations );
+        fprintf( fp, "  \"finalized_bytes\": %"PRIu64"\n}\n", stats->finalized_bytes );
+        fclose( fp );
+    }
+}
+
+static double get_latency_percentile
+(
+    live_t *live,
+    double  percentile
+)
+{
+    uint64_t rank  = live->num_frames * percentile / 100;
+    uint64_t count = 0;
+    for( uint32_t i = 0; i < LIVE_LATENCY_BINS; i++ )
+    {
+        count += live->histogram[i];
+        if( count > rank )
+            return (i + 1) * LIVE_LATENCY_RESOLUTION;
+    }
+    return live->max_latency;
+}
+
+static void report_live_latency
+(
+    mp4opusenc_t *enc
+)
+{
+    live_t *live = enc->output.file.movie.tracks[0].media.live;
+    if( !live || live->num_frames == 0 )
+        return;
+    eprintf( "Latency from reading to writing per frame (%"PRIu64" frames):\n", live->num_frames );
+    eprintf( "    p50 %.1lf ms, p90 %.1lf ms, p99 %.1lf ms, max %.1lf ms\n",
+             get_latency_percentile( live, 50 ) * 1000,
+             get_latency_percentile( live, 90 ) * 1000,
+             get_latency_percentile( live, 99 ) * 1000,
+             live->max_latency * 1000 );
+}
+
+static void report_complexity
+(
+    mp4opusenc_t *enc
+)
+{
+    for( uint32_t i = 0; i < enc->output.file.movie.num_tracks; i++ )
+    {
+        budget_t *budget = enc->opus[i].budget;
+        if( !budget || budget->num_frames == 0 )
+            continue;
+        double sum = 0;
+        eprintf( "Complexity over time (track_ID %"PRIu32"):\n", enc->output.file.movie.tracks[i].track_ID );
+        for( uint32_t j = 0; j < budget->num_changes; j++ )
+        {
+            uint64_t start = budget->changes[j].frame_number;
+            uint64_t end   = j + 1 < budget->num_changes ? budget->changes[j + 1].frame_number : budget->num_frames;
+            eprintf( "    %10.2lf - %10.2lf sec : %d\n",
+                     start * budget->frame_duration, end * budget->frame_duration, budget->changes[j].complexity );
+            sum += (double)(end - start) * budget->changes[j].complexity;
+        }
+        eprintf( "    average %.2lf\n", sum / budget->num_frames );
+    }
+}
+
+static void report_loudness
+(
+    mp4opusenc_t *enc
+)
+{
+    for( uint32_t i = 0; i < enc->input.file.movie.num_tracks; i++ )
+    {
+        mp4opus_loudness_t *loudness = enc->input.file.movie.tracks[i].media.loudness;
+        if( !loudness )
+            continue;
+        eprintf( "Track %"PRIu32": integrated loudness %.1lf LUFS, loudness range %.1lf LU, true peak %.1lf dBTP\n",
+                 enc->output.file.movie.tracks[i].track_ID,
+                 mp4opus_loudness_integrated( loudness ),
+                 mp4opus_loudness_range( loudness ),
+                 mp4opus_loudness_true_peak( loudness ) );
+        if( enc->opt.normalize )
+            eprintf( "    OutputGain %+.2lf dB\n", enc->output.file.movie.tracks[i].media.output_gain / 256.0 );
+    }
+}
+
 int main
 (
     int   argc,
@@ -1001,18 +3759,46 @@ int main
         display_help();
         return 0;
     }
+    if( enc.opt.batch )
+        return do_batch( &enc );
+    if( enc.opt.stats || enc.opt.stats_json )
+        enc.opus[0].stats = &enc.stats;
+    if( enc.opt.segments )
+    {
+        if( do_stitch( &enc ) < 0 )
+            return MP4OPUSENC_ERR( "failed to stitch segments.\n" );
+        if( finish_movie( &enc ) < 0 )
+            return MP4OPUSENC_ERR( "failed to finish output movie.\n" );
+        REFRESH_CONSOLE;
+        eprintf( "Stitching completed!\n" );
+        report_stats( &enc );
+        cleanup_mp4opusenc( &enc );
+        return 0;
+    }
     if( open_input_file( &enc ) < 0 )
         return MP4OPUSENC_USAGE_ERR();
     if( prepare_output( &enc ) < 0 )
         return MP4OPUSENC_ERR( "failed to set up preparation for output.\n" );
     if( do_encode( &enc ) < 0 )
         return MP4OPUSENC_ERR( "failed to encode.\n" );
-    if( construct_timeline_maps( &enc ) < 0 )
-        return MP4OPUSENC_ERR( "failed to construct timeline maps.\n" );
-    if( finish_movie( &enc ) < 0 )
-        return MP4OPUSENC_ERR( "failed to finish output movie.\n" );
+    if( enc.opt.segment )
+    {
+        if( finish_segment( &enc ) < 0 )
+            return MP4OPUSENC_ERR( "failed to finish output segment.\n" );
+    }
+    else
+    {
+        if( construct_timeline_maps( &enc ) < 0 )
+            return MP4OPUSENC_ERR( "failed to construct timeline maps.\n" );
+        if( finish_movie( &enc ) < 0 )
+            return MP4OPUSENC_ERR( "failed to finish output movie.\n" );
+    }
     REFRESH_CONSOLE;
     eprintf( "Encoding completed!\n" );
+    report_live_latency( &enc );
+    report_complexity( &enc );
+    report_loudness( &enc );
+    report_stats( &enc );
     cleanup_mp4opusenc( &enc );
     return 0;
 }
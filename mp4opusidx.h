@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * mp4opusidx.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSIDX_H
+#define MP4OPUSIDX_H
+
+#include <stdint.h>
+
+/* Sidecar packet index written by mp4opusenc --index.
+ * The index consists of a header followed by an entry per packet of the track in decoding order.
+ * Every field is aligned to its size, so the whole file can be mapped and accessed in place.
+ * The fields are in the byte order of the machine which wrote the index, which the magic tells. */
+
+#define MP4OPUSIDX_MAGIC   0x5849504F   /* "OPIX" in little endian */
+#define MP4OPUSIDX_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t track_ID;      /* track the index describes */
+    uint32_t timescale;     /* media timescale of the timestamps */
+    uint64_t num_entries;
+    uint64_t reserved;
+} mp4opusidx_header_t;
+
+typedef struct
+{
+    uint64_t offset;            /* absolute file offset of the packet */
+    uint64_t timestamp;         /* composition time in the media timescale */
+    uint32_t size;
+    uint32_t pre_roll_distance; /* number of packets to be decoded before this packet */
+} mp4opusidx_entry_t;
+
+#endif
@@ -0,0 +1,480 @@
+/*****************************************************************************
+ * mp4opusloud.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSLOUD_H
+#define MP4OPUSLOUD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <lsmash.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Loudness meter of ITU-R BS.1770 and EBU R128 over interleaved samples in the SMPTE/USB channel order.
+ * The K-weighting filters run on two channels at a time in double precision.
+ * The momentary (400ms) and short-term (3s) blocks slide by 100ms, and their loudness is counted
+ * into histograms of 0.01 LU, from which the gated integrated loudness and the loudness range are taken.
+ * The true peak is the maximum of the samples upsampled to 192kHz or more. */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MP4OPUSLOUD_MIN_LOUDNESS    -70.0   /* absolute gate (LUFS) */
+#define MP4OPUSLOUD_MAX_LOUDNESS      5.0
+#define MP4OPUSLOUD_BIN_WIDTH         0.01
+#define MP4OPUSLOUD_NUM_BINS        7500    /* (MAX - MIN) / BIN_WIDTH */
+#define MP4OPUSLOUD_SHORT_TERM_BLOCKS 30    /* 100ms blocks in a short-term block */
+#define MP4OPUSLOUD_SCRATCH_FRAMES  1024
+#define MP4OPUSLOUD_PEAK_TAPS       12      /* taps per phase of the upsampling filter */
+
+typedef struct
+{
+    uint32_t  channels;
+    uint32_t  stride;               /* channels padded to the vector width */
+    double    b[2][3];              /* coefficients of the high shelf and the high-pass */
+    double    a[2][3];
+    double   *state;                /* 4 per channel: z1 and z2 of both filters */
+    double   *weights;              /* per channel, padded with zeros */
+    double   *scratch;              /* MP4OPUSLOUD_SCRATCH_FRAMES frames of the padded stride */
+    uint32_t  block_frames;         /* frames in a 100ms block */
+    uint32_t  block_pos;
+    double    block_energy;
+    double    recent[MP4OPUSLOUD_SHORT_TERM_BLOCKS];   /* energy of the last 100ms blocks */
+    uint64_t  num_blocks;
+    uint64_t *momentary;            /* histograms of the loudness of the gating blocks */
+    uint64_t *short_term;
+    uint32_t  peak_factor;          /* upsampling factor */
+    double   *peak_filter;          /* peak_factor * MP4OPUSLOUD_PEAK_TAPS taps */
+    double   *peak_history;         /* MP4OPUSLOUD_PEAK_TAPS per channel */
+    uint32_t  peak_pos;
+    double    peak;                 /* linear */
+} mp4opus_loudness_t;
+
+static inline double mp4opus_loudness_from_energy
+(
+    double energy
+)
+{
+    return energy > 0 ? -0.691 + 10 * log10( energy ) : -HUGE_VAL;
+}
+
+static inline double mp4opus_loudness_bin_energy
+(
+    uint32_t bin
+)
+{
+    /* the energy at the center of the bin */
+    return pow( 10, (MP4OPUSLOUD_MIN_LOUDNESS + (bin + 0.5) * MP4OPUSLOUD_BIN_WIDTH + 0.691) / 10 );
+}
+
+static inline void mp4opus_loudness_cleanup
+(
+    mp4opus_loudness_t *meter
+)
+{
+    lsmash_free( meter->state );
+    lsmash_free( meter->weights );
+    lsmash_free( meter->scratch );
+    lsmash_free( meter->momentary );
+    lsmash_free( meter->short_term );
+    lsmash_free( meter->peak_filter );
+    lsmash_free( meter->peak_history );
+    memset( meter, 0, sizeof(mp4opus_loudness_t) );
+}
+
+static inline int mp4opus_loudness_init
+(
+    mp4opus_loudness_t *meter,
+    uint32_t            sample_rate,
+    uint32_t            channels
+)
+{
+    /* Weights of L, R, C, LFE and the surrounds in the SMPTE/USB channel order. The LFE is excluded. */
+    static const double channel_weights[8][8] =
+        {
+            { 1.0 },
+            { 1.0, 1.0 },
+            { 1.0, 1.0, 1.0 },
+            { 1.0, 1.0, 1.41, 1.41 },
+            { 1.0, 1.0, 1.0, 1.41, 1.41 },
+            { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41 },
+            { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41, 1.41 },
+            { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41, 1.41, 1.41 }
+        };
+    memset( meter, 0, sizeof(mp4opus_loudness_t) );
+    if( channels == 0 || sample_rate < 1000 )
+        return -1;
+    meter->channels     = channels;
+    meter->stride       = (channels + 1) & ~1;
+    meter->block_frames = (sample_rate + 5) / 10;
+    meter->peak_factor  = (192000 + sample_rate - 1) / sample_rate;
+    meter->state        = lsmash_malloc_zero( 4 * meter->stride * sizeof(double) );
+    meter->weights      = lsmash_malloc_zero( meter->stride * sizeof(double) );
+    meter->scratch      = lsmash_malloc_zero( MP4OPUSLOUD_SCRATCH_FRAMES * meter->stride * sizeof(double) );
+    meter->momentary    = lsmash_malloc_zero( MP4OPUSLOUD_NUM_BINS * sizeof(uint64_t) );
+    meter->short_term   = lsmash_malloc_zero( MP4OPUSLOUD_NUM_BINS * sizeof(uint64_t) );
+    meter->peak_filter  = lsmash_malloc( meter->peak_factor * MP4OPUSLOUD_PEAK_TAPS * sizeof(double) );
+    meter->peak_history = lsmash_malloc_zero( channels * MP4OPUSLOUD_PEAK_TAPS * sizeof(double) );
+    if( !meter->state || !meter->weights || !meter->scratch || !meter->momentary || !meter->short_term
+     || !meter->peak_filter || !meter->peak_history )
+    {
+        mp4opus_loudness_cleanup( meter );
+        return -1;
+    }
+    for( uint32_t i = 0; i < channels; i++ )
+        meter->weights[i] = channels <= 8 ? channel_weights[channels - 1][i] : 1.0;
+    /* K-weighting: the high shelf of the head and the RLB high-pass, derived for the sample rate. */
+    double K  = tan( M_PI * 1681.974450955533 / sample_rate );
+    double Q  = 0.7071752369554196;
+    double Vh = pow( 10, 3.999843853973347 / 20 );
+    double Vb = pow( Vh, 0.4996667741545416 );
+    double a0 = 1 + K / Q + K * K;
+    meter->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+    meter->b[0][1] = 2 * (K * K - Vh) / a0;
+    meter->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+    meter->a[0][1] = 2 * (K * K - 1) / a0;
+    meter->a[0][2] = (1 - K / Q + K * K) / a0;
+    K  = tan( M_PI * 38.13547087602444 / sample_rate );
+    Q  = 0.5003270373238773;
+    a0 = 1 + K / Q + K * K;
+    meter->b[1][0] =  1;
+    meter->b[1][1] = -2;
+    meter->b[1][2] =  1;
+    meter->a[1][1] = 2 * (K * K - 1) / a0;
+    meter->a[1][2] = (1 - K / Q + K * K) / a0;
+    /* Polyphase windowed sinc interpolator of the upsampling for the true peak. */
+    uint32_t num_taps = meter->peak_factor * MP4OPUSLOUD_PEAK_TAPS;
+    for( uint32_t i = 0; i < num_taps; i++ )
+    {
+        double t      = (double)i - (num_taps - 1) / 2.0;
+        double x      = M_PI * t / meter->peak_factor;
+        double sinc   = t == 0 ? 1 : sin( x ) / x;
+        double window = 0.5 + 0.5 * cos( 2 * M_PI * t / num_taps );
+        /* Phase p of the output uses the taps p, p + factor, p + 2 * factor and so on. */
+        uint32_t phase = i % meter->peak_factor;
+        meter->peak_filter[ phase * MP4OPUSLOUD_PEAK_TAPS + i / meter->peak_factor ] = sinc * window;
+    }
+    return 0;
+}
+
+static inline void mp4opus_loudness_count
+(
+    uint64_t *histogram,
+    double    energy
+)
+{
+    double loudness = mp4opus_loudness_from_energy( energy );
+    if( loudness < MP4OPUSLOUD_MIN_LOUDNESS )
+        return;
+    uint32_t bin = (loudness - MP4OPUSLOUD_MIN_LOUDNESS) / MP4OPUSLOUD_BIN_WIDTH;
+    ++histogram[ bin < MP4OPUSLOUD_NUM_BINS ? bin : MP4OPUSLOUD_NUM_BINS - 1 ];
+}
+
+static inline void mp4opus_loudness_end_block
+(
+    mp4opus_loudness_t *meter
+)
+{
+    meter->recent[ meter->num_blocks++ % MP4OPUSLOUD_SHORT_TERM_BLOCKS ] = meter->block_energy / meter->block_frames;
+    meter->block_energy = 0;
+    meter->block_pos    = 0;
+    double sum = 0;
+    for( uint32_t i = 0; i < MP4OPUSLOUD_SHORT_TERM_BLOCKS && i < meter->num_blocks; i++ )
+    {
+        sum += meter->recent[ (meter->num_blocks - 1 - i) % MP4OPUSLOUD_SHORT_TERM_BLOCKS ];
+        if( i == 3 )
+            mp4opus_loudness_count( meter->momentary, sum / 4 );
+    }
+    if( meter->num_blocks >= MP4OPUSLOUD_SHORT_TERM_BLOCKS )
+        mp4opus_loudness_count( meter->short_term, sum / MP4OPUSLOUD_SHORT_TERM_BLOCKS );
+}
+
+static inline double mp4opus_loudness_filter_frame
+(
+    mp4opus_loudness_t *meter,
+    const double       *x
+)
+{
+    /* Run the cascade of the biquads in the transposed direct form II and return the weighted energy. */
+    double *state  = meter->state;
+    uint32_t c     = 0;
+    double  energy = 0;
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    for( ; c < meter->stride; c += 2 )
+    {
+        double *z = state + 4 * c;  /* z1 and z2 of both filters for the 2 channels */
+#ifdef __SSE2__
+        __m128d in  = _mm_loadu_pd( x + c );
+        __m128d z10 = _mm_loadu_pd( z + 0 );
+        __m128d z20 = _mm_loadu_pd( z + 2 );
+        __m128d z11 = _mm_loadu_pd( z + 4 );
+        __m128d z21 = _mm_loadu_pd( z + 6 );
+        __m128d y0  = _mm_add_pd( _mm_mul_pd( _mm_set1_pd( meter->b[0][0] ), in ), z10 );
+        z10 = _mm_add_pd( _mm_sub_pd( _mm_mul_pd( _mm_set1_pd( meter->b[0][1] ), in ),
+                                      _mm_mul_pd( _mm_set1_pd( meter->a[0][1] ), y0 ) ), z20 );
+        z20 = _mm_sub_pd( _mm_mul_pd( _mm_set1_pd( meter->b[0][2] ), in ),
+                          _mm_mul_pd( _mm_set1_pd( meter->a[0][2] ), y0 ) );
+        __m128d y1  = _mm_add_pd( y0, z11 );
+        z11 = _mm_add_pd( _mm_sub_pd( _mm_mul_pd( _mm_set1_pd( -2.0 ), y0 ),
+                                      _mm_mul_pd( _mm_set1_pd( meter->a[1][1] ), y1 ) ), z21 );
+        z21 = _mm_sub_pd( y0, _mm_mul_pd( _mm_set1_pd( meter->a[1][2] ), y1 ) );
+        _mm_storeu_pd( z + 0, z10 );
+        _mm_storeu_pd( z + 2, z20 );
+        _mm_storeu_pd( z + 4, z11 );
+        _mm_storeu_pd( z + 6, z21 );
+        double e[2];
+        _mm_storeu_pd( e, _mm_mul_pd( _mm_loadu_pd( meter->weights + c ), _mm_mul_pd( y1, y1 ) ) );
+        energy += e[0] + e[1];
+#else
+        float64x2_t in  = vld1q_f64( x + c );
+        float64x2_t z10 = vld1q_f64( z + 0 );
+        float64x2_t z20 = vld1q_f64( z + 2 );
+        float64x2_t z11 = vld1q_f64( z + 4 );
+        float64x2_t z21 = vld1q_f64( z + 6 );
+        float64x2_t y0  = vfmaq_n_f64( z10, in, meter->b[0][0] );
+        z10 = vaddq_f64( vfmsq_n_f64( vmulq_n_f64( in, meter->b[0][1] ), y0, meter->a[0][1] ), z20 );
+        z20 = vfmsq_n_f64( vmulq_n_f64( in, meter->b[0][2] ), y0, meter->a[0][2] );
+        float64x2_t y1  = vaddq_f64( y0, z11 );
+        z11 = vaddq_f64( vfmsq_n_f64( vmulq_n_f64( y0, -2.0 ), y1, meter->a[1][1] ), z21 );
+        z21 = vfmsq_n_f64( y0, y1, meter->a[1][2] );
+        vst1q_f64( z + 0, z10 );
+        vst1q_f64( z + 2, z20 );
+        vst1q_f64( z + 4, z11 );
+        vst1q_f64( z + 6, z21 );
+        energy += vaddvq_f64( vmulq_f64( vld1q_f64( meter->weights + c ), vmulq_f64( y1, y1 ) ) );
+#endif
+    }
+#else
+    for( ; c < meter->channels; c++ )
+    {
+        /* The same layout as the vectors: z1 and z2 of a filter are interleaved by the channel pair. */
+        double *z   = state + 4 * (c & ~1) + (c & 1);
+        double  in  = x[c];
+        double  y0  = meter->b[0][0] * in + z[0];
+        z[0] = meter->b[0][1] * in - meter->a[0][1] * y0 + z[2];
+        z[2] = meter->b[0][2] * in - meter->a[0][2] * y0;
+        double  y1  = y0 + z[4];
+        z[4] = -2.0 * y0 - meter->a[1][1] * y1 + z[6];
+        z[6] = y0 - meter->a[1][2] * y1;
+        energy += meter->weights[c] * y1 * y1;
+    }
+#endif
+    return energy;
+}
+
+static inline void mp4opus_loudness_track_peak
+(
+    mp4opus_loudness_t *meter,
+    const double       *x
+)
+{
+    uint32_t pos = meter->peak_pos;
+    for( uint32_t c = 0; c < meter->channels; c++ )
+    {
+        double *history = meter->peak_history + c * MP4OPUSLOUD_PEAK_TAPS;
+        history[pos] = x[c];
+        for( uint32_t p = 0; p < meter->peak_factor; p++ )
+        {
+            const double *h   = meter->peak_filter + p * MP4OPUSLOUD_PEAK_TAPS;
+            double        sum = 0;
+            for( uint32_t k = 0; k < MP4OPUSLOUD_PEAK_TAPS; k++ )
+                sum += h[k] * history[ (pos + MP4OPUSLOUD_PEAK_TAPS - k) % MP4OPUSLOUD_PEAK_TAPS ];
+            sum = fabs( sum );
+            if( sum > meter->peak )
+                meter->peak = sum;
+        }
+        if( fabs( x[c] ) > meter->peak )
+            meter->peak = fabs( x[c] );
+    }
+    meter->peak_pos = (pos + 1) % MP4OPUSLOUD_PEAK_TAPS;
+}
+
+static inline void mp4opus_loudness_process
+(
+    mp4opus_loudness_t *meter,
+    uint32_t            num_frames
+)
+{
+    const double *x = meter->scratch;
+    for( uint32_t i = 0; i < num_frames; i++, x += meter->stride )
+    {
+        meter->block_energy += mp4opus_loudness_filter_frame( meter, x );
+        mp4opus_loudness_track_peak( meter, x );
+        if( ++meter->block_pos == meter->block_frames )
+            mp4opus_loudness_end_block( meter );
+    }
+}
+
+/* The samples are converted into the scratch buffer per the frames it holds and then processed. */
+static inline uint32_t mp4opus_loudness_scratch_count
+(
+    uint32_t num_frames
+)
+{
+    return num_frames < MP4OPUSLOUD_SCRATCH_FRAMES ? num_frames : MP4OPUSLOUD_SCRATCH_FRAMES;
+}
+
+static inline void mp4opus_loudness_add_s16
+(
+    mp4opus_loudness_t *meter,
+    const int16_t      *pcm,
+    uint32_t            num_frames
+)
+{
+    while( num_frames )
+    {
+        uint32_t count = mp4opus_loudness_scratch_count( num_frames );
+        for( uint32_t i = 0; i < count; i++, pcm += meter->channels )
+            for( uint32_t c = 0; c < meter->channels; c++ )
+                meter->scratch[ i * meter->stride + c ] = pcm[c] * (1.0 / 32768);
+        mp4opus_loudness_process( meter, count );
+        num_frames -= count;
+    }
+}
+
+static inline void mp4opus_loudness_add_s24
+(
+    mp4opus_loudness_t *meter,
+    const uint8_t      *pcm,
+    uint32_t            num_frames
+)
+{
+    /* packed little endian */
+    while( num_frames )
+    {
+        uint32_t count = mp4opus_loudness_scratch_count( num_frames );
+        for( uint32_t i = 0; i < count; i++, pcm += 3 * meter->channels )
+            for( uint32_t c = 0; c < meter->channels; c++ )
+            {
+                int32_t value = (int32_t)((uint32_t)pcm[3 * c] << 8 | (uint32_t)pcm[3 * c + 1] << 16 | (uint32_t)pcm[3 * c + 2] << 24);
+                meter->scratch[ i * meter->stride + c ] = value * (1.0 / 2147483648.0);
+            }
+        mp4opus_loudness_process( meter, count );
+        num_frames -= count;
+    }
+}
+
+static inline void mp4opus_loudness_add_float
+(
+    mp4opus_loudness_t *meter,
+    const float        *pcm,
+    uint32_t            num_frames
+)
+{
+    while( num_frames )
+    {
+        uint32_t count = mp4opus_loudness_scratch_count( num_frames );
+        for( uint32_t i = 0; i < count; i++, pcm += meter->channels )
+            for( uint32_t c = 0; c < meter->channels; c++ )
+                meter->scratch[ i * meter->stride + c ] = pcm[c];
+        mp4opus_loudness_process( meter, count );
+        num_frames -= count;
+    }
+}
+
+static inline double mp4opus_loudness_gated_mean
+(
+    const uint64_t *histogram,
+    double          gate,
+    uint64_t       *count
+)
+{
+    /* Return the mean energy of the blocks at or above the gate (LUFS). */
+    double sum = 0;
+    *count = 0;
+    for( uint32_t i = 0; i < MP4OPUSLOUD_NUM_BINS; i++ )
+        if( histogram[i] && MP4OPUSLOUD_MIN_LOUDNESS + (i + 1) * MP4OPUSLOUD_BIN_WIDTH > gate )
+        {
+            sum    += histogram[i] * mp4opus_loudness_bin_energy( i );
+            *count += histogram[i];
+        }
+    return *count ? sum / *count : 0;
+}
+
+static inline double mp4opus_loudness_integrated
+(
+    mp4opus_loudness_t *meter
+)
+{
+    /* Return the integrated loudness in LUFS, -HUGE_VAL for silence. */
+    uint64_t count;
+    double   energy = mp4opus_loudness_gated_mean( meter->momentary, MP4OPUSLOUD_MIN_LOUDNESS, &count );
+    if( count == 0 )
+        return -HUGE_VAL;
+    return mp4opus_loudness_from_energy( mp4opus_loudness_gated_mean( meter->momentary,
+                                                                      mp4opus_loudness_from_energy( energy ) - 10,
+                                                                      &count ) );
+}
+
+static inline double mp4opus_loudness_range
+(
+    mp4opus_loudness_t *meter
+)
+{
+    /* Return the loudness range in LU between the 10th and the 95th percentiles of the short-term loudness. */
+    uint64_t count;
+    double   energy = mp4opus_loudness_gated_mean( meter->short_term, MP4OPUSLOUD_MIN_LOUDNESS, &count );
+    if( count == 0 )
+        return 0;
+    double   gate  = mp4opus_loudness_from_energy( energy ) - 20;
+    uint32_t first = 0;
+    while( first < MP4OPUSLOUD_NUM_BINS && MP4OPUSLOUD_MIN_LOUDNESS + (first + 1) * MP4OPUSLOUD_BIN_WIDTH <= gate )
+        ++first;
+    uint64_t total = 0;
+    for( uint32_t i = first; i < MP4OPUSLOUD_NUM_BINS; i++ )
+        total += meter->short_term[i];
+    if( total == 0 )
+        return 0;
+    uint64_t low_rank  = (uint64_t)(total * 0.10);
+    uint64_t high_rank = (uint64_t)(total * 0.95);
+    double   low       = 0;
+    double   high      = 0;
+    uint64_t seen      = 0;
+    for( uint32_t i = first; i < MP4OPUSLOUD_NUM_BINS; i++ )
+    {
+        if( seen <= low_rank && low_rank < seen + meter->short_term[i] )
+            low = MP4OPUSLOUD_MIN_LOUDNESS + (i + 0.5) * MP4OPUSLOUD_BIN_WIDTH;
+        if( seen <= high_rank && high_rank < seen + meter->short_term[i] )
+            high = MP4OPUSLOUD_MIN_LOUDNESS + (i + 0.5) * MP4OPUSLOUD_BIN_WIDTH;
+        seen += meter->short_term[i];
+    }
+    return high - low;
+}
+
+static inline double mp4opus_loudness_true_peak
+(
+    mp4opus_loudness_t *meter
+)
+{
+    /* Return the true peak in dBTP. */
+    return meter->peak > 0 ? 20 * log10( meter->peak ) : -HUGE_VAL;
+}
+
+#endif
@@ -0,0 +1,1103 @@
+/*****************************************************************************
+ * mp4opusmux.c
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+/* mp4opusmux: packet level trim and concatenation of Opus in ISO Base Media and import of Ogg Opus.
+ * Packets are copied as they are. What is cut is only the presentation, by the edits of the output track,
+ * and every segment is preceded by its pre-roll packets so that the decoder converges before it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include <lsmash.h>
+
+#include <opus/opus_multistream.h>
+
+#include "mp4opuscore.h"
+
+#define MAX_OPUS_PACKET_DURATION 5760
+#define PRE_ROLL_DURATION        (MP4OPUS_PRE_ROLL_DURATION * 48)   /* in 48kHz */
+
+typedef struct
+{
+    int    help;
+    double start;
+    double duration;
+} option_t;
+
+typedef struct
+{
+    char                              *name;
+    /* ISO Base Media input */
+    lsmash_root_t                     *root;
+    lsmash_file_parameters_t           param;
+    uint32_t                           track_ID;
+    /* Ogg Opus input */
+    lsmash_sample_t                  **packets;     /* timestamps are in 48kHz from 0 */
+    uint32_t                           num_packets;
+    uint32_t                           packets_capacity;
+    /* common */
+    lsmash_opus_specific_parameters_t  config;
+    uint32_t                           last_delta;  /* duration of the last packet */
+    lsmash_edit_t                     *edits;       /* durations are in 48kHz */
+    uint32_t                           num_edits;
+} source_t;
+
+typedef struct
+{
+    source_t     *source;
+    lsmash_edit_t edit;         /* clipped into the requested range, durations are in 48kHz */
+} segment_t;
+
+typedef struct
+{
+    char                    *name;
+    lsmash_root_t           *root;
+    lsmash_file_t           *fh;
+    lsmash_file_parameters_t param;
+    uint32_t                 track_ID;
+    uint32_t                 sample_entry;
+    uint64_t                 timestamp;
+    uint32_t                 last_duration;
+    uint64_t                 num_packets;
+} output_t;
+
+typedef struct
+{
+    option_t   opt;
+    source_t  *sources;
+    uint32_t   num_sources;
+    segment_t *segments;
+    uint32_t   num_segments;
+    output_t   output;
+} mp4opusmux_t;
+
+typedef struct
+{
+    FILE    *fp;
+    uint8_t  page[27 + 255 + 255 * 255];
+    uint32_t serial;
+    int      serial_found;
+    uint8_t *partial;           /* packet continued onto the next page */
+    uint32_t partial_size;
+    uint32_t partial_capacity;
+    uint64_t num_packets;       /* packets including the headers */
+    uint64_t total_samples;     /* samples of the audio packets */
+    int64_t  granule_offset;    /* granule position of the timestamp 0 */
+    int      granule_found;
+    int64_t  last_granule;
+} ogg_reader_t;
+
+#define MP4OPUSMUX_MIN( a, b ) (((a) < (b)) ? (a) : (b))
+#define MP4OPUSMUX_MAX( a, b ) (((a) > (b)) ? (a) : (b))
+#define eprintf( ... ) fprintf( stderr, __VA_ARGS__ )
+#define ERROR_MSG( ... ) error_message( __VA_ARGS__ )
+#define WARNING_MSG( ... ) warning_message( __VA_ARGS__ )
+#define MP4OPUSMUX_ERR( ... ) mp4opusmux_error( &mux, __VA_ARGS__ )
+#define MP4OPUSMUX_USAGE_ERR() mp4opusmux_usage_error();
+#define REFRESH_CONSOLE eprintf( "                                                                               \r" )
+
+static void cleanup_source
+(
+    source_t *source
+)
+{
+    if( source->root )
+    {
+        lsmash_close_file( &source->param );
+        lsmash_destroy_root( source->root );
+        source->root = NULL;
+    }
+    for( uint32_t i = 0; i < source->num_packets; i++ )
+        lsmash_delete_sample( source->packets[i] );
+    lsmash_freep( &source->packets );
+    lsmash_freep( &source->edits );
+}
+
+static void cleanup_mp4opusmux
+(
+    mp4opusmux_t *mux
+)
+{
+    for( uint32_t i = 0; i < mux->num_sources; i++ )
+        cleanup_source( &mux->sources[i] );
+    lsmash_freep( &mux->sources );
+    lsmash_freep( &mux->segments );
+    if( mux->output.root )
+    {
+        lsmash_close_file( &mux->output.param );
+        lsmash_destroy_root( mux->output.root );
+        mux->output.root = NULL;
+    }
+}
+
+static int mp4opusmux_error
+(
+    mp4opusmux_t *mux,
+    const char   *message,
+    ...
+)
+{
+    cleanup_mp4opusmux( mux );
+    REFRESH_CONSOLE;
+    eprintf( "Error: " );
+    va_list args;
+    va_start( args, message );
+    vfprintf( stderr, message, args );
+    va_end( args );
+    return -1;
+}
+
+static int error_message
+(
+    const char *message,
+    ...
+)
+{
+    REFRESH_CONSOLE;
+    eprintf( "Error: " );
+    va_list args;
+    va_start( args, message );
+    vfprintf( stderr, message, args );
+    va_end( args );
+    return -1;
+}
+
+static int warning_message
+(
+    const char *message,
+    ...
+)
+{
+    REFRESH_CONSOLE;
+    eprintf( "Warning: " );
+    va_list args;
+    va_start( args, message );
+    vfprintf( stderr, message, args );
+    va_end( args );
+    return -1;
+}
+
+static void display_help( void )
+{
+    eprintf
+    (
+        "\n"
+        "Usage: mp4opusmux [options] -i input [-i input ...] -o output\n"
+        "Inputs are Opus in ISO Base Media or Ogg Opus, and concatenated in order.\n"
+        "Packets are copied without decoding, and only the first Opus track of each\n"
+        "input is used. Every input has to have the same channel configuration.\n"
+        "Options:\n"
+        "    --help                    Display help\n"
+        "    --start <float>           Specify the presentation time in seconds of the\n"
+        "                                concatenated inputs to start at\n"
+        "                                the default value is 0\n"
+        "    --duration <float>        Specify the duration in seconds to be muxed\n"
+        "                                the default value is 0 (until the end)\n"
+        "                                The packets are cut at the packet boundaries around\n"
+        "                                the range with the pre-roll of 80ms, and the range\n"
+        "                                itself is kept exact by the edit list.\n"
+    );
+}
+
+static int mp4opusmux_usage_error( void )
+{
+    display_help();
+    return -1;
+}
+
+static int parse_options
+(
+    int           argc,
+    char        **argv,
+    mp4opusmux_t *mux
+)
+{
+    if ( argc < 2 )
+        return -1;
+    else if( !strcasecmp( argv[1], "-h" ) || !strcasecmp( argv[1], "--help" ) )
+    {
+        mux->opt.help = 1;
+        return 0;
+    }
+    else if( argc < 3 )
+        return -1;
+    /* Inputs can be no more than the arguments. */
+    mux->sources = lsmash_malloc_zero( argc * sizeof(source_t) );
+    if( !mux->sources )
+        return ERROR_MSG( "failed to allocate the inputs.\n" );
+    uint32_t i = 1;
+    while( argc > i && *argv[i] == '-' )
+    {
+#define CHECK_NEXT_ARG if( argc == ++i ) return ERROR_MSG( "%s requires argument.\n", argv[i - 1] );
+        if( !strcasecmp( argv[i], "-i" ) || !strcasecmp( argv[i], "--input" ) )
+        {
+            CHECK_NEXT_ARG;
+            mux->sources[ mux->num_sources++ ].name = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "-o" ) || !strcasecmp( argv[i], "--output" ) )
+        {
+            CHECK_NEXT_ARG;
+            mux->output.name = argv[i];
+        }
+        else if( !strcasecmp( argv[i], "--start" ) )
+        {
+            CHECK_NEXT_ARG;
+            mux->opt.start = atof( argv[i] );
+            if( mux->opt.start < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+        else if( !strcasecmp( argv[i], "--duration" ) )
+        {
+            CHECK_NEXT_ARG;
+            mux->opt.duration = atof( argv[i] );
+            if( mux->opt.duration < 0 )
+                return ERROR_MSG( "you specified invalid argument: %s.\n", argv[i] );
+        }
+#undef CHECK_NEXT_ARG
+        else
+            return ERROR_MSG( "you specified invalid option: %s.\n", argv[i] );
+        ++i;
+    }
+    if( mux->num_sources == 0 )
+        return ERROR_MSG( "input file name is not specified.\n" );
+    if( !mux->output.name )
+        return ERROR_MSG( "output file name is not specified.\n" );
+    if( !strcmp( mux->output.name, "-" ) )
+        return ERROR_MSG( "stdout is not available for output.\n" );
+    return 0;
+}
+
+static int add_source_edit
+(
+    source_t     *source,
+    lsmash_edit_t edit
+)
+{
+    lsmash_edit_t *edits = lsmash_realloc( source->edits, (source->num_edits + 1) * sizeof(lsmash_edit_t) );
+    if( !edits )
+        return ERROR_MSG( "failed to allocate edits.\n" );
+    source->edits = edits;
+    source->edits[ source->num_edits++ ] = edit;
+    return 0;
+}
+
+static int get_opus_specific_info
+(
+    lsmash_summary_t                  *summary,
+    lsmash_opus_specific_parameters_t *config
+)
+{
+    lsmash_codec_specific_t *cs = mp4opus_get_opus_specific_info( summary );
+    if( !cs )
+        return ERROR_MSG( "failed to get Opus specific info.\n" );
+    *config = *(lsmash_opus_specific_parameters_t *)cs->data.structured;
+    lsmash_destroy_codec_specific_data( cs );
+    return 0;
+}
+
+static int open_movie_source
+(
+    source_t *source
+)
+{
+    source->root = lsmash_create_root();
+    if( !source->root )
+        return ERROR_MSG( "failed to create ROOT for input file.\n" );
+    if( lsmash_open_file( source->name, 1, &source->param ) < 0 )
+        return ERROR_MSG( "failed to open input file.\n" );
+    lsmash_file_t *fh = lsmash_set_file( source->root, &source->param );
+    if( !fh )
+        return ERROR_MSG( "failed to add input file into ROOT.\n" );
+    if( lsmash_read_file( fh, &source->param ) < 0 )
+        return ERROR_MSG( "failed to read input file\n" );
+    lsmash_movie_parameters_t movie_param;
+    if( lsmash_get_movie_parameters( source->root, &movie_param ) < 0 )
+        return ERROR_MSG( "failed to get movie parameters.\n" );
+    /* Find the first Opus track. */
+    for( uint32_t i = 0; i < movie_param.number_of_tracks && source->track_ID == 0; i++ )
+    {
+        uint32_t track_ID = lsmash_get_track_ID( source->root, i + 1 );
+        if( track_ID == 0 )
+            return ERROR_MSG( "failed to get track_ID.\n" );
+        if( lsmash_count_summary( source->root, track_ID ) != 1 )
+            continue;
+        lsmash_summary_t *summary = lsmash_get_summary( source->root, track_ID, 1 );
+        if( !summary )
+            continue;
+        if( summary->summary_type == LSMASH_SUMMARY_TYPE_AUDIO
+         && lsmash_check_codec_type_identical( summary->sample_type, ISOM_CODEC_TYPE_OPUS_AUDIO )
+         && lsmash_get_media_timescale( source->root, track_ID ) == 48000
+         && get_opus_specific_info( summary, &source->config ) == 0 )
+            source->track_ID = track_ID;
+        lsmash_cleanup_summary( summary );
+    }
+    if( source->track_ID == 0 )
+        return ERROR_MSG( "failed to find Opus stream to mux.\n" );
+    if( lsmash_construct_timeline( source->root, source->track_ID ) < 0 )
+        return ERROR_MSG( "failed to construct timeline.\n" );
+    if( lsmash_get_last_sample_delta_from_media_timeline( source->root, source->track_ID, &source->last_delta ) < 0 )
+        return ERROR_MSG( "failed to get the last sample delta.\n" );
+    lsmash_destroy_children( lsmash_file_as_box( fh ) );
+    /* Take the edits in 48kHz. */
+    uint64_t media_duration = lsmash_get_media_duration_from_media_timeline( source->root, source->track_ID );
+    uint32_t edit_count     = lsmash_count_explicit_timeline_map( source->root, source->track_ID );
+    for( uint32_t edit_number = 1; edit_number <= edit_count; edit_number++ )
+    {
+        lsmash_edit_t edit;
+        if( lsmash_get_explicit_timeline_map( source->root, source->track_ID, edit_number, &edit ) < 0 )
+            return ERROR_MSG( "failed to get explicit timeline map.\n" );
+        if( edit.duration == 0 && edit.start_time != -1 )
+            edit.duration = media_duration > (uint64_t)edit.start_time ? media_duration - edit.start_time : 0;
+        else
+            edit.duration = ((double)edit.duration / movie_param.timescale) * 48000;
+        if( add_source_edit( source, edit ) < 0 )
+            return -1;
+    }
+    if( edit_count == 0 )
+        /* The whole media is presented. */
+        return add_source_edit( source, (lsmash_edit_t){ .duration = media_duration, .start_time = 0, .rate = ISOM_EDIT_MODE_NORMAL } );
+    return 0;
+}
+
+static uint32_t get_ogg_crc
+(
+    const uint8_t *data,
+    uint32_t       size
+)
+{
+    static uint32_t table[256];
+    if( !table[1] )
+        for( uint32_t i = 0; i < 256; i++ )
+        {
+            uint32_t r = i << 24;
+            for( int j = 0; j < 8; j++ )
+                r = (r & 0x80000000) ? (r << 1) ^ 0x04C11DB7 : r << 1;
+            table[i] = r;
+        }
+    uint32_t crc = 0;
+    for( uint32_t i = 0; i < size; i++ )
+        crc = (crc << 8) ^ table[ (crc >> 24) ^ data[i] ];
+    return crc;
+}
+
+static uint32_t get_le32
+(
+    const uint8_t *p
+)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int read_ogg_page
+(
+    ogg_reader_t *ogg,
+    uint32_t     *page_size
+)
+{
+    /* Return 1 at the end of the file. */
+    uint8_t *page = ogg->page;
+    size_t   size = fread( page, 1, 27, ogg->fp );
+    if( size == 0 && feof( ogg->fp ) )
+        return 1;
+    if( size != 27 || memcmp( page, "OggS", 4 ) || page[4] != 0 )
+        return ERROR_MSG( "failed to find an Ogg page.\n" );
+    uint32_t num_segments = page[26];
+    if( fread( page + 27, 1, num_segments, ogg->fp ) != num_segments )
+        return ERROR_MSG( "failed to read an Ogg page.\n" );
+    uint32_t body_size = 0;
+    for( uint32_t i = 0; i < num_segments; i++ )
+        body_size += page[27 + i];
+    if( fread( page + 27 + num_segments, 1, body_size, ogg->fp ) != body_size )
+        return ERROR_MSG( "failed to read an Ogg page.\n" );
+    *page_size = 27 + num_segments + body_size;
+    uint32_t crc = get_le32( page + 22 );
+    memset( page + 22, 0, 4 );
+    if( get_ogg_crc( page, *page_size ) != crc )
+        return ERROR_MSG( "CRC mismatch in an Ogg page.\n" );
+    return 0;
+}
+
+static int parse_opus_head
+(
+    source_t      *source,
+    const uint8_t *data,
+    uint32_t       size
+)
+{
+    lsmash_opus_specific_parameters_t *config = &source->config;
+    if( size < 19 || memcmp( data, "OpusHead", 8 ) || (data[8] & 0xF0) )
+        return ERROR_MSG( "failed to find OpusHead.\n" );
+    config->Version              = 0;
+    config->OutputChannelCount   = data[9];
+    config->PreSkip              = data[10] | data[11] << 8;
+    config->InputSampleRate      = get_le32( data + 12 );
+    config->OutputGain           = (int16_t)(data[16] | data[17] << 8);
+    config->ChannelMappingFamily = data[18];
+    if( config->OutputChannelCount == 0 )
+        return ERROR_MSG( "OpusHead has no channels.\n" );
+    if( config->ChannelMappingFamily == 0 )
+    {
+        if( config->OutputChannelCount > 2 )
+            return ERROR_MSG( "OpusHead of the channel mapping family 0 has more than 2 channels.\n" );
+        config->StreamCount  = 1;
+        config->CoupledCount = config->OutputChannelCount - 1;
+        for( int i = 0; i < config->OutputChannelCount; i++ )
+            config->ChannelMapping[i] = i;
+        return 0;
+    }
+    /* The family 3 needs the demixing matrix, which OpusSpecificBox cannot carry. */
+    if( (config->ChannelMappingFamily == 1 && config->OutputChannelCount > 8)
+     || (config->ChannelMappingFamily != 1 && config->ChannelMappingFamily != 2 && config->ChannelMappingFamily != 255) )
+        return ERROR_MSG( "the channel mapping family %d of %d channels is not supported.\n",
+                          config->ChannelMappingFamily, config->OutputChannelCount );
+    if( size < 21u + config->OutputChannelCount )
+        return ERROR_MSG( "OpusHead is too short.\n" );
+    config->StreamCount  = data[19];
+    config->CoupledCount = data[20];
+    memcpy( config->ChannelMapping, data + 21, config->OutputChannelCount );
+    return 0;
+}
+
+static int add_ogg_packet
+(
+    source_t      *source,
+    ogg_reader_t  *ogg,
+    const uint8_t *data,
+    uint32_t       size
+)
+{
+    if( ogg->num_packets++ == 0 )
+        return parse_opus_head( source, data, size );
+    if( ogg->num_packets == 2 )
+        /* OpusTags has nothing to be carried. */
+        return size >= 8 && !memcmp( data, "OpusTags", 8 ) ? 0 : ERROR_MSG( "failed to find OpusTags.\n" );
+    int duration = size ? opus_packet_get_nb_samples( data, size, 48000 ) : 0;
+    if( duration <= 0 || duration > MAX_OPUS_PACKET_DURATION )
+        return ERROR_MSG( "invalid Opus packet %"PRIu64" in Ogg.\n", ogg->num_packets - 2 );
+    if( source->num_packets == source->packets_capacity )
+    {
+        uint32_t capacity = source->packets_capacity ? 2 * source->packets_capacity : 4096;
+        lsmash_sample_t **packets = lsmash_realloc( source->packets, capacity * sizeof(lsmash_sample_t *) );
+        if( !packets )
+            return ERROR_MSG( "failed to allocate packets.\n" );
+        source->packets          = packets;
+        source->packets_capacity = capacity;
+    }
+    lsmash_sample_t *sample = lsmash_create_sample( size );
+    if( !sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    memcpy( sample->data, data, size );
+    sample->dts           = ogg->total_samples;
+    sample->cts           = ogg->total_samples;
+    sample->prop.ra_flags = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
+    source->packets[ source->num_packets++ ] = sample;
+    source->last_delta    = duration;
+    ogg->total_samples   += duration;
+    return 0;
+}
+
+static int read_ogg_stream
+(
+    source_t     *source,
+    ogg_reader_t *ogg
+)
+{
+    /* Only the first logical stream is read. The pages of the other streams multiplexed with it are skipped. */
+    int ret;
+    uint32_t page_size;
+    while( (ret = read_ogg_page( ogg, &page_size )) == 0 )
+    {
+        const uint8_t *page   = ogg->page;
+        uint32_t       serial = get_le32( page + 14 );
+        if( !ogg->serial_found )
+        {
+            if( !(page[5] & 0x02) )
+                return ERROR_MSG( "the first Ogg page is not the beginning of a stream.\n" );
+            ogg->serial       = serial;
+            ogg->serial_found = 1;
+        }
+        else if( serial != ogg->serial )
+            continue;
+        if( !(page[5] & 0x01) && ogg->partial_size )
+        {
+            WARNING_MSG( "an incomplete packet in Ogg is dropped.\n" );
+            ogg->partial_size = 0;
+        }
+        uint32_t       num_segments = page[26];
+        const uint8_t *body         = page + 27 + num_segments;
+        int            completed    = 0;
+        for( uint32_t i = 0; i < num_segments; i++ )
+        {
+            uint32_t lacing = page[27 + i];
+            if( ogg->partial_size + lacing > ogg->partial_capacity )
+            {
+                uint32_t capacity = MP4OPUSMUX_MAX( 2 * ogg->partial_capacity, ogg->partial_size + lacing );
+                uint8_t *partial  = lsmash_realloc( ogg->partial, capacity );
+                if( !partial )
+                    return ERROR_MSG( "failed to allocate a packet buffer.\n" );
+                ogg->partial          = partial;
+                ogg->partial_capacity = capacity;
+            }
+            memcpy( ogg->partial + ogg->partial_size, body, lacing );
+            ogg->partial_size += lacing;
+            body              += lacing;
+            if( lacing == 255 )
+                continue;
+            if( add_ogg_packet( source, ogg, ogg->partial, ogg->partial_size ) < 0 )
+                return -1;
+            ogg->partial_size = 0;
+            completed         = 1;
+        }
+        /* The granule position is of the last packet completed in the page. */
+        int64_t granule = (int64_t)((uint64_t)get_le32( page + 6 ) | (uint64_t)get_le32( page + 10 ) << 32);
+        if( completed && granule != -1 && ogg->num_packets > 2 )
+        {
+            if( !ogg->granule_found )
+            {
+                ogg->granule_offset = granule - (int64_t)ogg->total_samples;
+                ogg->granule_found  = 1;
+            }
+            ogg->last_granule = granule;
+        }
+        if( page[5] & 0x04 )
+            break;  /* the end of the stream, chained streams are not read */
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static int open_ogg_source
+(
+    source_t *source
+)
+{
+    ogg_reader_t *ogg = lsmash_malloc_zero( sizeof(ogg_reader_t) );
+    if( !ogg )
+        return ERROR_MSG( "failed to allocate Ogg reader.\n" );
+    int ret = -1;
+    ogg->fp = fopen( source->name, "rb" );
+    if( !ogg->fp )
+    {
+        ERROR_MSG( "failed to open input file.\n" );
+        goto done;
+    }
+    if( read_ogg_stream( source, ogg ) < 0 )
+        goto done;
+    if( source->num_packets == 0 )
+    {
+        ERROR_MSG( "Ogg Opus has no audio packets.\n" );
+        goto done;
+    }
+    /* The granule position of a sample is its timestamp plus granule_offset,
+     * and the presentation is from PreSkip to the granule position of the last page. */
+    int64_t start_time = MP4OPUSMUX_MAX( (int64_t)source->config.PreSkip - ogg->granule_offset, 0 );
+    int64_t end_time   = ogg->granule_found ? ogg->last_granule - ogg->granule_offset : (int64_t)ogg->total_samples;
+    end_time = MP4OPUSMUX_MIN( end_time, (int64_t)ogg->total_samples );
+    if( end_time <= start_time )
+    {
+        ERROR_MSG( "Ogg Opus has nothing to be presented.\n" );
+        goto done;
+    }
+    ret = add_source_edit( source, (lsmash_edit_t){ .duration = end_time - start_time, .start_time = start_time, .rate = ISOM_EDIT_MODE_NORMAL } );
+done:
+    if( ogg->fp )
+        fclose( ogg->fp );
+    lsmash_free( ogg->partial );
+    lsmash_free( ogg );
+    return ret;
+}
+
+static int open_source
+(
+    source_t *source
+)
+{
+    FILE *fp = fopen( source->name, "rb" );
+    if( !fp )
+        return ERROR_MSG( "failed to open %s.\n", source->name );
+    uint8_t magic[4] = { 0 };
+    size_t  size     = fread( magic, 1, 4, fp );
+    fclose( fp );
+    int ret = size == 4 && !memcmp( magic, "OggS", 4 ) ? open_ogg_source( source ) : open_movie_source( source );
+    if( ret < 0 )
+        return ERROR_MSG( "failed to open %s as an input.\n", source->name );
+    return 0;
+}
+
+static int is_same_config
+(
+    const lsmash_opus_specific_parameters_t *a,
+    const lsmash_opus_specific_parameters_t *b
+)
+{
+    /* PreSkip and InputSampleRate are informative only and may differ. */
+    return a->OutputChannelCount   == b->OutputChannelCount
+        && a->OutputGain           == b->OutputGain
+        && a->ChannelMappingFamily == b->ChannelMappingFamily
+        && a->StreamCount          == b->StreamCount
+        && a->CoupledCount         == b->CoupledCount
+        && !memcmp( a->ChannelMapping, b->ChannelMapping, a->OutputChannelCount );
+}
+
+static int open_sources
+(
+    mp4opusmux_t *mux
+)
+{
+    for( uint32_t i = 0; i < mux->num_sources; i++ )
+    {
+        if( open_source( &mux->sources[i] ) < 0 )
+            return -1;
+        if( i && !is_same_config( &mux->sources[0].config, &mux->sources[i].config ) )
+            return ERROR_MSG( "the Opus configuration of %s differs from %s.\n", mux->sources[i].name, mux->sources[0].name );
+    }
+    return 0;
+}
+
+static int plan_segments
+(
+    mp4opusmux_t *mux
+)
+{
+    /* Lay the edits of the inputs in order and clip them into the requested range. */
+    uint32_t num_edits = 0;
+    for( uint32_t i = 0; i < mux->num_sources; i++ )
+        num_edits += mux->sources[i].num_edits;
+    mux->segments = lsmash_malloc( num_edits * sizeof(segment_t) );
+    if( !mux->segments )
+        return ERROR_MSG( "failed to allocate segments.\n" );
+    uint64_t range_start = mux->opt.start * 48000;
+    uint64_t range_end   = mux->opt.duration > 0 ? range_start + (uint64_t)(mux->opt.duration * 48000) : UINT64_MAX;
+    uint64_t edit_offset = 0;   /* presentation time of the current edit */
+    for( uint32_t i = 0; i < mux->num_sources; i++ )
+        for( uint32_t j = 0; j < mux->sources[i].num_edits; j++ )
+        {
+            /* The output movie and the media are both in 48kHz. */
+            lsmash_edit_t edit = mux->sources[i].edits[j];
+            uint64_t edit_start = edit_offset;
+            edit_offset += edit.duration;
+            if( !mp4opus_clip_edit( &edit, edit_start, range_start, range_end, 48000 ) )
+                continue;
+            mux->segments[ mux->num_segments++ ] = (segment_t){ &mux->sources[i], edit };
+        }
+    for( uint32_t i = 0; i < mux->num_segments; i++ )
+        if( mux->segments[i].edit.start_time != -1 )
+            return 0;
+    return ERROR_MSG( "nothing is presented in the range.\n" );
+}
+
+static int get_packet_info
+(
+    source_t        *source,
+    uint32_t         packet_number,
+    lsmash_sample_t *info
+)
+{
+    /* Return 1 if there is no such packet. */
+    if( !source->root )
+    {
+        if( packet_number == 0 || packet_number > source->num_packets )
+            return 1;
+        *info = *source->packets[packet_number - 1];
+        return 0;
+    }
+    if( lsmash_get_sample_info_from_media_timeline( source->root, source->track_ID, packet_number, info ) < 0 )
+    {
+        if( lsmash_check_sample_existence_in_media_timeline( source->root, source->track_ID, packet_number ) )
+            return ERROR_MSG( "failed to get sample info.\n" );
+        return 1;
+    }
+    return 0;
+}
+
+static lsmash_sample_t *get_packet
+(
+    source_t *source,
+    uint32_t  packet_number
+)
+{
+    if( source->root )
+        return lsmash_get_sample_from_media_timeline( source->root, source->track_ID, packet_number );
+    lsmash_sample_t *packet = source->packets[packet_number - 1];
+    lsmash_sample_t *sample = lsmash_create_sample( packet->length );
+    if( sample )
+        memcpy( sample->data, packet->data, packet->length );
+    return sample;
+}
+
+static int get_packet_duration
+(
+    source_t        *source,
+    uint32_t         packet_number,
+    lsmash_sample_t *info,
+    uint32_t        *duration
+)
+{
+    lsmash_sample_t next_info;
+    int ret = get_packet_info( source, packet_number + 1, &next_info );
+    if( ret < 0 )
+        return ret;
+    *duration = ret ? source->last_delta : next_info.cts - info->cts;
+    return 0;
+}
+
+static int get_pre_roll_distance
+(
+    source_t        *source,
+    uint32_t         packet_number,
+    lsmash_sample_t *info,
+    uint32_t        *distance
+)
+{
+    /* Ogg carries no roll distance, and a movie may lack it. Then derive it from the packet duration. */
+    if( info->prop.pre_roll.distance )
+    {
+        *distance = info->prop.pre_roll.distance;
+        return 0;
+    }
+    uint32_t duration;
+    if( get_packet_duration( source, packet_number, info, &duration ) < 0 )
+        return -1;
+    *distance = (PRE_ROLL_DURATION + MP4OPUSMUX_MAX( duration, 1 ) - 1) / MP4OPUSMUX_MAX( duration, 1 );
+    return 0;
+}
+
+static int find_start_packet
+(
+    source_t *source,
+    int64_t   start_time,
+    uint32_t *start_packet
+)
+{
+    /* Locate the first sample composed at or after the start time,
+     * and then go back by the pre-roll distance as mp4opusdec does.
+     * Return 1 if the start time is beyond the last sample. */
+    lsmash_sample_t info;
+    uint32_t        low;
+    if( source->root )
+    {
+        int ret = mp4opus_find_start_sample( source->root, source->track_ID, 1, start_time, &low, &info );
+        if( ret < 0 )
+            return ERROR_MSG( "failed to get sample info.\n" );
+        if( ret )
+            return 1;
+    }
+    else
+    {
+        /* The packets of Ogg are held in composition order. */
+        uint32_t high = source->num_packets + 1;
+        low = 1;
+        while( low < high )
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if( (int64_t)source->packets[mid - 1]->cts < start_time )
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if( low > source->num_packets )
+            return 1;
+        info = *source->packets[low - 1];
+    }
+    uint32_t pre_roll_distance;
+    if( get_pre_roll_distance( source, low, &info, &pre_roll_distance ) < 0 )
+        return -1;
+    *start_packet = mp4opus_get_decode_start( low, pre_roll_distance, (int64_t)info.cts > start_time );
+    return 0;
+}
+
+static int get_skipped_samples
+(
+    mp4opusmux_t *mux,
+    uint32_t     *skipped_samples
+)
+{
+    /* The pre-roll of the first segment is what the decoder skips at the beginning.
+     * A segment beyond the last sample is dropped by mux_segment(), so it is skipped here as well. */
+    for( uint32_t i = 0; i < mux->num_segments; i++ )
+    {
+        segment_t *segment = &mux->segments[i];
+        if( segment->edit.start_time == -1 )
+            continue;
+        uint32_t        start_packet;
+        lsmash_sample_t info;
+        int ret = find_start_packet( segment->source, segment->edit.start_time, &start_packet );
+        if( ret == 1 )
+            continue;
+        if( ret < 0 || get_packet_info( segment->source, start_packet, &info ) != 0 )
+            return ERROR_MSG( "failed to locate the first packet.\n" );
+        *skipped_samples = MP4OPUSMUX_MAX( segment->edit.start_time - (int64_t)info.cts, 0 );
+        return 0;
+    }
+    *skipped_samples = 0;
+    return 0;
+}
+
+static int prepare_output
+(
+    mp4opusmux_t *mux
+)
+{
+    output_t *output = &mux->output;
+    output->root = lsmash_create_root();
+    if( !output->root )
+        return ERROR_MSG( "failed to create ROOT.\n" );
+    lsmash_file_parameters_t *file_param = &output->param;
+    if( lsmash_open_file( output->name, 0, file_param ) < 0 )
+        return ERROR_MSG( "failed to open an output file.\n" );
+    file_param->major_brand   = ISOM_BRAND_TYPE_OPUS;
+    file_param->brands        = (lsmash_brand_type [2]){ ISOM_BRAND_TYPE_OPUS, ISOM_BRAND_TYPE_ISO2 };
+    file_param->brand_count   = 2;
+    file_param->minor_version = 0;
+    output->fh = lsmash_set_file( output->root, file_param );
+    if( !output->fh )
+        return ERROR_MSG( "failed to add output file into ROOT.\n" );
+    lsmash_movie_parameters_t movie_param;
+    lsmash_initialize_movie_parameters( &movie_param );
+    movie_param.timescale = 48000;
+    if( lsmash_set_movie_parameters( output->root, &movie_param ) < 0 )
+        return ERROR_MSG( "failed to set movie parameters.\n" );
+    output->track_ID = lsmash_create_track( output->root, ISOM_MEDIA_HANDLER_TYPE_AUDIO_TRACK );
+    if( output->track_ID == 0 )
+        return ERROR_MSG( "failed to create track.\n" );
+    lsmash_track_parameters_t track_param;
+    lsmash_initialize_track_parameters( &track_param );
+    track_param.mode = ISOM_TRACK_IN_MOVIE | ISOM_TRACK_IN_PREVIEW | ISOM_TRACK_ENABLED;
+    if( lsmash_set_track_parameters( output->root, output->track_ID, &track_param ) < 0 )
+        return ERROR_MSG( "failed to set track parameters.\n" );
+    lsmash_media_parameters_t media_param;
+    lsmash_initialize_media_parameters( &media_param );
+    media_param.timescale     = 48000;
+    media_param.roll_grouping = 1;
+    if( lsmash_set_media_parameters( output->root, output->track_ID, &media_param ) < 0 )
+        return ERROR_MSG( "failed to set media parameters.\n" );
+    /* The configuration of the first input is shared by all of them except for PreSkip. */
+    uint32_t skipped_samples;
+    if( get_skipped_samples( mux, &skipped_samples ) < 0 )
+        return -1;
+    lsmash_audio_summary_t *summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
+    if( !summary )
+        return ERROR_MSG( "failed to allocate summary for output.\n" );
+    summary->sample_type = ISOM_CODEC_TYPE_OPUS_AUDIO;
+    summary->frequency   = 48000;
+    summary->channels    = mux->sources[0].config.OutputChannelCount;
+    summary->sample_size = 16;
+    lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_AUDIO_OPUS,
+                                                                     LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !cs )
+    {
+        lsmash_cleanup_summary( (lsmash_summary_t *)summary );
+        return ERROR_MSG( "failed to create Opus specific info.\n" );
+    }
+    lsmash_opus_specific_parameters_t *param = (lsmash_opus_specific_parameters_t *)cs->data.structured;
+    *param = mux->sources[0].config;
+    param->PreSkip = MP4OPUSMUX_MIN( skipped_samples, UINT16_MAX );
+    int ret = lsmash_add_codec_specific_data( (lsmash_summary_t *)summary, cs );
+    lsmash_destroy_codec_specific_data( cs );
+    if( ret < 0 )
+    {
+        lsmash_cleanup_summary( (lsmash_summary_t *)summary );
+        return ERROR_MSG( "failed to add Opus specific info.\n" );
+    }
+    output->sample_entry = lsmash_add_sample_entry( output->root, output->track_ID, summary );
+    lsmash_cleanup_summary( (lsmash_summary_t *)summary );
+    if( !output->sample_entry )
+        return ERROR_MSG( "failed to add sample description entry.\n" );
+    return 0;
+}
+
+static int mux_segment
+(
+    output_t  *output,
+    segment_t *segment
+)
+{
+    lsmash_edit_t edit = segment->edit;
+    if( edit.start_time == -1 )
+    {
+        if( lsmash_create_explicit_timeline_map( output->root, output->track_ID, edit ) < 0 )
+            return ERROR_MSG( "failed to create empty edit.\n" );
+        return 0;
+    }
+    source_t *source = segment->source;
+    uint32_t  start_packet;
+    int ret = find_start_packet( source, edit.start_time, &start_packet );
+    if( ret < 0 )
+        return ret;
+    if( ret )
+    {
+        WARNING_MSG( "an edit of %s beyond the last sample is dropped.\n", source->name );
+        return 0;
+    }
+    int64_t end_time  = edit.start_time + edit.duration;
+    int64_t first_cts = -1;
+    for( uint32_t packet_number = start_packet; ; packet_number++ )
+    {
+        lsmash_sample_t info;
+        ret = get_packet_info( source, packet_number, &info );
+        if( ret < 0 )
+            return ret;
+        if( ret || (int64_t)info.cts >= end_time )
+            break;
+        uint32_t duration;
+        uint32_t pre_roll_distance;
+        if( get_packet_duration( source, packet_number, &info, &duration ) < 0
+         || get_pre_roll_distance( source, packet_number, &info, &pre_roll_distance ) < 0 )
+            return -1;
+        lsmash_sample_t *sample = get_packet( source, packet_number );
+        if( !sample )
+            return ERROR_MSG( "failed to get sample.\n" );
+        if( first_cts < 0 )
+        {
+            /* The edit points into the copied packets. */
+            first_cts       = info.cts;
+            edit.start_time = output->timestamp + MP4OPUSMUX_MAX( edit.start_time - first_cts, 0 );
+        }
+        sample->dts                    = output->timestamp;
+        sample->cts                    = output->timestamp;
+        sample->index                  = output->sample_entry;
+        sample->prop.ra_flags          = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
+        sample->prop.pre_roll.distance = pre_roll_distance;
+        if( lsmash_append_sample( output->root, output->track_ID, sample ) < 0 )
+        {
+            lsmash_delete_sample( sample );
+            return ERROR_MSG( "failed to append sample.\n" );
+        }
+        output->timestamp     += duration;
+        output->last_duration  = duration;
+        ++output->num_packets;
+    }
+    if( first_cts < 0 )
+        return 0;
+    if( lsmash_create_explicit_timeline_map( output->root, output->track_ID, edit ) < 0 )
+        return ERROR_MSG( "failed to create explicit timeline map.\n" );
+    return 0;
+}
+
+static int do_mux
+(
+    mp4opusmux_t *mux
+)
+{
+    output_t *output = &mux->output;
+    for( uint32_t i = 0; i < mux->num_segments; i++ )
+    {
+        if( mux_segment( output, &mux->segments[i] ) < 0 )
+            return -1;
+        REFRESH_CONSOLE;
+        eprintf( "Muxing: [%5.2lf%%]\r", ((double)(i + 1) / mux->num_segments) * 100.0 );
+    }
+    if( output->num_packets == 0 )
+        return ERROR_MSG( "no packets are muxed.\n" );
+    if( lsmash_flush_pooled_samples( output->root, output->track_ID, output->last_duration ) < 0 )
+        return ERROR_MSG( "failed to flush samples.\n" );
+    return 0;
+}
+
+static int moov_to_front_callback
+(
+    void    *param,
+    uint64_t written_movie_size,
+    uint64_t total_movie_size
+)
+{
+    REFRESH_CONSOLE;
+    eprintf( "Finalizing: [%5.2lf%%]\r", ((double)written_movie_size / total_movie_size) * 100.0 );
+    return 0;
+}
+
+static void write_tool_indicator( lsmash_root_t *root )
+{
+    /* Write a tag in a free space to indicate the output file is written by this tool. */
+    char *string = "Mp4OpusMux: Don't waste your time in order to support this file!";
+    int   length = strlen( string );
+    lsmash_box_type_t type = lsmash_form_iso_box_type( LSMASH_4CC( 'f', 'r', 'e', 'e' ) );
+    lsmash_box_t *free_box = lsmash_create_box( type, (uint8_t *)string, length, LSMASH_BOX_PRECEDENCE_N );
+    if( !free_box )
+    {
+        ERROR_MSG( "failed to allocate the tool specific tag.\n" );
+        return;
+    }
+    if( lsmash_add_box_ex( lsmash_root_as_box( root ), &free_box ) < 0 )
+    {
+        lsmash_destroy_box( free_box );
+        ERROR_MSG( "failed to add the tool specific tag.\n" );
+        return;
+    }
+    if( lsmash_write_top_level_box( free_box ) < 0 )
+        ERROR_MSG( "failed to write the tool specific tag.\n" );
+}
+
+static int finish_movie
+(
+    mp4opusmux_t *mux
+)
+{
+    output_t *output = &mux->output;
+    REFRESH_CONSOLE;
+    /* The movie header grows mainly with the sample size table as in mp4opusenc. */
+    uint64_t moov_size = 64 * 1024 + output->num_packets * 4 + (output->timestamp / 24000 + 1) * 8;
+    lsmash_adhoc_remux_t moov_to_front =
+    {
+        .func        = moov_to_front_callback,
+        .buffer_size = MP4OPUSMUX_MIN( MP4OPUSMUX_MAX( 2 * moov_size, 4 * 1024 * 1024 ), (uint64_t)1 << 30 ),
+        .param       = NULL
+    };
+    if( lsmash_finish_movie( output->root, &moov_to_front ) < 0 )
+        return ERROR_MSG( "failed to finalize output movie.\n" );
+    write_tool_indicator( output->root );
+    return 0;
+}
+
+int main
+(
+    int   argc,
+    char *argv[]
+)
+{
+    mp4opusmux_t mux = { { 0 } };
+    if( parse_options( argc, argv, &mux ) < 0 )
+        return MP4OPUSMUX_ERR( "failed to parse options.\n" );
+    if( mux.opt.help )
+    {
+        display_help();
+        cleanup_mp4opusmux( &mux );
+        return 0;
+    }
+    if( open_sources( &mux ) < 0 )
+        return MP4OPUSMUX_USAGE_ERR();
+    if( plan_segments( &mux ) < 0 )
+        return MP4OPUSMUX_ERR( "failed to plan the segments.\n" );
+    if( prepare_output( &mux ) < 0 )
+        return MP4OPUSMUX_ERR( "failed to set up preparation for output.\n" );
+    if( do_mux( &mux ) < 0 )
+        return MP4OPUSMUX_ERR( "failed to mux.\n" );
+    if( finish_movie( &mux ) < 0 )
+        return MP4OPUSMUX_ERR( "failed to finish output movie.\n" );
+    REFRESH_CONSOLE;
+    eprintf( "Muxing completed! %"PRIu64" packets in %"PRIu32" segments.\n", mux.output.num_packets, mux.num_segments );
+    cleanup_mp4opusmux( &mux );
+    return 0;
+}
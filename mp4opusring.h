@@ -0,0 +1,149 @@
+/*****************************************************************************
+ * mp4opusring.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSRING_H
+#define MP4OPUSRING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include <lsmash.h>
+
+/* Bounded lock-free ring buffer of fixed size elements between a single producer and a single consumer.
+ * Only the producer advances the tail and only the consumer advances the head, so each index is
+ * published by a release store and observed by an acquire load of the other side.
+ * A side waiting for the other yields for a while and then sleeps shortly per retry,
+ * since the stages around a ring are bound by I/O or the codec rather than by the ring itself. */
+
+typedef struct
+{
+    uint8_t *slots;
+    uint32_t element_size;
+    uint32_t capacity;
+    uint32_t head;      /* the next element to be consumed */
+    uint32_t tail;      /* the next element to be produced */
+    int      aborted;   /* either side gave up */
+} mp4opus_ring_t;
+
+#define MP4OPUSRING_YIELD_COUNT 64
+#define MP4OPUSRING_SLEEP_NSEC  50000
+
+static inline int mp4opus_ring_init
+(
+    mp4opus_ring_t *ring,
+    uint32_t        element_size,
+    uint32_t        capacity
+)
+{
+    memset( ring, 0, sizeof(mp4opus_ring_t) );
+    ring->slots = lsmash_malloc( (size_t)element_size * capacity );
+    if( !ring->slots )
+        return -1;
+    ring->element_size = element_size;
+    ring->capacity     = capacity;
+    return 0;
+}
+
+static inline void mp4opus_ring_cleanup
+(
+    mp4opus_ring_t *ring
+)
+{
+    lsmash_free( ring->slots );
+    ring->slots = NULL;
+}
+
+static inline void mp4opus_ring_wait
+(
+    uint32_t *retries
+)
+{
+    if( ++*retries < MP4OPUSRING_YIELD_COUNT )
+        sched_yield();
+    else
+        nanosleep( &(struct timespec){ 0, MP4OPUSRING_SLEEP_NSEC }, NULL );
+}
+
+static inline void mp4opus_ring_abort
+(
+    mp4opus_ring_t *ring
+)
+{
+    /* Wake up the other side waiting for this side forever. */
+    __atomic_store_n( &ring->aborted, 1, __ATOMIC_RELEASE );
+}
+
+static inline int mp4opus_ring_push
+(
+    mp4opus_ring_t *ring,
+    const void     *element
+)
+{
+    /* Return -1 if the ring is aborted. */
+    uint32_t tail    = ring->tail;
+    uint32_t retries = 0;
+    while( tail - __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) == ring->capacity )
+    {
+        if( __atomic_load_n( &ring->aborted, __ATOMIC_ACQUIRE ) )
+            return -1;
+        mp4opus_ring_wait( &retries );
+    }
+    memcpy( ring->slots + (size_t)(tail % ring->capacity) * ring->element_size, element, ring->element_size );
+    __atomic_store_n( &ring->tail, tail + 1, __ATOMIC_RELEASE );
+    return 0;
+}
+
+static inline int mp4opus_ring_try_pop
+(
+    mp4opus_ring_t *ring,
+    void           *element
+)
+{
+    /* Return 1 if the ring is empty. */
+    uint32_t head = ring->head;
+    if( __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) == head )
+        return 1;
+    memcpy( element, ring->slots + (size_t)(head % ring->capacity) * ring->element_size, ring->element_size );
+    __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE );
+    return 0;
+}
+
+static inline int mp4opus_ring_pop
+(
+    mp4opus_ring_t *ring,
+    void           *element
+)
+{
+    /* Return -1 if the ring is aborted while empty. */
+    uint32_t retries = 0;
+    while( mp4opus_ring_try_pop( ring, element ) )
+    {
+        if( __atomic_load_n( &ring->aborted, __ATOMIC_ACQUIRE ) )
+            return -1;
+        mp4opus_ring_wait( &retries );
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,172 @@
+/*****************************************************************************
+ * mp4opusseg.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSSEG_H
+#define MP4OPUSSEG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Packet segment written by mp4opusenc --segment and stitched into a movie by mp4opusenc --stitch.
+ * The segment consists of a header followed by the packets in decoding order, each of which is
+ * preceded by its size in 32 bits. Nothing but the encoded input and the options goes into a segment,
+ * so the same segment is written byte for byte by every run with the same build.
+ * Segments move between machines, so every field is stored in little endian regardless of the host,
+ * in the order of the structure below without any padding. */
+
+#define MP4OPUSSEG_MAGIC   0x4753504F   /* "OPSG" in little endian */
+#define MP4OPUSSEG_VERSION 1
+
+#define MP4OPUSSEG_FLAG_LAST 0x1        /* the segment ends with the end of the stream */
+
+#define MP4OPUSSEG_HEADER_SIZE 312      /* bytes of the header in the file */
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t sample_duration;       /* duration of every packet in 48kHz */
+    uint64_t start_packet;          /* number of packets of the stream preceding the segment */
+    uint64_t num_packets;
+    uint64_t duration;              /* presented samples in 48kHz, trimmed to the input for the last segment */
+    uint32_t pre_roll_distance;     /* number of packets to be decoded before a packet */
+    /* OpusSpecificBox of the stream */
+    uint32_t input_sample_rate;
+    uint16_t pre_skip;
+    int16_t  output_gain;
+    uint8_t  output_channel_count;
+    uint8_t  channel_mapping_family;
+    uint8_t  stream_count;
+    uint8_t  coupled_count;
+    uint8_t  channel_mapping[256];  /* the last byte is reserved */
+} mp4opusseg_header_t;
+
+static inline void mp4opus_seg_put_le
+(
+    uint8_t **p,
+    uint64_t  value,
+    int       size
+)
+{
+    for( int i = 0; i < size; i++ )
+        *(*p)++ = (uint8_t)(value >> (8 * i));
+}
+
+static inline uint64_t mp4opus_seg_get_le
+(
+    const uint8_t **p,
+    int             size
+)
+{
+    uint64_t value = 0;
+    for( int i = 0; i < size; i++ )
+        value |= (uint64_t)*(*p)++ << (8 * i);
+    return value;
+}
+
+static inline int mp4opus_seg_write_header
+(
+    FILE                      *fp,
+    const mp4opusseg_header_t *header
+)
+{
+    uint8_t  buf[MP4OPUSSEG_HEADER_SIZE];
+    uint8_t *p = buf;
+    mp4opus_seg_put_le( &p, header->magic,                  4 );
+    mp4opus_seg_put_le( &p, header->version,                4 );
+    mp4opus_seg_put_le( &p, header->flags,                  4 );
+    mp4opus_seg_put_le( &p, header->sample_duration,        4 );
+    mp4opus_seg_put_le( &p, header->start_packet,           8 );
+    mp4opus_seg_put_le( &p, header->num_packets,            8 );
+    mp4opus_seg_put_le( &p, header->duration,               8 );
+    mp4opus_seg_put_le( &p, header->pre_roll_distance,      4 );
+    mp4opus_seg_put_le( &p, header->input_sample_rate,      4 );
+    mp4opus_seg_put_le( &p, header->pre_skip,               2 );
+    mp4opus_seg_put_le( &p, (uint16_t)header->output_gain,  2 );
+    mp4opus_seg_put_le( &p, header->output_channel_count,   1 );
+    mp4opus_seg_put_le( &p, header->channel_mapping_family, 1 );
+    mp4opus_seg_put_le( &p, header->stream_count,           1 );
+    mp4opus_seg_put_le( &p, header->coupled_count,          1 );
+    memcpy( p, header->channel_mapping, sizeof(header->channel_mapping) );
+    return fwrite( buf, MP4OPUSSEG_HEADER_SIZE, 1, fp ) == 1 ? 0 : -1;
+}
+
+/* Return -1 on a read error or a truncated header. The magic and the version are left to the caller. */
+static inline int mp4opus_seg_read_header
+(
+    FILE                *fp,
+    mp4opusseg_header_t *header
+)
+{
+    uint8_t buf[MP4OPUSSEG_HEADER_SIZE];
+    if( fread( buf, MP4OPUSSEG_HEADER_SIZE, 1, fp ) != 1 )
+        return -1;
+    const uint8_t *p = buf;
+    header->magic                  = mp4opus_seg_get_le( &p, 4 );
+    header->version                = mp4opus_seg_get_le( &p, 4 );
+    header->flags                  = mp4opus_seg_get_le( &p, 4 );
+    header->sample_duration        = mp4opus_seg_get_le( &p, 4 );
+    header->start_packet           = mp4opus_seg_get_le( &p, 8 );
+    header->num_packets            = mp4opus_seg_get_le( &p, 8 );
+    header->duration               = mp4opus_seg_get_le( &p, 8 );
+    header->pre_roll_distance      = mp4opus_seg_get_le( &p, 4 );
+    header->input_sample_rate      = mp4opus_seg_get_le( &p, 4 );
+    header->pre_skip               = mp4opus_seg_get_le( &p, 2 );
+    header->output_gain            = (int16_t)mp4opus_seg_get_le( &p, 2 );
+    header->output_channel_count   = mp4opus_seg_get_le( &p, 1 );
+    header->channel_mapping_family = mp4opus_seg_get_le( &p, 1 );
+    header->stream_count           = mp4opus_seg_get_le( &p, 1 );
+    header->coupled_count          = mp4opus_seg_get_le( &p, 1 );
+    memcpy( header->channel_mapping, p, sizeof(header->channel_mapping) );
+    return 0;
+}
+
+/* The size preceding each packet */
+static inline int mp4opus_seg_write_size
+(
+    FILE    *fp,
+    uint32_t size
+)
+{
+    uint8_t  buf[4];
+    uint8_t *p = buf;
+    mp4opus_seg_put_le( &p, size, 4 );
+    return fwrite( buf, 4, 1, fp ) == 1 ? 0 : -1;
+}
+
+static inline int mp4opus_seg_read_size
+(
+    FILE     *fp,
+    uint32_t *size
+)
+{
+    uint8_t buf[4];
+    if( fread( buf, 4, 1, fp ) != 1 )
+        return -1;
+    const uint8_t *p = buf;
+    *size = mp4opus_seg_get_le( &p, 4 );
+    return 0;
+}
+
+#endif
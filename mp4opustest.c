@@ -0,0 +1,441 @@
+/*****************************************************************************
+ * mp4opustest.c
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+/* Tests of the public API of libmp4opus.
+ * Every movie is written into and read from memory, so no files are left. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mp4opus.h"
+
+#define TEST_SAMPLE_RATE 48000
+#define TEST_CHANNELS    2
+#define TEST_DURATION    48000      /* samples per channel */
+#define TEST_PUSH_SIZE   1000       /* not aligned to frames on purpose */
+
+static int failures = 0;
+
+#define CHECK( cond, ... )                          \
+    do                                              \
+    {                                               \
+        if( !(cond) )                               \
+        {                                           \
+            fprintf( stderr, "FAILED: " );          \
+            fprintf( stderr, __VA_ARGS__ );         \
+            ++failures;                             \
+        }                                           \
+    } while( 0 )
+
+typedef struct
+{
+    uint8_t *data;
+    int64_t  size;
+    int64_t  capacity;
+    int64_t  pos;
+} memory_file_t;
+
+static int memory_read
+(
+    void    *opaque,
+    uint8_t *buf,
+    int      size
+)
+{
+    memory_file_t *file = opaque;
+    int64_t rest = file->size - file->pos;
+    if( rest <= 0 )
+        return 0;
+    if( size > rest )
+        size = (int)rest;
+    memcpy( buf, file->data + file->pos, size );
+    file->pos += size;
+    return size;
+}
+
+static int memory_write
+(
+    void    *opaque,
+    uint8_t *buf,
+    int      size
+)
+{
+    memory_file_t *file = opaque;
+    if( file->pos + size > file->capacity )
+    {
+        int64_t capacity = file->capacity ? file->capacity : 65536;
+        while( capacity < file->pos + size )
+            capacity *= 2;
+        uint8_t *data = realloc( file->data, capacity );
+        if( !data )
+            return -1;
+        file->data     = data;
+        file->capacity = capacity;
+    }
+    if( file->pos > file->size )
+        memset( file->data + file->size, 0, file->pos - file->size );
+    memcpy( file->data + file->pos, buf, size );
+    file->pos += size;
+    if( file->pos > file->size )
+        file->size = file->pos;
+    return size;
+}
+
+static int64_t memory_seek
+(
+    void   *opaque,
+    int64_t offset,
+    int     whence
+)
+{
+    memory_file_t *file = opaque;
+    int64_t pos = whence == SEEK_SET ? offset
+                : whence == SEEK_CUR ? file->pos + offset
+                : whence == SEEK_END ? file->size + offset
+                : -1;
+    if( pos < 0 )
+        return -1;
+    file->pos = pos;
+    return pos;
+}
+
+static mp4opus_io_t memory_io
+(
+    memory_file_t *file
+)
+{
+    return (mp4opus_io_t){ .opaque = file, .read = memory_read, .write = memory_write, .seek = memory_seek };
+}
+
+static double get_test_signal
+(
+    uint32_t channel,
+    uint32_t n
+)
+{
+    /* A different tone per channel to catch swapped channels. */
+    double frequency = channel ? 660.0 : 440.0;
+    return 0.5 * sin( 2.0 * 3.14159265358979323846 * frequency * n / TEST_SAMPLE_RATE );
+}
+
+static int encode_test_signal
+(
+    memory_file_t                 *file,
+    const mp4opus_encoder_param_t *param
+)
+{
+    mp4opus_io_t       io = memory_io( file );
+    mp4opus_encoder_t *enc;
+    if( mp4opus_encoder_open( &enc, param, &io ) < 0 )
+    {
+        fprintf( stderr, "FAILED: open encoder: %s", mp4opus_encoder_error( enc ) );
+        mp4opus_encoder_close( enc );
+        return -1;
+    }
+    size_t sample_size = param->float_input ? sizeof(float) : sizeof(int16_t);
+    uint8_t *pcm = malloc( TEST_PUSH_SIZE * TEST_CHANNELS * sample_size );
+    int ret = pcm ? 0 : -1;
+    for( uint32_t n = 0; n < TEST_DURATION && ret == 0; n += TEST_PUSH_SIZE )
+    {
+        uint32_t count = TEST_DURATION - n < TEST_PUSH_SIZE ? TEST_DURATION - n : TEST_PUSH_SIZE;
+        for( uint32_t i = 0; i < count; i++ )
+            for( uint32_t ch = 0; ch < TEST_CHANNELS; ch++ )
+            {
+                double value = get_test_signal( ch, n + i );
+                if( param->float_input )
+                    ((float   *)pcm)[i * TEST_CHANNELS + ch] = (float)value;
+                else
+                    ((int16_t *)pcm)[i * TEST_CHANNELS + ch] = (int16_t)lrint( value * 32767.0 );
+            }
+        ret = mp4opus_encoder_push( enc, pcm, count );
+    }
+    if( ret == 0 )
+        ret = mp4opus_encoder_finish( enc );
+    if( ret < 0 )
+        fprintf( stderr, "FAILED: encode: %s", mp4opus_encoder_error( enc ) );
+    else
+    {
+        /* Nothing can be pushed into the finished encoder. */
+        CHECK( mp4opus_encoder_push( enc, pcm, 1 ) < 0, "push after finish succeeded.\n" );
+        CHECK( *mp4opus_encoder_error( enc ), "no error message for push after finish.\n" );
+    }
+    free( pcm );
+    mp4opus_encoder_close( enc );
+    return ret;
+}
+
+static void test_round_trip
+(
+    const char *name,
+    int         float_input,
+    int         fragment,
+    int         faststart
+)
+{
+    memory_file_t           file = { 0 };
+    mp4opus_encoder_param_t enc_param;
+    mp4opus_encoder_default_param( &enc_param );
+    enc_param.sample_rate = TEST_SAMPLE_RATE;
+    enc_param.channels    = TEST_CHANNELS;
+    enc_param.float_input = float_input;
+    enc_param.fragment    = fragment;
+    enc_param.faststart   = faststart;
+    if( encode_test_signal( &file, &enc_param ) < 0 )
+    {
+        fprintf( stderr, "FAILED: %s\n", name );
+        ++failures;
+        free( file.data );
+        return;
+    }
+    file.pos = 0;
+    mp4opus_io_t            io = memory_io( &file );
+    mp4opus_decoder_param_t dec_param;
+    mp4opus_decoder_default_param( &dec_param );
+    dec_param.float_output = 1;
+    mp4opus_decoder_t    *dec;
+    mp4opus_stream_info_t info;
+    float                *pcm = NULL;
+    if( mp4opus_decoder_open( &dec, &dec_param, &io ) < 0
+     || mp4opus_decoder_get_info( dec, &info ) < 0 )
+        fprintf( stderr, "FAILED: %s: open decoder: %s", name, mp4opus_decoder_error( dec ) );
+    else if( !(pcm = malloc( (TEST_DURATION + 1) * TEST_CHANNELS * sizeof(float) )) )
+        fprintf( stderr, "FAILED: %s: failed to allocate buffer.\n", name );
+    if( !pcm )
+    {
+        ++failures;
+        mp4opus_decoder_close( dec );
+        free( file.data );
+        return;
+    }
+    CHECK( info.channels == TEST_CHANNELS, "%s: %u channels decoded.\n", name, info.channels );
+    CHECK( info.sample_rate == 48000, "%s: sample rate %u.\n", name, info.sample_rate );
+    CHECK( info.duration == TEST_DURATION, "%s: duration %llu.\n", name, (unsigned long long)info.duration );
+    /* Pull in odd chunks and ask for one more sample than encoded. */
+    uint32_t pulled = 0;
+    int      ret;
+    do
+    {
+        ret = mp4opus_decoder_pull( dec, pcm + pulled * TEST_CHANNELS, TEST_DURATION + 1 - pulled < 777 ? TEST_DURATION + 1 - pulled : 777 );
+        if( ret > 0 )
+            pulled += ret;
+    } while( ret > 0 && pulled <= TEST_DURATION );
+    CHECK( ret >= 0, "%s: pull: %s", name, mp4opus_decoder_error( dec ) );
+    CHECK( pulled == TEST_DURATION, "%s: %u samples pulled.\n", name, pulled );
+    /* The encoder delay is removed by the edit, so the decoded signal lines up with the source.
+     * Compare in the middle to stay away from the start-up and the padding. */
+    for( uint32_t ch = 0; ch < TEST_CHANNELS && pulled == TEST_DURATION; ch++ )
+    {
+        double xy = 0.0, xx = 0.0, yy = 0.0;
+        for( uint32_t n = TEST_DURATION / 10; n < TEST_DURATION - TEST_DURATION / 10; n++ )
+        {
+            double x = get_test_signal( ch, n );
+            double y = pcm[n * TEST_CHANNELS + ch];
+            xy += x * y;
+            xx += x * x;
+            yy += y * y;
+        }
+        double correlation = xx > 0.0 && yy > 0.0 ? xy / sqrt( xx * yy ) : 0.0;
+        CHECK( correlation > 0.9, "%s: channel %u correlates by %.3f.\n", name, ch, correlation );
+    }
+    mp4opus_decoder_close( dec );
+    free( pcm );
+    free( file.data );
+}
+
+static void test_encoder_error
+(
+    const char                    *name,
+    const mp4opus_encoder_param_t *param,
+    const mp4opus_io_t            *io
+)
+{
+    mp4opus_encoder_t *enc = NULL;
+    int ret = mp4opus_encoder_open( &enc, param, io );
+    CHECK( ret < 0, "%s: the encoder opened.\n", name );
+    CHECK( enc, "%s: no encoder to get the error.\n", name );
+    if( enc )
+    {
+        CHECK( *mp4opus_encoder_error( enc ), "%s: no error message.\n", name );
+        /* The failed encoder refuses everything and keeps the reason. */
+        char error[256];
+        snprintf( error, sizeof(error), "%s", mp4opus_encoder_error( enc ) );
+        CHECK( ret >= 0 || mp4opus_encoder_finish( enc ) < 0, "%s: the failed encoder finished.\n", name );
+        CHECK( !strcmp( error, mp4opus_encoder_error( enc ) ), "%s: the reason was overwritten.\n", name );
+    }
+    mp4opus_encoder_close( enc );
+}
+
+static void test_encoder_errors( void )
+{
+    memory_file_t           file = { 0 };
+    mp4opus_io_t            io   = memory_io( &file );
+    mp4opus_encoder_param_t param;
+    mp4opus_encoder_default_param( &param );
+    mp4opus_encoder_param_t bad = param;
+    bad.frame_size = 30;
+    test_encoder_error( "frame size 30 ms", &bad, &io );
+    bad = param;
+    bad.frame_size = 0;
+    test_encoder_error( "frame size 0 ms", &bad, &io );
+    bad = param;
+    bad.sample_rate = 0;
+    test_encoder_error( "sample rate 0", &bad, &io );
+    bad = param;
+    bad.channels = 0;
+    test_encoder_error( "0 channels", &bad, &io );
+    bad = param;
+    bad.channels = 256;
+    test_encoder_error( "256 channels", &bad, &io );
+    bad = param;
+    bad.channels       = 9;
+    bad.mapping_family = 1;
+    test_encoder_error( "9 channels of the channel mapping family 1", &bad, &io );
+    bad = param;
+    bad.mapping_family = 3;
+    test_encoder_error( "channel mapping family 3", &bad, &io );
+    bad = param;
+    bad.fragment = -1;
+    test_encoder_error( "negative fragment", &bad, &io );
+    mp4opus_io_t no_write = io;
+    no_write.write = NULL;
+    test_encoder_error( "no write callback", &param, &no_write );
+    mp4opus_io_t no_seek = io;
+    no_seek.seek = NULL;
+    test_encoder_error( "no seek callback", &param, &no_seek );
+    mp4opus_io_t no_read = io;
+    no_read.read = NULL;
+    bad = param;
+    bad.faststart = 1;
+    test_encoder_error( "faststart without read callback", &bad, &no_read );
+    free( file.data );
+    /* Every valid frame size opens. */
+    static const double frame_sizes[] = { 2.5, 5, 10, 20, 40, 60 };
+    for( size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++ )
+    {
+        memory_file_t      valid_file = { 0 };
+        mp4opus_io_t       valid_io   = memory_io( &valid_file );
+        mp4opus_encoder_t *enc;
+        bad = param;
+        bad.frame_size = frame_sizes[i];
+        CHECK( mp4opus_encoder_open( &enc, &bad, &valid_io ) == 0, "frame size %g ms: %s", frame_sizes[i], mp4opus_encoder_error( enc ) );
+        mp4opus_encoder_close( enc );
+        free( valid_file.data );
+    }
+    /* The sample rates not supported by Opus are resampled, and more than 8 channels are coded discretely. */
+    static const struct { uint32_t sample_rate; uint32_t channels; } formats[] = { { 44100, 2 }, { 96000, 2 }, { 48000, 9 }, { 44100, 255 } };
+    for( size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++ )
+    {
+        memory_file_t      valid_file = { 0 };
+        mp4opus_io_t       valid_io   = memory_io( &valid_file );
+        mp4opus_encoder_t *enc;
+        bad = param;
+        bad.sample_rate = formats[i].sample_rate;
+        bad.channels    = formats[i].channels;
+        CHECK( mp4opus_encoder_open( &enc, &bad, &valid_io ) == 0,
+               "%u Hz %u channels: %s", formats[i].sample_rate, formats[i].channels, mp4opus_encoder_error( enc ) );
+        mp4opus_encoder_close( enc );
+        free( valid_file.data );
+    }
+}
+
+static void test_decoder_error
+(
+    const char                    *name,
+    const mp4opus_decoder_param_t *param,
+    const mp4opus_io_t            *io
+)
+{
+    mp4opus_decoder_t *dec = NULL;
+    int ret = mp4opus_decoder_open( &dec, param, io );
+    CHECK( ret < 0, "%s: the decoder opened.\n", name );
+    CHECK( dec, "%s: no decoder to get the error.\n", name );
+    if( dec )
+    {
+        CHECK( *mp4opus_decoder_error( dec ), "%s: no error message.\n", name );
+        mp4opus_stream_info_t info;
+        float                 pcm[TEST_CHANNELS];
+        CHECK( ret >= 0 || mp4opus_decoder_get_info( dec, &info ) < 0, "%s: got info of the failed decoder.\n", name );
+        CHECK( ret >= 0 || mp4opus_decoder_pull( dec, pcm, 1 ) < 0, "%s: pulled from the failed decoder.\n", name );
+    }
+    mp4opus_decoder_close( dec );
+}
+
+static void test_decoder_errors( void )
+{
+    mp4opus_decoder_param_t param;
+    mp4opus_decoder_default_param( &param );
+    /* Not a movie at all */
+    memory_file_t garbage = { 0 };
+    mp4opus_io_t  io      = memory_io( &garbage );
+    uint8_t bytes[4096];
+    for( size_t i = 0; i < sizeof(bytes); i++ )
+        bytes[i] = (uint8_t)(i * 37 + 11);
+    memory_write( &garbage, bytes, sizeof(bytes) );
+    garbage.pos = 0;
+    test_decoder_error( "garbage input", &param, &io );
+    free( garbage.data );
+    /* Empty input */
+    memory_file_t empty = { 0 };
+    io = memory_io( &empty );
+    test_decoder_error( "empty input", &param, &io );
+    /* Missing callbacks */
+    mp4opus_io_t no_read = io;
+    no_read.read = NULL;
+    test_decoder_error( "no read callback", &param, &no_read );
+    mp4opus_io_t no_seek = io;
+    no_seek.seek = NULL;
+    test_decoder_error( "no seek callback", &param, &no_seek );
+    /* Track that does not exist in a valid movie */
+    memory_file_t           movie = { 0 };
+    mp4opus_encoder_param_t enc_param;
+    mp4opus_encoder_default_param( &enc_param );
+    if( encode_test_signal( &movie, &enc_param ) == 0 )
+    {
+        movie.pos = 0;
+        io = memory_io( &movie );
+        mp4opus_decoder_param_t bad = param;
+        bad.track_ID = 100;
+        test_decoder_error( "non-existent track", &bad, &io );
+    }
+    else
+        ++failures;
+    free( movie.data );
+}
+
+int main( void )
+{
+    test_round_trip( "16-bit round trip", 0, 0, 0 );
+    test_round_trip( "float round trip", 1, 0, 0 );
+    test_round_trip( "fragmented round trip", 0, 500, 0 );
+    test_round_trip( "faststart round trip", 0, 0, 1 );
+    test_encoder_errors();
+    test_decoder_errors();
+    if( failures )
+    {
+        fprintf( stderr, "%d check(s) failed.\n", failures );
+        return 1;
+    }
+    fprintf( stderr, "all tests passed.\n" );
+    return 0;
+}
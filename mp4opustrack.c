@@ -0,0 +1,1306 @@
+/*****************************************************************************
+ * mp4opustrack.c
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <lsmash.h>
+
+#include <opus/opus_multistream.h>
+
+#include "mp4opuscore.h"
+#include "mp4opustrack.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define MP4OPUS_MIN( a, b ) ((a) < (b) ? (a) : (b))
+#define MP4OPUS_MAX( a, b ) ((a) > (b) ? (a) : (b))
+
+#define RESAMPLER_TAPS        128   /* taps per phase for each 48kHz of the input sample rate */
+#define RESAMPLER_ATTENUATION 100.0 /* stopband attenuation (dB) */
+#define RESAMPLER_BLOCK_SIZE  1024  /* input frames converted at a time */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Every function reporting errors takes the buffer as error. */
+#define ERROR_MSG( ... ) error_message( error, __VA_ARGS__ )
+
+static int error_message
+(
+    char       *error,
+    const char *message,
+    ...
+)
+{
+    va_list args;
+    va_start( args, message );
+    vsnprintf( error, MP4OPUS_ERROR_LENGTH, message, args );
+    va_end( args );
+    return -1;
+}
+
+/*** PCM ***/
+
+static void convert_s16be
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 2 )
+        dst[i] = (int16_t)((src[0] << 8) | src[1]) * (1.0f / 32768);
+}
+
+static void convert_s24le
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    uint32_t i = 0;
+#ifdef __SSE2__
+    /* Gather 4 samples of 3 bytes into the upper 24 bits of 32-bit lanes
+     * and sign extend them by the arithmetic shift. 16 bytes are loaded per 12 bytes. */
+    const __m128 scale = _mm_set1_ps( 1.0f / 8388608 );
+    for( ; i + 6 <= count; i += 4, src += 12 )
+    {
+        __m128i x = _mm_loadu_si128( (const __m128i *)src );
+        __m128i a = _mm_unpacklo_epi32( x, _mm_srli_si128( x, 3 ) );
+        __m128i b = _mm_unpacklo_epi32( _mm_srli_si128( x, 6 ), _mm_srli_si128( x, 9 ) );
+        __m128i v = _mm_srai_epi32( _mm_slli_epi32( _mm_unpacklo_epi64( a, b ), 8 ), 8 );
+        _mm_storeu_ps( dst + i, _mm_mul_ps( _mm_cvtepi32_ps( v ), scale ) );
+    }
+#endif
+    for( ; i < count; i++, src += 3 )
+        dst[i] = ((int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 24) >> 8) * (1.0f / 8388608);
+}
+
+static void convert_s24be
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 3 )
+        dst[i] = ((int32_t)((uint32_t)src[2] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[0] << 24) >> 8) * (1.0f / 8388608);
+}
+
+static void convert_s32le
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    uint32_t i = 0;
+#if defined( __SSE2__ )
+    const __m128 scale = _mm_set1_ps( 1.0f / 2147483648.0f );
+    for( ; i + 4 <= count; i += 4, src += 16 )
+        _mm_storeu_ps( dst + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i *)src ) ), scale ) );
+#elif defined( __ARM_NEON ) && !defined( __ARM_BIG_ENDIAN )
+    for( ; i + 4 <= count; i += 4, src += 16 )
+        vst1q_f32( dst + i, vcvtq_n_f32_s32( vreinterpretq_s32_u8( vld1q_u8( src ) ), 31 ) );
+#endif
+    for( ; i < count; i++, src += 4 )
+        dst[i] = (int32_t)((uint32_t)src[0] | (uint32_t)src[1] << 8 | (uint32_t)src[2] << 16 | (uint32_t)src[3] << 24) * (1.0f / 2147483648.0f);
+}
+
+static void convert_s32be
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 4 )
+        dst[i] = (int32_t)((uint32_t)src[3] | (uint32_t)src[2] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[0] << 24) * (1.0f / 2147483648.0f);
+}
+
+static void convert_f32le
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 4 )
+    {
+        uint32_t v = (uint32_t)src[0] | (uint32_t)src[1] << 8 | (uint32_t)src[2] << 16 | (uint32_t)src[3] << 24;
+        memcpy( &dst[i], &v, sizeof(float) );
+    }
+}
+
+static void convert_f32be
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 4 )
+    {
+        uint32_t v = (uint32_t)src[3] | (uint32_t)src[2] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[0] << 24;
+        memcpy( &dst[i], &v, sizeof(float) );
+    }
+}
+
+void mp4opus_convert_s16le
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    for( uint32_t i = 0; i < count; i++, src += 2 )
+        dst[i] = (int16_t)(src[0] | (src[1] << 8)) * (1.0f / 32768);
+}
+
+void mp4opus_convert_s16
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    const int16_t *s16 = (const int16_t *)src;
+    for( uint32_t i = 0; i < count; i++ )
+        dst[i] = s16[i] * (1.0f / 32768);
+}
+
+void mp4opus_convert_float
+(
+    float         *dst,
+    const uint8_t *src,
+    uint32_t       count
+)
+{
+    memcpy( dst, src, count * sizeof(float) );
+}
+
+int mp4opus_get_pcm_converter
+(
+    int                is_float,
+    int                big_endian,
+    uint32_t           sample_size,
+    mp4opus_convert_t *convert
+)
+{
+    if( is_float )
+    {
+        if( sample_size != 32 )
+            return -1;
+        *convert = big_endian ? convert_f32be : convert_f32le;
+    }
+    else if( sample_size == 16 )
+        *convert = big_endian ? convert_s16be : NULL;
+    else if( sample_size == 24 )
+        *convert = big_endian ? convert_s24be : convert_s24le;
+    else if( sample_size == 32 )
+        *convert = big_endian ? convert_s32be : convert_s32le;
+    else
+        return -1;
+    return 0;
+}
+
+/*** Resampler ***/
+
+uint32_t mp4opus_get_encoder_sample_rate
+(
+    uint32_t input_rate
+)
+{
+    return mp4opus_is_native_rate( input_rate ) ? input_rate : 48000;
+}
+
+uint32_t mp4opus_get_resampler_phases
+(
+    uint32_t in_rate,
+    uint32_t out_rate
+)
+{
+    uint32_t a = in_rate;
+    uint32_t b = out_rate;
+    while( b )
+    {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return out_rate / a;
+}
+
+static double bessel_i0
+(
+    double x
+)
+{
+    double sum  = 1.0;
+    double term = 1.0;
+    for( int k = 1; term > sum * 1e-12; k++ )
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum  += term;
+    }
+    return sum;
+}
+
+static inline void deinterleave_frames
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     start,
+    uint32_t     count
+)
+{
+    /* The loops are unrolled by the specialized callers giving constant channels. */
+    for( uint32_t c = 0; c < channels; c++ )
+        for( uint32_t i = start; i < count; i++ )
+            dst[c * stride + i] = src[i * channels + c];
+}
+
+static void deinterleave_any
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     count
+)
+{
+    deinterleave_frames( dst, stride, src, channels, 0, count );
+}
+
+static void deinterleave_1
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     count
+)
+{
+    memcpy( dst, src, count * sizeof(float) );
+}
+
+static void deinterleave_2
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     count
+)
+{
+    uint32_t i = 0;
+#if defined( __SSE2__ )
+    for( ; i + 4 <= count; i += 4 )
+    {
+        __m128 a = _mm_loadu_ps( src + 2 * i     );
+        __m128 b = _mm_loadu_ps( src + 2 * i + 4 );
+        _mm_storeu_ps( dst          + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+        _mm_storeu_ps( dst + stride + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+    }
+#elif defined( __ARM_NEON )
+    for( ; i + 4 <= count; i += 4 )
+    {
+        float32x4x2_t v = vld2q_f32( src + 2 * i );
+        vst1q_f32( dst          + i, v.val[0] );
+        vst1q_f32( dst + stride + i, v.val[1] );
+    }
+#endif
+    deinterleave_frames( dst, stride, src, 2, i, count );
+}
+
+static void deinterleave_6
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     count
+)
+{
+    uint32_t i = 0;
+#ifdef __SSE2__
+    /* Transpose the first 4 channels of 4 frames, and pick the pairs of the last 2 channels. */
+    for( ; i + 4 <= count; i += 4 )
+    {
+        const float *p = src + 6 * i;
+        __m128 r0 = _mm_loadu_ps( p      );
+        __m128 r1 = _mm_loadu_ps( p +  6 );
+        __m128 r2 = _mm_loadu_ps( p + 12 );
+        __m128 r3 = _mm_loadu_ps( p + 18 );
+        _MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+        _mm_storeu_ps( dst              + i, r0 );
+        _mm_storeu_ps( dst +     stride + i, r1 );
+        _mm_storeu_ps( dst + 2 * stride + i, r2 );
+        _mm_storeu_ps( dst + 3 * stride + i, r3 );
+        __m128 s0 = _mm_loadh_pi( _mm_loadl_pi( _mm_setzero_ps(), (const __m64 *)(p +  4) ), (const __m64 *)(p + 10) );
+        __m128 s1 = _mm_loadh_pi( _mm_loadl_pi( _mm_setzero_ps(), (const __m64 *)(p + 16) ), (const __m64 *)(p + 22) );
+        _mm_storeu_ps( dst + 4 * stride + i, _mm_shuffle_ps( s0, s1, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+        _mm_storeu_ps( dst + 5 * stride + i, _mm_shuffle_ps( s0, s1, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+    }
+#endif
+    deinterleave_frames( dst, stride, src, 6, i, count );
+}
+
+static void deinterleave_8
+(
+    float       *dst,
+    uint32_t     stride,
+    const float *src,
+    uint32_t     channels,
+    uint32_t     count
+)
+{
+    uint32_t i = 0;
+#ifdef __SSE2__
+    /* Transpose each half of the channels of 4 frames. */
+    for( ; i + 4 <= count; i += 4 )
+    {
+        const float *p = src + 8 * i;
+        for( int half = 0; half < 2; half++, p += 4 )
+        {
+            __m128 r0 = _mm_loadu_ps( p      );
+            __m128 r1 = _mm_loadu_ps( p +  8 );
+            __m128 r2 = _mm_loadu_ps( p + 16 );
+            __m128 r3 = _mm_loadu_ps( p + 24 );
+            _MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+            float *q = dst + 4 * half * stride + i;
+            _mm_storeu_ps( q             , r0 );
+            _mm_storeu_ps( q +     stride, r1 );
+            _mm_storeu_ps( q + 2 * stride, r2 );
+            _mm_storeu_ps( q + 3 * stride, r3 );
+        }
+    }
+#endif
+    deinterleave_frames( dst, stride, src, 8, i, count );
+}
+
+void mp4opus_destroy_resampler
+(
+    mp4opus_resampler_t *rs
+)
+{
+    if( !rs )
+        return;
+    lsmash_free( rs->filter );
+    lsmash_free( rs->planes );
+    lsmash_free( rs->scratch );
+    lsmash_free( rs->tail );
+    lsmash_free( rs );
+}
+
+mp4opus_resampler_t *mp4opus_create_resampler
+(
+    uint32_t          in_rate,
+    uint32_t          out_rate,
+    uint32_t          channels,
+    uint32_t          sample_bytes,
+    mp4opus_convert_t convert,
+    char             *error
+)
+{
+    uint32_t up = mp4opus_get_resampler_phases( in_rate, out_rate );
+    if( up > MP4OPUS_RESAMPLER_MAX_PHASES )
+    {
+        ERROR_MSG( "%"PRIu32" Hz cannot be resampled into %"PRIu32" Hz, since it requires %"PRIu32" filter phases"
+                   " while at most %d are supported.\n", in_rate, out_rate, up, MP4OPUS_RESAMPLER_MAX_PHASES );
+        return NULL;
+    }
+    mp4opus_resampler_t *rs = lsmash_malloc_zero( sizeof(mp4opus_resampler_t) );
+    if( !rs )
+    {
+        ERROR_MSG( "failed to allocate resampler.\n" );
+        return NULL;
+    }
+    rs->channels     = channels;
+    rs->convert      = convert;
+    rs->sample_bytes = sample_bytes;
+    rs->up           = up;
+    rs->down         = (uint64_t)in_rate * up / out_rate;
+    rs->taps         = RESAMPLER_TAPS * ((in_rate + out_rate - 1) / out_rate);
+    rs->capacity     = rs->taps + RESAMPLER_BLOCK_SIZE;
+    rs->filter       = lsmash_malloc( (size_t)rs->up * rs->taps * sizeof(float) );
+    rs->planes       = lsmash_malloc_zero( (size_t)channels * rs->capacity * sizeof(float) );
+    rs->scratch      = lsmash_malloc( (size_t)channels * RESAMPLER_BLOCK_SIZE * sizeof(float) );
+    rs->tail_size    = rs->taps * channels * sample_bytes;
+    rs->tail         = lsmash_malloc_zero( rs->tail_size );
+    if( !rs->filter || !rs->planes || !rs->scratch || !rs->tail )
+    {
+        mp4opus_destroy_resampler( rs );
+        ERROR_MSG( "failed to allocate resampler.\n" );
+        return NULL;
+    }
+    /* Pick the kernel specialized for the common layouts once. */
+    rs->deinterleave = channels == 1 ? deinterleave_1
+                     : channels == 2 ? deinterleave_2
+                     : channels == 6 ? deinterleave_6
+                     : channels == 8 ? deinterleave_8
+                     :                 deinterleave_any;
+    /* Design the prototype lowpass filter at the interpolated rate with the Kaiser window.
+     * The transition band is placed just below the lower Nyquist frequency.
+     * The last tap is left zero so that the filter is symmetric about an integer center. */
+    uint32_t length     = rs->up * rs->taps;
+    uint32_t center     = length / 2 - 1;
+    double   beta       = 0.1102 * (RESAMPLER_ATTENUATION - 8.7);
+    double   transition = (RESAMPLER_ATTENUATION - 7.95) / (14.36 * rs->taps) * in_rate;
+    double   cutoff     = (MP4OPUS_MIN( in_rate, out_rate ) - transition) / 2 / ((double)rs->up * in_rate);
+    double   sum        = 0;
+    for( uint32_t j = 0; j < length; j++ )
+    {
+        double t = (double)j - center;
+        double r = t / center;
+        double h = t == 0 ? 2 * cutoff : sin( 2 * M_PI * cutoff * t ) / (M_PI * t);
+        h *= r > 1 ? 0 : bessel_i0( beta * sqrt( 1 - r * r ) ) / bessel_i0( beta );
+        /* Store the taps of each phase in reverse order so that the filter is applied by dot products. */
+        rs->filter[(j % rs->up) * rs->taps + (rs->taps - 1 - j / rs->up)] = h;
+        sum += h;
+    }
+    for( uint32_t j = 0; j < length; j++ )
+        rs->filter[j] *= rs->up / sum;
+    /* Start with the history of zeros. The first output sample is positioned
+     * so that the group delay is just an integer number of output samples. */
+    uint32_t offset = center % rs->down;
+    rs->delay      = center / rs->down;
+    rs->num_frames = rs->taps - 1;
+    rs->index      = offset / rs->up;
+    rs->phase      = offset % rs->up;
+    return rs;
+}
+
+static float dot_product
+(
+    const float *a,
+    const float *b,
+    uint32_t     n
+)
+{
+    float    sum = 0;
+    uint32_t i   = 0;
+#if defined( __SSE2__ )
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for( ; i + 8 <= n; i += 8 )
+    {
+        acc0 = _mm_add_ps( acc0, _mm_mul_ps( _mm_loadu_ps( a + i     ), _mm_loadu_ps( b + i     ) ) );
+        acc1 = _mm_add_ps( acc1, _mm_mul_ps( _mm_loadu_ps( a + i + 4 ), _mm_loadu_ps( b + i + 4 ) ) );
+    }
+    float v[4];
+    _mm_storeu_ps( v, _mm_add_ps( acc0, acc1 ) );
+    sum = (v[0] + v[1]) + (v[2] + v[3]);
+#elif defined( __ARM_NEON )
+    float32x4_t acc = vdupq_n_f32( 0 );
+    for( ; i + 4 <= n; i += 4 )
+        acc = vmlaq_f32( acc, vld1q_f32( a + i ), vld1q_f32( b + i ) );
+    sum = (vgetq_lane_f32( acc, 0 ) + vgetq_lane_f32( acc, 1 )) + (vgetq_lane_f32( acc, 2 ) + vgetq_lane_f32( acc, 3 ));
+#endif
+    for( ; i < n; i++ )
+        sum += a[i] * b[i];
+    return sum;
+}
+
+uint32_t mp4opus_resample
+(
+    mp4opus_resampler_t *rs,
+    uint8_t             *dst,
+    uint32_t             dst_size,
+    const uint8_t      **src,
+    uint32_t            *src_size
+)
+{
+    float   *out        = (float *)dst;
+    uint32_t out_frames = dst_size / (rs->channels * sizeof(float));
+    uint32_t frame_size = rs->channels * rs->sample_bytes;
+    uint32_t n          = 0;
+    while( n < out_frames )
+    {
+        if( rs->index + rs->taps > rs->num_frames )
+        {
+            if( *src_size < frame_size )
+            {
+                *src      += *src_size;     /* Drop a broken frame if any. */
+                *src_size  = 0;
+                break;
+            }
+            /* Discard the frames no longer referenced and append the next block. */
+            uint32_t shift = MP4OPUS_MIN( rs->index, rs->num_frames );
+            for( uint32_t c = 0; c < rs->channels; c++ )
+                memmove( rs->planes + c * rs->capacity,
+                         rs->planes + c * rs->capacity + shift,
+                         (rs->num_frames - shift) * sizeof(float) );
+            rs->num_frames -= shift;
+            rs->index      -= shift;
+            uint32_t count = MP4OPUS_MIN( rs->capacity - rs->num_frames, *src_size / frame_size );
+            count = MP4OPUS_MIN( count, RESAMPLER_BLOCK_SIZE );
+            rs->convert( rs->scratch, *src, count * rs->channels );
+            rs->deinterleave( rs->planes + rs->num_frames, rs->capacity, rs->scratch, rs->channels, count );
+            rs->num_frames += count;
+            *src           += count * frame_size;
+            *src_size      -= count * frame_size;
+            continue;
+        }
+        const float *h = rs->filter + rs->phase * rs->taps;
+        for( uint32_t c = 0; c < rs->channels; c++ )
+            out[n * rs->channels + c] = dot_product( h, rs->planes + c * rs->capacity + rs->index, rs->taps );
+        ++n;
+        rs->phase += rs->down;
+        rs->index += rs->phase / rs->up;
+        rs->phase %= rs->up;
+    }
+    return n * rs->channels * sizeof(float);
+}
+
+int mp4opus_get_resampler_tail
+(
+    mp4opus_resampler_t *rs,
+    uint8_t            **data,
+    uint32_t            *size
+)
+{
+    if( rs->tail_fed )
+        return 0;
+    rs->tail_fed = 1;
+    *data = rs->tail;
+    *size = rs->tail_size;
+    return 1;
+}
+
+/*** Encoder ***/
+
+void mp4opus_default_encoder_option
+(
+    mp4opus_encoder_option_t *opt
+)
+{
+    memset( opt, 0, sizeof(mp4opus_encoder_option_t) );
+    opt->application    = OPUS_APPLICATION_AUDIO;
+    opt->complexity     = 10;
+    opt->bitrate        = OPUS_AUTO;
+    opt->vbr            = 1;
+    opt->max_bandwidth  = OPUS_BANDWIDTH_FULLBAND;
+    opt->frame_size     = 20;
+    opt->signal         = OPUS_AUTO;
+    opt->mapping_family = -1;
+}
+
+static void remap_channel_layout
+(
+    lsmash_summary_t                  *summary,
+    lsmash_opus_specific_parameters_t *param,
+    uint8_t                            channel_mapping[255]
+)
+{
+    /* SMPTE/USB channel order -> Encoder channel order -> Vorbis channel order */
+    const mp4opus_channel_layout_t *found = NULL;
+    uint32_t cs_count = summary ? lsmash_count_codec_specific_data( summary ) : 0;
+    for( uint32_t i = 0; i < cs_count; i++ )
+    {
+        lsmash_codec_specific_t *cs = lsmash_get_codec_specific_data( summary, i + 1 );
+        if( !cs || cs->type != LSMASH_CODEC_SPECIFIC_DATA_TYPE_QT_AUDIO_CHANNEL_LAYOUT )
+            continue;
+        lsmash_codec_specific_t *conv = lsmash_convert_codec_specific_format( cs, LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+        if( !conv )
+            continue;
+        lsmash_qt_audio_channel_layout_t *layout = (lsmash_qt_audio_channel_layout_t *)conv->data.structured;
+        for( uint32_t channels = 1; channels <= 8 && !found; channels++ )
+        {
+            const mp4opus_channel_layout_t *known = mp4opus_get_channel_layout( channels );
+            if( layout->channelLayoutTag == QT_CHANNEL_LAYOUT_USE_CHANNEL_BITMAP
+              ? layout->channelBitmap == known->bitmap
+              : ((layout->channelLayoutTag & QT_CHANNEL_LAYOUT_UNKNOWN) != QT_CHANNEL_LAYOUT_UNKNOWN
+              && layout->channelLayoutTag == known->tag) )
+                found = known;
+        }
+        lsmash_destroy_codec_specific_data( conv );
+        break;
+    }
+    if( !found )
+        /* Without any known channel layout, e.g. raw PCM input, assume the SMPTE/USB channel order. */
+        found = mp4opus_get_channel_layout( param->OutputChannelCount );
+    mp4opus_set_encoder_mapping( param, found, channel_mapping );
+}
+
+static int setup_extended_mapping
+(
+    lsmash_opus_specific_parameters_t *param,
+    uint8_t                            channel_mapping[255],
+    char                              *error
+)
+{
+    /* The channels are coded in the input order without any layout.
+     * For the family 2, the ambisonic channels are coded in mono streams after the coupled stream
+     * of the non-diegetic stereo pair if present. */
+    int channels = param->OutputChannelCount;
+    int coupled  = 0;
+    if( param->ChannelMappingFamily == 2 )
+    {
+        int order_plus_one = 1;
+        while( (order_plus_one + 1) * (order_plus_one + 1) <= channels )
+            ++order_plus_one;
+        int nondiegetic = channels - order_plus_one * order_plus_one;
+        if( order_plus_one > 15 || (nondiegetic != 0 && nondiegetic != 2) )
+            return ERROR_MSG( "%d channels are not ambisonics of the channel mapping family 2.\n", channels );
+        coupled = nondiegetic / 2;
+    }
+    param->StreamCount  = channels - coupled;
+    param->CoupledCount = coupled;
+    int ambisonic = channels - 2 * coupled;
+    for( int i = 0; i < ambisonic; i++ )
+        param->ChannelMapping[i] = 2 * coupled + i;
+    for( int i = 0; i < 2 * coupled; i++ )
+        param->ChannelMapping[ambisonic + i] = i;
+    memcpy( channel_mapping, param->ChannelMapping, channels );
+    return 0;
+}
+
+int mp4opus_setup_channel_mapping
+(
+    lsmash_opus_specific_parameters_t *param,
+    int                                mapping_family,
+    lsmash_summary_t                  *in_summary,
+    uint8_t                            channel_mapping[255],
+    char                              *error
+)
+{
+    int channels = param->OutputChannelCount;
+    if( channels == 0 )
+        return ERROR_MSG( "no channels to be encoded.\n" );
+    int family = mapping_family;
+    if( family < 0 )
+        family = channels > 8 ? 255 : channels > 2 ? 1 : 0;
+    param->ChannelMappingFamily = family;
+    if( family > 1 )
+        return setup_extended_mapping( param, channel_mapping, error );
+    if( channels > (family ? 8 : 2) )
+        return ERROR_MSG( "the channel mapping family %d supports up to %d channels.\n", family, family ? 8 : 2 );
+    mp4opus_set_stream_layout( param );
+    remap_channel_layout( in_summary, param, channel_mapping );
+    return 0;
+}
+
+OpusMSEncoder *mp4opus_create_encoder
+(
+    const mp4opus_encoder_option_t          *opt,
+    const lsmash_opus_specific_parameters_t *param,
+    const uint8_t                            channel_mapping[255],
+    char                                    *error
+)
+{
+    int err;
+    OpusMSEncoder *msenc;
+    if( param->ChannelMappingFamily >= 2 )
+    {
+        /* Let the encoder know the channels are ambisonics or discrete so that the bitrate is
+         * allocated evenly among the streams. The streams are laid out as setup_extended_mapping(). */
+        int           streams;
+        int           coupled;
+        unsigned char mapping[255];
+        msenc = opus_multistream_surround_encoder_create( mp4opus_get_encoder_sample_rate( param->InputSampleRate ),
+                                                          param->OutputChannelCount,
+                                                          param->ChannelMappingFamily,
+                                                          &streams,
+                                                          &coupled,
+                                                          mapping,
+                                                          opt->application,
+                                                          &err );
+        if( err == OPUS_OK
+         && (streams != param->StreamCount || coupled != param->CoupledCount
+          || memcmp( mapping, channel_mapping, param->OutputChannelCount )) )
+        {
+            opus_multistream_encoder_destroy( msenc );
+            ERROR_MSG( "the encoder laid out the streams unexpectedly.\n" );
+            return NULL;
+        }
+    }
+    else
+        msenc = opus_multistream_encoder_create( mp4opus_get_encoder_sample_rate( param->InputSampleRate ),
+                                                 param->OutputChannelCount,
+                                                 param->StreamCount,
+                                                 param->CoupledCount,
+                                                 channel_mapping,
+                                                 opt->application,
+                                                 &err );
+    if( err != OPUS_OK )
+    {
+        ERROR_MSG( "failed to create encoder.\n" );
+        return NULL;
+    }
+#define SET_OPT( ctl, ... )                               \
+    err = opus_multistream_encoder_ctl( msenc, ctl );     \
+    if( err != OPUS_OK )                                  \
+    {                                                     \
+        opus_multistream_encoder_destroy( msenc );        \
+        ERROR_MSG( __VA_ARGS__ );                         \
+        return NULL;                                      \
+    }
+    SET_OPT( OPUS_SET_COMPLEXITY( opt->complexity ), "failed to set complexity.\n" );
+    SET_OPT( OPUS_SET_BITRATE( opt->bitrate ), "failed to set bitrate.\n" );
+    SET_OPT( OPUS_SET_VBR( opt->vbr > 0 ? 1 : 0 ), "failed to set VBR.\n" );
+    SET_OPT( OPUS_SET_VBR_CONSTRAINT( opt->vbr == 2 ? 1 : 0 ), "failed to set constraint VBR.\n" );
+    SET_OPT( OPUS_SET_MAX_BANDWIDTH( opt->max_bandwidth ), "failed to set maximum bandwidth.\n" );
+    SET_OPT( OPUS_SET_INBAND_FEC( opt->fec ), "failed to set in-band FEC.\n" );
+    SET_OPT( OPUS_SET_PACKET_LOSS_PERC( opt->expected_loss ), "failed to set expected packet loss.\n" );
+    SET_OPT( OPUS_SET_DTX( opt->dtx ), "failed to set DTX.\n" );
+    SET_OPT( OPUS_SET_SIGNAL( opt->signal ), "failed to set signal type.\n" );
+#undef SET_OPT
+    return msenc;
+}
+
+int mp4opus_is_same_encoder_config
+(
+    const mp4opus_encoder_config_t          *config,
+    const lsmash_opus_specific_parameters_t *param,
+    const uint8_t                            channel_mapping[255]
+)
+{
+    return config->sample_rate   == mp4opus_get_encoder_sample_rate( param->InputSampleRate )
+        && config->channels      == param->OutputChannelCount
+        && config->stream_count  == param->StreamCount
+        && config->coupled_count == param->CoupledCount
+        && !memcmp( config->channel_mapping, channel_mapping, param->OutputChannelCount );
+}
+
+int mp4opus_setup_encoder
+(
+    mp4opus_track_encoder_t           *codec,
+    lsmash_opus_specific_parameters_t *param,
+    const uint8_t                      channel_mapping[255],
+    char                              *error
+)
+{
+    if( codec->opt.frame_size < 10 )
+        codec->opt.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;  /* framesize < 10ms can only use the MDCT modes. */
+    mp4opus_encoder_config_t *config = &codec->config;
+    if( codec->msenc && !mp4opus_is_same_encoder_config( config, param, channel_mapping ) )
+        mp4opus_cleanup_encoder( codec );
+    int created = !codec->msenc;
+    if( created )
+    {
+        config->sample_rate   = mp4opus_get_encoder_sample_rate( param->InputSampleRate );
+        config->channels      = param->OutputChannelCount;
+        config->stream_count  = param->StreamCount;
+        config->coupled_count = param->CoupledCount;
+        memcpy( config->channel_mapping, channel_mapping, param->OutputChannelCount );
+        codec->msenc = mp4opus_create_encoder( &codec->opt, param, channel_mapping, error );
+        if( !codec->msenc )
+            return -1;
+    }
+    else if( opus_multistream_encoder_ctl( codec->msenc, OPUS_RESET_STATE ) != OPUS_OK )
+        return ERROR_MSG( "failed to reset encoder.\n" );
+    codec->stream_count = param->StreamCount;
+    codec->frame_size   = config->sample_rate * codec->opt.frame_size / 1000;
+    /* Get the number of priming samples. */
+    int priming_samples;
+    if( opus_multistream_encoder_ctl( codec->msenc, OPUS_GET_LOOKAHEAD( &priming_samples ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to get number of priming samples.\n" );
+    param->PreSkip = priming_samples * (48000 / config->sample_rate);
+    return created;
+}
+
+void mp4opus_cleanup_encoder
+(
+    mp4opus_track_encoder_t *codec
+)
+{
+    opus_multistream_encoder_destroy( codec->msenc );
+    codec->msenc = NULL;
+}
+
+static int make_dtx_packet
+(
+    OpusMSEncoder *msenc,
+    int            frame_size,
+    uint8_t       *packet,
+    uint32_t       max_packet_size
+)
+{
+    /* Nothing is to be transmitted for the frame, but every sample in the movie needs a packet of its duration.
+     * Make a packet of an empty frame per stream, which is decoded as a lost frame of the duration. */
+    opus_int32 rate;
+    if( opus_multistream_encoder_ctl( msenc, OPUS_GET_SAMPLE_RATE( &rate ) ) != OPUS_OK )
+        return OPUS_INTERNAL_ERROR;
+    int stream_count = 0;
+    for( OpusEncoder *stream; opus_multistream_encoder_ctl( msenc, OPUS_MULTISTREAM_GET_ENCODER_STATE( stream_count, &stream ) ) == OPUS_OK; )
+        ++stream_count;
+    if( stream_count == 0 || (uint32_t)(2 * stream_count - 1) > max_packet_size )
+        return OPUS_BUFFER_TOO_SMALL;
+    /* CELT-only fullband of 2.5, 5, 10 and 20ms, and SILK-only wideband of 40 and 60ms */
+    int     duration = frame_size * (48000 / rate);
+    uint8_t config   = duration == 2880 ? 11 : duration == 1920 ? 10 : 28;
+    for( int d = 120; d < duration && config >= 28; d *= 2 )
+        ++config;
+    /* Every stream other than the last is self-delimited by the frame length of 0. */
+    int size = 0;
+    for( int i = 0; i < stream_count - 1; i++ )
+    {
+        packet[size++] = config << 3;
+        packet[size++] = 0;
+    }
+    packet[size++] = config << 3;
+    return size;
+}
+
+int mp4opus_encode_pcm
+(
+    OpusMSEncoder *msenc,
+    const uint8_t *pcm,
+    int            float_input,
+    int            frame_size,
+    uint8_t       *packet,
+    uint32_t       max_packet_size
+)
+{
+    int ret = float_input
+            ? opus_multistream_encode_float( msenc, (const float *)pcm, frame_size, packet, max_packet_size )
+            : opus_multistream_encode( msenc, (const opus_int16 *)pcm, frame_size, packet, max_packet_size );
+    if( ret == 0 )
+        ret = make_dtx_packet( msenc, frame_size, packet, max_packet_size );
+    return ret;
+}
+
+/*** Output track ***/
+
+int mp4opus_create_output_track
+(
+    lsmash_root_t *root,
+    uint32_t      *track_ID,
+    char          *error
+)
+{
+    /* Set up track parameters. */
+    *track_ID = lsmash_create_track( root, ISOM_MEDIA_HANDLER_TYPE_AUDIO_TRACK );
+    if( *track_ID == 0 )
+        return ERROR_MSG( "failed to create track.\n" );
+    lsmash_track_parameters_t track_param;
+    lsmash_initialize_track_parameters( &track_param );
+    track_param.mode = ISOM_TRACK_IN_MOVIE | ISOM_TRACK_IN_PREVIEW | ISOM_TRACK_ENABLED;
+    if( lsmash_set_track_parameters( root, *track_ID, &track_param ) < 0 )
+        return ERROR_MSG( "failed to set track parameters.\n" );
+    /* Set up media parameters. */
+    lsmash_media_parameters_t media_param;
+    lsmash_initialize_media_parameters( &media_param );
+    media_param.timescale     = 48000;
+    media_param.roll_grouping = 1;
+    if( lsmash_set_media_parameters( root, *track_ID, &media_param ) < 0 )
+        return ERROR_MSG( "failed to set media parameters.\n" );
+    return 0;
+}
+
+int mp4opus_prepare_output_media
+(
+    mp4opus_output_media_t                  *out,
+    const lsmash_opus_specific_parameters_t *param,
+    double                                   frame_size,
+    char                                    *error
+)
+{
+    out->summary = (lsmash_audio_summary_t *)lsmash_create_summary( LSMASH_SUMMARY_TYPE_AUDIO );
+    if( !out->summary )
+        return ERROR_MSG( "failed to allocate summary for output.\n" );
+    out->summary->sample_type = ISOM_CODEC_TYPE_OPUS_AUDIO;
+    out->summary->frequency   = 48000;
+    out->summary->channels    = param->OutputChannelCount;
+    out->summary->sample_size = 16;
+    /* Packets are encoded into the scratch buffer of the worst case size
+     * and then copied into samples of the exact size, which are owned by the muxer. */
+    out->packet_buffer_size = mp4opus_get_max_packet_size( frame_size, param->StreamCount );
+    out->packet_buffer      = lsmash_malloc( out->packet_buffer_size );
+    if( !out->packet_buffer )
+        return ERROR_MSG( "failed to allocate packet buffer.\n" );
+    out->priming_samples  = param->PreSkip;
+    out->preroll_distance = mp4opus_get_preroll_distance( frame_size );
+    out->sample_duration  = 48000 * frame_size / 1000;
+    out->timestamp        = 0;
+    return 0;
+}
+
+int mp4opus_add_output_entry
+(
+    lsmash_root_t           *root,
+    uint32_t                 track_ID,
+    mp4opus_output_media_t  *out,
+    lsmash_codec_specific_t *cs,
+    int                      fragment,
+    char                    *error
+)
+{
+    if( lsmash_add_codec_specific_data( (lsmash_summary_t *)out->summary, cs ) < 0 )
+        return ERROR_MSG( "failed to add Opus specific info.\n" );
+    out->sample_entry = lsmash_add_sample_entry( root, track_ID, out->summary );
+    if( !out->sample_entry )
+        return ERROR_MSG( "failed to add sample description entry.\n" );
+    if( fragment )
+    {
+        /* The edit has to be created before the movie header is written at the first fragment.
+         * Its duration is settled in mp4opus_construct_timeline_map(). */
+        lsmash_edit_t edit =
+        {
+            .duration   = ISOM_EDIT_DURATION_UNKNOWN32,
+            .start_time = out->priming_samples,
+            .rate       = ISOM_EDIT_MODE_NORMAL
+        };
+        if( lsmash_create_explicit_timeline_map( root, track_ID, edit ) < 0 )
+            return ERROR_MSG( "failed to create explicit timeline map.\n" );
+        out->fragment_duration = (uint64_t)fragment * 48;
+    }
+    return 0;
+}
+
+void mp4opus_cleanup_output_media
+(
+    mp4opus_output_media_t *out
+)
+{
+    lsmash_cleanup_summary( (lsmash_summary_t *)out->summary );
+    lsmash_free( out->packet_buffer );
+    out->summary       = NULL;
+    out->packet_buffer = NULL;
+}
+
+int mp4opus_mux_opus_packet
+(
+    lsmash_root_t          *root,
+    uint32_t                track_ID,
+    mp4opus_output_media_t *out,
+    lsmash_sample_t        *sample,
+    int                     new_fragment,
+    char                   *error
+)
+{
+    int fragment_started = 0;
+    if( out->fragment_duration
+     && (!out->fragment_created || out->timestamp >= out->fragment_start + out->fragment_duration || new_fragment) )
+    {
+        /* Every Opus sample is a sync sample, so a fragment can start at any sample.
+         * The samples of the previous fragment are written out here and then released. */
+        if( out->fragment_created
+         && lsmash_flush_pooled_samples( root, track_ID, out->sample_duration ) < 0 )
+        {
+            lsmash_delete_sample( sample );
+            return ERROR_MSG( "failed to flush samples.\n" );
+        }
+        if( lsmash_create_fragment_movie( root ) < 0 )
+        {
+            lsmash_delete_sample( sample );
+            return ERROR_MSG( "failed to create a movie fragment.\n" );
+        }
+        out->fragment_created = 1;
+        out->fragment_start   = out->timestamp;
+        fragment_started      = 1;
+    }
+    sample->dts                    = out->timestamp;
+    sample->cts                    = out->timestamp;
+    sample->index                  = out->sample_entry;
+    sample->prop.ra_flags          = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC;
+    sample->prop.pre_roll.distance = out->preroll_distance;
+    if( lsmash_append_sample( root, track_ID, sample ) < 0 )
+    {
+        lsmash_delete_sample( sample );
+        return ERROR_MSG( "failed to append sample.\n" );
+    }
+    out->timestamp += out->sample_duration;
+    return fragment_started;
+}
+
+int mp4opus_encode_frame
+(
+    lsmash_root_t           *root,
+    uint32_t                 track_ID,
+    mp4opus_track_encoder_t *codec,
+    mp4opus_output_media_t  *out,
+    const uint8_t           *pcm,
+    char                    *error
+)
+{
+    int ret = mp4opus_encode_pcm( codec->msenc,
+                                  pcm,
+                                  codec->float_input,
+                                  codec->frame_size,
+                                  out->packet_buffer,
+                                  out->packet_buffer_size );
+    if( ret < 0 )
+        return ERROR_MSG( "failed to encode.\n" );
+    lsmash_sample_t *sample = lsmash_create_sample( ret );
+    if( !sample )
+        return ERROR_MSG( "failed to allocate sample.\n" );
+    memcpy( sample->data, out->packet_buffer, ret );
+    if( mp4opus_mux_opus_packet( root, track_ID, out, sample, 0, error ) < 0 )
+        return -1;
+    return ret;
+}
+
+uint64_t mp4opus_get_presentation_duration
+(
+    uint64_t num_samples,
+    uint32_t sample_rate
+)
+{
+    return ((double)num_samples * 48000) / sample_rate;
+}
+
+uint32_t mp4opus_get_padding_frames
+(
+    const mp4opus_output_media_t *out,
+    uint64_t                      num_frames,
+    uint64_t                      duration
+)
+{
+    /* The last sample presented is delayed by the priming samples in the encoded frames. */
+    uint64_t required_frames = (out->priming_samples + duration + out->sample_duration - 1) / out->sample_duration;
+    return required_frames > num_frames ? required_frames - num_frames : 0;
+}
+
+int mp4opus_flush_output_track
+(
+    lsmash_root_t          *root,
+    uint32_t                track_ID,
+    mp4opus_output_media_t *out,
+    char                   *error
+)
+{
+    if( lsmash_flush_pooled_samples( root, track_ID, out->sample_duration ) < 0 )
+        return ERROR_MSG( "failed to flush samples.\n" );
+    return 0;
+}
+
+int mp4opus_construct_timeline_map
+(
+    lsmash_root_t          *root,
+    uint32_t                track_ID,
+    mp4opus_output_media_t *out,
+    uint64_t                duration,
+    char                   *error
+)
+{
+    lsmash_edit_t edit =
+    {
+        .duration   = duration,
+        .start_time = out->priming_samples,
+        .rate       = ISOM_EDIT_MODE_NORMAL
+    };
+    if( out->fragment_duration )
+    {
+        if( lsmash_modify_explicit_timeline_map( root, track_ID, 1, edit ) < 0 )
+            return ERROR_MSG( "failed to modify explicit timeline map.\n" );
+    }
+    else if( lsmash_create_explicit_timeline_map( root, track_ID, edit ) < 0 )
+        return ERROR_MSG( "failed to create explicit timeline map.\n" );
+    return 0;
+}
+
+/*** Decoder ***/
+
+OpusMSDecoder *mp4opus_create_decoder
+(
+    const lsmash_opus_specific_parameters_t *param,
+    const uint8_t                            channel_mapping[255],
+    char                                    *error
+)
+{
+    int err;
+    OpusMSDecoder *msdec = opus_multistream_decoder_create( 48000,
+                                                            param->OutputChannelCount,
+                                                            param->StreamCount,
+                                                            param->CoupledCount,
+                                                            channel_mapping,
+                                                            &err );
+    if( err != OPUS_OK )
+    {
+        ERROR_MSG( "failed to create decoder.\n" );
+        return NULL;
+    }
+    return msdec;
+}
+
+int mp4opus_is_same_decoder_config
+(
+    const mp4opus_decoder_config_t          *config,
+    const lsmash_opus_specific_parameters_t *param,
+    const uint8_t                            channel_mapping[255]
+)
+{
+    return config->channels      == param->OutputChannelCount
+        && config->stream_count  == param->StreamCount
+        && config->coupled_count == param->CoupledCount
+        && !memcmp( config->channel_mapping, channel_mapping, param->OutputChannelCount );
+}
+
+int mp4opus_setup_decoder
+(
+    mp4opus_track_decoder_t                 *codec,
+    const lsmash_opus_specific_parameters_t *param,
+    const uint8_t                            channel_mapping[255],
+    char                                    *error
+)
+{
+    if( param->OutputChannelCount == 0 )
+        return ERROR_MSG( "no channels to be decoded.\n" );
+    mp4opus_decoder_config_t *config = &codec->config;
+    if( codec->msdec && !mp4opus_is_same_decoder_config( config, param, channel_mapping ) )
+        mp4opus_cleanup_decoder( codec );
+    int created = !codec->msdec;
+    if( created )
+    {
+        config->channels      = param->OutputChannelCount;
+        config->stream_count  = param->StreamCount;
+        config->coupled_count = param->CoupledCount;
+        memcpy( config->channel_mapping, channel_mapping, param->OutputChannelCount );
+        codec->msdec = mp4opus_create_decoder( param, channel_mapping, error );
+        if( !codec->msdec )
+            return -1;
+    }
+    else if( opus_multistream_decoder_ctl( codec->msdec, OPUS_RESET_STATE ) != OPUS_OK )
+        return ERROR_MSG( "failed to reset decoder.\n" );
+    if( opus_multistream_decoder_ctl( codec->msdec, OPUS_SET_GAIN( param->OutputGain ) ) != OPUS_OK )
+        return ERROR_MSG( "failed to set output gain.\n" );
+    return created;
+}
+
+void mp4opus_cleanup_decoder
+(
+    mp4opus_track_decoder_t *codec
+)
+{
+    opus_multistream_decoder_destroy( codec->msdec );
+    codec->msdec = NULL;
+}
+
+int mp4opus_get_packet_samples
+(
+    const uint8_t *data,
+    uint32_t       size
+)
+{
+    int num_samples = data ? opus_packet_get_nb_samples( data, size, 48000 ) : 0;
+    if( num_samples <= 0 || num_samples > MP4OPUS_MAX_PACKET_DURATION )
+        num_samples = MP4OPUS_MAX_PACKET_DURATION;
+    return num_samples;
+}
+
+int mp4opus_decode_packet
+(
+    OpusMSDecoder *msdec,
+    int            float_output,
+    const uint8_t *data,
+    uint32_t       size,
+    void          *pcm,
+    int            max_samples,
+    int            decode_fec
+)
+{
+    return float_output
+         ? opus_multistream_decode_float( msdec, data, size, (float *)pcm, max_samples, decode_fec )
+         : opus_multistream_decode( msdec, data, size, (opus_int16 *)pcm, max_samples, decode_fec );
+}
+
+int mp4opus_find_start_packet
+(
+    lsmash_root_t            *root,
+    uint32_t                  track_ID,
+    const mp4opusidx_entry_t *index,
+    uint32_t                  num_index_entries,
+    uint32_t                  packet_number,
+    int64_t                   start_time,
+    uint32_t                 *start_packet,
+    char                     *error
+)
+{
+    /* Binary search from packet_number for the first sample composed at or after the start time,
+     * and then go back by the pre-roll to recover the decoder. */
+    uint32_t sample_number;
+    int      start_from_prev_sample;
+    uint32_t pre_roll_distance;
+    if( index )
+    {
+        /* The packet index has everything needed in place of the timeline. */
+        uint32_t low  = packet_number;
+        uint32_t high = num_index_entries + 1;
+        while( low < high )
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if( (int64_t)index[mid - 1].timestamp < start_time )
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if( low > num_index_entries )
+            return 1;
+        sample_number          = low;
+        start_from_prev_sample = (int64_t)index[low - 1].timestamp > start_time;
+        pre_roll_distance      = index[low - 1].pre_roll_distance;
+    }
+    else
+    {
+        lsmash_sample_t sample_info = { 0 };
+        int ret = mp4opus_find_start_sample( root, track_ID, packet_number, start_time, &sample_number, &sample_info );
+        if( ret < 0 )
+            return ERROR_MSG( "failed to get sample info.\n" );
+        if( ret )
+            return 1;
+        start_from_prev_sample = (int64_t)sample_info.cts > start_time;
+        pre_roll_distance      = sample_info.prop.pre_roll.distance;
+    }
+    *start_packet = mp4opus_get_decode_start( sample_number, pre_roll_distance, start_from_prev_sample );
+    return 0;
+}
+
+int mp4opus_apply_edit
+(
+    mp4opus_presentation_t *presentation,
+    int64_t                 cts,
+    int                     num_samples,
+    uint32_t               *skipped_samples
+)
+{
+    *skipped_samples = 0;
+    if( num_samples <= 0 )
+        return num_samples;
+    if( cts < presentation->start_time )
+    {
+        /* Drop the samples decoded for the pre-roll. */
+        *skipped_samples = cts + num_samples <= presentation->start_time
+                         ? (uint32_t)num_samples    /* no output samples */
+                         : (uint32_t)(presentation->start_time - cts);
+        num_samples -= *skipped_samples;
+    }
+    presentation->timestamp += ((double)num_samples / 48000) * presentation->timescale;
+    if( presentation->timestamp > presentation->duration )
+        num_samples -= ((double)(presentation->timestamp - presentation->duration) / presentation->timescale) * 48000;
+    return num_samples;
+}
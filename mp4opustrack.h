@@ -0,0 +1,281 @@
+/*****************************************************************************
+ * mp4opustrack.h
+ *****************************************************************************
+ * Copyright (C) 2014
+ *
+ * Authors: Yusuke Nakamura <muken.the.vfrmaniac@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* This file is available under an ISC license. */
+
+#ifndef MP4OPUSTRACK_H
+#define MP4OPUSTRACK_H
+
+#include <stdint.h>
+
+#include <lsmash.h>
+
+#include <opus/opus_multistream.h>
+
+#include "mp4opusidx.h"
+
+/* Per-track stages of encoding and decoding in libmp4opus, which mp4opusenc and mp4opusdec are built on.
+ * The public API in mp4opus.h drives them for a single track, and the tools drive them per track
+ * with their own threading, batch processing and statistics around.
+ * Nothing here keeps a global state, so the stages of different tracks may run on different threads.
+ * Every function taking error writes the reason of the failure into it, which has to be
+ * MP4OPUS_ERROR_LENGTH bytes, and returns a negative value or NULL. */
+
+#define MP4OPUS_ERROR_LENGTH         256
+#define MP4OPUS_MAX_PACKET_DURATION  5760   /* 120ms at 48kHz */
+#define MP4OPUS_RESAMPLER_MAX_PHASES 1024
+
+/*** PCM ***/
+
+/* Convert count samples into float. */
+typedef void (*mp4opus_convert_t)( float *dst, const uint8_t *src, uint32_t count );
+
+/* Set *convert to the converter of interleaved LPCM of the format.
+ * *convert is set to NULL for 16-bit little endian integers, which are encoded as they are.
+ * Return -1 if the format is not supported. */
+int mp4opus_get_pcm_converter( int is_float, int big_endian, uint32_t sample_size, mp4opus_convert_t *convert );
+
+/* Converters of the native formats taken by mp4opus_encoder_push(). */
+void mp4opus_convert_s16( float *dst, const uint8_t *src, uint32_t count );
+void mp4opus_convert_float( float *dst, const uint8_t *src, uint32_t count );
+void mp4opus_convert_s16le( float *dst, const uint8_t *src, uint32_t count );
+
+/*** Resampler ***/
+
+typedef struct
+{
+    uint32_t channels;
+    uint32_t up;                /* interpolation factor */
+    uint32_t down;              /* decimation factor */
+    uint32_t taps;              /* number of taps per phase */
+    uint32_t delay;             /* group delay in output samples */
+    float   *filter;            /* coefficients of each phase in reverse order */
+    float   *planes;            /* buffered input frames per channel */
+    float   *scratch;           /* interleaved input frames converted into float */
+    void   (*deinterleave)( float *dst, uint32_t stride, const float *src, uint32_t channels, uint32_t count );
+                                /* kernel picked for the number of channels */
+    mp4opus_convert_t convert;  /* input samples -> float */
+    uint32_t sample_bytes;      /* bytes per input sample of a channel */
+    uint32_t capacity;          /* maximum number of buffered frames per channel */
+    uint32_t num_frames;
+    uint32_t index;             /* the first buffered frame for the next output sample */
+    uint32_t phase;
+    uint8_t *tail;              /* zeroed input to flush the filter at the end of stream */
+    uint32_t tail_size;
+    int      tail_fed;
+} mp4opus_resampler_t;
+
+/* Sample rates not supported by Opus are resampled into 48kHz. */
+uint32_t mp4opus_get_encoder_sample_rate( uint32_t input_rate );
+
+/* The polyphase resampler interpolates by out_rate / gcd( in_rate, out_rate ),
+ * which has to be MP4OPUS_RESAMPLER_MAX_PHASES at most. */
+uint32_t mp4opus_get_resampler_phases( uint32_t in_rate, uint32_t out_rate );
+
+mp4opus_resampler_t *mp4opus_create_resampler( uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                                               uint32_t sample_bytes, mp4opus_convert_t convert, char *error );
+void mp4opus_destroy_resampler( mp4opus_resampler_t *rs );
+
+/* Produce as many float samples as fit into dst, pulling input frames from *src on demand.
+ * *src and *src_size are advanced by the consumed input. Return the number of bytes written into dst. */
+uint32_t mp4opus_resample( mp4opus_resampler_t *rs, uint8_t *dst, uint32_t dst_size, const uint8_t **src, uint32_t *src_size );
+
+/* Get the input of zeros to be fed once at the end of stream to take out the samples delayed by the filter.
+ * Return 0 if already got. */
+int mp4opus_get_resampler_tail( mp4opus_resampler_t *rs, uint8_t **data, uint32_t *size );
+
+/*** Encoder ***/
+
+typedef struct
+{
+    int    application;
+    int    complexity;
+    int    bitrate;
+    int    vbr;
+    int    max_bandwidth;
+    double frame_size;
+    int    fec;
+    int    expected_loss;   /* packet loss rate (%) the encoder is tuned for */
+    int    dtx;
+    int    signal;          /* OPUS_SIGNAL_* or OPUS_AUTO */
+    int    mapping_family;  /* ChannelMappingFamily, -1 for the choice by the number of channels */
+} mp4opus_encoder_option_t;
+
+typedef struct
+{
+    uint32_t sample_rate;
+    uint8_t  channels;
+    uint8_t  stream_count;
+    uint8_t  coupled_count;
+    uint8_t  channel_mapping[255];
+} mp4opus_encoder_config_t;
+
+typedef struct
+{
+    OpusMSEncoder           *msenc;
+    mp4opus_encoder_option_t opt;
+    mp4opus_encoder_config_t config;    /* configuration the encoder was created with */
+    int                      stream_count;
+    int                      frame_size;    /* samples per channel in a frame at the encoder sample rate */
+    int                      float_input;   /* PCM samples are staged as float */
+} mp4opus_track_encoder_t;
+
+void mp4opus_default_encoder_option( mp4opus_encoder_option_t *opt );
+
+/* Decide the channel mapping family by opt->mapping_family and lay out the streams for
+ * OutputChannelCount channels, which are taken in the layout of in_summary,
+ * or in the SMPTE/USB channel order if in_summary is NULL or has no known layout.
+ * channel_mapping is set to the mapping the encoder takes the channels by. */
+int mp4opus_setup_channel_mapping( lsmash_opus_specific_parameters_t *param, int mapping_family,
+                                   lsmash_summary_t *in_summary, uint8_t channel_mapping[255], char *error );
+
+OpusMSEncoder *mp4opus_create_encoder( const mp4opus_encoder_option_t *opt, const lsmash_opus_specific_parameters_t *param,
+                                       const uint8_t channel_mapping[255], char *error );
+
+int mp4opus_is_same_encoder_config( const mp4opus_encoder_config_t *config, const lsmash_opus_specific_parameters_t *param,
+                                    const uint8_t channel_mapping[255] );
+
+/* Create the encoder, or reset the one created with the same configuration, and set PreSkip.
+ * Return 1 if created, and 0 if reused. */
+int mp4opus_setup_encoder( mp4opus_track_encoder_t *codec, lsmash_opus_specific_parameters_t *param,
+                           const uint8_t channel_mapping[255], char *error );
+
+void mp4opus_cleanup_encoder( mp4opus_track_encoder_t *codec );
+
+/* Encode a frame into packet, which is never empty since DTX frames are made into packets of empty frames.
+ * Return the size of the packet, or an error code of Opus. */
+int mp4opus_encode_pcm( OpusMSEncoder *msenc, const uint8_t *pcm, int float_input, int frame_size,
+                        uint8_t *packet, uint32_t max_packet_size );
+
+/*** Output track ***/
+
+typedef struct
+{
+    lsmash_audio_summary_t *summary;
+    uint32_t                sample_entry;
+    uint32_t                priming_samples;
+    uint32_t                preroll_distance;
+    uint32_t                sample_duration;    /* in 48kHz */
+    uint64_t                timestamp;          /* of the next sample in 48kHz */
+    uint8_t                *packet_buffer;      /* scratch buffer for an encoded packet */
+    uint32_t                packet_buffer_size;
+    uint64_t                fragment_duration;  /* 0 unless fragmented */
+    uint64_t                fragment_start;     /* timestamp of the first sample in the current fragment */
+    int                     fragment_created;
+} mp4opus_output_media_t;
+
+int mp4opus_create_output_track( lsmash_root_t *root, uint32_t *track_ID, char *error );
+
+/* Set up the summary, the packet buffer and the timing of the output for the Opus parameters. */
+int mp4opus_prepare_output_media( mp4opus_output_media_t *out, const lsmash_opus_specific_parameters_t *param,
+                                  double frame_size, char *error );
+
+/* Add the sample entry of the Opus specific info, and start the edit of a fragmented movie unless fragment is 0. */
+int mp4opus_add_output_entry( lsmash_root_t *root, uint32_t track_ID, mp4opus_output_media_t *out,
+                              lsmash_codec_specific_t *cs, int fragment, char *error );
+
+void mp4opus_cleanup_output_media( mp4opus_output_media_t *out );
+
+/* Append an encoded packet at the timestamp, and advance the timestamp.
+ * A fragment starts by the fragment duration, or before the packet if new_fragment is set.
+ * The sample is owned by the muxer even on failure. Return 1 if a fragment started. */
+int mp4opus_mux_opus_packet( lsmash_root_t *root, uint32_t track_ID, mp4opus_output_media_t *out,
+                             lsmash_sample_t *sample, int new_fragment, char *error );
+
+/* Encode a frame and append its packet. Return the size of the packet. */
+int mp4opus_encode_frame( lsmash_root_t *root, uint32_t track_ID, mp4opus_track_encoder_t *codec,
+                          mp4opus_output_media_t *out, const uint8_t *pcm, char *error );
+
+/* Duration in 48kHz of num_samples samples at sample_rate. */
+uint64_t mp4opus_get_presentation_duration( uint64_t num_samples, uint32_t sample_rate );
+
+/* Return the number of frames of zeros to be encoded after num_frames frames including the zero padded one
+ * so that the last sample of the presentation of duration gets out of the encoder delay. */
+uint32_t mp4opus_get_padding_frames( const mp4opus_output_media_t *out, uint64_t num_frames, uint64_t duration );
+
+int mp4opus_flush_output_track( lsmash_root_t *root, uint32_t track_ID, mp4opus_output_media_t *out, char *error );
+
+/* Present duration after the priming samples. */
+int mp4opus_construct_timeline_map( lsmash_root_t *root, uint32_t track_ID, mp4opus_output_media_t *out,
+                                    uint64_t duration, char *error );
+
+/*** Decoder ***/
+
+typedef struct
+{
+    uint8_t channels;
+    uint8_t stream_count;
+    uint8_t coupled_count;
+    uint8_t channel_mapping[255];
+} mp4opus_decoder_config_t;
+
+typedef struct
+{
+    OpusMSDecoder           *msdec;
+    mp4opus_decoder_config_t config;    /* configuration the decoder was created with */
+} mp4opus_track_decoder_t;
+
+OpusMSDecoder *mp4opus_create_decoder( const lsmash_opus_specific_parameters_t *param,
+                                       const uint8_t channel_mapping[255], char *error );
+
+int mp4opus_is_same_decoder_config( const mp4opus_decoder_config_t *config, const lsmash_opus_specific_parameters_t *param,
+                                    const uint8_t channel_mapping[255] );
+
+/* Create the decoder, or reset the one created with the same configuration, and set OutputGain.
+ * Return 1 if created, and 0 if reused. */
+int mp4opus_setup_decoder( mp4opus_track_decoder_t *codec, const lsmash_opus_specific_parameters_t *param,
+                           const uint8_t channel_mapping[255], char *error );
+
+void mp4opus_cleanup_decoder( mp4opus_track_decoder_t *codec );
+
+/* Return the number of samples per channel the packet is decoded into, or MP4OPUS_MAX_PACKET_DURATION if unknown. */
+int mp4opus_get_packet_samples( const uint8_t *data, uint32_t size );
+
+/* Decode a packet, or conceal a lost one if data is NULL. Return the number of samples per channel. */
+int mp4opus_decode_packet( OpusMSDecoder *msdec, int float_output, const uint8_t *data, uint32_t size,
+                           void *pcm, int max_samples, int decode_fec );
+
+#define MP4OPUS_RECOVERY_REQUIRED 0
+#define MP4OPUS_RECOVERY_STARTED  1
+
+/* An edit being presented */
+typedef struct
+{
+    int      status;        /* MP4OPUS_RECOVERY_* */
+    uint32_t timescale;     /* of the timestamp and the duration */
+    uint64_t timestamp;     /* presented so far */
+    uint64_t duration;
+    int64_t  start_time;    /* media time in 48kHz */
+    int32_t  rate;
+} mp4opus_presentation_t;
+
+/* Find the packet where the decoding starts to present start_time, going back by the pre-roll.
+ * The sidecar packet index is searched in place of the timeline unless index is NULL.
+ * Return 1 if start_time is beyond the last packet. */
+int mp4opus_find_start_packet( lsmash_root_t *root, uint32_t track_ID,
+                               const mp4opusidx_entry_t *index, uint32_t num_index_entries,
+                               uint32_t packet_number, int64_t start_time, uint32_t *start_packet, char *error );
+
+/* Trim num_samples samples decoded from the packet composed at cts into the presentation.
+ * *skipped_samples is set to the number of the samples before the start time.
+ * Return the number of the samples to be presented following them. */
+int mp4opus_apply_edit( mp4opus_presentation_t *presentation, int64_t cts, int num_samples, uint32_t *skipped_samples );
+
+#endif